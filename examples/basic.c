@@ -53,6 +53,8 @@ int main(int argc, char **argv)
             flags |= XMPP_CONN_FLAG_MANDATORY_TLS;
         else if (strcmp(argv[i], "--legacy-ssl") == 0)
             flags |= XMPP_CONN_FLAG_LEGACY_SSL;
+        else if (strcmp(argv[i], "--ktls") == 0)
+            flags |= XMPP_CONN_FLAG_KTLS;
         else
             break;
     }
@@ -61,7 +63,8 @@ int main(int argc, char **argv)
                         "Options:\n"
                         "  --disable-tls        Disable TLS.\n"
                         "  --mandatory-tls      Deny plaintext connection.\n"
-                        "  --legacy-ssl         Use old style SSL.\n\n"
+                        "  --legacy-ssl         Use old style SSL.\n"
+                        "  --ktls               Use kernel TLS if available.\n\n"
                         "Note: --disable-tls conflicts with --mandatory-tls or "
                               "--legacy-ssl\n");
         return 1;
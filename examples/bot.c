@@ -25,38 +25,20 @@
 
 int version_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza, void * const userdata)
 {
-	xmpp_stanza_t *reply, *query, *name, *version, *text;
-	char *ns;
+	xmpp_stanza_t *reply;
 	xmpp_ctx_t *ctx = (xmpp_ctx_t*)userdata;
 	printf("Received version request from %s\n", xmpp_stanza_get_from(stanza));
 	
-	reply = xmpp_stanza_reply(stanza);
-	xmpp_stanza_set_type(reply, "result");
-
-	query = xmpp_stanza_new(ctx);
-	xmpp_stanza_set_name(query, "query");
-    ns = xmpp_stanza_get_ns(xmpp_stanza_get_children(stanza));
-    if (ns) {
-        xmpp_stanza_set_ns(query, ns);
-    }
-
-	name = xmpp_stanza_new(ctx);
-	xmpp_stanza_set_name(name, "name");
-	xmpp_stanza_add_child(query, name);
-	
-	text = xmpp_stanza_new(ctx);
-	xmpp_stanza_set_text(text, "libstrophe example bot");
-	xmpp_stanza_add_child(name, text);
-	
-	version = xmpp_stanza_new(ctx);
-	xmpp_stanza_set_name(version, "version");
-	xmpp_stanza_add_child(query, version);
-	
-	text = xmpp_stanza_new(ctx);
-	xmpp_stanza_set_text(text, "1.0");
-	xmpp_stanza_add_child(version, text);
-	
-	xmpp_stanza_add_child(reply, query);
+	reply = xmpp_stanza_build(ctx,
+		"<iq type='result' id=%s to=%s>"
+		  "<query xmlns=%s>"
+		    "<name>libstrophe example bot</name>"
+		    "<version>1.0</version>"
+		  "</query>"
+		"</iq>",
+		xmpp_stanza_get_id(stanza), xmpp_stanza_get_from(stanza),
+		xmpp_stanza_get_ns(xmpp_stanza_get_children(stanza)));
+	if (!reply) return 1;
 
 	xmpp_send(conn, reply);
 	xmpp_stanza_release(reply);
@@ -66,39 +48,29 @@ int version_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza, void
 
 int message_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza, void * const userdata)
 {
-	xmpp_stanza_t *reply, *body, *text;
-	char *intext, *replytext;
+	xmpp_stanza_t *reply;
+	char *intext, *type;
 	xmpp_ctx_t *ctx = (xmpp_ctx_t*)userdata;
 	
 	if(!xmpp_stanza_get_child_by_name(stanza, "body")) return 1;
-	if(xmpp_stanza_get_type(stanza) !=NULL && !strcmp(xmpp_stanza_get_type(stanza), "error")) return 1;
+	type = xmpp_stanza_get_type(stanza);
+	if(type != NULL && !strcmp(type, "error")) return 1;
 	
 	intext = xmpp_stanza_get_text(xmpp_stanza_get_child_by_name(stanza, "body"));
 	
 	printf("Incoming message from %s: %s\n", xmpp_stanza_get_from(stanza), intext);
 	
-	reply = xmpp_stanza_reply(stanza);
-	if (xmpp_stanza_get_type(reply) == NULL)
-	    xmpp_stanza_set_type(reply, "chat");
-
-	body = xmpp_stanza_new(ctx);
-	xmpp_stanza_set_name(body, "body");
-	
-	replytext = malloc(strlen(" to you too!") + strlen(intext) + 1);
-	strcpy(replytext, intext);
-	strcat(replytext, " to you too!");
+	reply = xmpp_stanza_build(ctx,
+		"<message type=%s id=%s to=%s>"
+		  "<body>%s to you too!</body>"
+		"</message>",
+		type ? type : "chat", xmpp_stanza_get_id(stanza),
+		xmpp_stanza_get_from(stanza), intext);
 	xmpp_free(ctx, intext);
-	
-	text = xmpp_stanza_new(ctx);
-	xmpp_stanza_set_text(text, replytext);
-	xmpp_stanza_add_child(body, text);
-	xmpp_stanza_add_child(reply, body);
-	xmpp_stanza_release(body);
-	xmpp_stanza_release(text);
+	if (!reply) return 1;
 	
 	xmpp_send(conn, reply);
 	xmpp_stanza_release(reply);
-	free(replytext);
 	return 1;
 }
 
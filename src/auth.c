@@ -47,6 +47,18 @@
  */
 #define SESSION_TIMEOUT 15000 /* 15 seconds */
 #endif
+#ifndef SM_RESUME_TIMEOUT
+/** @def SM_RESUME_TIMEOUT
+ *  Time to wait for the reply to a stream management &lt;resume/&gt;.
+ */
+#define SM_RESUME_TIMEOUT 15000 /* 15 seconds */
+#endif
+#ifndef COMPRESS_TIMEOUT
+/** @def COMPRESS_TIMEOUT
+ *  Time to wait for the reply to a stream compression &lt;compress/&gt;.
+ */
+#define COMPRESS_TIMEOUT 15000 /* 15 seconds */
+#endif
 #ifndef LEGACY_TIMEOUT
 /** @def LEGACY_TIMEOUT
  *  Time to wait for legacy authentication to complete.
@@ -85,10 +97,10 @@ static int _handle_digestmd5_challenge(xmpp_conn_t * const conn,
 static int _handle_digestmd5_rspauth(xmpp_conn_t * const conn,
 			xmpp_stanza_t * const stanza,
 			void * const userdata);
-static int _handle_scram_sha1_challenge(xmpp_conn_t * const conn,
+static int _handle_scram_challenge(xmpp_conn_t * const conn,
 			xmpp_stanza_t * const stanza,
 			void * const userdata);
-static char *_make_scram_sha1_init_msg(xmpp_conn_t * const conn);
+static char *_make_scram_init_msg(xmpp_conn_t * const conn);
 
 static int _handle_missing_features_sasl(xmpp_conn_t * const conn,
 					 void * const userdata);
@@ -104,6 +116,36 @@ static int _handle_missing_session(xmpp_conn_t * const conn,
 				   void * const userdata);
 static int _handle_missing_handshake(xmpp_conn_t * const conn,
                                      void * const userdata);
+static void _auth_session(xmpp_conn_t * const conn);
+static void _auth_bind(xmpp_conn_t * const conn);
+static void _auth_resume(xmpp_conn_t * const conn);
+static int _auth_compression_offered(xmpp_conn_t * const conn,
+                                     xmpp_stanza_t * const features);
+static void _auth_compress(xmpp_conn_t * const conn);
+static int _handle_compress_result(xmpp_conn_t * const conn,
+                                   xmpp_stanza_t * const stanza,
+                                   void * const userdata);
+static int _handle_missing_compress(xmpp_conn_t * const conn,
+                                    void * const userdata);
+static void _auth_established(xmpp_conn_t * const conn);
+static void _auth_resumed(xmpp_conn_t * const conn,
+			  xmpp_stanza_t * const resumed);
+static void _auth_sasl2_features(xmpp_conn_t * const conn,
+				 xmpp_stanza_t * const authentication);
+static void _auth_sasl2(xmpp_conn_t * const conn);
+static int _handle_sasl2_result(xmpp_conn_t * const conn,
+				xmpp_stanza_t * const stanza,
+				void * const userdata);
+static void _auth_sasl2_success(xmpp_conn_t * const conn,
+				xmpp_stanza_t * const success);
+static int _handle_sm_enabled(xmpp_conn_t * const conn,
+                              xmpp_stanza_t * const stanza,
+                              void * const userdata);
+static int _handle_sm_resume(xmpp_conn_t * const conn,
+                             xmpp_stanza_t * const stanza,
+                             void * const userdata);
+static int _handle_missing_sm_resume(xmpp_conn_t * const conn,
+                                     void * const userdata);
 
 /* stream:error handler */
 static int _handle_error(xmpp_conn_t * const conn,
@@ -247,6 +289,10 @@ static int _handle_features(xmpp_conn_t * const conn,
 		    conn->sasl_support |= SASL_MASK_DIGESTMD5;
                 else if (strcasecmp(text, "SCRAM-SHA-1") == 0)
                     conn->sasl_support |= SASL_MASK_SCRAMSHA1;
+                else if (strcasecmp(text, "SCRAM-SHA-256") == 0)
+                    conn->sasl_support |= SASL_MASK_SCRAMSHA256;
+                else if (strcasecmp(text, "SCRAM-SHA-512") == 0)
+                    conn->sasl_support |= SASL_MASK_SCRAMSHA512;
 		else if (strcasecmp(text, "ANONYMOUS") == 0)
 		    conn->sasl_support |= SASL_MASK_ANONYMOUS;
 
@@ -255,6 +301,14 @@ static int _handle_features(xmpp_conn_t * const conn,
 	}
     }
 
+    /* check for SASL2, which is tried before SASL */
+    conn->sasl2_support = 0;
+    conn->sasl2_inline = 0;
+    child = xmpp_stanza_get_child_by_name(stanza, "authentication");
+    if (conn->sasl2_allowed && child && xmpp_stanza_get_ns(child) &&
+	strcmp(xmpp_stanza_get_ns(child), XMPP_NS_SASL2) == 0)
+	_auth_sasl2_features(conn, child);
+
     _auth(conn);
 
     return 0;
@@ -287,9 +341,8 @@ static int _handle_proceedtls_default(xmpp_conn_t * const conn,
     if (strcmp(name, "proceed") == 0) {
         xmpp_debug(conn->ctx, "xmpp", "proceeding with TLS");
 
-        if (conn_tls_start(conn) == 0) {
-            conn_open_stream(conn);
-        } else {
+        /* the stream is reopened when the handshake completes */
+        if (conn_tls_start(conn) != 0) {
             /* failed tls spoils the connection, so disconnect */
             xmpp_disconnect(conn);
         }
@@ -421,74 +474,130 @@ static int _handle_digestmd5_rspauth(xmpp_conn_t * const conn,
     return 1;
 }
 
-/* handle the challenge phase of SCRAM-SHA-1 auth */
-static int _handle_scram_sha1_challenge(xmpp_conn_t * const conn,
-					xmpp_stanza_t * const stanza,
-					void * const userdata)
+/* builds the response to a SCRAM challenge, ns is the namespace of
+ * the SASL version in use */
+static xmpp_stanza_t *_make_scram_response(xmpp_conn_t * const conn,
+					   xmpp_stanza_t * const stanza,
+					   const char * const ns)
 {
     char *text;
     char *response;
     xmpp_stanza_t *auth, *authdata;
-    char *name;
     char *challenge;
-    char *scram_init = (char *)userdata;
+
+    text = xmpp_stanza_get_text(stanza);
+    if (!text)
+        return NULL;
+
+    challenge = (char *)base64_decode(conn->ctx, text, strlen(text));
+    xmpp_free(conn->ctx, text);
+    if (!challenge)
+        return NULL;
+
+    response = sasl_scram(conn->ctx, conn->scram_alg, challenge,
+                          conn->scram_init, conn->jid, conn->pass);
+    xmpp_free(conn->ctx, challenge);
+    if (!response)
+        return NULL;
+
+    auth = xmpp_stanza_new(conn->ctx);
+    if (!auth)
+        goto err_free_response;
+    xmpp_stanza_set_name(auth, "response");
+    xmpp_stanza_set_ns(auth, ns);
+
+    authdata = xmpp_stanza_new(conn->ctx);
+    if (!authdata)
+        goto err_release_auth;
+    xmpp_stanza_set_text(authdata, response);
+    xmpp_free(conn->ctx, response);
+
+    xmpp_stanza_add_child(auth, authdata);
+    xmpp_stanza_release(authdata);
+
+    return auth;
+
+err_release_auth:
+    xmpp_stanza_release(auth);
+err_free_response:
+    xmpp_free(conn->ctx, response);
+    return NULL;
+}
+
+/* drops the state of a SCRAM exchange */
+static void _scram_clear(xmpp_conn_t * const conn)
+{
+    if (conn->scram_init) {
+        xmpp_free(conn->ctx, conn->scram_init);
+        conn->scram_init = NULL;
+    }
+}
+
+/* starts a SCRAM exchange with the strongest hash in mask and unsets it
+ * there, returns the client-first message in base64 */
+static char *_scram_start(xmpp_conn_t * const conn, int * const mask)
+{
+    _scram_clear(conn);
+    if (*mask & SASL_MASK_SCRAMSHA512) {
+        conn->scram_alg = &scram_sha512;
+        *mask &= ~SASL_MASK_SCRAMSHA512;
+    } else if (*mask & SASL_MASK_SCRAMSHA256) {
+        conn->scram_alg = &scram_sha256;
+        *mask &= ~SASL_MASK_SCRAMSHA256;
+    } else {
+        conn->scram_alg = &scram_sha1;
+        *mask &= ~SASL_MASK_SCRAMSHA1;
+    }
+
+    /* kept for the challenge */
+    conn->scram_init = _make_scram_init_msg(conn);
+    if (!conn->scram_init)
+        return NULL;
+    return base64_encode(conn->ctx, (unsigned char *)conn->scram_init,
+                         strlen(conn->scram_init));
+}
+
+/* handle the challenge phase of SCRAM auth */
+static int _handle_scram_challenge(xmpp_conn_t * const conn,
+				   xmpp_stanza_t * const stanza,
+				   void * const userdata)
+{
+    xmpp_stanza_t *auth;
+    char *name;
+    const char *mechanism;
+
+    /* left over from a connection which was lost during auth */
+    if (!conn->scram_init)
+        return 0;
 
     name = xmpp_stanza_get_name(stanza);
+    mechanism = conn->scram_alg->scram_name;
     xmpp_debug(conn->ctx, "xmpp",
-               "handle SCRAM-SHA-1 (challenge) called for %s", name);
+               "handle %s (challenge) called for %s", mechanism, name);
 
     if (strcmp(name, "challenge") == 0) {
-        text = xmpp_stanza_get_text(stanza);
-        if (!text)
-            goto err;
-
-        challenge = (char *)base64_decode(conn->ctx, text, strlen(text));
-        xmpp_free(conn->ctx, text);
-        if (!challenge)
-            goto err;
-
-        response = sasl_scram_sha1(conn->ctx, challenge, scram_init,
-                                   conn->jid, conn->pass);
-        xmpp_free(conn->ctx, challenge);
-        if (!response)
-            goto err;
-
-        auth = xmpp_stanza_new(conn->ctx);
-        if (!auth)
-            goto err_free_response;
-        xmpp_stanza_set_name(auth, "response");
-        xmpp_stanza_set_ns(auth, XMPP_NS_SASL);
-
-        authdata = xmpp_stanza_new(conn->ctx);
-        if (!authdata)
-            goto err_release_auth;
-        xmpp_stanza_set_text(authdata, response);
-        xmpp_free(conn->ctx, response);
-
-        xmpp_stanza_add_child(auth, authdata);
-        xmpp_stanza_release(authdata);
+        auth = _make_scram_response(conn, stanza, XMPP_NS_SASL);
+        if (!auth) {
+            _scram_clear(conn);
+            disconnect_mem_error(conn);
+            return 0;
+        }
 
         xmpp_send(conn, auth);
         xmpp_stanza_release(auth);
 
     } else {
-        xmpp_free(conn->ctx, scram_init);
-        return _handle_sasl_result(conn, stanza, "SCRAM-SHA-1");
+        _scram_clear(conn);
+        _handle_sasl_result(conn, stanza, (void *)mechanism);
+        /* a failure may start SCRAM with the next hash, which goes
+           to this handler again */
+        return conn->scram_init != NULL;
     }
 
     return 1;
-
-err_release_auth:
-    xmpp_stanza_release(auth);
-err_free_response:
-    xmpp_free(conn->ctx, response);
-err:
-    xmpp_free(conn->ctx, scram_init);
-    disconnect_mem_error(conn);
-    return 0;
 }
 
-static char *_make_scram_sha1_init_msg(xmpp_conn_t * const conn)
+static char *_make_scram_init_msg(xmpp_conn_t * const conn)
 {
     size_t message_len;
     char *node;
@@ -549,7 +658,6 @@ static void _auth(xmpp_conn_t * const conn)
 {
     xmpp_stanza_t *auth, *authdata, *query, *child, *iq;
     char *str, *authid;
-    char *scram_init;
     int anonjid;
 
     /* if there is no node in conn->jid, we assume anonymous connect */
@@ -603,6 +711,11 @@ static void _auth(xmpp_conn_t * const conn)
         return;
     }
 
+    if (!anonjid && conn->sasl2_support) {
+	_auth_sasl2(conn);
+	return;
+    }
+
     if (anonjid && conn->sasl_support & SASL_MASK_ANONYMOUS) {
 	/* some crap here */
 	auth = _make_sasl_auth(conn, "ANONYMOUS");
@@ -623,26 +736,17 @@ static void _auth(xmpp_conn_t * const conn)
 	xmpp_error(conn->ctx, "auth",
 		   "No node in JID, and SASL ANONYMOUS unsupported.");
 	xmpp_disconnect(conn);
-    } else if (conn->sasl_support & SASL_MASK_SCRAMSHA1) {
-        auth = _make_sasl_auth(conn, "SCRAM-SHA-1");
-        if (!auth) {
-            disconnect_mem_error(conn);
-            return;
-        }
-
-        /* don't free scram_init on success */
-        scram_init = _make_scram_sha1_init_msg(conn);
-        if (!scram_init) {
-            xmpp_stanza_release(auth);
+    } else if (conn->sasl_support & SASL_MASK_SCRAM) {
+        /* unsets the flag of the SCRAM hash which is tried */
+        str = _scram_start(conn, &conn->sasl_support);
+        if (!str) {
             disconnect_mem_error(conn);
             return;
         }
 
-        str = (char *)base64_encode(conn->ctx, (unsigned char *)scram_init,
-                                    strlen(scram_init));
-        if (!str) {
-            xmpp_free(conn->ctx, scram_init);
-            xmpp_stanza_release(auth);
+        auth = _make_sasl_auth(conn, conn->scram_alg->scram_name);
+        if (!auth) {
+            xmpp_free(conn->ctx, str);
             disconnect_mem_error(conn);
             return;
         }
@@ -650,7 +754,6 @@ static void _auth(xmpp_conn_t * const conn)
         authdata = xmpp_stanza_new(conn->ctx);
         if (!authdata) {
             xmpp_free(conn->ctx, str);
-            xmpp_free(conn->ctx, scram_init);
             xmpp_stanza_release(auth);
             disconnect_mem_error(conn);
             return;
@@ -660,14 +763,11 @@ static void _auth(xmpp_conn_t * const conn)
         xmpp_stanza_add_child(auth, authdata);
         xmpp_stanza_release(authdata);
 
-        handler_add(conn, _handle_scram_sha1_challenge,
-                    XMPP_NS_SASL, NULL, NULL, (void *)scram_init);
+        handler_add(conn, _handle_scram_challenge,
+                    XMPP_NS_SASL, NULL, NULL, NULL);
 
         xmpp_send(conn, auth);
         xmpp_stanza_release(auth);
-
-        /* SASL SCRAM-SHA-1 was tried, unset flag */
-        conn->sasl_support &= ~SASL_MASK_SCRAMSHA1;
     } else if (conn->sasl_support & SASL_MASK_DIGESTMD5) {
 	auth = _make_sasl_auth(conn, "DIGEST-MD5");
 	if (!auth) {
@@ -826,6 +926,428 @@ static void _auth(xmpp_conn_t * const conn)
 }
 
 
+/* returns the child of stanza with the given name and namespace */
+static xmpp_stanza_t *_get_child(xmpp_stanza_t * const stanza,
+				 const char * const name,
+				 const char * const ns)
+{
+    xmpp_stanza_t *child;
+    char *child_ns;
+
+    for (child = xmpp_stanza_get_children(stanza); child;
+	 child = xmpp_stanza_get_next(child)) {
+	child_ns = xmpp_stanza_get_ns(child);
+	if (xmpp_stanza_get_name(child) &&
+	    strcmp(xmpp_stanza_get_name(child), name) == 0 &&
+	    child_ns && strcmp(child_ns, ns) == 0)
+	    return child;
+    }
+
+    return NULL;
+}
+
+/* adds a new element to parent, with text unless it is NULL; the child
+ * is owned by parent, NULL is returned on an allocation failure */
+static xmpp_stanza_t *_add_child(xmpp_conn_t * const conn,
+				 xmpp_stanza_t * const parent,
+				 const char * const name,
+				 const char * const ns,
+				 const char * const text)
+{
+    xmpp_stanza_t *child, *body;
+
+    child = xmpp_stanza_new(conn->ctx);
+    if (!child)
+	return NULL;
+    xmpp_stanza_set_name(child, name);
+    if (ns)
+	xmpp_stanza_set_ns(child, ns);
+    if (text) {
+	body = xmpp_stanza_new(conn->ctx);
+	if (!body) {
+	    xmpp_stanza_release(child);
+	    return NULL;
+	}
+	xmpp_stanza_set_text(body, text);
+	xmpp_stanza_add_child(child, body);
+	xmpp_stanza_release(body);
+    }
+    xmpp_stanza_add_child(parent, child);
+    xmpp_stanza_release(child);
+
+    return child;
+}
+
+/* maps a <mechanism/> of SASL2 or FAST to SASL_MASK_* */
+static int _sasl2_mechanism(xmpp_conn_t * const conn,
+			    xmpp_stanza_t * const mechanism)
+{
+    char *text;
+    int mask = 0;
+
+    text = xmpp_stanza_get_text(mechanism);
+    if (!text)
+	return 0;
+    if (strcasecmp(text, "PLAIN") == 0)
+	mask = SASL_MASK_PLAIN;
+    else if (strcasecmp(text, "SCRAM-SHA-1") == 0)
+	mask = SASL_MASK_SCRAMSHA1;
+    else if (strcasecmp(text, "SCRAM-SHA-256") == 0)
+	mask = SASL_MASK_SCRAMSHA256;
+    else if (strcasecmp(text, "SCRAM-SHA-512") == 0)
+	mask = SASL_MASK_SCRAMSHA512;
+    else if (strcasecmp(text, "HT-SHA-256-NONE") == 0)
+	mask = SASL_MASK_HTSHA256;
+    xmpp_free(conn->ctx, text);
+
+    return mask;
+}
+
+/* reads the SASL2 mechanisms and the features the server takes inline */
+static void _auth_sasl2_features(xmpp_conn_t * const conn,
+				 xmpp_stanza_t * const authentication)
+{
+    xmpp_stanza_t *child, *inl, *feature;
+    char *name, *var;
+    int mask;
+
+    for (child = xmpp_stanza_get_children(authentication); child;
+	 child = xmpp_stanza_get_next(child)) {
+	name = xmpp_stanza_get_name(child);
+	if (name && strcmp(name, "mechanism") == 0)
+	    conn->sasl2_support |= _sasl2_mechanism(conn, child) &
+				   ~SASL_MASK_HTSHA256;
+    }
+
+    inl = xmpp_stanza_get_child_by_name(authentication, "inline");
+    if (!inl)
+	return;
+
+    child = _get_child(inl, "bind", XMPP_NS_BIND2);
+    if (child) {
+	conn->sasl2_inline |= SASL2_INLINE_BIND;
+	/* features which can be enabled along with the bind */
+	child = xmpp_stanza_get_child_by_name(child, "inline");
+	for (feature = child ? xmpp_stanza_get_children(child) : NULL;
+	     feature; feature = xmpp_stanza_get_next(feature)) {
+	    var = xmpp_stanza_get_attribute(feature, "var");
+	    if (var && strcmp(var, XMPP_NS_SM) == 0)
+		conn->sasl2_inline |= SASL2_INLINE_BIND_SM;
+	}
+    }
+
+    if (_get_child(inl, "sm", XMPP_NS_SM))
+	conn->sasl2_inline |= SASL2_INLINE_SM;
+
+    child = _get_child(inl, "fast", XMPP_NS_FAST);
+    for (feature = child ? xmpp_stanza_get_children(child) : NULL;
+	 feature; feature = xmpp_stanza_get_next(feature)) {
+	name = xmpp_stanza_get_name(feature);
+	if (!name || strcmp(name, "mechanism") != 0)
+	    continue;
+	mask = _sasl2_mechanism(conn, feature);
+	if (mask == SASL_MASK_HTSHA256) {
+	    conn->sasl2_support |= mask;
+	    conn->sasl2_inline |= SASL2_INLINE_FAST;
+	}
+    }
+}
+
+/* a stream management session is resumed within the authentication */
+static int _sasl2_sm_resume(const xmpp_conn_t * const conn)
+{
+    return conn->sm_allowed && conn->sm_id &&
+	   (conn->sasl2_inline & SASL2_INLINE_SM);
+}
+
+/* stream management is enabled along with the bind */
+static int _sasl2_sm_enable(const xmpp_conn_t * const conn)
+{
+    return conn->sm_allowed && (conn->sasl2_inline & SASL2_INLINE_BIND_SM);
+}
+
+/* builds the SASL2 <authenticate/> with everything the server can do
+ * inline, so that the session is ready with its reply */
+static xmpp_stanza_t *_make_sasl2_authenticate(xmpp_conn_t * const conn,
+					       const char * const mechanism,
+					       const char * const response)
+{
+    xmpp_stanza_t *auth, *ua, *bind, *child;
+    char buf[21];
+
+    auth = xmpp_stanza_new(conn->ctx);
+    if (!auth)
+	return NULL;
+    xmpp_stanza_set_name(auth, "authenticate");
+    xmpp_stanza_set_ns(auth, XMPP_NS_SASL2);
+    xmpp_stanza_set_attribute(auth, "mechanism", mechanism);
+
+    if (!_add_child(conn, auth, "initial-response", NULL, response))
+	goto err;
+
+    ua = _add_child(conn, auth, "user-agent", NULL, NULL);
+    if (!ua)
+	goto err;
+    xmpp_stanza_set_attribute(ua, "id", conn->ua_id);
+    if (conn->ua_software &&
+	!_add_child(conn, ua, "software", NULL, conn->ua_software))
+	goto err;
+    if (conn->ua_device &&
+	!_add_child(conn, ua, "device", NULL, conn->ua_device))
+	goto err;
+
+    /* the server binds a new resource if it can't resume */
+    if (_sasl2_sm_resume(conn)) {
+	child = _add_child(conn, auth, "resume", XMPP_NS_SM, NULL);
+	if (!child)
+	    goto err;
+	xmpp_snprintf(buf, sizeof(buf), "%u", (unsigned int)conn->sm_handled);
+	xmpp_stanza_set_attribute(child, "h", buf);
+	xmpp_stanza_set_attribute(child, "previd", conn->sm_id);
+    }
+
+    if (conn->sasl2_inline & SASL2_INLINE_BIND) {
+	bind = _add_child(conn, auth, "bind", XMPP_NS_BIND2, NULL);
+	if (!bind)
+	    goto err;
+	if (conn->ua_software &&
+	    !_add_child(conn, bind, "tag", NULL, conn->ua_software))
+	    goto err;
+	if (_sasl2_sm_enable(conn)) {
+	    child = _add_child(conn, bind, "enable", XMPP_NS_SM, NULL);
+	    if (!child)
+		goto err;
+	    xmpp_stanza_set_attribute(child, "resume", "true");
+	}
+    }
+
+    if (conn->sasl2_fast) {
+	child = _add_child(conn, auth, "fast", XMPP_NS_FAST, NULL);
+	if (!child)
+	    goto err;
+	xmpp_snprintf(buf, sizeof(buf), "%lu", conn->fast_count);
+	xmpp_stanza_set_attribute(child, "count", buf);
+    } else if (conn->sasl2_inline & SASL2_INLINE_FAST) {
+	/* a token for the next login */
+	child = _add_child(conn, auth, "request-token", XMPP_NS_FAST, NULL);
+	if (!child)
+	    goto err;
+	xmpp_stanza_set_attribute(child, "mechanism", "HT-SHA-256-NONE");
+    }
+
+    return auth;
+
+err:
+    xmpp_stanza_release(auth);
+    return NULL;
+}
+
+/* authenticate with SASL2
+ * like _auth() this is called again if a mechanism fails, the FAST token
+ * goes first, then SCRAM with the strongest hash and PLAIN with the
+ * password
+ */
+static void _auth_sasl2(xmpp_conn_t * const conn)
+{
+    xmpp_stanza_t *auth;
+    char *authid, *response;
+    const char *mechanism;
+
+    /* the server ties tokens to the user agent, so it needs an id */
+    if (!conn->ua_id) {
+	conn->ua_id = xmpp_uuid_gen(conn->ctx);
+	if (!conn->ua_id) {
+	    disconnect_mem_error(conn);
+	    return;
+	}
+    }
+
+    authid = _get_authid(conn);
+    if (!authid) {
+	disconnect_mem_error(conn);
+	return;
+    }
+
+    conn->sasl2_fast = 0;
+    _scram_clear(conn);
+    if (conn->sasl2_support & SASL_MASK_HTSHA256 && conn->fast_token) {
+	mechanism = "HT-SHA-256-NONE";
+	response = sasl_ht_sha256(conn->ctx, authid, conn->fast_token);
+	conn->sasl2_support &= ~SASL_MASK_HTSHA256;
+	conn->sasl2_fast = 1;
+	conn->fast_count++;
+    } else if (conn->sasl2_support & SASL_MASK_SCRAM) {
+	response = _scram_start(conn, &conn->sasl2_support);
+	mechanism = conn->scram_alg->scram_name;
+    } else if (conn->sasl2_support & SASL_MASK_PLAIN) {
+	mechanism = "PLAIN";
+	response = sasl_plain(conn->ctx, authid, conn->pass);
+	conn->sasl2_support &= ~SASL_MASK_PLAIN;
+    } else {
+	/* nothing we can use is left, carry on with SASL */
+	xmpp_free(conn->ctx, authid);
+	conn->sasl2_support = 0;
+	_auth(conn);
+	return;
+    }
+    xmpp_free(conn->ctx, authid);
+
+    auth = response ? _make_sasl2_authenticate(conn, mechanism, response)
+		    : NULL;
+    if (response)
+	xmpp_free(conn->ctx, response);
+    if (!auth) {
+	disconnect_mem_error(conn);
+	return;
+    }
+
+    if (_sasl2_sm_resume(conn))
+	conn->sm_state = XMPP_SM_RESUMING;
+    /* after a failure the handler is still there for the next try */
+    handler_add(conn, _handle_sasl2_result, XMPP_NS_SASL2,
+		NULL, NULL, NULL);
+
+    xmpp_send(conn, auth);
+    xmpp_stanza_release(auth);
+}
+
+/* a SASL2 mechanism which _auth_sasl2() can try */
+static int _sasl2_usable(const xmpp_conn_t * const conn)
+{
+    return (conn->sasl2_support & (SASL_MASK_SCRAM | SASL_MASK_PLAIN)) ||
+	   (conn->sasl2_support & SASL_MASK_HTSHA256 && conn->fast_token);
+}
+
+static int _handle_sasl2_result(xmpp_conn_t * const conn,
+				xmpp_stanza_t * const stanza,
+				void * const userdata)
+{
+    xmpp_stanza_t *response;
+    char *name;
+    int retry;
+
+    name = xmpp_stanza_get_name(stanza);
+
+    if (strcmp(name, "challenge") == 0 && conn->scram_init) {
+	response = _make_scram_response(conn, stanza, XMPP_NS_SASL2);
+	if (!response) {
+	    disconnect_mem_error(conn);
+	    return 0;
+	}
+	xmpp_send(conn, response);
+	xmpp_stanza_release(response);
+	return 1;
+    }
+    _scram_clear(conn);
+
+    if (strcmp(name, "success") == 0) {
+	_auth_sasl2_success(conn, stanza);
+    } else if (strcmp(name, "failure") == 0) {
+	if (conn->sasl2_fast) {
+	    /* the token expired or was revoked */
+	    xmpp_debug(conn->ctx, "xmpp", "SASL2 FAST token rejected");
+	    xmpp_conn_set_fast_token(conn, NULL, 0);
+	    conn->sasl2_fast = 0;
+	} else {
+	    xmpp_debug(conn->ctx, "xmpp", "SASL2 auth failed");
+	}
+
+	/* fall back to next auth method, keep this handler if it is
+	   another SASL2 one */
+	retry = _sasl2_usable(conn);
+	_auth(conn);
+	return retry;
+    } else {
+	/* a <continue/> for tasks we don't know */
+	xmpp_error(conn->ctx, "xmpp", "Got unexpected reply to SASL2 "
+		   "authentication.");
+	xmpp_disconnect(conn);
+    }
+
+    return 0;
+}
+
+/* the user is authenticated and the stream stays open, the session is
+ * set up from what the server did inline */
+static void _auth_sasl2_success(xmpp_conn_t * const conn,
+				xmpp_stanza_t * const success)
+{
+    xmpp_stanza_t *child, *bound;
+    char *text, *token;
+
+    if (conn->sasl2_fast) {
+	/* the server proves that it knows the token as well, a success
+	 * without the proof is no success */
+	child = xmpp_stanza_get_child_by_name(success, "additional-data");
+	text = child ? xmpp_stanza_get_text(child) : NULL;
+	if (!text || sasl_ht_sha256_verify(conn->ctx, conn->fast_token,
+					   text) != 0) {
+	    if (text)
+		xmpp_free(conn->ctx, text);
+	    xmpp_error(conn->ctx, "xmpp", "Server failed to prove it knows "
+		       "the FAST token.");
+	    xmpp_disconnect(conn);
+	    return;
+	}
+	xmpp_free(conn->ctx, text);
+	conn->sasl2_fast = 0;
+    }
+    xmpp_debug(conn->ctx, "xmpp", "SASL2 auth successful");
+
+    child = xmpp_stanza_get_child_by_name(success,
+					  "authorization-identifier");
+    text = child ? xmpp_stanza_get_text(child) : NULL;
+    if (text)
+	conn_set_bound_jid(conn, text);
+
+    child = _get_child(success, "token", XMPP_NS_FAST);
+    token = child ? xmpp_stanza_get_attribute(child, "token") : NULL;
+    if (token) {
+	if (xmpp_conn_set_fast_token(conn, token, 0) != 0) {
+	    disconnect_mem_error(conn);
+	    return;
+	}
+	xmpp_debug(conn->ctx, "xmpp", "Got a new FAST token.");
+    }
+
+    child = _get_child(success, "resumed", XMPP_NS_SM);
+    if (child && conn->sm_state == XMPP_SM_RESUMING) {
+	_auth_resumed(conn, child);
+	return;
+    }
+    if (conn->sm_id) {
+	if (conn->sm_state == XMPP_SM_RESUMING)
+	    xmpp_debug(conn->ctx, "xmpp", "Stream resumption failed, "
+		       "binding a new session.");
+	sm_reset(conn);
+    }
+
+    bound = _get_child(success, "bound", XMPP_NS_BIND2);
+    if (!bound) {
+	/* no Bind2, bind the resource on the same stream */
+	conn->bind_required = 1;
+	conn->session_required = 0;
+	conn->sm_support = (conn->sasl2_inline & SASL2_INLINE_SM) != 0;
+	_auth_bind(conn);
+	return;
+    }
+
+    if (_sasl2_sm_enable(conn)) {
+	/* <enable/> went along with the bind */
+	conn->sm_support = 0;
+	child = _get_child(bound, "enabled", XMPP_NS_SM);
+	if (child)
+	    _handle_sm_enabled(conn, child, NULL);
+	else
+	    xmpp_debug(conn->ctx, "xmpp", "Server refused stream "
+		       "management.");
+    } else {
+	conn->sm_support = (conn->sasl2_inline & SASL2_INLINE_SM) != 0;
+    }
+
+    _auth_established(conn);
+}
+
 /** Set up handlers at stream start.
  *  This function is called internally to Strophe for handling the opening
  *  of an XMPP stream.  It's called by the parser when a stream is opened
@@ -867,8 +1389,8 @@ static int _handle_features_sasl(xmpp_conn_t * const conn,
 				 xmpp_stanza_t * const stanza,
 				 void * const userdata)
 {
-    xmpp_stanza_t *bind, *session, *iq, *res, *text;
-    char *resource;
+    xmpp_stanza_t *bind, *session, *sm;
+    char *ns;
 
     /* remove missing features handler */
     xmpp_timed_handler_delete(conn, _handle_missing_features_sasl);
@@ -888,84 +1410,332 @@ static int _handle_features_sasl(xmpp_conn_t * const conn,
 	conn->session_required = 1;
     }
 
+    sm = xmpp_stanza_get_child_by_name(stanza, "sm");
+    ns = sm ? xmpp_stanza_get_ns(sm) : NULL;
+    conn->sm_support = ns && strcmp(ns, XMPP_NS_SM) == 0;
+
+    /* compress first, so that everything after it benefits; the stream
+       is restarted and the features come again */
+    if (conn->compression_allowed && !compression_active(conn) &&
+	_auth_compression_offered(conn, stanza)) {
+	_auth_compress(conn);
+	return 0;
+    }
+
+    _auth_session(conn);
+
+    return 0;
+}
+
+/* resumes the stream management session or binds a new resource */
+static void _auth_session(xmpp_conn_t * const conn)
+{
+    /* a stream management session survives the connection, resume it
+       instead of binding a new resource */
+    if (conn->sm_id) {
+	if (conn->sm_allowed && conn->sm_support) {
+	    _auth_resume(conn);
+	    return;
+	}
+	sm_reset(conn);
+    }
+
     /* if bind is required, go ahead and start it */
     if (conn->bind_required) {
-	/* bind resource */
+	_auth_bind(conn);
+    } else {
+	/* can't bind, disconnect */
+	xmpp_error(conn->ctx, "xmpp", "Stream features does not allow "\
+		   "resource bind.");
+	xmpp_disconnect(conn);
+    }
+}
 
-	/* setup response handlers */
-	handler_add_id(conn, _handle_bind, "_xmpp_bind1", NULL);
-	handler_add_timed(conn, _handle_missing_bind,
-			  BIND_TIMEOUT, NULL);
+/* checks the stream features for XEP-0138 zlib compression */
+static int _auth_compression_offered(xmpp_conn_t * const conn,
+                                     xmpp_stanza_t * const features)
+{
+    xmpp_stanza_t *compression, *method;
+    char *ns, *name, *text;
+    int found = 0;
+
+    compression = xmpp_stanza_get_child_by_name(features, "compression");
+    ns = compression ? xmpp_stanza_get_ns(compression) : NULL;
+    if (!ns || strcmp(ns, XMPP_NS_FEATURE_COMPRESS) != 0)
+	return 0;
+
+    for (method = xmpp_stanza_get_children(compression);
+	 method && !found; method = xmpp_stanza_get_next(method)) {
+	name = xmpp_stanza_get_name(method);
+	if (!name || strcmp(name, "method") != 0)
+	    continue;
+	text = xmpp_stanza_get_text(method);
+	found = text && strcmp(text, "zlib") == 0;
+	if (text) xmpp_free(conn->ctx, text);
+    }
 
-	/* send bind request */
-	iq = xmpp_stanza_new(conn->ctx);
-	if (!iq) {
+    return found;
+}
+
+/* asks the server to compress the stream */
+static void _auth_compress(xmpp_conn_t * const conn)
+{
+    handler_add(conn, _handle_compress_result, XMPP_NS_COMPRESS,
+		NULL, NULL, NULL);
+    handler_add_timed(conn, _handle_missing_compress,
+		      COMPRESS_TIMEOUT, NULL);
+
+    xmpp_send_raw_string(conn, "<compress xmlns='%s'>"
+			 "<method>zlib</method></compress>", XMPP_NS_COMPRESS);
+}
+
+static int _handle_compress_result(xmpp_conn_t * const conn,
+                                   xmpp_stanza_t * const stanza,
+                                   void * const userdata)
+{
+    char *name;
+
+    xmpp_timed_handler_delete(conn, _handle_missing_compress);
+
+    name = xmpp_stanza_get_name(stanza);
+    if (name && strcmp(name, "compressed") == 0) {
+	if (compression_start(conn) != 0) {
 	    disconnect_mem_error(conn);
 	    return 0;
 	}
+	xmpp_debug(conn->ctx, "xmpp", "Stream compression enabled.");
 
-	xmpp_stanza_set_name(iq, "iq");
-	xmpp_stanza_set_type(iq, "set");
-	xmpp_stanza_set_id(iq, "_xmpp_bind1");
+	/* restart the stream on top of the compression */
+	conn_prepare_reset(conn, _handle_open_sasl);
+	conn_open_stream(conn);
+    } else {
+	/* <failure/>, carry on uncompressed */
+	xmpp_debug(conn->ctx, "xmpp", "Server refused stream compression.");
+	_auth_session(conn);
+    }
+
+    return 0;
+}
+
+static int _handle_missing_compress(xmpp_conn_t * const conn,
+                                    void * const userdata)
+{
+    xmpp_error(conn->ctx, "xmpp", "Server did not reply to compress "
+	       "request.");
+    xmpp_disconnect(conn);
+    return 0;
+}
 
-	bind = xmpp_stanza_copy(bind);
-	if (!bind) {
+/* sends the bind request */
+static void _auth_bind(xmpp_conn_t * const conn)
+{
+    xmpp_stanza_t *bind, *iq, *res, *text;
+    char *resource;
+
+    /* setup response handlers */
+    handler_add_id(conn, _handle_bind, "_xmpp_bind1", NULL);
+    handler_add_timed(conn, _handle_missing_bind,
+		      BIND_TIMEOUT, NULL);
+
+    /* send bind request */
+    iq = xmpp_stanza_new(conn->ctx);
+    if (!iq) {
+	disconnect_mem_error(conn);
+	return;
+    }
+
+    xmpp_stanza_set_name(iq, "iq");
+    xmpp_stanza_set_type(iq, "set");
+    xmpp_stanza_set_id(iq, "_xmpp_bind1");
+
+    bind = xmpp_stanza_new(conn->ctx);
+    if (!bind) {
+	xmpp_stanza_release(iq);
+	disconnect_mem_error(conn);
+	return;
+    }
+    xmpp_stanza_set_name(bind, "bind");
+    xmpp_stanza_set_ns(bind, XMPP_NS_BIND);
+
+    /* request a specific resource if we have one */
+    resource = xmpp_jid_resource(conn->ctx, conn->jid);
+    if ((resource != NULL) && (strlen(resource) == 0)) {
+	/* jabberd2 doesn't handle an empty resource */
+	xmpp_free(conn->ctx, resource);
+	resource = NULL;
+    }
+
+    /* if we have a resource to request, do it. otherwise the
+       server will assign us one */
+    if (resource) {
+	res = xmpp_stanza_new(conn->ctx);
+	if (!res) {
+	    xmpp_stanza_release(bind);
 	    xmpp_stanza_release(iq);
 	    disconnect_mem_error(conn);
-	    return 0;
+	    return;
 	}
-
-	/* request a specific resource if we have one */
-        resource = xmpp_jid_resource(conn->ctx, conn->jid);
-	if ((resource != NULL) && (strlen(resource) == 0)) {
-	    /* jabberd2 doesn't handle an empty resource */
-	    xmpp_free(conn->ctx, resource);
-	    resource = NULL;
+	xmpp_stanza_set_name(res, "resource");
+	text = xmpp_stanza_new(conn->ctx);
+	if (!text) {
+	    xmpp_stanza_release(res);
+	    xmpp_stanza_release(bind);
+	    xmpp_stanza_release(iq);
+	    disconnect_mem_error(conn);
+	    return;
 	}
+	xmpp_stanza_set_text(text, resource);
+	xmpp_stanza_add_child(res, text);
+	xmpp_stanza_release(text);
+	xmpp_stanza_add_child(bind, res);
+	xmpp_stanza_release(res);
+	xmpp_free(conn->ctx, resource);
+    }
 
-	/* if we have a resource to request, do it. otherwise the
-	   server will assign us one */
-	if (resource) {
-	    res = xmpp_stanza_new(conn->ctx);
-	    if (!res) {
-		xmpp_stanza_release(bind);
-		xmpp_stanza_release(iq);
-		disconnect_mem_error(conn);
-		return 0;
-	    }
-	    xmpp_stanza_set_name(res, "resource");
-	    text = xmpp_stanza_new(conn->ctx);
-	    if (!text) {
-		xmpp_stanza_release(res);
-		xmpp_stanza_release(bind);
-		xmpp_stanza_release(iq);
-		disconnect_mem_error(conn);
-		return 0;
-	    }
-	    xmpp_stanza_set_text(text, resource);
-	    xmpp_stanza_add_child(res, text);
-            xmpp_stanza_release(text);
-	    xmpp_stanza_add_child(bind, res);
-            xmpp_stanza_release(res);
-	    xmpp_free(conn->ctx, resource);
+    xmpp_stanza_add_child(iq, bind);
+    xmpp_stanza_release(bind);
+
+    /* send bind request */
+    xmpp_send(conn, iq);
+    xmpp_stanza_release(iq);
+}
+
+/* asks the server to resume the previous stream management session */
+static void _auth_resume(xmpp_conn_t * const conn)
+{
+    xmpp_stanza_t *resume;
+    char h[11];
+
+    resume = xmpp_stanza_new(conn->ctx);
+    if (!resume) {
+	disconnect_mem_error(conn);
+	return;
+    }
+    xmpp_snprintf(h, sizeof(h), "%u", (unsigned int)conn->sm_handled);
+    xmpp_stanza_set_name(resume, "resume");
+    xmpp_stanza_set_ns(resume, XMPP_NS_SM);
+    xmpp_stanza_set_attribute(resume, "h", h);
+    xmpp_stanza_set_attribute(resume, "previd", conn->sm_id);
+
+    conn->sm_state = XMPP_SM_RESUMING;
+    xmpp_handler_delete(conn, _handle_sm_resume);
+    handler_add(conn, _handle_sm_resume, XMPP_NS_SM, NULL, NULL, NULL);
+    handler_add_timed(conn, _handle_missing_sm_resume,
+		      SM_RESUME_TIMEOUT, NULL);
+
+    xmpp_send(conn, resume);
+    xmpp_stanza_release(resume);
+}
+
+static int _handle_sm_resume(xmpp_conn_t * const conn,
+			     xmpp_stanza_t * const stanza,
+			     void * const userdata)
+{
+    char *name = xmpp_stanza_get_name(stanza);
+
+    if (strcmp(name, "resumed") == 0) {
+	xmpp_timed_handler_delete(conn, _handle_missing_sm_resume);
+	_auth_resumed(conn, stanza);
+    } else if (strcmp(name, "failed") == 0) {
+	xmpp_timed_handler_delete(conn, _handle_missing_sm_resume);
+	xmpp_debug(conn->ctx, "xmpp", "Stream resumption failed, binding "
+		   "a new session.");
+
+	sm_reset(conn);
+	conn_set_bound_jid(conn, NULL);
+	if (conn->bind_required) {
+	    _auth_bind(conn);
+	} else {
+	    xmpp_error(conn->ctx, "xmpp", "Stream features does not allow "
+		       "resource bind.");
+	    xmpp_disconnect(conn);
 	}
+    } else {
+	/* not for us */
+	return 1;
+    }
 
-	xmpp_stanza_add_child(iq, bind);
-	xmpp_stanza_release(bind);
+    return 0;
+}
 
-	/* send bind request */
-	xmpp_send(conn, iq);
-	xmpp_stanza_release(iq);
+/* the server took the session back, send what it didn't get */
+static void _auth_resumed(xmpp_conn_t * const conn,
+			  xmpp_stanza_t * const resumed)
+{
+    char *h;
+
+    xmpp_debug(conn->ctx, "xmpp", "Stream resumed.");
+
+    conn->sm_state = XMPP_SM_ENABLED;
+    h = xmpp_stanza_get_attribute(resumed, "h");
+    if (h)
+	sm_ack(conn, strtoul(h, NULL, 10));
+    sm_start(conn);
+    sm_resend(conn);
+
+    conn->sm_resumed = 1;
+    conn->authenticated = 1;
+
+    /* call connection handler */
+    conn->conn_handler(conn, XMPP_CONN_CONNECT, 0, NULL, conn->userdata);
+}
+
+static int _handle_missing_sm_resume(xmpp_conn_t * const conn,
+				     void * const userdata)
+{
+    xmpp_error(conn->ctx, "xmpp", "Server did not reply to resume request.");
+    xmpp_disconnect(conn);
+    return 0;
+}
+
+static int _handle_sm_enabled(xmpp_conn_t * const conn,
+			      xmpp_stanza_t * const stanza,
+			      void * const userdata)
+{
+    char *name = xmpp_stanza_get_name(stanza);
+    char *resume, *id;
+
+    if (strcmp(name, "enabled") == 0) {
+	conn->sm_state = XMPP_SM_ENABLED;
+	resume = xmpp_stanza_get_attribute(stanza, "resume");
+	id = xmpp_stanza_get_attribute(stanza, "id");
+	if (id && resume && (strcmp(resume, "true") == 0 ||
+			     strcmp(resume, "1") == 0))
+	    conn->sm_id = xmpp_strdup(conn->ctx, id);
+	xmpp_debug(conn->ctx, "xmpp", "Stream management enabled%s.",
+		   conn->sm_id ? " with resumption" : "");
+	sm_start(conn);
+    } else if (strcmp(name, "failed") == 0) {
+	xmpp_debug(conn->ctx, "xmpp", "Server refused stream management.");
+	sm_reset(conn);
     } else {
-	/* can't bind, disconnect */
-	xmpp_error(conn->ctx, "xmpp", "Stream features does not allow "\
-		   "resource bind.");
-	xmpp_disconnect(conn);
+	/* not for us */
+	return 1;
     }
 
     return 0;
 }
 
+/* the session is ready, enable stream management and report the connect */
+static void _auth_established(xmpp_conn_t * const conn)
+{
+    if (conn->sm_allowed && conn->sm_support) {
+	/* stanzas are counted from here on, no need to wait for the reply */
+	sm_reset(conn);
+	conn->sm_state = XMPP_SM_REQUESTED;
+	xmpp_handler_delete(conn, _handle_sm_enabled);
+	handler_add(conn, _handle_sm_enabled, XMPP_NS_SM, NULL, NULL, NULL);
+	xmpp_send_raw_string(conn, "<enable xmlns='%s' resume='true'/>",
+			     XMPP_NS_SM);
+    }
+
+    conn->sm_resumed = 0;
+    conn->authenticated = 1;
+
+    /* call connection handler */
+    conn->conn_handler(conn, XMPP_CONN_CONNECT, 0, NULL, conn->userdata);
+}
+
 static int _handle_missing_features_sasl(xmpp_conn_t * const conn,
 					 void * const userdata)
 {
@@ -998,7 +1768,7 @@ static int _handle_bind(xmpp_conn_t * const conn,
             xmpp_stanza_t *jid_stanza = xmpp_stanza_get_child_by_name(binding,
                                                                       "jid");
             if (jid_stanza) {
-                conn->bound_jid = xmpp_stanza_get_text(jid_stanza);
+                conn_set_bound_jid(conn, xmpp_stanza_get_text(jid_stanza));
             }
         }
 
@@ -1036,11 +1806,7 @@ static int _handle_bind(xmpp_conn_t * const conn,
 	    xmpp_send(conn, iq);
 	    xmpp_stanza_release(iq);
 	} else {
-	    conn->authenticated = 1;
-
-	    /* call connection handler */
-	    conn->conn_handler(conn, XMPP_CONN_CONNECT, 0, NULL,
-			       conn->userdata);
+	    _auth_established(conn);
 	}
     } else {
 	xmpp_error(conn->ctx, "xmpp", "Server sent malformed bind reply.");
@@ -1075,10 +1841,7 @@ static int _handle_session(xmpp_conn_t * const conn,
     } else if (type && strcmp(type, "result") == 0) {
 	xmpp_debug(conn->ctx, "xmpp", "Session establishment successful.");
 
-	conn->authenticated = 1;
-
-	/* call connection handler */
-	conn->conn_handler(conn, XMPP_CONN_CONNECT, 0, NULL, conn->userdata);
+	_auth_established(conn);
     } else {
 	xmpp_error(conn->ctx, "xmpp", "Server sent malformed session reply.");
 	xmpp_disconnect(conn);
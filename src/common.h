@@ -28,6 +28,11 @@
 #include "util.h"
 #include "parser.h"
 #include "rand.h"
+#include "jid.h"
+#include "resolver.h"
+#include "transport.h"
+#include "compression.h"
+#include "scram.h"
 #include "snprintf.h"
 
 /** run-time context **/
@@ -48,8 +53,21 @@ struct _xmpp_ctx_t {
     const xmpp_log_t *log;
 
     xmpp_rand_t *rand;
+    resolver_t *resolver;
     xmpp_loop_status_t loop_status;
     xmpp_connlist_t *connlist;
+
+    /* reconnect throttling */
+    unsigned int connect_max; /* connects in progress, 0 for no limit */
+    unsigned int connect_rate; /* reconnects per second, 0 for no limit */
+    uint64_t connect_tokens; /* reconnects allowed now, in 1/1000 */
+    uint64_t connect_tokens_stamp;
+
+    /* SCRAM keys of recent logins */
+    scram_cache_t scram_cache;
+
+    /* recently normalized JIDs, created on first use */
+    jid_cache_t *jid_cache;
 };
 
 
@@ -88,7 +106,9 @@ void xmpp_debug(const xmpp_ctx_t * const ctx,
 /* opaque connection object */
 typedef enum {
     XMPP_STATE_DISCONNECTED,
+    XMPP_STATE_RESOLVING,
     XMPP_STATE_CONNECTING,
+    XMPP_STATE_TLS_HANDSHAKE,
     XMPP_STATE_CONNECTED
 } xmpp_conn_state_t;
 
@@ -101,6 +121,14 @@ struct _xmpp_send_queue_t {
     xmpp_send_queue_t *next;
 };
 
+/* XEP-0198 stream management */
+typedef enum {
+    XMPP_SM_DISABLED,
+    XMPP_SM_REQUESTED, /* <enable/> sent, outgoing stanzas are counted */
+    XMPP_SM_RESUMING, /* <resume/> sent */
+    XMPP_SM_ENABLED
+} xmpp_sm_state_t;
+
 typedef struct _xmpp_handlist_t xmpp_handlist_t;
 struct _xmpp_handlist_t {
     /* common members */
@@ -135,6 +163,18 @@ struct _xmpp_handlist_t {
 #define SASL_MASK_DIGESTMD5 0x02
 #define SASL_MASK_ANONYMOUS 0x04
 #define SASL_MASK_SCRAMSHA1 0x08
+#define SASL_MASK_HTSHA256 0x10
+#define SASL_MASK_SCRAMSHA256 0x20
+#define SASL_MASK_SCRAMSHA512 0x40
+
+#define SASL_MASK_SCRAM (SASL_MASK_SCRAMSHA1 | SASL_MASK_SCRAMSHA256 | \
+                         SASL_MASK_SCRAMSHA512)
+
+/* features the server takes inline with a SASL2 <authenticate/> */
+#define SASL2_INLINE_BIND 0x01 /* XEP-0386 Bind2 */
+#define SASL2_INLINE_BIND_SM 0x02 /* <enable/> inside Bind2 */
+#define SASL2_INLINE_SM 0x04 /* <resume/> */
+#define SASL2_INLINE_FAST 0x08 /* XEP-0484 tokens */
 
 enum {
     XMPP_PORT_CLIENT = 5222,
@@ -144,6 +184,15 @@ enum {
 
 typedef void (*xmpp_open_handler)(xmpp_conn_t * const conn);
 
+/* one address of the connection race */
+typedef struct _xmpp_connect_attempt_t {
+    resolver_addr_t addr;
+    sock_t sock; /* -1 unless the connect is in progress */
+} xmpp_connect_attempt_t;
+
+/* random characters in front of the counter of xmpp_conn_gen_id() */
+#define CONN_ID_PREFIX_LEN 8
+
 struct _xmpp_conn_t {
     unsigned int ref;
     xmpp_ctx_t *ctx;
@@ -155,29 +204,81 @@ struct _xmpp_conn_t {
     xmpp_stream_error_t *stream_error;
     sock_t sock;
     tls_t *tls;
+    const transport_t *transport;
+    void *transport_data;
 
     int tls_support;
     int tls_disabled;
     int tls_mandatory;
     int tls_legacy_ssl;
+    int tls_ktls; /* offload TLS records to the kernel if possible */
+    int tls_low_mem; /* release TLS buffers while the link is idle */
     int tls_failed; /* set when tls fails, so we don't try again */
+    sock_opts_t sock_opts; /* applied to the socket before connect */
     int sasl_support; /* if true, field is a bitfield of supported 
 			 mechanisms */ 
+    char *scram_init; /* SCRAM client-first message, SASL or SASL2 */
+    const scram_hash_t *scram_alg;
     int secured; /* set when stream is secured with TLS */
 
     /* if server returns <bind/> or <session/> we must do them */
     int bind_required;
     int session_required;
 
+    /* XEP-0198 stream management */
+    int sm_allowed; /* XMPP_CONN_FLAG_STREAM_MGMT */
+    int sm_support; /* offered in the stream features */
+    xmpp_sm_state_t sm_state;
+    char *sm_id; /* resumption id, NULL if the session can't be resumed */
+    uint32_t sm_handled; /* incoming stanzas handled */
+    uint32_t sm_sent; /* outgoing stanzas counted */
+    uint32_t sm_acked; /* outgoing stanzas acknowledged by the server */
+    xmpp_send_queue_t *sm_queue_head; /* unacknowledged stanzas */
+    xmpp_send_queue_t *sm_queue_tail;
+    int sm_unrequested; /* stanzas sent since the last <r/> */
+    int sm_resumed; /* the last connect resumed the session */
+
+    /* XEP-0138 stream compression */
+    int compression_allowed; /* XMPP_CONN_FLAG_COMPRESSION */
+    int compression_level;
+    int compression_mem_level;
+    compression_t *compression; /* kept for the next connection */
+
+    /* XEP-0388 SASL2 with Bind2 and FAST */
+    int sasl2_allowed; /* XMPP_CONN_FLAG_SASL2 */
+    int sasl2_support; /* SASL2 mechanisms offered, SASL_MASK_* */
+    int sasl2_inline; /* SASL2_INLINE_* */
+    int sasl2_fast; /* authenticating with the FAST token */
+    char *fast_token;
+    unsigned long fast_count; /* uses of the token */
+    char *ua_id; /* user agent, FAST tokens are tied to its id */
+    char *ua_software;
+    char *ua_device;
+
     char *lang;
     char *domain;
-    char *connectdomain;
-    char *connectport;
+    char *connectdomain; /* host to connect to, set while resolving */
+    unsigned short connectport;
+    char *unix_path; /* local socket to connect to instead of TCP */
+    int resolve_srv; /* waiting for the SRV lookup of the domain */
+    int srv_port; /* take the port from the SRV record */
+    resolver_srv_rr_t *srv_targets; /* SRV targets left to try */
+    int target_error; /* of the last target, reported if none is left */
+
+    /* parallel connection attempts to the addresses of the target */
+    xmpp_connect_attempt_t *attempts;
+    int attempt_count;
+    int attempt_next; /* next address to start */
+    uint64_t attempt_stamp; /* start of the last attempt */
     char *jid;
     char *pass;
     char *bound_jid;
     char *stream_id;
 
+    /* stanza ids of xmpp_conn_gen_id() */
+    char id_prefix[CONN_ID_PREFIX_LEN + 1]; /* empty until the first id */
+    uint64_t id_counter;
+
     /* send queue and parameters */
     int blocking_send;
     int send_queue_max;
@@ -192,6 +293,16 @@ struct _xmpp_conn_t {
     /* timeouts */
     unsigned int connect_timeout;
 
+    /* automatic reconnect */
+    unsigned long reconnect_min; /* first delay in ms, 0 if disabled */
+    unsigned long reconnect_max; /* upper bound of the backoff */
+    unsigned long reconnect_backoff; /* delay of the last try, no jitter */
+    int reconnect_pending; /* waiting to connect again */
+    uint64_t reconnect_stamp; /* time of the next try */
+    char *reconnect_host; /* altdomain or component server, may be NULL */
+    unsigned short reconnect_port;
+    int disconnect_requested; /* xmpp_disconnect() was called */
+
     /* event handlers */    
 
     /* stream open handler */
@@ -211,11 +322,34 @@ struct _xmpp_conn_t {
 };
 
 void conn_disconnect(xmpp_conn_t * const conn);
+int conn_sock_connect(xmpp_conn_t * const conn);
+void conn_established(xmpp_conn_t * const conn);
+void conn_resolve(xmpp_conn_t * const conn);
+void conn_connect_failed(xmpp_conn_t * const conn);
+uint64_t conn_connect_watch(xmpp_conn_t * const conn, fd_set *wfds,
+                            sock_t *max);
+int conn_connect_process(xmpp_conn_t * const conn, fd_set *wfds);
 void conn_disconnect_clean(xmpp_conn_t * const conn);
 void conn_open_stream(xmpp_conn_t * const conn);
 int conn_tls_start(xmpp_conn_t * const conn);
+void conn_tls_handshake(xmpp_conn_t * const conn);
 void conn_prepare_reset(xmpp_conn_t * const conn, xmpp_open_handler handler);
 void conn_parser_reset(xmpp_conn_t * const conn);
+void conn_set_bound_jid(xmpp_conn_t * const conn, char * const jid);
+uint64_t conn_reconnect_process(xmpp_ctx_t * const ctx);
+
+/* stream management */
+void sm_start(xmpp_conn_t * const conn);
+void sm_reset(xmpp_conn_t * const conn);
+void sm_disconnect(xmpp_conn_t * const conn);
+int sm_stanza_held(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza);
+int sm_stanza_sent(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza,
+                   char *buf, size_t len);
+void sm_stanza_handled(xmpp_conn_t * const conn,
+                       xmpp_stanza_t * const stanza);
+void sm_ack(xmpp_conn_t * const conn, uint32_t h);
+void sm_send_ack(xmpp_conn_t * const conn);
+void sm_resend(xmpp_conn_t * const conn);
 
 
 typedef enum {
@@ -224,11 +358,13 @@ typedef enum {
     XMPP_STANZA_TAG
 } xmpp_stanza_type_t;
 
+typedef struct _stanza_arena_t stanza_arena_t;
+
 struct _xmpp_stanza_t {
     int ref;
-    xmpp_ctx_t *ctx;
-
     xmpp_stanza_type_t type;
+    xmpp_ctx_t *ctx;
+    stanza_arena_t *arena; /* block of xmpp_stanza_build(), NULL if none */
     
     xmpp_stanza_t *prev;
     xmpp_stanza_t *next;
@@ -238,6 +374,12 @@ struct _xmpp_stanza_t {
     char *data;
 
     hash_t *attributes;
+
+    /* text of a frozen stanza, kept until it changes */
+    int frozen;
+    int rendered_skip_ns; /* whether the xmlns was left out */
+    char *rendered;
+    size_t rendered_len;
 };
 
 /* handler management */
@@ -0,0 +1,396 @@
+/* compression.c
+** strophe XMPP client library -- XEP-0138 stream compression
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/** @file
+ *  Zlib stream compression.
+ *
+ *  Compression is a transport layered over the one the connection already
+ *  uses, so it sits between the send queue and the socket or TLS on the
+ *  way out and between the socket and the parser on the way in.  Every
+ *  write from the send queue ends with a sync flush, so the server can
+ *  parse each batch of stanzas as soon as it arrives.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "compression.h"
+
+#ifdef HAVE_ZLIB
+
+#include <zlib.h>
+
+#ifndef COMPRESSION_BUFFER
+/** @def COMPRESSION_BUFFER
+ *  Size of the buffer for compressed data read from the transport.
+ */
+#define COMPRESSION_BUFFER 4096
+#endif
+
+struct _compression_t {
+    const transport_t *inner; /* the transport under the compression */
+    int active;
+    z_stream deflate;
+    z_stream inflate;
+    int level;
+    int mem_level;
+
+    /* compressed data read from the transport, not inflated yet */
+    unsigned char in[COMPRESSION_BUFFER];
+    size_t in_len;
+    size_t in_off;
+    int inflate_full; /* the last read filled its buffer */
+
+    /* compressed data not written to the transport yet */
+    unsigned char *out;
+    size_t out_len;
+    size_t out_off;
+    size_t out_size;
+
+    int would_block; /* the last call failed without an error */
+    int error; /* the stream is corrupt */
+};
+
+/* writes out as much of the compressed data as the transport takes */
+static int _compression_flush_out(xmpp_conn_t * const conn)
+{
+    compression_t *c = conn->compression;
+    int ret;
+
+    while (c->out_off < c->out_len) {
+        ret = c->inner->write(conn, c->out + c->out_off,
+                              c->out_len - c->out_off);
+        if (ret < 0) return -1;
+        if (ret == 0) break;
+        c->out_off += ret;
+    }
+    if (c->out_off == c->out_len)
+        c->out_off = c->out_len = 0;
+
+    return 0;
+}
+
+/* compresses len bytes into the output buffer, a flush other than
+ * Z_NO_FLUSH ends the block */
+static int _compression_deflate(xmpp_conn_t * const conn,
+                                const void * const data, const size_t len,
+                                int flush)
+{
+    compression_t *c = conn->compression;
+    z_stream *z = &c->deflate;
+    unsigned char *p;
+    size_t size;
+    int ret;
+
+    z->next_in = (Bytef *)data;
+    z->avail_in = len;
+    do {
+        if (c->out_len == c->out_size) {
+            size = c->out_size ? c->out_size * 2 : COMPRESSION_BUFFER;
+            p = xmpp_realloc(conn->ctx, c->out, size);
+            if (!p) return -1;
+            c->out = p;
+            c->out_size = size;
+        }
+        z->next_out = c->out + c->out_len;
+        z->avail_out = c->out_size - c->out_len;
+        ret = deflate(z, flush);
+        c->out_len = c->out_size - z->avail_out;
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            xmpp_error(conn->ctx, "zlib", "deflate failed: %d", ret);
+            return -1;
+        }
+        /* a flush is complete once deflate leaves room in the buffer */
+    } while (z->avail_in > 0 || (flush != Z_NO_FLUSH && z->avail_out == 0));
+
+    return 0;
+}
+
+static int _compression_connect(xmpp_conn_t * const conn)
+{
+    return conn->compression->inner->connect(conn);
+}
+
+static int _compression_read(xmpp_conn_t * const conn, void * const buff,
+                             const size_t len)
+{
+    compression_t *c = conn->compression;
+    z_stream *z = &c->inflate;
+    int ret;
+
+    c->would_block = 0;
+    for (;;) {
+        if (c->in_off == c->in_len && !c->inflate_full) {
+            ret = c->inner->read(conn, c->in, sizeof(c->in));
+            if (ret <= 0) return ret;
+            c->in_len = ret;
+            c->in_off = 0;
+        }
+
+        z->next_in = c->in + c->in_off;
+        z->avail_in = c->in_len - c->in_off;
+        z->next_out = buff;
+        z->avail_out = len;
+        ret = inflate(z, Z_SYNC_FLUSH);
+        c->in_off = c->in_len - z->avail_in;
+        if (c->in_off == c->in_len)
+            c->in_off = c->in_len = 0;
+        c->inflate_full = z->avail_out == 0;
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            /* the stream doesn't end before the connection does */
+            xmpp_error(conn->ctx, "zlib", "inflate failed: %d", ret);
+            c->error = EIO;
+            return -1;
+        }
+        if (z->avail_out < len)
+            return (int)(len - z->avail_out);
+
+        /* the input ended in the middle of a block */
+        if (c->inner->pending(conn) == 0) {
+            c->would_block = 1;
+            return -1;
+        }
+    }
+}
+
+static int _compression_writev(xmpp_conn_t * const conn,
+                               const sock_iovec_t * const iov,
+                               const int iovcnt)
+{
+    compression_t *c = conn->compression;
+    int written = 0;
+    int i;
+
+    c->would_block = 0;
+    /* take new data only once the last batch is out, so the send queue
+     * holds back when the transport does */
+    if (_compression_flush_out(conn) < 0)
+        return -1;
+    if (c->out_len > 0) {
+        c->would_block = 1;
+        return -1;
+    }
+
+    for (i = 0; i < iovcnt; ++i) {
+        if (_compression_deflate(conn, iov[i].iov_base, iov[i].iov_len,
+                                 Z_NO_FLUSH) < 0) {
+            c->error = ENOMEM;
+            return -1;
+        }
+        written += iov[i].iov_len;
+    }
+    /* the queue hands over whole stanzas, end the batch on a boundary */
+    if (_compression_deflate(conn, NULL, 0, Z_SYNC_FLUSH) < 0) {
+        c->error = ENOMEM;
+        return -1;
+    }
+
+    /* what the transport doesn't take now goes with the next call */
+    _compression_flush_out(conn);
+
+    return written;
+}
+
+static int _compression_write(xmpp_conn_t * const conn,
+                              const void * const buff, const size_t len)
+{
+    sock_iovec_t iov;
+
+    iov.iov_base = (void *)buff;
+    iov.iov_len = len;
+
+    return _compression_writev(conn, &iov, 1);
+}
+
+static int _compression_flush(xmpp_conn_t * const conn)
+{
+    compression_t *c = conn->compression;
+
+    c->would_block = 0;
+    if (c->inner->flush(conn) < 0 || _compression_flush_out(conn) < 0)
+        return -1;
+    if (c->out_len > 0) {
+        c->would_block = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _compression_pending(xmpp_conn_t * const conn)
+{
+    compression_t *c = conn->compression;
+
+    return (int)(c->in_len - c->in_off) + c->inflate_full +
+           c->inner->pending(conn);
+}
+
+static int _compression_error(xmpp_conn_t * const conn)
+{
+    compression_t *c = conn->compression;
+
+    if (c->error) return c->error;
+    if (c->would_block) return 0;
+
+    return c->inner->error(conn);
+}
+
+static void _compression_close(xmpp_conn_t * const conn)
+{
+    compression_t *c = conn->compression;
+
+    xmpp_debug(conn->ctx, "zlib", "Sent %lu bytes as %lu, received %lu "
+               "bytes as %lu", c->deflate.total_in, c->deflate.total_out,
+               c->inflate.total_out, c->inflate.total_in);
+
+    c->inner->close(conn);
+    conn->transport = c->inner;
+    c->active = 0;
+}
+
+static sock_t _compression_fd(xmpp_conn_t * const conn)
+{
+    return conn->compression->inner->fd(conn);
+}
+
+static const transport_t transport_compression = {
+    "zlib",
+    _compression_connect,
+    _compression_read,
+    _compression_write,
+    _compression_writev,
+    _compression_flush,
+    _compression_pending,
+    _compression_error,
+    _compression_close,
+    _compression_fd,
+    NULL
+};
+
+int compression_available(void)
+{
+    return 1;
+}
+
+/** Check whether the stream of a connection is compressed.
+ *  This function should not be used outside of the library.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return TRUE if the stream is compressed, FALSE otherwise
+ */
+int compression_active(const xmpp_conn_t * const conn)
+{
+    return conn->compression != NULL && conn->compression->active;
+}
+
+/** Compress the stream of a connection from now on.
+ *  This is called once the server has answered <compress/> with
+ *  <compressed/>.  This function should not be used outside of the
+ *  library.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return 0 on success or -1 on an error
+ */
+int compression_start(xmpp_conn_t * const conn)
+{
+    compression_t *c = conn->compression;
+
+    if (c && c->active) return 0;
+
+    /* the streams are reset rather than set up again for a new connection
+     * with the same parameters */
+    if (c && (c->level != conn->compression_level ||
+              c->mem_level != conn->compression_mem_level)) {
+        compression_free(conn);
+        c = NULL;
+    }
+    if (c) {
+        deflateReset(&c->deflate);
+        inflateReset(&c->inflate);
+    } else {
+        c = xmpp_alloc(conn->ctx, sizeof(*c));
+        if (!c) return -1;
+        memset(c, 0, sizeof(*c));
+        c->level = conn->compression_level;
+        c->mem_level = conn->compression_mem_level;
+        if (deflateInit2(&c->deflate, c->level, Z_DEFLATED, MAX_WBITS,
+                         c->mem_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+            xmpp_free(conn->ctx, c);
+            return -1;
+        }
+        if (inflateInit(&c->inflate) != Z_OK) {
+            deflateEnd(&c->deflate);
+            xmpp_free(conn->ctx, c);
+            return -1;
+        }
+        conn->compression = c;
+    }
+
+    c->in_len = c->in_off = 0;
+    c->inflate_full = 0;
+    c->out_len = c->out_off = 0;
+    c->would_block = 0;
+    c->error = 0;
+    c->inner = conn->transport;
+    c->active = 1;
+    conn->transport = &transport_compression;
+
+    return 0;
+}
+
+/** Release the zlib streams of a connection.
+ *  This function should not be used outside of the library.
+ *
+ *  @param conn a Strophe connection object
+ */
+void compression_free(xmpp_conn_t * const conn)
+{
+    compression_t *c = conn->compression;
+
+    if (!c) return;
+
+    if (c->active) {
+        conn->transport = c->inner;
+        c->active = 0;
+    }
+    deflateEnd(&c->deflate);
+    inflateEnd(&c->inflate);
+    if (c->out) xmpp_free(conn->ctx, c->out);
+    xmpp_free(conn->ctx, c);
+    conn->compression = NULL;
+}
+
+#else /* !HAVE_ZLIB */
+
+int compression_available(void)
+{
+    return 0;
+}
+
+int compression_start(xmpp_conn_t * const conn)
+{
+    return -1;
+}
+
+int compression_active(const xmpp_conn_t * const conn)
+{
+    return 0;
+}
+
+void compression_free(xmpp_conn_t * const conn)
+{
+}
+
+#endif /* HAVE_ZLIB */
@@ -0,0 +1,38 @@
+/* compression.h
+** strophe XMPP client library -- XEP-0138 stream compression header
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/** @file
+ *  Stream compression API.
+ */
+
+#ifndef __LIBSTROPHE_COMPRESSION_H__
+#define __LIBSTROPHE_COMPRESSION_H__
+
+#include "strophe.h"
+
+typedef struct _compression_t compression_t;
+
+/* zlib defaults: Z_DEFAULT_COMPRESSION and the memory level of deflateInit() */
+#define COMPRESSION_LEVEL_DEFAULT (-1)
+#define COMPRESSION_MEM_LEVEL_DEFAULT 8
+
+/* returns 1 if the library was built with zlib */
+int compression_available(void);
+
+/* layers zlib over the transport of a connection.  everything written
+ * after this is compressed and everything read is inflated before it
+ * reaches the parser.  the layer is removed when the transport is closed,
+ * the zlib streams are kept for the next connection. */
+int compression_start(xmpp_conn_t * const conn);
+int compression_active(const xmpp_conn_t * const conn);
+void compression_free(xmpp_conn_t * const conn);
+
+#endif /* __LIBSTROPHE_COMPRESSION_H__ */
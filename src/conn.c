@@ -20,6 +20,12 @@
 #include <stdarg.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#endif
+
 #include "strophe.h"
 
 #include "common.h"
@@ -46,6 +52,21 @@
  */
 #define CONNECT_TIMEOUT 5000 /* 5 seconds */
 #endif
+#ifndef CONNECT_ATTEMPT_DELAY
+/** @def CONNECT_ATTEMPT_DELAY
+ *  The time to wait (in milliseconds) for a connection attempt before
+ *  the next address of the host is tried in parallel.  The default is the
+ *  250 milliseconds recommended by RFC 8305.
+ */
+#define CONNECT_ATTEMPT_DELAY 250
+#endif
+#ifndef RECONNECT_POLL
+/** @def RECONNECT_POLL
+ *  The time to wait (in milliseconds) before checking again whether a
+ *  reconnect held back by xmpp_ctx_set_connect_limits() may start.
+ */
+#define RECONNECT_POLL 100
+#endif
 
 static int _disconnect_cleanup(xmpp_conn_t * const conn,
                                void * const userdata);
@@ -57,6 +78,23 @@ static void _handle_stream_end(char *name,
 static void _handle_stream_stanza(xmpp_stanza_t *stanza,
                                   void * const userdata);
 static int _conn_default_port(xmpp_conn_t * const conn);
+static int _conn_connect(xmpp_conn_t * const conn, const char * const host,
+                         unsigned short port, xmpp_conn_handler callback,
+                         void * const userdata);
+static int _conn_resolve(xmpp_conn_t * const conn);
+static int _conn_connect_unix(xmpp_conn_t * const conn);
+static int _conn_next_target(xmpp_conn_t * const conn);
+static int _conn_start_attempts(xmpp_conn_t * const conn,
+                                const resolver_addr_t *addrs, int count);
+static int _conn_next_attempt(xmpp_conn_t * const conn);
+static void _conn_free_attempts(xmpp_conn_t * const conn);
+static void _conn_free_send_queue(xmpp_conn_t * const conn);
+static void _conn_free_stream_error(xmpp_conn_t * const conn);
+static void _conn_free_fast_token(xmpp_conn_t * const conn);
+static int _conn_set_reconnect_target(xmpp_conn_t * const conn,
+                                      const char * const host,
+                                      unsigned short port);
+static void _conn_schedule_reconnect(xmpp_conn_t * const conn);
 
 /** Create a new Strophe connection object.
  *
@@ -81,6 +119,8 @@ xmpp_conn_t *xmpp_conn_new(xmpp_ctx_t * const ctx)
         conn->state = XMPP_STATE_DISCONNECTED;
         conn->sock = -1;
         conn->tls = NULL;
+        conn->transport = &transport_sock;
+        conn->transport_data = NULL;
         conn->timeout_stamp = 0;
         conn->error = 0;
         conn->stream_error = NULL;
@@ -95,28 +135,81 @@ xmpp_conn_t *xmpp_conn_new(xmpp_ctx_t * const ctx)
         /* default timeouts */
         conn->connect_timeout = CONNECT_TIMEOUT;
 
+        /* no automatic reconnect */
+        conn->reconnect_min = 0;
+        conn->reconnect_max = 0;
+        conn->reconnect_backoff = 0;
+        conn->reconnect_pending = 0;
+        conn->reconnect_stamp = 0;
+        conn->reconnect_host = NULL;
+        conn->reconnect_port = 0;
+        conn->disconnect_requested = 0;
+
         conn->lang = xmpp_strdup(conn->ctx, "en");
         if (!conn->lang) {
             xmpp_free(conn->ctx, conn);
             return NULL;
         }
         conn->domain = NULL;
+        conn->connectdomain = NULL;
+        conn->connectport = 0;
+        conn->unix_path = NULL;
+        conn->resolve_srv = 0;
+        conn->srv_port = 0;
+        conn->srv_targets = NULL;
+        conn->attempts = NULL;
+        conn->attempt_count = 0;
+        conn->attempt_next = 0;
         conn->jid = NULL;
         conn->pass = NULL;
         conn->stream_id = NULL;
         conn->bound_jid = NULL;
+        conn->id_prefix[0] = '\0';
+        conn->id_counter = 0;
 
         conn->tls_support = 0;
         conn->tls_disabled = 0;
         conn->tls_mandatory = 0;
         conn->tls_legacy_ssl = 0;
+        conn->tls_ktls = 0;
+        conn->tls_low_mem = 0;
         conn->tls_failed = 0;
+        memset(&conn->sock_opts, 0, sizeof(conn->sock_opts));
         conn->sasl_support = 0;
+        conn->scram_init = NULL;
+        conn->scram_alg = NULL;
         conn->secured = 0;
 
         conn->bind_required = 0;
         conn->session_required = 0;
 
+        conn->sm_allowed = 0;
+        conn->sm_support = 0;
+        conn->sm_state = XMPP_SM_DISABLED;
+        conn->sm_id = NULL;
+        conn->sm_handled = 0;
+        conn->sm_sent = 0;
+        conn->sm_acked = 0;
+        conn->sm_queue_head = NULL;
+        conn->sm_queue_tail = NULL;
+        conn->sm_unrequested = 0;
+        conn->sm_resumed = 0;
+
+        conn->compression_allowed = 0;
+        conn->compression_level = COMPRESSION_LEVEL_DEFAULT;
+        conn->compression_mem_level = COMPRESSION_MEM_LEVEL_DEFAULT;
+        conn->compression = NULL;
+
+        conn->sasl2_allowed = 0;
+        conn->sasl2_support = 0;
+        conn->sasl2_inline = 0;
+        conn->sasl2_fast = 0;
+        conn->fast_token = NULL;
+        conn->fast_count = 0;
+        conn->ua_id = NULL;
+        conn->ua_software = NULL;
+        conn->ua_device = NULL;
+
         conn->parser = parser_new(conn->ctx,
                                   _handle_stream_start,
                                   _handle_stream_end,
@@ -259,21 +352,30 @@ int xmpp_conn_release(xmpp_conn_t * const conn)
             xmpp_free(ctx, thli);
         }
 
-        if (conn->stream_error) {
-            xmpp_stanza_release(conn->stream_error->stanza);
-            if (conn->stream_error->text)
-                xmpp_free(ctx, conn->stream_error->text);
-            xmpp_free(ctx, conn->stream_error);
-        }
+        _conn_free_stream_error(conn);
 
         parser_free(conn->parser);
 
         if (conn->domain) xmpp_free(ctx, conn->domain);
+        if (conn->connectdomain) xmpp_free(ctx, conn->connectdomain);
+        if (conn->unix_path) xmpp_free(ctx, conn->unix_path);
+        if (conn->reconnect_host) xmpp_free(ctx, conn->reconnect_host);
+        compression_free(conn);
+        if (conn->transport->free) conn->transport->free(conn);
+        _conn_free_send_queue(conn);
+        sm_reset(conn);
+        resolver_srv_free(ctx, conn->srv_targets);
+        _conn_free_attempts(conn);
         if (conn->jid) xmpp_free(ctx, conn->jid);
         if (conn->bound_jid) xmpp_free(ctx, conn->bound_jid);
         if (conn->pass) xmpp_free(ctx, conn->pass);
         if (conn->stream_id) xmpp_free(ctx, conn->stream_id);
         if (conn->lang) xmpp_free(ctx, conn->lang);
+        _conn_free_fast_token(conn);
+        if (conn->scram_init) xmpp_free(ctx, conn->scram_init);
+        if (conn->ua_id) xmpp_free(ctx, conn->ua_id);
+        if (conn->ua_software) xmpp_free(ctx, conn->ua_software);
+        if (conn->ua_device) xmpp_free(ctx, conn->ua_device);
         xmpp_free(ctx, conn);
         released = 1;
     }
@@ -294,6 +396,57 @@ const char *xmpp_conn_get_jid(const xmpp_conn_t * const conn)
     return conn->jid;
 }
 
+/** Generate an id for a stanza sent on a connection.
+ *  The id is a random prefix, chosen once per connection, followed by a
+ *  counter, both in the base64url alphabet.  It is unique per connection
+ *  and is written to the caller's buffer, so nothing is allocated and it
+ *  can be passed straight to xmpp_stanza_set_id() and
+ *  xmpp_id_handler_add().
+ *
+ *  @param conn a Strophe connection object
+ *  @param buf the buffer for the id
+ *  @param len the size of buf, XMPP_ID_SIZE is always enough
+ *
+ *  @return the length of the id without the '\0', or 0 if buf is too small
+ *
+ *  @ingroup Connections
+ */
+size_t xmpp_conn_gen_id(xmpp_conn_t * const conn, char * const buf,
+                        const size_t len)
+{
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    uint8_t rnd[CONN_ID_PREFIX_LEN];
+    char digits[12];
+    uint64_t n;
+    size_t i, count;
+
+    if (conn->id_prefix[0] == '\0') {
+        xmpp_rand_bytes(conn->ctx, rnd, sizeof(rnd));
+        for (i = 0; i < CONN_ID_PREFIX_LEN; ++i)
+            conn->id_prefix[i] = alphabet[rnd[i] & 0x3f];
+        conn->id_prefix[CONN_ID_PREFIX_LEN] = '\0';
+    }
+
+    /* digits of the counter, least significant first */
+    n = conn->id_counter;
+    count = 0;
+    do {
+        digits[count++] = alphabet[n & 0x3f];
+        n >>= 6;
+    } while (n != 0);
+
+    if (len < CONN_ID_PREFIX_LEN + count + 1)
+        return 0;
+    ++conn->id_counter;
+    memcpy(buf, conn->id_prefix, CONN_ID_PREFIX_LEN);
+    for (i = 0; i < count; ++i)
+        buf[CONN_ID_PREFIX_LEN + i] = digits[count - 1 - i];
+    buf[CONN_ID_PREFIX_LEN + count] = '\0';
+
+    return CONN_ID_PREFIX_LEN + count;
+}
+
 /**
  * Get the JID discovered during binding time.
  *
@@ -304,6 +457,7 @@ const char *xmpp_conn_get_jid(const xmpp_conn_t * const conn)
  * @param conn a Strophe connection object.
  *
  * @return a string containing the full JID or NULL if it's not been discovered
+ *     or the session is gone
  *
  * @ingroup Connections
  */
@@ -374,14 +528,18 @@ xmpp_ctx_t* xmpp_conn_get_context(xmpp_conn_t * const conn)
  *  process to the XMPP server, and notifiations of connection state changes
  *  will be sent to the callback function.  The domain and port to connect to
  *  are usually determined by an SRV lookup for the xmpp-client service at
- *  the domain specified in the JID.  If SRV lookup fails, altdomain and 
- *  altport will be used instead if specified.
+ *  the domain specified in the JID.  The SRV targets are tried in the order
+ *  of RFC 2782, moving on to the next one when a connection attempt fails.
+ *  If SRV lookup fails, the domain itself and altport will be used instead.
+ *  Name resolution is done by the event loop, a host which can't be
+ *  resolved is reported as a disconnect.  A socket path set with
+ *  xmpp_conn_set_unix_path() replaces all of this.
  *
  *  @param conn a Strophe connection object
- *  @param altdomain a string with domain to use if SRV lookup fails.  If this
- *      is NULL, the domain from the JID will be used.
- *  @param altport an integer port number to use if SRV lookup fails.  If this
- *      is 0, the default port will be assumed.
+ *  @param altdomain a string with domain to connect to instead of doing the
+ *      SRV lookup.  If this is NULL, the domain from the JID will be used.
+ *  @param altport an integer port number to use if SRV lookup fails or
+ *      altdomain is given.  If this is 0, the default port will be assumed.
  *  @param callback a xmpp_conn_handler callback function that will receive
  *      notifications of connection status
  *  @param userdata an opaque data pointer that will be passed to the callback
@@ -396,10 +554,7 @@ int xmpp_connect_client(xmpp_conn_t * const conn,
                         xmpp_conn_handler callback,
                         void * const userdata)
 {
-    char domain[2048];
-    int port;
-    const char *prefdomain = NULL;
-    int found;
+    const char *host;
 
     if (conn->state != XMPP_STATE_DISCONNECTED)
         return -1;
@@ -411,51 +566,29 @@ int xmpp_connect_client(xmpp_conn_t * const conn,
     conn->tls_failed = 0;
     conn->domain = xmpp_jid_domain(conn->ctx, conn->jid);
     if (!conn->domain) return -1;
+    if (_conn_set_reconnect_target(conn, altdomain, altport) != 0)
+        return -1;
 
     if (altdomain != NULL) {
         xmpp_debug(conn->ctx, "xmpp", "Connecting via altdomain.");
-        prefdomain = altdomain;
-        port = altport ? altport : _conn_default_port(conn);
+        host = altdomain;
+        conn->resolve_srv = 0;
     } else {
-        found = sock_srv_lookup("xmpp-client", "tcp", conn->domain,
-                                domain, sizeof(domain), &port);
-        if (!found) {
-            xmpp_debug(conn->ctx, "xmpp", "SRV lookup failed, "
-                                          "connecting via domain.");
-            prefdomain = conn->domain;
-            port = altport ? altport : _conn_default_port(conn);
-        }
-        if (conn->tls_legacy_ssl) {
-            /* SSL tunneled connection on 5223 port is legacy and doesn't
-             * have an SRV record. Force port 5223 here unless altport is
-             * specified.
-             */
-            port = altport ? altport : XMPP_PORT_CLIENT_LEGACY_SSL;
-        }
+        host = conn->domain;
+        conn->resolve_srv = 1;
+        /* SSL tunneled connection on 5223 port is legacy and doesn't
+         * have an SRV record. Keep port 5223 here unless altport is
+         * specified.
+         */
+        conn->srv_port = !conn->tls_legacy_ssl;
     }
-    if (prefdomain != NULL) {
-        strncpy(domain, prefdomain, sizeof(domain));
-        domain[sizeof(domain) - 1] = '\0';
-    }
-    conn->sock = sock_connect(domain, port);
-    xmpp_debug(conn->ctx, "xmpp", "sock_connect to %s:%d returned %d",
-               domain, port, conn->sock);
-    if (conn->sock == -1) return -1;
 
-    /* setup handler */
-    conn->conn_handler = callback;
-    conn->userdata = userdata;
-
-    /* FIXME: it could happen that the connect returns immediately as
-     * successful, though this is pretty unlikely.  This would be a little
-     * hard to fix, since we'd have to detect and fire off the callback
-     * from within the event loop */
-
-    conn->state = XMPP_STATE_CONNECTING;
-    conn->timeout_stamp = time_stamp();
-    xmpp_debug(conn->ctx, "xmpp", "attempting to connect to %s", domain);
+    /* a reconnect starts over with a fresh stream */
+    conn_prepare_reset(conn, auth_handle_open);
 
-    return 0;
+    return _conn_connect(conn, host,
+                         altport ? altport : _conn_default_port(conn),
+                         callback, userdata);
 }
 
 /** Initiate a component connection to server.
@@ -465,7 +598,8 @@ int xmpp_connect_client(xmpp_conn_t * const conn,
  *  for the component handshake as defined in XEP-0114.
  *  The domain and port to connect to must be provided in this case as the JID
  *  provided to the call serves as component identifier to the server and is
- *  not subject to DNS resolution.
+ *  not subject to DNS resolution.  Components on the server's host can
+ *  connect through a local socket, see xmpp_conn_set_unix_path().
  *
  *  @param conn a Strophe connection object
  *  @param server a string with domain to use directly as the domain can't be
@@ -485,8 +619,6 @@ int xmpp_connect_component(xmpp_conn_t * const conn, const char * const server,
                            unsigned short port, xmpp_conn_handler callback,
                            void * const userdata)
 {
-    int connectport;
-
     if (conn->state != XMPP_STATE_DISCONNECTED)
         return -1;
     if (conn->domain != NULL)
@@ -501,23 +633,134 @@ int xmpp_connect_component(xmpp_conn_t * const conn, const char * const server,
 
     /*  The server domain, jid and password MUST be specified. */
     if (!(server && conn->jid && conn->pass)) return -1;
-
-    connectport = port ? port : _conn_default_port(conn);
+    if (_conn_set_reconnect_target(conn, server, port) != 0)
+        return -1;
 
     xmpp_debug(conn->ctx, "xmpp", "Connecting via %s", server);
-    conn->sock = sock_connect(server, connectport);
-    xmpp_debug(conn->ctx, "xmpp", "sock_connect to %s:%d returned %d",
-               server, connectport, conn->sock);
-    if (conn->sock == -1) return -1;
 
     /* XEP-0114 does not support TLS */
     conn->tls_disabled = 1;
 
+    conn_prepare_reset(conn, auth_handle_component_open);
+
+    conn->resolve_srv = 0;
+    return _conn_connect(conn, server, port ? port : _conn_default_port(conn),
+                         callback, userdata);
+}
+
+/* sets up the handler and starts resolving host; the connect itself is
+ * started by _conn_resolve() once the addresses are known */
+static int _conn_connect(xmpp_conn_t * const conn, const char * const host,
+                         unsigned short port, xmpp_conn_handler callback,
+                         void * const userdata)
+{
+    if (conn->connectdomain) xmpp_free(conn->ctx, conn->connectdomain);
+    conn->connectdomain = xmpp_strdup(conn->ctx, host);
+    if (!conn->connectdomain) return -1;
+    conn->connectport = port;
+    resolver_srv_free(conn->ctx, conn->srv_targets);
+    conn->srv_targets = NULL;
+    conn->error = 0;
+    conn->target_error = 0;
+    _conn_free_stream_error(conn);
+    conn->authenticated = 0;
+    conn->reconnect_pending = 0;
+    conn->disconnect_requested = 0;
+
     /* setup handler */
     conn->conn_handler = callback;
     conn->userdata = userdata;
 
-    conn_prepare_reset(conn, auth_handle_component_open);
+    return conn->transport->connect(conn);
+}
+
+/** Start connecting the socket transport.
+ *  The host and port have been stored in the connection by
+ *  _conn_connect().  This function should not be used outside of the
+ *  library.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return 0 if the connection process was started or -1 on an error
+ */
+int conn_sock_connect(xmpp_conn_t * const conn)
+{
+    /* a local socket has nothing to resolve */
+    if (conn->unix_path) {
+        conn->resolve_srv = 0;
+        return _conn_connect_unix(conn);
+    }
+
+    /* cached answers let this go all the way to the connect right away */
+    conn->state = XMPP_STATE_RESOLVING;
+    if (_conn_resolve(conn) != 0) {
+        conn->state = XMPP_STATE_DISCONNECTED;
+        return -1;
+    }
+
+    return 0;
+}
+
+/** Set up the stream on a freshly connected transport.
+ *  Legacy SSL connections start the TLS handshake first, the others open
+ *  the stream right away.  This function should not be used outside of
+ *  the library.
+ *
+ *  @param conn a Strophe connection object
+ */
+void conn_established(xmpp_conn_t * const conn)
+{
+    conn->state = XMPP_STATE_CONNECTED;
+    xmpp_debug(conn->ctx, "xmpp", "connection successful");
+
+    if (conn->tls_legacy_ssl) {
+        /* stream is opened when the handshake completes */
+        xmpp_debug(conn->ctx, "xmpp", "using legacy SSL connection");
+        if (conn_tls_start(conn) != 0)
+            conn_disconnect(conn);
+        return;
+    }
+
+    /* send stream init */
+    conn_open_stream(conn);
+}
+
+/* moves a connection in the RESOLVING state forward: looks up the SRV
+ * record, if needed, and the addresses of the host and then starts the
+ * connect.  returns -1 if the host can't be resolved or connected. */
+static int _conn_resolve(xmpp_conn_t * const conn)
+{
+    resolver_t *resolver = conn->ctx->resolver;
+    const resolver_srv_rr_t *srv;
+    const resolver_addr_t *addrs;
+    resolver_status_t status;
+    int count;
+
+    if (conn->resolve_srv) {
+        status = resolver_srv_lookup(resolver, "xmpp-client", "tcp",
+                                     conn->domain, &srv);
+        if (status == RESOLVER_PENDING) return 0;
+
+        conn->resolve_srv = 0;
+        if (status == RESOLVER_FOUND)
+            conn->srv_targets = resolver_srv_select(conn->ctx, srv);
+        if (conn->srv_targets == NULL || _conn_next_target(conn) != 0)
+            xmpp_debug(conn->ctx, "xmpp", "SRV lookup failed, "
+                                          "connecting via domain.");
+    }
+
+    while (1) {
+        status = resolver_addr_lookup(resolver, conn->connectdomain,
+                                      &addrs, &count);
+        if (status == RESOLVER_PENDING) return 0;
+        if (status == RESOLVER_FOUND) {
+            if (_conn_start_attempts(conn, addrs, count) == 0) break;
+        } else {
+            xmpp_debug(conn->ctx, "xmpp", "Failed to resolve %s",
+                       conn->connectdomain);
+        }
+        if (_conn_next_target(conn) != 0) return -1;
+    }
 
     /* FIXME: it could happen that the connect returns immediately as
      * successful, though this is pretty unlikely.  This would be a little
@@ -526,7 +769,460 @@ int xmpp_connect_component(xmpp_conn_t * const conn, const char * const server,
 
     conn->state = XMPP_STATE_CONNECTING;
     conn->timeout_stamp = time_stamp();
-    xmpp_debug(conn->ctx, "xmpp", "attempting to connect to %s", server);
+    xmpp_debug(conn->ctx, "xmpp", "attempting to connect to %s",
+               conn->connectdomain);
+
+    return 0;
+}
+
+/** Continue name resolution for a connection.
+ *  This is called by the event loop for connections waiting for DNS
+ *  answers.  The connection is closed if its host can't be resolved,
+ *  with the error of the last SRV target tried if there was one.
+ *
+ *  @param conn a Strophe connection object
+ */
+void conn_resolve(xmpp_conn_t * const conn)
+{
+    if (_conn_resolve(conn) != 0) {
+        conn->error = conn->target_error ? conn->target_error : EHOSTUNREACH;
+        conn_disconnect(conn);
+    }
+}
+
+/* connects to the local socket through a single connection attempt, so the
+ * event loop treats it like any TCP connect */
+static int _conn_connect_unix(xmpp_conn_t * const conn)
+{
+    _conn_free_attempts(conn);
+    conn->attempts = xmpp_alloc(conn->ctx, sizeof(*conn->attempts));
+    if (!conn->attempts) return -1;
+    memset(&conn->attempts[0].addr, 0, sizeof(conn->attempts[0].addr));
+    conn->attempts[0].addr.family = AF_UNIX;
+    conn->attempts[0].sock = -1;
+    conn->attempt_count = 1;
+    conn->attempt_next = 0;
+
+    if (_conn_next_attempt(conn) != 0) {
+        _conn_free_attempts(conn);
+        return -1;
+    }
+
+    conn->state = XMPP_STATE_CONNECTING;
+    conn->timeout_stamp = time_stamp();
+    xmpp_debug(conn->ctx, "xmpp", "attempting to connect to %s",
+               conn->unix_path);
+
+    return 0;
+}
+
+/** Handle a failed connection attempt.
+ *  This is called by the event loop when the connect errors or times out.
+ *  The next SRV target is tried if there is one left, otherwise the
+ *  connection is closed.
+ *
+ *  @param conn a Strophe connection object
+ */
+void conn_connect_failed(xmpp_conn_t * const conn)
+{
+    if (conn->srv_targets == NULL) {
+        conn_disconnect(conn);
+        return;
+    }
+
+    /* a later target that connects must not inherit the error */
+    _conn_free_attempts(conn);
+    conn->target_error = conn->error;
+    conn->error = 0;
+    if (_conn_next_target(conn) != 0) {
+        conn->error = ENOMEM;
+        conn_disconnect(conn);
+        return;
+    }
+    xmpp_debug(conn->ctx, "xmpp", "Trying next SRV target %s:%d",
+               conn->connectdomain, conn->connectport);
+    conn->state = XMPP_STATE_RESOLVING;
+    conn_resolve(conn);
+}
+
+/* orders the addresses for the connection race, alternating between the
+ * address families starting with the preferred one (RFC 8305, section 4),
+ * and starts the first attempt */
+static int _conn_start_attempts(xmpp_conn_t * const conn,
+                                const resolver_addr_t *addrs, int count)
+{
+    int family = addrs[0].family;
+    int n = 0, same = 0, other = 0;
+
+    _conn_free_attempts(conn);
+    conn->attempts = xmpp_alloc(conn->ctx, count * sizeof(*conn->attempts));
+    if (!conn->attempts) return -1;
+
+    while (n < count) {
+        while (same < count && addrs[same].family != family) ++same;
+        if (same < count) conn->attempts[n++].addr = addrs[same++];
+        while (other < count && addrs[other].family == family) ++other;
+        if (other < count) conn->attempts[n++].addr = addrs[other++];
+    }
+    for (n = 0; n < count; ++n)
+        conn->attempts[n].sock = -1;
+    conn->attempt_count = count;
+    conn->attempt_next = 0;
+
+    return _conn_next_attempt(conn);
+}
+
+static const char *_conn_family_name(int family)
+{
+    switch (family) {
+    case AF_INET6: return "IPv6";
+    case AF_UNIX: return "unix socket";
+    default: return "IPv4";
+    }
+}
+
+/* the socket still connects without an option it couldn't set, so this is
+ * only worth a warning */
+static void _conn_warn_sock_opts(xmpp_conn_t * const conn, int failed)
+{
+    if (failed & SOCK_OPT_NODELAY)
+        xmpp_warn(conn->ctx, "xmpp", "Couldn't set TCP_NODELAY");
+    if (failed & SOCK_OPT_KEEPALIVE)
+        xmpp_warn(conn->ctx, "xmpp", "Couldn't enable TCP keepalive");
+    if (failed & SOCK_OPT_SNDBUF)
+        xmpp_warn(conn->ctx, "xmpp", "Couldn't set the send buffer to %d "
+                  "bytes", conn->sock_opts.sndbuf);
+    if (failed & SOCK_OPT_RCVBUF)
+        xmpp_warn(conn->ctx, "xmpp", "Couldn't set the receive buffer to "
+                  "%d bytes", conn->sock_opts.rcvbuf);
+    if (failed & SOCK_OPT_USER_TIMEOUT)
+        xmpp_warn(conn->ctx, "xmpp", "Couldn't set TCP_USER_TIMEOUT to "
+                  "%u ms", conn->sock_opts.user_timeout);
+    if (failed & SOCK_OPT_BUSY_POLL)
+        xmpp_warn(conn->ctx, "xmpp", "Couldn't set SO_BUSY_POLL to %u us",
+                  conn->sock_opts.busy_poll);
+}
+
+/* starts a connect to the next address of the race */
+static int _conn_next_attempt(xmpp_conn_t * const conn)
+{
+    xmpp_connect_attempt_t *attempt;
+    int failed;
+
+    while (conn->attempt_next < conn->attempt_count) {
+        attempt = &conn->attempts[conn->attempt_next++];
+        if (attempt->addr.family == AF_UNIX) {
+            attempt->sock = sock_connect_unix(conn->unix_path,
+                                              &conn->sock_opts, &failed);
+            xmpp_debug(conn->ctx, "xmpp", "sock_connect to %s returned %d",
+                       conn->unix_path, attempt->sock);
+        } else {
+            attempt->sock = sock_connect_addr(attempt->addr.family,
+                                              attempt->addr.addr,
+                                              conn->connectport,
+                                              &conn->sock_opts, &failed);
+            xmpp_debug(conn->ctx, "xmpp", "sock_connect to %s:%d over %s "
+                       "returned %d", conn->connectdomain, conn->connectport,
+                       _conn_family_name(attempt->addr.family),
+                       attempt->sock);
+        }
+        if (attempt->sock != -1) {
+            _conn_warn_sock_opts(conn, failed);
+            conn->attempt_stamp = time_stamp();
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* closes the attempts which are still in progress */
+static void _conn_free_attempts(xmpp_conn_t * const conn)
+{
+    int i;
+
+    for (i = 0; i < conn->attempt_next; ++i) {
+        if (conn->attempts[i].sock != -1)
+            sock_close(conn->attempts[i].sock);
+    }
+    if (conn->attempts) xmpp_free(conn->ctx, conn->attempts);
+    conn->attempts = NULL;
+    conn->attempt_count = 0;
+    conn->attempt_next = 0;
+}
+
+/* drops the data which hasn't been written yet */
+static void _conn_free_send_queue(xmpp_conn_t * const conn)
+{
+    xmpp_send_queue_t *sq;
+
+    while ((sq = conn->send_queue_head)) {
+        conn->send_queue_head = sq->next;
+        xmpp_free(conn->ctx, sq->data);
+        xmpp_free(conn->ctx, sq);
+    }
+    conn->send_queue_tail = NULL;
+    conn->send_queue_len = 0;
+}
+
+/* the token is a credential, don't leave it in freed memory */
+static void _conn_free_fast_token(xmpp_conn_t * const conn)
+{
+    if (conn->fast_token) {
+        memset(conn->fast_token, 0, strlen(conn->fast_token));
+        xmpp_free(conn->ctx, conn->fast_token);
+        conn->fast_token = NULL;
+    }
+    conn->fast_count = 0;
+}
+
+static void _conn_free_stream_error(xmpp_conn_t * const conn)
+{
+    if (!conn->stream_error) return;
+
+    xmpp_stanza_release(conn->stream_error->stanza);
+    if (conn->stream_error->text)
+        xmpp_free(conn->ctx, conn->stream_error->text);
+    xmpp_free(conn->ctx, conn->stream_error);
+    conn->stream_error = NULL;
+}
+
+/* remembers where the application asked to connect, so a reconnect can
+ * go through the same xmpp_connect_*() call */
+static int _conn_set_reconnect_target(xmpp_conn_t * const conn,
+                                      const char * const host,
+                                      unsigned short port)
+{
+    char *copy = NULL;
+
+    /* a reconnect passes the current target, which the caller goes on
+     * using, so it must not be freed */
+    if (host && host == conn->reconnect_host) {
+        conn->reconnect_port = port;
+        return 0;
+    }
+    if (host) {
+        copy = xmpp_strdup(conn->ctx, host);
+        if (!copy) return -1;
+    }
+    if (conn->reconnect_host) xmpp_free(conn->ctx, conn->reconnect_host);
+    conn->reconnect_host = copy;
+    conn->reconnect_port = port;
+
+    return 0;
+}
+
+/* doubles the backoff up to its limit and picks the time of the next try
+ * at random in the upper half of it, so connections which dropped
+ * together spread out */
+static void _conn_schedule_reconnect(xmpp_conn_t * const conn)
+{
+    unsigned long delay;
+
+    if (conn->reconnect_backoff == 0)
+        conn->reconnect_backoff = conn->reconnect_min;
+    else if (conn->reconnect_backoff > conn->reconnect_max / 2)
+        conn->reconnect_backoff = conn->reconnect_max;
+    else
+        conn->reconnect_backoff *= 2;
+
+    delay = conn->reconnect_backoff / 2;
+    delay += (unsigned int)xmpp_rand(conn->ctx) % (delay + 1);
+    xmpp_debug(conn->ctx, "xmpp", "Reconnecting in %lu ms.", delay);
+
+    conn->reconnect_pending = 1;
+    conn->reconnect_stamp = time_stamp() + delay;
+}
+
+static int _conn_reconnect(xmpp_conn_t * const conn)
+{
+    if (conn->type == XMPP_COMPONENT)
+        return xmpp_connect_component(conn, conn->reconnect_host,
+                                      conn->reconnect_port,
+                                      conn->conn_handler, conn->userdata);
+
+    return xmpp_connect_client(conn, conn->reconnect_host,
+                               conn->reconnect_port,
+                               conn->conn_handler, conn->userdata);
+}
+
+/* refills the reconnects allowed by the rate limit of the context */
+static void _conn_refill_tokens(xmpp_ctx_t * const ctx, uint64_t now)
+{
+    uint64_t max = (uint64_t)ctx->connect_rate * 1000;
+
+    ctx->connect_tokens += time_elapsed(ctx->connect_tokens_stamp, now) *
+                           ctx->connect_rate;
+    if (ctx->connect_tokens > max)
+        ctx->connect_tokens = max;
+    ctx->connect_tokens_stamp = now;
+}
+
+/** Start the reconnects which are due.
+ *  Reconnects which are due wait while the context is at its limit of
+ *  connections in progress or of reconnects per second.  This function
+ *  should not be used outside of the library.
+ *
+ *  @param ctx a Strophe context object
+ *
+ *  @return the time in milliseconds until the next reconnect may start
+ */
+uint64_t conn_reconnect_process(xmpp_ctx_t * const ctx)
+{
+    xmpp_connlist_t *item, *next_item;
+    xmpp_conn_t *conn;
+    uint64_t now, wait, next = (uint64_t)(-1);
+    unsigned int connecting = 0;
+    int pending = 0;
+
+    for (item = ctx->connlist; item; item = item->next) {
+        conn = item->conn;
+        if (conn->reconnect_pending)
+            pending = 1;
+        else if (conn->state != XMPP_STATE_DISCONNECTED &&
+                 !conn->authenticated)
+            connecting++;
+    }
+    if (!pending) return next;
+
+    now = time_stamp();
+    if (ctx->connect_rate)
+        _conn_refill_tokens(ctx, now);
+
+    for (item = ctx->connlist; item; item = next_item) {
+        next_item = item->next;
+        conn = item->conn;
+        if (!conn->reconnect_pending) continue;
+
+        if (conn->reconnect_stamp > now) {
+            wait = conn->reconnect_stamp - now;
+        } else if (ctx->connect_max && connecting >= ctx->connect_max) {
+            /* woken up by the connects in progress */
+            wait = RECONNECT_POLL;
+        } else if (ctx->connect_rate && ctx->connect_tokens < 1000) {
+            wait = (1000 - ctx->connect_tokens + ctx->connect_rate - 1) /
+                   ctx->connect_rate;
+        } else {
+            if (ctx->connect_rate) ctx->connect_tokens -= 1000;
+            conn->reconnect_pending = 0;
+            xmpp_debug(ctx, "xmpp", "Reconnecting.");
+            if (_conn_reconnect(conn) == 0) {
+                connecting++;
+                continue;
+            }
+            /* a failed connect which didn't get as far as a disconnect
+             * tries again later */
+            if (!conn->reconnect_pending) {
+                if (conn->disconnect_requested) continue;
+                _conn_schedule_reconnect(conn);
+            }
+            wait = conn->reconnect_stamp > now ?
+                   conn->reconnect_stamp - now : 0;
+        }
+        if (wait < next) next = wait;
+    }
+
+    return next;
+}
+
+/** Watch the connection attempts of a connection.
+ *  Another address is raced against the attempts in progress whenever
+ *  CONNECT_ATTEMPT_DELAY passes without one of them completing.
+ *
+ *  @param conn a Strophe connection object in the CONNECTING state
+ *  @param wfds the write set to add the attempts to
+ *  @param max updated to the highest socket in the set
+ *
+ *  @return the time in milliseconds until the next attempt is due
+ */
+uint64_t conn_connect_watch(xmpp_conn_t * const conn, fd_set *wfds,
+                            sock_t *max)
+{
+    uint64_t elapsed;
+    uint64_t next = (uint64_t)-1;
+    int i;
+
+    if (conn->attempt_next < conn->attempt_count) {
+        elapsed = time_elapsed(conn->attempt_stamp, time_stamp());
+        if (elapsed >= CONNECT_ATTEMPT_DELAY) {
+            _conn_next_attempt(conn);
+            next = CONNECT_ATTEMPT_DELAY;
+        } else {
+            next = CONNECT_ATTEMPT_DELAY - elapsed;
+        }
+    }
+
+    for (i = 0; i < conn->attempt_next; ++i) {
+        if (conn->attempts[i].sock == -1) continue;
+        FD_SET(conn->attempts[i].sock, wfds);
+        if (conn->attempts[i].sock > *max)
+            *max = conn->attempts[i].sock;
+    }
+
+    return next;
+}
+
+/** Check the connection attempts which got write events.
+ *  The first attempt to complete becomes the connection's socket and the
+ *  other attempts are closed.  The next address is started right away
+ *  when every attempt in progress has failed.
+ *
+ *  @param conn a Strophe connection object in the CONNECTING state
+ *  @param wfds the write set returned by select()
+ *
+ *  @return 1 if the connection is established, 0 while attempts are in
+ *      progress and -1 if every address failed
+ */
+int conn_connect_process(xmpp_conn_t * const conn, fd_set *wfds)
+{
+    xmpp_connect_attempt_t *attempt;
+    int in_progress = 0;
+    int error, i;
+
+    for (i = 0; i < conn->attempt_next; ++i) {
+        attempt = &conn->attempts[i];
+        if (attempt->sock == -1) continue;
+        if (!FD_ISSET(attempt->sock, wfds)) {
+            in_progress++;
+            continue;
+        }
+
+        error = sock_connect_error(attempt->sock);
+        if (error == 0) {
+            conn->sock = attempt->sock;
+            attempt->sock = -1;
+            _conn_free_attempts(conn);
+            return 1;
+        }
+        xmpp_debug(conn->ctx, "xmpp", "connection attempt over %s failed, "
+                   "error %d", _conn_family_name(attempt->addr.family),
+                   error);
+        sock_close(attempt->sock);
+        attempt->sock = -1;
+        conn->error = error;
+    }
+
+    if (in_progress > 0 || _conn_next_attempt(conn) == 0)
+        return 0;
+
+    return -1;
+}
+
+/* switches the connection over to the next SRV target */
+static int _conn_next_target(xmpp_conn_t * const conn)
+{
+    resolver_srv_rr_t *rr = conn->srv_targets;
+    char *host;
+
+    if (rr == NULL) return -1;
+    host = xmpp_strdup(conn->ctx, rr->target);
+    if (!host) return -1;
+
+    xmpp_free(conn->ctx, conn->connectdomain);
+    conn->connectdomain = host;
+    if (conn->srv_port) conn->connectport = rr->port;
+    conn->srv_targets = rr->next;
+    xmpp_free(conn->ctx, rr);
 
     return 0;
 }
@@ -555,12 +1251,27 @@ void conn_disconnect(xmpp_conn_t * const conn)
 {
     xmpp_debug(conn->ctx, "xmpp", "Closing socket.");
     conn->state = XMPP_STATE_DISCONNECTED;
-    if (conn->tls) {
-        tls_stop(conn->tls);
-        tls_free(conn->tls);
-        conn->tls = NULL;
-    }
-    sock_close(conn->sock);
+    resolver_srv_free(conn->ctx, conn->srv_targets);
+    conn->srv_targets = NULL;
+    _conn_free_attempts(conn);
+    conn->transport->close(conn);
+    /* unsent data belongs to the old stream, stream management keeps
+     * its own copy of the stanzas */
+    _conn_free_send_queue(conn);
+    sm_disconnect(conn);
+    /* a session which can be resumed keeps its JID */
+    if (!conn->sm_id)
+        conn_set_bound_jid(conn, NULL);
+
+    /* a session which got through authentication starts the backoff over,
+     * the handler may still cancel the reconnect with xmpp_disconnect() */
+    if (conn->authenticated)
+        conn->reconnect_backoff = 0;
+    if (conn->reconnect_min && !conn->disconnect_requested &&
+        !(conn->stream_error &&
+          (conn->stream_error->type == XMPP_SE_CONFLICT ||
+           conn->stream_error->type == XMPP_SE_NOT_AUTHORIZED)))
+        _conn_schedule_reconnect(conn);
 
     /* fire off connection handler */
     conn->conn_handler(conn, XMPP_CONN_DISCONNECT, conn->error,
@@ -582,6 +1293,13 @@ void conn_parser_reset(xmpp_conn_t * const conn)
     parser_reset(conn->parser);
 }
 
+/* takes the JID the session is bound to, NULL once it is gone */
+void conn_set_bound_jid(xmpp_conn_t * const conn, char * const jid)
+{
+    if (conn->bound_jid) xmpp_free(conn->ctx, conn->bound_jid);
+    conn->bound_jid = jid;
+}
+
 /* timed handler for cleanup if normal disconnect procedure takes too long */
 static int _disconnect_cleanup(xmpp_conn_t * const conn, 
                                void * const userdata)
@@ -597,7 +1315,10 @@ static int _disconnect_cleanup(xmpp_conn_t * const conn,
 /** Initiate termination of the connection to the XMPP server.
  *  This function starts the disconnection sequence by sending
  *  </stream:stream> to the XMPP server.  This function will do nothing
- *  if the connection state is CONNECTING or CONNECTED.
+ *  if the connection state is not CONNECTING or CONNECTED.  A connection
+ *  which is still resolving its host or in the middle of a TLS handshake
+ *  is closed immediately.  A pending automatic reconnect is cancelled and
+ *  the connection won't reconnect after this disconnect.
  *
  *  @param conn a Strophe connection object
  *
@@ -605,10 +1326,28 @@ static int _disconnect_cleanup(xmpp_conn_t * const conn,
  */
 void xmpp_disconnect(xmpp_conn_t * const conn)
 {
+    conn->disconnect_requested = 1;
+    if (conn->reconnect_pending) {
+        xmpp_debug(conn->ctx, "xmpp", "Reconnect cancelled.");
+        conn->reconnect_pending = 0;
+    }
+
+    if (conn->state == XMPP_STATE_RESOLVING ||
+        conn->state == XMPP_STATE_TLS_HANDSHAKE) {
+        /* there is no stream to close yet */
+        conn_disconnect(conn);
+        return;
+    }
     if (conn->state != XMPP_STATE_CONNECTING &&
         conn->state != XMPP_STATE_CONNECTED)
         return;
 
+    /* closing the stream ends the stream management session, tell the
+     * server what we have handled before */
+    if (conn->sm_state == XMPP_SM_ENABLED)
+        sm_send_ack(conn);
+    sm_reset(conn);
+
     /* close the stream */
     xmpp_send_raw_string(conn, "</stream:stream>");
 
@@ -728,9 +1467,16 @@ void xmpp_send(xmpp_conn_t * const conn,
 
     if (conn->state == XMPP_STATE_CONNECTED) {
         if ((ret = xmpp_stanza_to_text(stanza, &buf, &len)) == 0) {
-            xmpp_send_raw(conn, buf, len);
-            xmpp_debug(conn->ctx, "conn", "SENT: %s", buf);
-            xmpp_free(conn->ctx, buf);
+            /* a session being resumed gets its stanzas once it is back */
+            if (sm_stanza_held(conn, stanza)) {
+                xmpp_debug(conn->ctx, "conn", "HELD: %s", buf);
+            } else {
+                xmpp_send_raw(conn, buf, len);
+                xmpp_debug(conn->ctx, "conn", "SENT: %s", buf);
+            }
+            /* stream management keeps the stanza until it is acked */
+            if (!sm_stanza_sent(conn, stanza, buf, len))
+                xmpp_free(conn->ctx, buf);
         }
     }
 }
@@ -757,6 +1503,15 @@ void conn_open_stream(xmpp_conn_t * const conn)
                          XMPP_NS_STREAMS);
 }
 
+/** Start TLS negotiation on the connection.
+ *  The handshake itself is driven by the event loop, which calls
+ *  conn_tls_handshake() whenever the socket is ready.  The stream is
+ *  reopened when the handshake completes.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return 0 if the handshake was started or a negative error code
+ */
 int conn_tls_start(xmpp_conn_t * const conn)
 {
     int rc;
@@ -769,22 +1524,52 @@ int conn_tls_start(xmpp_conn_t * const conn)
         rc = conn->tls == NULL ? -ENOMEM : 0;
     }
 
-    if (conn->tls != NULL) {
-        if (tls_start(conn->tls)) {
-            conn->secured = 1;
-            conn_prepare_reset(conn, auth_handle_open);
-        } else {
-            rc = tls_error(conn->tls);
-            conn->error = rc;
-            tls_free(conn->tls);
-            conn->tls = NULL;
-            conn->tls_failed = 1;
-        }
-    }
-    if (rc != 0)
+    if (rc != 0) {
         xmpp_debug(conn->ctx, "conn", "Couldn't start TLS! error %d", rc);
+        return rc;
+    }
+
+    if (conn->tls_ktls && !tls_enable_ktls(conn->tls))
+        xmpp_debug(conn->ctx, "conn", "Kernel TLS is not supported by "
+                                      "the TLS backend");
+    if (conn->tls_low_mem && !tls_enable_low_mem(conn->tls))
+        xmpp_debug(conn->ctx, "conn", "Low memory mode is not supported by "
+                                      "the TLS backend");
 
-    return rc;
+    conn->state = XMPP_STATE_TLS_HANDSHAKE;
+    conn->timeout_stamp = time_stamp();
+    conn_tls_handshake(conn);
+
+    return 0;
+}
+
+/** Advance the TLS handshake.
+ *  This function is called by the event loop when the socket of a
+ *  connection in TLS handshake state becomes ready.  It should not be
+ *  used outside of the library.
+ *
+ *  @param conn a Strophe connection object
+ */
+void conn_tls_handshake(xmpp_conn_t * const conn)
+{
+    int rc;
+
+    if (tls_start(conn->tls)) {
+        xmpp_debug(conn->ctx, "conn", "TLS handshake complete");
+        conn->state = XMPP_STATE_CONNECTED;
+        conn->secured = 1;
+        conn_prepare_reset(conn, auth_handle_open);
+        conn_open_stream(conn);
+    } else if (!tls_is_recoverable(tls_error(conn->tls))) {
+        rc = tls_error(conn->tls);
+        xmpp_debug(conn->ctx, "conn", "Couldn't start TLS! error %d", rc);
+        conn->error = rc;
+        tls_free(conn->tls);
+        conn->tls = NULL;
+        conn->tls_failed = 1;
+        /* failed tls spoils the connection, so disconnect */
+        conn_disconnect(conn);
+    }
 }
 
 /** Return applied flags for the connection.
@@ -799,7 +1584,13 @@ long xmpp_conn_get_flags(const xmpp_conn_t * const conn)
 
     flags = XMPP_CONN_FLAG_DISABLE_TLS * conn->tls_disabled |
             XMPP_CONN_FLAG_MANDATORY_TLS * conn->tls_mandatory |
-            XMPP_CONN_FLAG_LEGACY_SSL * conn->tls_legacy_ssl;
+            XMPP_CONN_FLAG_LEGACY_SSL * conn->tls_legacy_ssl |
+            XMPP_CONN_FLAG_KTLS * conn->tls_ktls |
+            XMPP_CONN_FLAG_TLS_LOW_MEM * conn->tls_low_mem |
+            XMPP_CONN_FLAG_TCP_NODELAY * conn->sock_opts.nodelay |
+            XMPP_CONN_FLAG_STREAM_MGMT * conn->sm_allowed |
+            XMPP_CONN_FLAG_COMPRESSION * conn->compression_allowed |
+            XMPP_CONN_FLAG_SASL2 * conn->sasl2_allowed;
 
     return flags;
 }
@@ -816,6 +1607,43 @@ long xmpp_conn_get_flags(const xmpp_conn_t * const conn)
  *    - XMPP_CONN_FLAG_DISABLE_TLS
  *    - XMPP_CONN_FLAG_MANDATORY_TLS
  *    - XMPP_CONN_FLAG_LEGACY_SSL
+ *    - XMPP_CONN_FLAG_KTLS
+ *    - XMPP_CONN_FLAG_TLS_LOW_MEM
+ *    - XMPP_CONN_FLAG_TCP_NODELAY
+ *    - XMPP_CONN_FLAG_STREAM_MGMT
+ *    - XMPP_CONN_FLAG_COMPRESSION
+ *    - XMPP_CONN_FLAG_SASL2
+ *
+ *  XMPP_CONN_FLAG_KTLS asks the TLS backend to hand record encryption over
+ *  to the kernel once the handshake is complete.  It is silently ignored
+ *  when the backend or the kernel doesn't support kernel TLS.
+ *
+ *  XMPP_CONN_FLAG_TLS_LOW_MEM trades a little CPU for memory: the TLS
+ *  backend frees its record buffers whenever they are empty, which cuts
+ *  the footprint of idle connections considerably.
+ *
+ *  XMPP_CONN_FLAG_TCP_NODELAY disables Nagle's algorithm on the socket, so
+ *  small stanzas go out at once instead of waiting for the previous
+ *  segment to be acknowledged.
+ *
+ *  XMPP_CONN_FLAG_STREAM_MGMT enables XEP-0198 stream management when the
+ *  server supports it.  Stanzas sent with xmpp_send() are kept until the
+ *  server acknowledges them, and connecting the same connection object
+ *  again after a network failure resumes the session instead of binding
+ *  a new resource; the unacknowledged stanzas are sent again.  See
+ *  xmpp_conn_is_resumed().
+ *
+ *  XMPP_CONN_FLAG_COMPRESSION compresses the stream with zlib (XEP-0138)
+ *  after authentication when the server offers it.  This trades CPU time
+ *  for bandwidth, see xmpp_conn_set_compression().  The flag isn't
+ *  supported when the library is built without zlib.
+ *
+ *  XMPP_CONN_FLAG_SASL2 logs in with XEP-0388 SASL2 when the server offers
+ *  it.  The resource is bound (XEP-0386) and stream management is enabled
+ *  or resumed within the authentication, without restarting the stream.
+ *  The server may also hand out a XEP-0484 FAST token, which replaces the
+ *  password on the next login and saves the SCRAM round trip; see
+ *  xmpp_conn_get_fast_token().
  *
  *  @param conn a Strophe connection object
  *  @param flags ORed connection flags
@@ -838,10 +1666,335 @@ int xmpp_conn_set_flags(xmpp_conn_t * const conn, long flags)
     conn->tls_disabled = (flags & XMPP_CONN_FLAG_DISABLE_TLS) ? 1 : 0;
     conn->tls_mandatory = (flags & XMPP_CONN_FLAG_MANDATORY_TLS) ? 1 : 0;
     conn->tls_legacy_ssl = (flags & XMPP_CONN_FLAG_LEGACY_SSL) ? 1 : 0;
+    conn->tls_ktls = (flags & XMPP_CONN_FLAG_KTLS) ? 1 : 0;
+    conn->tls_low_mem = (flags & XMPP_CONN_FLAG_TLS_LOW_MEM) ? 1 : 0;
+    conn->sock_opts.nodelay = (flags & XMPP_CONN_FLAG_TCP_NODELAY) ? 1 : 0;
+    conn->sm_allowed = (flags & XMPP_CONN_FLAG_STREAM_MGMT) ? 1 : 0;
+    if (!conn->sm_allowed)
+        sm_reset(conn);
+    conn->compression_allowed = (flags & XMPP_CONN_FLAG_COMPRESSION) &&
+                                compression_available();
+    conn->sasl2_allowed = (flags & XMPP_CONN_FLAG_SASL2) ? 1 : 0;
 
     return 0;
 }
 
+static int _conn_sockopt_check(xmpp_conn_t * const conn)
+{
+    if (conn->state != XMPP_STATE_DISCONNECTED) {
+        xmpp_error(conn->ctx, "conn", "Socket options can be set only "
+                                      "for disconnected connection");
+        return -1;
+    }
+    return 0;
+}
+
+/** Enable TCP keepalive for the connection.
+ *  The kernel starts probing the peer after the link has been idle for
+ *  idle seconds and drops the connection once count probes sent interval
+ *  seconds apart go unanswered, so a dead server is noticed without
+ *  XMPP level pings.  Zero for interval or count keeps the system default
+ *  and an idle time of zero disables keepalive.
+ *
+ *  The options take effect on the next connect.
+ *
+ *  @param conn a Strophe connection object
+ *  @param idle seconds of idle time before the first probe
+ *  @param interval seconds between probes
+ *  @param count number of unanswered probes before the link is dropped
+ *
+ *  @return 0 on success or -1 if the connection isn't disconnected
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_set_keepalive(xmpp_conn_t * const conn, int idle,
+                            int interval, int count)
+{
+    if (_conn_sockopt_check(conn) != 0)
+        return -1;
+
+    conn->sock_opts.keepalive_idle = idle > 0 ? idle : 0;
+    conn->sock_opts.keepalive_interval = interval > 0 ? interval : 0;
+    conn->sock_opts.keepalive_count = count > 0 ? count : 0;
+
+    return 0;
+}
+
+/** Set the socket buffer sizes of the connection.
+ *  The sizes are passed to SO_SNDBUF and SO_RCVBUF before connect, so the
+ *  receive buffer also determines the advertised TCP window.  Zero keeps
+ *  the system default.
+ *
+ *  @param conn a Strophe connection object
+ *  @param sndbuf send buffer size in bytes
+ *  @param rcvbuf receive buffer size in bytes
+ *
+ *  @return 0 on success or -1 if the connection isn't disconnected
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_set_sockbuf(xmpp_conn_t * const conn, int sndbuf, int rcvbuf)
+{
+    if (_conn_sockopt_check(conn) != 0)
+        return -1;
+
+    conn->sock_opts.sndbuf = sndbuf > 0 ? sndbuf : 0;
+    conn->sock_opts.rcvbuf = rcvbuf > 0 ? rcvbuf : 0;
+
+    return 0;
+}
+
+/** Limit how long sent data may stay unacknowledged.
+ *  When the peer doesn't acknowledge written data within timeout
+ *  milliseconds the kernel drops the connection (TCP_USER_TIMEOUT).  This
+ *  is ignored on platforms without the option.  Zero keeps the system
+ *  default.
+ *
+ *  @param conn a Strophe connection object
+ *  @param timeout timeout in milliseconds
+ *
+ *  @return 0 on success or -1 if the connection isn't disconnected
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_set_user_timeout(xmpp_conn_t * const conn,
+                               unsigned int timeout)
+{
+    if (_conn_sockopt_check(conn) != 0)
+        return -1;
+
+    conn->sock_opts.user_timeout = timeout;
+
+    return 0;
+}
+
+/** Busy poll the device queue on reads.
+ *  Sets SO_BUSY_POLL, which trades CPU time for lower receive latency.
+ *  This is ignored on platforms without the option and may need extra
+ *  privileges.  Zero disables busy polling.
+ *
+ *  @param conn a Strophe connection object
+ *  @param usec microseconds to busy poll
+ *
+ *  @return 0 on success or -1 if the connection isn't disconnected
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_set_busy_poll(xmpp_conn_t * const conn, unsigned int usec)
+{
+    if (_conn_sockopt_check(conn) != 0)
+        return -1;
+
+    conn->sock_opts.busy_poll = usec;
+
+    return 0;
+}
+
+/** Connect through a local stream socket instead of TCP.
+ *  When a path is set, xmpp_connect_client() and xmpp_connect_component()
+ *  connect to the AF_UNIX socket at path and skip name resolution; the
+ *  server and port passed to them are then only used for logging.  The
+ *  stream itself, authentication and handlers work as over TCP.  This
+ *  avoids the TCP stack for components running on the same host as the
+ *  server.  Pass NULL to go back to TCP.
+ *
+ *  @param conn a Strophe connection object
+ *  @param path the socket path or NULL
+ *
+ *  @return 0 on success or -1 if the connection isn't disconnected or
+ *      memory can't be allocated
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_set_unix_path(xmpp_conn_t * const conn, const char * const path)
+{
+    char *copy = NULL;
+
+    if (_conn_sockopt_check(conn) != 0)
+        return -1;
+    if (path) {
+        copy = xmpp_strdup(conn->ctx, path);
+        if (!copy) return -1;
+    }
+
+    if (conn->unix_path) xmpp_free(conn->ctx, conn->unix_path);
+    conn->unix_path = copy;
+
+    return 0;
+}
+
+/** Reconnect automatically when the connection is lost.
+ *  After a disconnect which wasn't asked for with xmpp_disconnect(), the
+ *  connection connects again the way it was first connected, with the
+ *  same JID, password, handlers and connection handler.  The connection
+ *  handler still gets the XMPP_CONN_DISCONNECT event and may call
+ *  xmpp_disconnect() to stay disconnected.
+ *
+ *  The first try waits up to min_delay milliseconds and each failed one
+ *  doubles the wait up to max_delay.  Every wait is shortened by a random
+ *  amount of up to half its length.  A connection which got through
+ *  authentication starts over at min_delay.  Stream errors telling that
+ *  another session took over the resource or that the account isn't
+ *  authorized end the reconnects.  See also
+ *  xmpp_ctx_set_connect_limits().
+ *
+ *  @param conn a Strophe connection object
+ *  @param min_delay delay of the first try in milliseconds, 0 disables
+ *      automatic reconnects
+ *  @param max_delay upper limit of the delay in milliseconds
+ *
+ *  @ingroup Connections
+ */
+void xmpp_conn_set_reconnect(xmpp_conn_t * const conn,
+                             unsigned long min_delay,
+                             unsigned long max_delay)
+{
+    conn->reconnect_min = min_delay;
+    conn->reconnect_max = max_delay > min_delay ? max_delay : min_delay;
+    conn->reconnect_backoff = 0;
+    if (min_delay == 0)
+        conn->reconnect_pending = 0;
+}
+
+/** Check whether the connection is waiting to reconnect.
+ *  This can be used in the connection handler to tell a lost connection
+ *  which will come back from one which stays disconnected.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return TRUE if an automatic reconnect is pending, FALSE otherwise
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_is_reconnecting(const xmpp_conn_t * const conn)
+{
+    return conn->reconnect_pending;
+}
+
+/** Tune the stream compression of a connection.
+ *  The level goes from 1 for the fastest compression to 9 for the best
+ *  one, the memory level from 1 for the least memory to 9 for the
+ *  fastest compression.  The defaults are the zlib ones, a level of 6 and
+ *  a memory level of 8, which takes about 256 KiB per connection.  Many
+ *  idle connections may want a lower memory level.  The compression
+ *  itself is enabled with XMPP_CONN_FLAG_COMPRESSION.
+ *
+ *  @param conn a Strophe connection object
+ *  @param level compression level, -1 for the default
+ *  @param mem_level memory level, 0 for the default
+ *
+ *  @return 0 on success or -1 if the values are out of range
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_set_compression(xmpp_conn_t * const conn, int level,
+                              int mem_level)
+{
+    if (level < -1 || level > 9 || mem_level < 0 || mem_level > 9)
+        return -1;
+
+    conn->compression_level = level;
+    conn->compression_mem_level =
+        mem_level ? mem_level : COMPRESSION_MEM_LEVEL_DEFAULT;
+
+    return 0;
+}
+
+/* replaces a string owned by the connection with a copy of value */
+static int _conn_set_string(xmpp_conn_t * const conn, char **field,
+                            const char * const value)
+{
+    char *copy = NULL;
+
+    if (value) {
+        copy = xmpp_strdup(conn->ctx, value);
+        if (!copy) return -1;
+    }
+    if (*field) xmpp_free(conn->ctx, *field);
+    *field = copy;
+
+    return 0;
+}
+
+/** Describe the application to the server for SASL2.
+ *  The id must be a UUID which stays the same for the installation of
+ *  the application, because the server ties FAST tokens to it.  Without
+ *  one, a random id is made for the lifetime of the connection object,
+ *  so a saved token is useless after a restart.  With Bind2, the software
+ *  name also becomes the start of the resource the server picks.
+ *
+ *  @param conn a Strophe connection object
+ *  @param id a UUID or NULL
+ *  @param software the name of the application or NULL
+ *  @param device a name for the device or NULL
+ *
+ *  @return 0 on success or -1 on a memory allocation failure
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_set_user_agent(xmpp_conn_t * const conn, const char * const id,
+                             const char * const software,
+                             const char * const device)
+{
+    if (_conn_set_string(conn, &conn->ua_id, id) != 0 ||
+        _conn_set_string(conn, &conn->ua_software, software) != 0 ||
+        _conn_set_string(conn, &conn->ua_device, device) != 0)
+        return -1;
+
+    return 0;
+}
+
+/** Set the FAST token for the next login.
+ *  This restores a token saved from xmpp_conn_get_fast_token() together
+ *  with the user agent id it was issued for, see
+ *  xmpp_conn_set_user_agent().  The password is only used if the server
+ *  rejects the token.
+ *
+ *  @param conn a Strophe connection object
+ *  @param token the token or NULL to forget it
+ *  @param count the number of times the token has been used
+ *
+ *  @return 0 on success or -1 on a memory allocation failure
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_set_fast_token(xmpp_conn_t * const conn,
+                             const char * const token, unsigned long count)
+{
+    char *copy = NULL;
+
+    if (token) {
+        copy = xmpp_strdup(conn->ctx, token);
+        if (!copy) return -1;
+    }
+    _conn_free_fast_token(conn);
+    conn->fast_token = copy;
+    conn->fast_count = count;
+
+    return 0;
+}
+
+/** Get the FAST token the server issued for this user agent.
+ *  A new token may come with every SASL2 login, the application should
+ *  save it together with the count when the connection handler reports
+ *  XMPP_CONN_CONNECT.  The token is a credential like the password.
+ *
+ *  @param conn a Strophe connection object
+ *  @param count set to the number of times the token has been used,
+ *      may be NULL
+ *
+ *  @return the token or NULL if there is none
+ *
+ *  @ingroup Connections
+ */
+const char *xmpp_conn_get_fast_token(const xmpp_conn_t * const conn,
+                                     unsigned long * const count)
+{
+    if (count) *count = conn->fast_count;
+
+    return conn->fast_token;
+}
+
 /** Disable TLS for this connection, called by users of the library.
  *  Occasionally a server will be misconfigured to send the starttls
  *  feature, but will not support the handshake.
@@ -856,6 +2009,35 @@ void xmpp_conn_disable_tls(xmpp_conn_t * const conn)
     conn->tls_disabled = 1;
 }
 
+/** Returns whether the last connect resumed a previous session.
+ *  A resumed session keeps its bound JID and the server's view of
+ *  presence and roster, so the application doesn't need to set them up
+ *  again.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return 1 if the session was resumed with XEP-0198, 0 otherwise
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_is_resumed(const xmpp_conn_t * const conn)
+{
+    return conn->sm_resumed;
+}
+
+/** Returns whether the stream is compressed.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return 1 if the stream is compressed with XEP-0138, 0 otherwise
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_is_compressed(const xmpp_conn_t * const conn)
+{
+    return compression_active(conn);
+}
+
 /** Returns whether TLS session is established or not. */
 int xmpp_conn_is_secured(xmpp_conn_t * const conn)
 {
@@ -957,6 +2139,7 @@ static void _handle_stream_stanza(xmpp_stanza_t *stanza,
     }
 
     handler_fire_stanza(conn, stanza);
+    sm_stanza_handled(conn, stanza);
 }
 
 static int _conn_default_port(xmpp_conn_t * const conn)
@@ -0,0 +1,91 @@
+/* cpu.c
+** strophe XMPP client library -- CPU feature detection
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/** @file
+ *  CPU feature detection.
+ *  The hash functions pick an implementation with these on first use.
+ */
+
+#include "cpu.h"
+
+#ifdef CPU_X86_SHA
+#include <cpuid.h>
+#endif
+
+#define CPU_SSSE3 0x01
+#define CPU_SSE4_1 0x02
+#define CPU_SHA 0x04
+#define CPU_AVX2 0x08
+
+/* cpuid bits we care about, read once */
+static int cpu_features(void)
+{
+#ifdef CPU_X86_SHA
+    static int features = -1;
+    unsigned int eax, ebx, ecx, edx;
+    int ymm = 0;
+
+    if (features < 0) {
+        features = 0;
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+            if (ecx & bit_SSSE3)
+                features |= CPU_SSSE3;
+            if (ecx & bit_SSE4_1)
+                features |= CPU_SSE4_1;
+            /* the OS must save the YMM registers for AVX to be usable */
+            if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+                __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+                ymm = (eax & 6) == 6;
+            }
+        }
+        if (__get_cpuid_max(0, 0) >= 7) {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            if (ebx & (1 << 29))
+                features |= CPU_SHA;
+            if (ymm && (ebx & bit_AVX2))
+                features |= CPU_AVX2;
+        }
+    }
+    return features;
+#else
+    return 0;
+#endif
+}
+
+/** Check for the x86 SHA extensions, together with the SSSE3 and
+ *  SSE4.1 instructions which the SHA-1 and SHA-256 code also uses.
+ *
+ *  @return 1 if the CPU has them, 0 otherwise
+ */
+int cpu_has_x86_sha(void)
+{
+    const int all = CPU_SSSE3 | CPU_SSE4_1 | CPU_SHA;
+
+    return (cpu_features() & all) == all;
+}
+
+/** Check for the x86 SSSE3 instructions.
+ *
+ *  @return 1 if the CPU has them, 0 otherwise
+ */
+int cpu_has_x86_ssse3(void)
+{
+    return (cpu_features() & CPU_SSSE3) != 0;
+}
+
+/** Check for the x86 AVX2 instructions and that the OS supports them.
+ *
+ *  @return 1 if they can be used, 0 otherwise
+ */
+int cpu_has_x86_avx2(void)
+{
+    return (cpu_features() & CPU_AVX2) != 0;
+}
@@ -0,0 +1,32 @@
+/* cpu.h
+** strophe XMPP client library -- CPU feature detection
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/** @file
+ *  CPU feature detection.
+ */
+
+#ifndef __LIBSTROPHE_CPU_H__
+#define __LIBSTROPHE_CPU_H__
+
+/* compilers which can build functions for the x86 SHA extensions, SSSE3
+ * and AVX2 without -msha, -mssse3 or -mavx2 for the whole file */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define CPU_X86_SHA 1
+#define CPU_X86_SSSE3 1
+#define CPU_X86_AVX2 1
+#endif
+
+int cpu_has_x86_sha(void);
+int cpu_has_x86_ssse3(void);
+int cpu_has_x86_avx2(void);
+
+#endif /* __LIBSTROPHE_CPU_H__ */
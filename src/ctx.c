@@ -404,8 +404,20 @@ xmpp_ctx_t *xmpp_ctx_new(const xmpp_mem_t * const mem,
 
 	ctx->connlist = NULL;
 	ctx->loop_status = XMPP_LOOP_NOTSTARTED;
+	ctx->connect_max = 0;
+	ctx->connect_rate = 0;
+	ctx->connect_tokens = 0;
+	ctx->connect_tokens_stamp = 0;
+	scram_cache_init(&ctx->scram_cache);
+	ctx->jid_cache = NULL;
 	ctx->rand = xmpp_rand_new(ctx);
 	if (ctx->rand == NULL) {
+	    xmpp_free(ctx, ctx);
+	    return NULL;
+	}
+	ctx->resolver = resolver_new(ctx);
+	if (ctx->resolver == NULL) {
+	    xmpp_rand_free(ctx, ctx->rand);
 	    xmpp_free(ctx, ctx);
 	    ctx = NULL;
 	}
@@ -423,7 +435,36 @@ xmpp_ctx_t *xmpp_ctx_new(const xmpp_mem_t * const mem,
 void xmpp_ctx_free(xmpp_ctx_t * const ctx)
 {
     /* mem and log are owned by their suppliers */
+    resolver_free(ctx->resolver);
     xmpp_rand_free(ctx, ctx->rand);
+    /* the cached keys are as good as the passwords */
+    scram_cache_wipe(&ctx->scram_cache);
+    if (ctx->jid_cache)
+        jid_cache_free(ctx, ctx->jid_cache);
     xmpp_free(ctx, ctx); /* pull the hole in after us */
 }
 
+/** Throttle the automatic reconnects of all connections in a context.
+ *  Reconnects wait while max_connecting connections are still connecting
+ *  or authenticating, and no more than max_rate of them start in a second.
+ *  This keeps a large number of connections which lost their server at
+ *  the same time from coming back all at once.  Connects started by the
+ *  application are not held back, but count towards max_connecting.
+ *
+ *  @param ctx a Strophe context object
+ *  @param max_connecting limit of connections in progress, 0 for none
+ *  @param max_rate limit of reconnects per second, 0 for none
+ *
+ *  @ingroup Context
+ */
+void xmpp_ctx_set_connect_limits(xmpp_ctx_t * const ctx,
+                                 unsigned int max_connecting,
+                                 unsigned int max_rate)
+{
+    ctx->connect_max = max_connecting;
+    ctx->connect_rate = max_rate;
+    /* allow a full second worth of reconnects right away */
+    ctx->connect_tokens = (uint64_t)max_rate * 1000;
+    ctx->connect_tokens_stamp = time_stamp();
+}
+
@@ -80,12 +80,15 @@ void xmpp_run_once(xmpp_ctx_t *ctx, const unsigned long timeout)
     sock_t max = 0;
     int ret;
     struct timeval tv;
-    xmpp_send_queue_t *sq, *tsq;
-    int towrite;
+    xmpp_send_queue_t *sq;
+    sock_iovec_t iov[SOCK_IOV_MAX];
+    int iovcnt, towrite;
+    size_t written;
     char buf[4096];
-    uint64_t next;
+    uint64_t next, resolver_next, attempt_next, reconnect_next;
     long usec;
-    int tls_read_bytes = 0;
+    sock_t fd;
+    int pending_bytes = 0;
 
     if (ctx->loop_status == XMPP_LOOP_QUIT) return;
     ctx->loop_status = XMPP_LOOP_RUNNING;
@@ -99,65 +102,55 @@ void xmpp_run_once(xmpp_ctx_t *ctx, const unsigned long timeout)
 	    continue;
 	}
 
-	/* if we're running tls, there may be some remaining data waiting to
-	 * be sent, so push that out */
-	if (conn->tls) {
-	    ret = tls_clear_pending_write(conn->tls);
-
-	    if (ret < 0 && !tls_is_recoverable(tls_error(conn->tls))) {
-		/* an error occured */
-		xmpp_debug(ctx, "xmpp", "Send error occured, disconnecting.");
-		conn->error = ECONNABORTED;
-		conn_disconnect(conn);
-	    }
+	/* the transport may hold back data from earlier writes, e.g. a TLS
+	 * record or compressed output, so push that out */
+	if (conn->transport->flush(conn) < 0 && conn->transport->error(conn)) {
+	    /* an error occured */
+	    xmpp_debug(ctx, "xmpp", "Send error occured, disconnecting.");
+	    conn->error = ECONNABORTED;
+	    conn_disconnect(conn);
 	}
 
-	/* write all data from the send queue to the socket */
-	sq = conn->send_queue_head;
-	while (sq) {
-	    towrite = sq->len - sq->written;
-
-	    if (conn->tls) {
-		ret = tls_write(conn->tls, &sq->data[sq->written], towrite);
-
-		if (ret < 0 && !tls_is_recoverable(tls_error(conn->tls))) {
-		    /* an error occured */
-		    conn->error = tls_error(conn->tls);
-		    break;
-		} else if (ret < towrite) {
-		    /* not all data could be sent now */
-		    if (ret >= 0) sq->written += ret;
-		    break;
-		}
-
-	    } else {
-		ret = sock_write(conn->sock, &sq->data[sq->written], towrite);
-
-		if (ret < 0 && !sock_is_recoverable(sock_error())) {
-		    /* an error occured */
-		    conn->error = sock_error();
-		    break;
-		} else if (ret < towrite) {
-		    /* not all data could be sent now */
-		    if (ret >= 0) sq->written += ret;
-		    break;
-		}
+	/* write the send queue to the transport, gathering several items
+	 * into each write */
+	while (conn->state == XMPP_STATE_CONNECTED && conn->send_queue_head) {
+	    towrite = 0;
+	    iovcnt = 0;
+	    for (sq = conn->send_queue_head; sq && iovcnt < SOCK_IOV_MAX;
+		 sq = sq->next) {
+		iov[iovcnt].iov_base = &sq->data[sq->written];
+		iov[iovcnt].iov_len = sq->len - sq->written;
+		towrite += iov[iovcnt].iov_len;
+		iovcnt++;
 	    }
 
-	    /* all data for this queue item written, delete and move on */
-	    xmpp_free(ctx, sq->data);
-	    tsq = sq;
-	    sq = sq->next;
-	    xmpp_free(ctx, tsq);
+	    ret = conn->transport->writev(conn, iov, iovcnt);
+	    if (ret < 0) {
+		/* an error occured unless the write would block */
+		conn->error = conn->transport->error(conn);
+		break;
+	    }
 
-	    /* pop the top item */
-	    conn->send_queue_head = sq;
+	    /* delete the items which have been written completely */
+	    written = ret;
+	    while ((sq = conn->send_queue_head) &&
+		   (size_t)(sq->len - sq->written) <= written) {
+		written -= sq->len - sq->written;
+		conn->send_queue_head = sq->next;
+		xmpp_free(ctx, sq->data);
+		xmpp_free(ctx, sq);
+	    }
+	    /* and keep the position in a partially written one */
+	    if (sq) sq->written += written;
 	    /* if we've sent everything update the tail */
-	    if (!sq) conn->send_queue_tail = NULL;
+	    if (!conn->send_queue_head) conn->send_queue_tail = NULL;
+
+	    /* not all data could be sent now */
+	    if (ret < towrite) break;
 	}
 
 	/* tear down connection on error */
-	if (conn->error) {
+	if (conn->state == XMPP_STATE_CONNECTED && conn->error) {
 	    /* FIXME: need to tear down send queues and random other things
 	     * maybe this should be abstracted */
 	    xmpp_debug(ctx, "xmpp", "Send error occured, disconnecting.");
@@ -179,10 +172,13 @@ void xmpp_run_once(xmpp_ctx_t *ctx, const unsigned long timeout)
        make sure we don't wait past the time when timed handlers need 
        to be called */
     next = handler_fire_timed(ctx);
-
-    usec = ((next < timeout) ? next : timeout) * 1000;
-    tv.tv_sec = usec / 1000000;
-    tv.tv_usec = usec % 1000000;
+    /* nor past the next DNS retransmission */
+    resolver_next = resolver_timeout(ctx->resolver);
+    if (resolver_next < next) next = resolver_next;
+    /* nor past the next reconnect, which is started here so that its
+       socket is watched right away */
+    reconnect_next = conn_reconnect_process(ctx);
+    if (reconnect_next < next) next = reconnect_next;
 
     FD_ZERO(&rfds); 
     FD_ZERO(&wfds);
@@ -193,22 +189,47 @@ void xmpp_run_once(xmpp_ctx_t *ctx, const unsigned long timeout)
 	conn = connitem->conn;
 	
 	switch (conn->state) {
+	case XMPP_STATE_RESOLVING:
+	    /* the resolver watches its own sockets */
+	    break;
 	case XMPP_STATE_CONNECTING:
 	    /* connect has been called and we're waiting for it to complete */
 	    /* connection will give us write or error events */
 	    
 	    /* make sure the timeout hasn't expired */
 	    if (time_elapsed(conn->timeout_stamp, time_stamp()) <= 
-		conn->connect_timeout)
-		FD_SET(conn->sock, &wfds);
-	    else {
+		conn->connect_timeout) {
+		/* nor past the time the next address joins the race */
+		attempt_next = conn_connect_watch(conn, &wfds, &max);
+		if (attempt_next < next) next = attempt_next;
+	    } else {
 		conn->error = ETIMEDOUT;
 		xmpp_info(ctx, "xmpp", "Connection attempt timed out.");
+		conn_connect_failed(conn);
+	    }
+	    break;
+	case XMPP_STATE_TLS_HANDSHAKE:
+	    /* the handshake is bounded by the same timeout as connect */
+	    if (time_elapsed(conn->timeout_stamp, time_stamp()) <=
+		conn->connect_timeout) {
+		if (tls_want_write(conn->tls))
+		    FD_SET(conn->sock, &wfds);
+		else
+		    FD_SET(conn->sock, &rfds);
+	    } else {
+		conn->error = ETIMEDOUT;
+		xmpp_info(ctx, "xmpp", "TLS handshake timed out.");
 		conn_disconnect(conn);
 	    }
 	    break;
 	case XMPP_STATE_CONNECTED:
-	    FD_SET(conn->sock, &rfds);
+	    fd = conn->transport->fd(conn);
+	    if (fd != -1) {
+		FD_SET(fd, &rfds);
+		if (fd > max) max = fd;
+	    }
+	    /* data buffered by the transport, e.g. in a TLS record */
+	    pending_bytes += conn->transport->pending(conn);
 	    break;
 	case XMPP_STATE_DISCONNECTED:
 	    /* do nothing */
@@ -216,20 +237,25 @@ void xmpp_run_once(xmpp_ctx_t *ctx, const unsigned long timeout)
 	    break;
 	}
 	
-	/* Check if there is something in the SSL buffer. */
-	if (conn->tls) {
-	    tls_read_bytes += tls_pending(conn->tls);
-	}
-	
 	if (conn->state != XMPP_STATE_DISCONNECTED && conn->sock > max)
 	    max = conn->sock;
 
 	connitem = connitem->next;
     }
 
+    /* queries in flight */
+    resolver_fdset(ctx->resolver, &rfds, &max);
+
+    /* buffered data must not wait for the socket */
+    usec = pending_bytes > 0 ? 0 : ((next < timeout) ? next : timeout) * 1000;
+    tv.tv_sec = usec / 1000000;
+    tv.tv_usec = usec % 1000000;
+
     /* check for events */
     if (max > 0)
         ret = select(max + 1, &rfds,  &wfds, NULL, &tv);
+    else if (pending_bytes > 0)
+        ret = 0;
     else {
         if (timeout > 0)
             _sleep(timeout);
@@ -243,9 +269,16 @@ void xmpp_run_once(xmpp_ctx_t *ctx, const unsigned long timeout)
 		       sock_error());
 	return;
     }
-    
+
+    /* pick up DNS answers and let waiting connections use them */
+    resolver_process(ctx->resolver, &rfds);
+    for (connitem = ctx->connlist; connitem; connitem = connitem->next) {
+	if (connitem->conn->state == XMPP_STATE_RESOLVING)
+	    conn_resolve(connitem->conn);
+    }
+
     /* no events happened */
-    if (ret == 0 && tls_read_bytes == 0) return;
+    if (ret == 0 && pending_bytes == 0) return;
 
     /* process events */
     connitem = ctx->connlist;
@@ -254,42 +287,29 @@ void xmpp_run_once(xmpp_ctx_t *ctx, const unsigned long timeout)
 
 	switch (conn->state) {
 	case XMPP_STATE_CONNECTING:
-	    if (FD_ISSET(conn->sock, &wfds)) {
+	    ret = conn_connect_process(conn, &wfds);
+	    if (ret < 0) {
+		/* connection failed */
+		xmpp_debug(ctx, "xmpp", "connection failed, error %d",
+			   conn->error);
+		conn_connect_failed(conn);
+		break;
+	    }
+	    if (ret > 0) {
 		/* connection complete */
-
-		/* check for error */
-                ret = sock_connect_error(conn->sock);
-		if (ret != 0) {
-		    /* connection failed */
-		    xmpp_debug(ctx, "xmpp", "connection failed, error %d", ret);
-		    conn_disconnect(conn);
-		    break;
-		}
-
-		conn->state = XMPP_STATE_CONNECTED;
-		xmpp_debug(ctx, "xmpp", "connection successful");
-
-                if (conn->tls_legacy_ssl) {
-                    xmpp_debug(ctx, "xmpp", "using legacy SSL connection");
-                    ret = conn_tls_start(conn);
-                    if (ret != 0) {
-                        conn_disconnect(conn);
-                        break;
-                    }
-                }
-
-		/* send stream init */
-		conn_open_stream(conn);
+		conn_established(conn);
 	    }
 
 	    break;
+	case XMPP_STATE_TLS_HANDSHAKE:
+	    if (FD_ISSET(conn->sock, &rfds) || FD_ISSET(conn->sock, &wfds))
+		conn_tls_handshake(conn);
+	    break;
 	case XMPP_STATE_CONNECTED:
-	    if (FD_ISSET(conn->sock, &rfds) || (conn->tls && tls_pending(conn->tls))) {
-		if (conn->tls) {
-		    ret = tls_read(conn->tls, buf, 4096);
-		} else {
-		    ret = sock_read(conn->sock, buf, 4096);
-		}
+	    fd = conn->transport->fd(conn);
+	    if ((fd != -1 && FD_ISSET(fd, &rfds)) ||
+		conn->transport->pending(conn) > 0) {
+		ret = conn->transport->read(conn, buf, 4096);
 
 		if (ret > 0) {
 		    ret = parser_feed(conn->parser, buf, ret);
@@ -299,18 +319,17 @@ void xmpp_run_once(xmpp_ctx_t *ctx, const unsigned long timeout)
 			xmpp_debug(ctx, "xmpp", "parse error, disconnecting");
 			conn_disconnect(conn);
 		    }
+		} else if (ret == 0) {
+		    /* return of 0 means socket closed by server */
+		    xmpp_debug(ctx, "xmpp", "Socket closed by remote host.");
+		    conn->error = ECONNRESET;
+		    conn_disconnect(conn);
 		} else {
-		    if (conn->tls) {
-			if (!tls_is_recoverable(tls_error(conn->tls)))
-			{
-			    xmpp_debug(ctx, "xmpp", "Unrecoverable TLS error, %d.", tls_error(conn->tls));
-			    conn->error = tls_error(conn->tls);
-			    conn_disconnect(conn);
-			}
-		    } else {
-			/* return of 0 means socket closed by server */
-			xmpp_debug(ctx, "xmpp", "Socket closed by remote host.");
-			conn->error = ECONNRESET;
+		    ret = conn->transport->error(conn);
+		    if (ret) {
+			xmpp_debug(ctx, "xmpp", "Unrecoverable %s error, %d.",
+				   conn->transport->name, ret);
+			conn->error = ret;
 			conn_disconnect(conn);
 		    }
 		}
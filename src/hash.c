@@ -78,6 +78,12 @@ hash_t *hash_clone(hash_t * const table)
     return table;
 }
 
+/** check whether a hash table has more than one reference */
+int hash_is_shared(hash_t * const table)
+{
+    return table->ref > 1;
+}
+
 /** release a hash table that is no longer needed */
 void hash_release(hash_t * const table)
 {
@@ -103,21 +109,20 @@ void hash_release(hash_t * const table)
     }
 }
 
-/** hash a key for our table lookup */
+/** hash a key for our table lookup with FNV-1a, so that every
+ *  character counts: ids which only differ in a counter at the end
+ *  spread over the table */
 static int _hash_key(hash_t *table, const char *key)
 {
-   int hash = 0;
-   int shift = 0;
-   const char *c = key;
+   uint32_t hash = 2166136261U;
+   const unsigned char *c = (const unsigned char *)key;
 
    while (*c != '\0') {
-	/* assume 32 bit ints */
-	hash ^= ((int)*c++ << shift);
-	shift += 8;
-	if (shift > 24) shift = 0;
+	hash ^= *c++;
+	hash *= 16777619U;
    }
 
-   return hash % table->length;
+   return (int)(hash % (uint32_t)table->length);
 }
 
 /** add a key, value pair to a hash table.
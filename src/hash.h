@@ -27,6 +27,9 @@ hash_t *hash_new(xmpp_ctx_t * const ctx, const int size,
 /** allocate a new reference to an existing hash table */
 hash_t *hash_clone(hash_t * const table);
 
+/** check whether a hash table has more than one reference */
+int hash_is_shared(hash_t * const table);
+
 /** release a hash table when no longer needed */
 void hash_release(hash_t * const table);
 
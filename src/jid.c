@@ -15,8 +15,43 @@
 
 #include <string.h>
 
+#ifdef HAVE_ICU
+#include <unicode/uidna.h>
+#include <unicode/usprep.h>
+#include <unicode/ustring.h>
+#endif
+
 #include "strophe.h"
 #include "common.h"
+#include "hash.h"
+#include "jid.h"
+
+typedef struct _jid_cache_entry_t jid_cache_entry_t;
+
+struct _jid_cache_entry_t {
+    char *raw;
+    char *norm; /* NULL if raw is not a valid JID */
+    jid_cache_entry_t *prev;
+    jid_cache_entry_t *next;
+};
+
+struct _jid_cache_t {
+    hash_t *table; /* raw JID to entry */
+    jid_cache_entry_t *head; /* most recently used */
+    jid_cache_entry_t *tail; /* next to go */
+    int count;
+#ifdef HAVE_ICU
+    UStringPrepProfile *nodeprep;
+    UStringPrepProfile *resourceprep;
+    UIDNA *idna;
+#endif
+};
+
+typedef enum {
+    JID_NODE,
+    JID_DOMAIN,
+    JID_RESOURCE
+} jid_part_t;
 
 /** Create a JID string from component parts node, domain, and resource.
  *
@@ -62,6 +97,22 @@ char *xmpp_jid_new(xmpp_ctx_t *ctx, const char *node,
     return result;
 }
 
+/* copy a part of a parsed JID to a new string, NULL if it is empty */
+static char *_jid_part_dup(xmpp_ctx_t *ctx, const xmpp_jid_view_t *view,
+                           const xmpp_jid_slice_t *part)
+{
+    char *result;
+
+    if (part->len == 0) return NULL;
+    result = xmpp_alloc(ctx, part->len + 1);
+    if (result != NULL) {
+        memcpy(result, view->jid + part->offset, part->len);
+        result[part->len] = '\0';
+    }
+
+    return result;
+}
+
 /** Create a bare JID from a JID.
  *  
  *  @param ctx the Strophe context object
@@ -71,19 +122,10 @@ char *xmpp_jid_new(xmpp_ctx_t *ctx, const char *node,
  */
 char *xmpp_jid_bare(xmpp_ctx_t *ctx, const char *jid)
 {
-    char *result;
-    const char *c;
+    xmpp_jid_view_t view;
 
-    c = strchr(jid, '/');
-    if (c == NULL) return xmpp_strdup(ctx, jid);
-
-    result = xmpp_alloc(ctx, c-jid+1);
-    if (result != NULL) {
-	memcpy(result, jid, c-jid);
-	result[c-jid] = '\0';
-    }
-
-    return result;
+    if (xmpp_jid_parse(jid, &view) != XMPP_EOK) return NULL;
+    return _jid_part_dup(ctx, &view, &view.bare);
 }
 
 /** Create a node string from a JID.
@@ -96,19 +138,10 @@ char *xmpp_jid_bare(xmpp_ctx_t *ctx, const char *jid)
  */
 char *xmpp_jid_node(xmpp_ctx_t *ctx, const char *jid)
 {
-    char *result = NULL;
-    const char *c;
+    xmpp_jid_view_t view;
 
-    c = strchr(jid, '@');
-    if (c != NULL) {
-	result = xmpp_alloc(ctx, (c-jid) + 1);
-	if (result != NULL) {
-	    memcpy(result, jid, (c-jid));
-	    result[c-jid] = '\0';
-	}
-    }
-
-    return result;
+    if (xmpp_jid_parse(jid, &view) != XMPP_EOK) return NULL;
+    return _jid_part_dup(ctx, &view, &view.node);
 }
 
 /** Create a domain string from a JID.
@@ -120,29 +153,10 @@ char *xmpp_jid_node(xmpp_ctx_t *ctx, const char *jid)
  */
 char *xmpp_jid_domain(xmpp_ctx_t *ctx, const char *jid)
 {
-    char *result = NULL;
-    const char *c,*s;
+    xmpp_jid_view_t view;
 
-    c = strchr(jid, '@');
-    if (c == NULL) {
-	/* no node, assume domain */
-	c = jid;
-    } else {
-	/* advance past the separator */
-	c++;
-    }
-    s = strchr(c, '/');
-    if (s == NULL) {
-	/* no resource */
-	s = c + strlen(c);
-    }
-    result = xmpp_alloc(ctx, (s-c) + 1);
-    if (result != NULL) {
-	memcpy(result, c, (s-c));
-	result[s-c] = '\0';
-    }
-
-    return result;
+    if (xmpp_jid_parse(jid, &view) != XMPP_EOK) return NULL;
+    return _jid_part_dup(ctx, &view, &view.domain);
 }
 
 /** Create a resource string from a JID.
@@ -155,20 +169,413 @@ char *xmpp_jid_domain(xmpp_ctx_t *ctx, const char *jid)
  */
 char *xmpp_jid_resource(xmpp_ctx_t *ctx, const char *jid)
 {
-    char *result = NULL;
+    xmpp_jid_view_t view;
+
+    if (xmpp_jid_parse(jid, &view) != XMPP_EOK) return NULL;
+    return _jid_part_dup(ctx, &view, &view.resource);
+}
+
+/** Split a JID into its parts without copying.
+ *  The JID is scanned once and the view records where the bare JID,
+ *  node, domain and resource lie within it, as in RFC 7622: the
+ *  resource starts after the first '/', and the node ends at the first
+ *  '@' in front of it.  The slices hold the parts byte for byte, so a
+ *  trailing '.' stays part of the domain as xmpp_jid_domain() returns it;
+ *  the comparison functions ignore it.  The view points into jid, which
+ *  must outlive it.
+ *
+ *  @param jid the JID
+ *  @param view the view to fill in
+ *
+ *  @return XMPP_EOK (0) on success or XMPP_EINVOP if the domain is empty
+ */
+int xmpp_jid_parse(const char * const jid, xmpp_jid_view_t * const view)
+{
     const char *c;
-    int len;
-
-    c = strchr(jid, '/');
-    if (c != NULL)  {
-	c++;
-	len = strlen(c);
-	result = xmpp_alloc(ctx, len + 1);
-	if (result != NULL) {
-	    memcpy(result, c, len);
-	    result[len] = '\0';
-	}
+    size_t at = 0, slash = 0, len;
+    int has_at = 0, has_slash = 0;
+
+    for (c = jid; *c != '\0'; c++) {
+        if (*c == '/') {
+            slash = c - jid;
+            has_slash = 1;
+            break;
+        }
+        if (*c == '@' && !has_at) {
+            at = c - jid;
+            has_at = 1;
+        }
+    }
+    len = has_slash ? slash + 1 + strlen(c + 1) : (size_t)(c - jid);
+
+    view->jid = jid;
+    view->bare.offset = 0;
+    view->bare.len = has_slash ? slash : len;
+    view->node.offset = 0;
+    view->node.len = has_at ? at : 0;
+    view->domain.offset = has_at ? at + 1 : 0;
+    view->domain.len = view->bare.len - view->domain.offset;
+    view->resource.offset = has_slash ? slash + 1 : len;
+    view->resource.len = len - view->resource.offset;
+
+    return view->domain.len > 0 ? XMPP_EOK : XMPP_EINVOP;
+}
+
+/* length of the domain without the trailing '.' of a fully qualified
+ * name, which RFC 7622 drops when comparing */
+static size_t _jid_domain_len(const xmpp_jid_view_t * const view)
+{
+    size_t len = view->domain.len;
+
+    if (len > 0 && view->jid[view->domain.offset + len - 1] == '.') len--;
+
+    return len;
+}
+
+/* compare ASCII case insensitively */
+static int _jid_part_equal(const char *a, const char *b, size_t len)
+{
+    unsigned char ca, cb;
+
+    for (; len > 0; len--) {
+        ca = (unsigned char)*a++;
+        cb = (unsigned char)*b++;
+        if (ca >= 'A' && ca <= 'Z') ca += 'a' - 'A';
+        if (cb >= 'A' && cb <= 'Z') cb += 'a' - 'A';
+        if (ca != cb) return 0;
     }
 
+    return 1;
+}
+
+/** Check whether two parsed JIDs have the same bare JID.
+ *  Node and domain are compared ignoring ASCII case and a trailing '.'
+ *  of the domain, resources are ignored.  Other characters are compared
+ *  as they are, so JIDs which are not in their normal form may differ
+ *  where XMPP would not.
+ *
+ *  @param a a view from xmpp_jid_parse()
+ *  @param b another view from xmpp_jid_parse()
+ *
+ *  @return 1 if the bare JIDs are equal, 0 if not
+ */
+int xmpp_jid_bare_equal(const xmpp_jid_view_t * const a,
+                        const xmpp_jid_view_t * const b)
+{
+    size_t len = _jid_domain_len(a);
+
+    return a->node.len == b->node.len &&
+           len == _jid_domain_len(b) &&
+           _jid_part_equal(a->jid + a->node.offset,
+                           b->jid + b->node.offset, a->node.len) &&
+           _jid_part_equal(a->jid + a->domain.offset,
+                           b->jid + b->domain.offset, len);
+}
+
+/** Check whether a parsed JID belongs to a domain.
+ *  The domain is compared ignoring ASCII case and a trailing '.'.
+ *  Subdomains do not match.
+ *
+ *  @param view a view from xmpp_jid_parse()
+ *  @param domain the domain
+ *
+ *  @return 1 if the JID is at the domain, 0 if not
+ */
+int xmpp_jid_domain_match(const xmpp_jid_view_t * const view,
+                          const char * const domain)
+{
+    size_t len = strlen(domain);
+
+    if (len > 0 && domain[len - 1] == '.') len--;
+
+    return len == _jid_domain_len(view) &&
+           _jid_part_equal(view->jid + view->domain.offset, domain, len);
+}
+
+/* characters RFC 7622 forbids in a part, besides the non-ASCII ones the
+ * Unicode profiles handle */
+static int _jid_ascii_forbidden(const jid_part_t part, const unsigned char c)
+{
+    if (c < 0x20 || c == 0x7f) return 1;
+    switch (part) {
+    case JID_NODE:
+        return c == ' ' || strchr("\"&'/:<>@", c) != NULL;
+    case JID_DOMAIN:
+        return c == ' ' || c == '@' || c == '/';
+    default:
+        return 0;
+    }
+}
+
+#ifdef HAVE_ICU
+/* check for a label of a domain in punycode */
+static int _jid_has_ace_label(const char *domain, const size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 4 <= len; i++)
+        if ((i == 0 || domain[i - 1] == '.') &&
+            (domain[i] == 'x' || domain[i] == 'X') &&
+            (domain[i + 1] == 'n' || domain[i + 1] == 'N') &&
+            domain[i + 2] == '-' && domain[i + 3] == '-')
+            return 1;
+
+    return 0;
+}
+#endif
+
+/* map a part to its canonical form, out holds JID_PART_MAX + 1 bytes;
+ * node and domain are lower cased and the resource is kept as it is,
+ * which is all there is to the ASCII characters; the others are left
+ * to ICU when there is a cache that holds its profiles */
+static int _jid_prep_part(jid_cache_t *cache, const jid_part_t part,
+                          const char *in, const size_t len,
+                          char *out, size_t *out_len)
+{
+    unsigned char c;
+    size_t i;
+    int ascii = 1;
+
+    if (len > JID_PART_MAX) return XMPP_EINVOP;
+    for (i = 0; i < len; i++) {
+        c = (unsigned char)in[i];
+        if (c >= 0x80) {
+            ascii = 0;
+        } else {
+            if (_jid_ascii_forbidden(part, c)) return XMPP_EINVOP;
+            if (part != JID_RESOURCE && c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+        }
+        out[i] = (char)c;
+    }
+    *out_len = len;
+
+#ifdef HAVE_ICU
+    /* punycode labels are mapped to Unicode like any other domain */
+    if (part == JID_DOMAIN && _jid_has_ace_label(in, len))
+        ascii = 0;
+    if (!ascii && cache != NULL) {
+        UChar src[JID_PART_MAX], dst[JID_PART_MAX];
+        UIDNAInfo info = UIDNA_INFO_INITIALIZER;
+        UErrorCode err = U_ZERO_ERROR;
+        int32_t n;
+
+        if (part == JID_DOMAIN) {
+            n = uidna_nameToUnicodeUTF8(cache->idna, in, (int32_t)len,
+                                        out, JID_PART_MAX, &info, &err);
+            if (U_FAILURE(err) || err == U_STRING_NOT_TERMINATED_WARNING ||
+                info.errors != 0 || n == 0)
+                return XMPP_EINVOP;
+        } else {
+            u_strFromUTF8(src, JID_PART_MAX, &n, in, (int32_t)len, &err);
+            if (U_FAILURE(err)) return XMPP_EINVOP;
+            n = usprep_prepare(part == JID_NODE ? cache->nodeprep
+                                                : cache->resourceprep,
+                               src, n, dst, JID_PART_MAX, USPREP_DEFAULT,
+                               NULL, &err);
+            if (U_FAILURE(err)) return XMPP_EINVOP;
+            u_strToUTF8(out, JID_PART_MAX, &n, dst, n, &err);
+            if (U_FAILURE(err) || err == U_STRING_NOT_TERMINATED_WARNING ||
+                n == 0)
+                return XMPP_EINVOP;
+        }
+        *out_len = (size_t)n;
+    }
+#else
+    (void)cache;
+    (void)ascii;
+#endif
+
+    return XMPP_EOK;
+}
+
+/* put the canonical parts of a JID back together */
+static char *_jid_prep(xmpp_ctx_t *ctx, jid_cache_t *cache,
+                       const xmpp_jid_view_t *view)
+{
+    char node[JID_PART_MAX + 1];
+    char domain[JID_PART_MAX + 1];
+    char resource[JID_PART_MAX + 1];
+    size_t nlen = 0, dlen, rlen = 0;
+    int has_node = view->domain.offset > 0;
+    int has_resource = view->resource.offset > view->bare.len;
+    char *result;
+
+    /* a separator must be followed by something */
+    if ((has_node && view->node.len == 0) ||
+        (has_resource && view->resource.len == 0))
+        return NULL;
+
+    if ((has_node &&
+         _jid_prep_part(cache, JID_NODE, view->jid + view->node.offset,
+                        view->node.len, node, &nlen) != XMPP_EOK) ||
+        _jid_prep_part(cache, JID_DOMAIN, view->jid + view->domain.offset,
+                       _jid_domain_len(view), domain, &dlen) != XMPP_EOK ||
+        (has_resource &&
+         _jid_prep_part(cache, JID_RESOURCE,
+                        view->jid + view->resource.offset,
+                        view->resource.len, resource, &rlen) != XMPP_EOK))
+        return NULL;
+
+    result = xmpp_alloc(ctx, nlen + 1 + dlen + 1 + rlen + 1);
+    if (result == NULL) return NULL;
+    if (has_node) {
+        memcpy(result, node, nlen);
+        result[nlen++] = '@';
+    }
+    memcpy(result + nlen, domain, dlen);
+    dlen += nlen;
+    if (has_resource) {
+        result[dlen++] = '/';
+        memcpy(result + dlen, resource, rlen);
+    }
+    result[dlen + rlen] = '\0';
+
     return result;
 }
+
+static jid_cache_t *_jid_cache_get(xmpp_ctx_t *ctx)
+{
+    jid_cache_t *cache = ctx->jid_cache;
+#ifdef HAVE_ICU
+    UErrorCode err = U_ZERO_ERROR;
+#endif
+
+    if (cache != NULL) return cache;
+
+    cache = xmpp_alloc(ctx, sizeof(*cache));
+    if (cache == NULL) return NULL;
+    memset(cache, 0, sizeof(*cache));
+    cache->table = hash_new(ctx, JID_CACHE_SIZE, NULL);
+#ifdef HAVE_ICU
+    cache->nodeprep = usprep_openByType(USPREP_RFC3920_NODEPREP, &err);
+    cache->resourceprep = usprep_openByType(USPREP_RFC3920_RESOURCEPREP,
+                                            &err);
+    cache->idna = uidna_openUTS46(UIDNA_NONTRANSITIONAL_TO_UNICODE, &err);
+    if (U_FAILURE(err)) {
+        xmpp_error(ctx, "jid", "Couldn't load the ICU profiles: %s",
+                   u_errorName(err));
+        jid_cache_free(ctx, cache);
+        return NULL;
+    }
+#endif
+    if (cache->table == NULL) {
+        jid_cache_free(ctx, cache);
+        return NULL;
+    }
+    ctx->jid_cache = cache;
+
+    return cache;
+}
+
+/* unlink an entry from the list of recently used ones */
+static void _jid_cache_unlink(jid_cache_t *cache, jid_cache_entry_t *entry)
+{
+    if (entry->prev) entry->prev->next = entry->next;
+    else cache->head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else cache->tail = entry->prev;
+}
+
+static void _jid_cache_push(jid_cache_t *cache, jid_cache_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) cache->head->prev = entry;
+    else cache->tail = entry;
+    cache->head = entry;
+}
+
+static void _jid_cache_entry_free(xmpp_ctx_t *ctx, jid_cache_entry_t *entry)
+{
+    xmpp_free(ctx, entry->raw);
+    if (entry->norm) xmpp_free(ctx, entry->norm);
+    xmpp_free(ctx, entry);
+}
+
+void jid_cache_free(xmpp_ctx_t * const ctx, jid_cache_t *cache)
+{
+    jid_cache_entry_t *entry;
+
+    while ((entry = cache->head) != NULL) {
+        cache->head = entry->next;
+        _jid_cache_entry_free(ctx, entry);
+    }
+    if (cache->table) hash_release(cache->table);
+#ifdef HAVE_ICU
+    if (cache->nodeprep) usprep_close(cache->nodeprep);
+    if (cache->resourceprep) usprep_close(cache->resourceprep);
+    if (cache->idna) uidna_close(cache->idna);
+#endif
+    if (ctx->jid_cache == cache) ctx->jid_cache = NULL;
+    xmpp_free(ctx, cache);
+}
+
+/** Normalize a JID.
+ *  The node and domain are case mapped and, if libstrophe was built
+ *  with ICU, the node and resource are prepared with the nodeprep and
+ *  resourceprep profiles of RFC 6122 and the domain is mapped with UTS
+ *  #46 to its Unicode form.  JIDs that normalize to the same string are
+ *  the same address, so the result serves as a key for rosters and
+ *  routing tables.
+ *
+ *  ASCII JIDs take a fast path.  The others are remembered in a cache
+ *  of the context holding the JID_CACHE_SIZE most recently used ones,
+ *  so a sender pays for the Unicode profiles only once.
+ *
+ *  @param ctx the Strophe context object
+ *  @param jid the JID
+ *
+ *  @return an allocated string with the normalized JID or NULL if jid
+ *      is not a valid JID or an error occurs
+ */
+char *xmpp_jid_normalize(xmpp_ctx_t *ctx, const char *jid)
+{
+    xmpp_jid_view_t view;
+    jid_cache_t *cache;
+    jid_cache_entry_t *entry;
+    const unsigned char *c;
+
+    if (xmpp_jid_parse(jid, &view) != XMPP_EOK) return NULL;
+
+    for (c = (const unsigned char *)jid; *c != '\0' && *c < 0x80; c++);
+#ifdef HAVE_ICU
+    if (*c == '\0' &&
+        !_jid_has_ace_label(jid + view.domain.offset, view.domain.len))
+#else
+    if (*c == '\0')
+#endif
+        return _jid_prep(ctx, NULL, &view);
+
+    cache = _jid_cache_get(ctx);
+    if (cache == NULL) return NULL;
+
+    entry = hash_get(cache->table, jid);
+    if (entry != NULL) {
+        _jid_cache_unlink(cache, entry);
+        _jid_cache_push(cache, entry);
+        return entry->norm ? xmpp_strdup(ctx, entry->norm) : NULL;
+    }
+
+    if (cache->count == JID_CACHE_SIZE) {
+        entry = cache->tail;
+        _jid_cache_unlink(cache, entry);
+        hash_drop(cache->table, entry->raw);
+        _jid_cache_entry_free(ctx, entry);
+        cache->count--;
+    }
+    entry = xmpp_alloc(ctx, sizeof(*entry));
+    if (entry == NULL) return NULL;
+    entry->raw = xmpp_strdup(ctx, jid);
+    entry->norm = _jid_prep(ctx, cache, &view);
+    if (entry->raw == NULL || hash_add(cache->table, jid, entry) != 0) {
+        if (entry->raw) xmpp_free(ctx, entry->raw);
+        if (entry->norm) xmpp_free(ctx, entry->norm);
+        xmpp_free(ctx, entry);
+        return NULL;
+    }
+    _jid_cache_push(cache, entry);
+    cache->count++;
+
+    return entry->norm ? xmpp_strdup(ctx, entry->norm) : NULL;
+}
@@ -0,0 +1,31 @@
+/* jid.h
+** strophe XMPP client library -- JID normalization
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/** @file
+ *  JID normalization cache.
+ */
+
+#ifndef __LIBSTROPHE_JID_H__
+#define __LIBSTROPHE_JID_H__
+
+#include "strophe.h"
+
+/* number of normalized JIDs kept per context */
+#define JID_CACHE_SIZE 256
+
+/* longest node, domain or resource in bytes, from RFC 7622 */
+#define JID_PART_MAX 1023
+
+typedef struct _jid_cache_t jid_cache_t;
+
+void jid_cache_free(xmpp_ctx_t * const ctx, jid_cache_t *cache);
+
+#endif /* __LIBSTROPHE_JID_H__ */
@@ -49,6 +49,12 @@ Stanza::Stanza(Context *ctx)
     // TODO: check for errors
 }
 
+Stanza::Stanza(Context *ctx, xmpp_stanza_t *stanza)
+{
+    m_ctx = ctx;
+    m_stanza = stanza;
+}
+
 Stanza::~Stanza()
 {
 }
@@ -58,6 +64,28 @@ Stanza *Stanza::create(Context *ctx)
     return new (ctx) Stanza(ctx);
 }
 
+Stanza *Stanza::build(Context *ctx, const char * const fmt, ...)
+{
+    xmpp_stanza_t *stanza;
+    Stanza *result;
+    va_list ap;
+
+    va_start(ap, fmt);
+    stanza = ::xmpp_stanza_vbuild(ctx->getContext(), fmt, ap);
+    va_end(ap);
+    if (!stanza) return NULL;
+
+    result = new (ctx) Stanza(ctx, stanza);
+    if (!result) ::xmpp_stanza_release(stanza);
+
+    return result;
+}
+
+xmpp_stanza_t *Stanza::getStanza()
+{
+    return m_stanza;
+}
+
 void Stanza::release()
 {
     if (::xmpp_stanza_release(m_stanza))
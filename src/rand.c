@@ -12,14 +12,31 @@
 /** @file
  *  Pseudo-random number generator.
  *
- *  Implemented Hash_DRBG mechanism according to NIST SP 800-90A.
- *  Hash function is SHA1.
+ *  Output comes from ChaCha20 keyed from the operating system's random
+ *  source, with fast key erasure: every refill of the buffer replaces the
+ *  key with its own first 32 bytes, so earlier output can't be recovered
+ *  from the state.  Small requests are served from the buffer.
+ *
+ *  Where the system has no random source the key comes from a Hash_DRBG
+ *  mechanism according to NIST SP 800-90A with the entropy we can gather
+ *  ourselves.  Hash function is SHA1.
  */
 
 #include <assert.h>
 #include <string.h>
 #include <time.h>
 
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif
+
 #include "common.h"
 #include "ostypes.h"
 #include "sha1.h"
@@ -42,10 +59,32 @@ struct Hash_DRBG_CTX_struc {
 };
 typedef struct Hash_DRBG_CTX_struc Hash_DRBG_CTX;
 
+/* ChaCha20 output is made this many blocks at a time */
+#define CHACHA_BLOCKS 16
+#define RAND_BUFSIZE (CHACHA_BLOCKS * 64)
+#define RAND_KEYLEN 32
+/* refills after which fresh entropy is mixed into the key */
+#define RAND_RESEED_REFILLS 1024
+
+typedef struct {
+    int seeded;
+    unsigned refills;
+    size_t avail;             /* unused bytes at the end of buf */
+    uint32_t key[8];
+    uint8_t buf[RAND_BUFSIZE];
+} chacha_rng_t;
+
 struct _xmpp_rand_t {
     int inited;
     unsigned reseed_count;
     Hash_DRBG_CTX ctx;
+    /* a page of its own which a forked child gets zeroed where the
+     * system can do that, otherwise the pid tells us about forks */
+    chacha_rng_t *rng;
+    int wipe_on_fork;
+#ifndef _WIN32
+    pid_t pid;
+#endif
 };
 
 /* returns smallest number mupliple of y that not less than x */
@@ -238,6 +277,9 @@ static void xmpp_rand_reseed(xmpp_ctx_t *ctx)
     ENTROPY_ACCUMULATE(ptr, last, clock_t, clock());
     ENTROPY_ACCUMULATE(ptr, last, void *, ctx);
     ENTROPY_ACCUMULATE(ptr, last, unsigned, ++rand->reseed_count);
+#ifndef _WIN32
+    ENTROPY_ACCUMULATE(ptr, last, pid_t, getpid());
+#endif
     len = ptr - entropy;
 
     if (rand->inited) {
@@ -248,30 +290,222 @@ static void xmpp_rand_reseed(xmpp_ctx_t *ctx)
     }
 }
 
+/* generates from the Hash_DRBG, which is only used to key ChaCha20 where
+ * the system has no random source */
+static void Hash_DRBG_bytes(xmpp_ctx_t *ctx, uint8_t *output, size_t len)
+{
+    int rc;
+    xmpp_rand_t *rand = ctx->rand;
+
+    rc = Hash_DRBG_Generate(&rand->ctx, output, len);
+    if (rc == RESEED_NEEDED) {
+        xmpp_rand_reseed(ctx);
+        rc = Hash_DRBG_Generate(&rand->ctx, output, len);
+        assert(rc == 0);
+    }
+}
+
+/* reads the system's random source, returns 0 on success */
+static int os_random_bytes(uint8_t *output, size_t len)
+{
+#ifndef _WIN32
+    ssize_t n;
+    int fd;
+
+#ifdef HAVE_GETRANDOM
+    while (len > 0) {
+        n = getrandom(output, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        output += n;
+        len -= (size_t)n;
+    }
+    if (len == 0)
+        return 0;
+#endif
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0)
+        return -1;
+    while (len > 0) {
+        n = read(fd, output, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        output += n;
+        len -= (size_t)n;
+    }
+    close(fd);
+    return len == 0 ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+/* one block of ChaCha20 according to RFC 8439 */
+static void chacha20_block(const uint32_t key[8], uint32_t counter,
+                           const uint32_t nonce[3], uint8_t out[64])
+{
+    uint32_t j[16], x[16];
+    int i;
+
+    j[0] = 0x61707865; j[1] = 0x3320646e; j[2] = 0x79622d32;
+    j[3] = 0x6b206574;
+    for (i = 0; i < 8; ++i)
+        j[4 + i] = key[i];
+    j[12] = counter;
+    j[13] = nonce[0]; j[14] = nonce[1]; j[15] = nonce[2];
+    memcpy(x, j, sizeof(x));
+
+    for (i = 0; i < 10; ++i) {
+        QUARTERROUND(x[0], x[4], x[8], x[12])
+        QUARTERROUND(x[1], x[5], x[9], x[13])
+        QUARTERROUND(x[2], x[6], x[10], x[14])
+        QUARTERROUND(x[3], x[7], x[11], x[15])
+        QUARTERROUND(x[0], x[5], x[10], x[15])
+        QUARTERROUND(x[1], x[6], x[11], x[12])
+        QUARTERROUND(x[2], x[7], x[8], x[13])
+        QUARTERROUND(x[3], x[4], x[9], x[14])
+    }
+
+    for (i = 0; i < 16; ++i) {
+        x[i] += j[i];
+        out[i * 4] = (uint8_t)x[i];
+        out[i * 4 + 1] = (uint8_t)(x[i] >> 8);
+        out[i * 4 + 2] = (uint8_t)(x[i] >> 16);
+        out[i * 4 + 3] = (uint8_t)(x[i] >> 24);
+    }
+}
+
+static uint32_t load_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[3] << 24;
+}
+
+/* fills the buffer and takes the next key from its start */
+static void rand_refill(chacha_rng_t *rng)
+{
+    static const uint32_t nonce[3] = {0, 0, 0};
+    int i;
+
+    for (i = 0; i < CHACHA_BLOCKS; ++i)
+        chacha20_block(rng->key, (uint32_t)i, nonce, rng->buf + i * 64);
+    for (i = 0; i < 8; ++i)
+        rng->key[i] = load_le32(rng->buf + i * 4);
+    memset(rng->buf, 0, RAND_KEYLEN);
+    rng->avail = RAND_BUFSIZE - RAND_KEYLEN;
+    ++rng->refills;
+}
+
+/* mixes fresh entropy into the key and drops what is buffered */
+static void rand_stir(xmpp_ctx_t *ctx)
+{
+    xmpp_rand_t *rand = ctx->rand;
+    chacha_rng_t *rng = rand->rng;
+    uint8_t seed[RAND_KEYLEN];
+    int i;
+
+    if (os_random_bytes(seed, sizeof(seed)) != 0)
+        Hash_DRBG_bytes(ctx, seed, sizeof(seed));
+    for (i = 0; i < 8; ++i)
+        rng->key[i] ^= load_le32(seed + i * 4);
+    memset(seed, 0, sizeof(seed));
+    memset(rng->buf, 0, sizeof(rng->buf));
+    rng->avail = 0;
+    rng->refills = 0;
+    rng->seeded = 1;
+#ifndef _WIN32
+    rand->pid = getpid();
+#endif
+}
+
+/* true in a child which still has the parent's state */
+static int rand_forked(xmpp_rand_t *rand)
+{
+#ifndef _WIN32
+    return !rand->wipe_on_fork && rand->pid != getpid();
+#else
+    return 0;
+#endif
+}
+
 xmpp_rand_t *xmpp_rand_new(xmpp_ctx_t *ctx)
 {
     xmpp_rand_t *out = xmpp_alloc(ctx, sizeof(*out));
-    if (out != NULL) {
-        memset(out, 0, sizeof(*out));
+    void *p;
+
+    if (out == NULL)
+        return NULL;
+    memset(out, 0, sizeof(*out));
+#ifdef MADV_WIPEONFORK
+    p = mmap(NULL, sizeof(*out->rng), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p != MAP_FAILED) {
+        if (madvise(p, sizeof(*out->rng), MADV_WIPEONFORK) == 0) {
+            out->rng = p;
+            out->wipe_on_fork = 1;
+        } else {
+            munmap(p, sizeof(*out->rng));
+        }
+    }
+#endif
+    if (out->rng == NULL) {
+        p = xmpp_alloc(ctx, sizeof(*out->rng));
+        if (p == NULL) {
+            xmpp_free(ctx, out);
+            return NULL;
+        }
+        out->rng = p;
     }
+    memset(out->rng, 0, sizeof(*out->rng));
     return out;
 }
 
 void xmpp_rand_free(xmpp_ctx_t *ctx, xmpp_rand_t *rand)
 {
+    memset(rand->rng, 0, sizeof(*rand->rng));
+#ifdef MADV_WIPEONFORK
+    if (rand->wipe_on_fork)
+        munmap(rand->rng, sizeof(*rand->rng));
+    else
+#endif
+        xmpp_free(ctx, rand->rng);
+    memset(rand, 0, sizeof(*rand));
     xmpp_free(ctx, rand);
 }
 
 void xmpp_rand_bytes(xmpp_ctx_t *ctx, uint8_t *output, size_t len)
 {
-    int rc;
-    xmpp_rand_t *rand = ctx->rand;
-
-    rc = Hash_DRBG_Generate(&rand->ctx, output, len);
-    if (rc == RESEED_NEEDED) {
-        xmpp_rand_reseed(ctx);
-        rc = Hash_DRBG_Generate(&rand->ctx, output, len);
-        assert(rc == 0);
+    chacha_rng_t *rng = ctx->rand->rng;
+    uint8_t *p;
+    size_t n;
+
+    if (!rng->seeded || rand_forked(ctx->rand))
+        rand_stir(ctx);
+    while (len > 0) {
+        if (rng->avail == 0) {
+            if (rng->refills >= RAND_RESEED_REFILLS)
+                rand_stir(ctx);
+            rand_refill(rng);
+        }
+        n = len < rng->avail ? len : rng->avail;
+        p = rng->buf + RAND_BUFSIZE - rng->avail;
+        memcpy(output, p, n);
+        /* nothing handed out stays in memory */
+        memset(p, 0, n);
+        output += n;
+        len -= n;
+        rng->avail -= n;
     }
 }
 
@@ -285,19 +519,23 @@ int xmpp_rand(xmpp_ctx_t *ctx)
 
 void xmpp_rand_nonce(xmpp_ctx_t *ctx, char *output, size_t len)
 {
-    size_t i;
-    size_t rand_len = len / 2;
-    uint8_t rand_buf[rand_len];
+    static const char hex[] = "0123456789abcdef";
+    uint8_t rand_buf[32];
+    size_t chars, i, k, n;
 
     /* current implementation returns printable HEX representation of
-     * a random buffer, however base64 encoding can be used instead;
-     * the only problem is that base64_encode() allocates memory and
-     * as result can fail.
-     */
-
-    xmpp_rand_bytes(ctx, rand_buf, rand_len);
-    for (i = 0; i < rand_len; ++i) {
-        xmpp_snprintf(output + i * 2, len, "%02x", (unsigned char)rand_buf[i]);
-        len -= 2;
+     * a random buffer, filling all of output */
+    if (len == 0)
+        return;
+    chars = len - 1;
+    for (i = 0; i < chars; i += n) {
+        n = chars - i;
+        if (n > sizeof(rand_buf) * 2)
+            n = sizeof(rand_buf) * 2;
+        xmpp_rand_bytes(ctx, rand_buf, (n + 1) / 2);
+        for (k = 0; k < n; ++k)
+            output[i + k] = hex[k & 1 ? rand_buf[k / 2] & 0x0f
+                                      : rand_buf[k / 2] >> 4];
     }
+    output[chars] = '\0';
 }
@@ -0,0 +1,1104 @@
+/* resolver.c
+** strophe XMPP client library -- DNS resolver
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/** @file
+ *  Asynchronous DNS resolver.
+ *
+ *  Queries go over UDP to the name servers listed in resolv.conf and the
+ *  replies are picked up by the event loop, so a slow name server doesn't
+ *  stall the other connections of the context.  Answers are cached per
+ *  context for as long as their TTL allows, and lookups of a name that is
+ *  already being resolved share the query in flight.
+ *
+ *  Without a usable resolv.conf (e.g. on Windows) the blocking system
+ *  resolver is used instead; its answers are cached as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#endif
+
+#include "strophe.h"
+#include "common.h"
+#include "resolver.h"
+
+#ifndef RESOLV_CONF
+#define RESOLV_CONF "/etc/resolv.conf"
+#endif
+#ifndef HOSTS_FILE
+#define HOSTS_FILE "/etc/hosts"
+#endif
+#ifndef RESOLVER_TIMEOUT
+/** @def RESOLVER_TIMEOUT
+ *  The time to wait (in milliseconds) for a name server to answer before
+ *  the query is sent again, unless resolv.conf sets its own.  The default
+ *  is 2 seconds.
+ */
+#define RESOLVER_TIMEOUT 2000
+#endif
+#ifndef RESOLVER_ATTEMPTS
+/** @def RESOLVER_ATTEMPTS
+ *  The number of times each name server is asked, unless resolv.conf sets
+ *  its own.
+ */
+#define RESOLVER_ATTEMPTS 2
+#endif
+#ifndef RESOLVER_NEGATIVE_TTL
+/** @def RESOLVER_NEGATIVE_TTL
+ *  The time (in seconds) names without records, and lookups which
+ *  failed, are cached.
+ */
+#define RESOLVER_NEGATIVE_TTL 30
+#endif
+
+/* TTL for answers which come without one (hosts file, system resolver) */
+#define RESOLVER_SYSTEM_TTL 60
+/* bounds for the TTL of cached answers; the lower bound makes sure waiting
+ * connections get to see a zero TTL answer before it expires */
+#define RESOLVER_MIN_TTL 5
+#define RESOLVER_MAX_TTL 86400
+/* how often (in milliseconds) expired entries are dropped from the cache */
+#define RESOLVER_SWEEP_INTERVAL 60000
+
+#define RESOLVER_MAX_NS 3
+#define RESOLVER_PORT 53
+/* advertised EDNS payload size, small enough to avoid fragmentation */
+#define RESOLVER_UDP_SIZE 1232
+#define RESOLVER_QUERY_MAX 512
+
+#define DNS_HEADER_LEN 12
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_TC 0x0200
+#define DNS_FLAG_RD 0x0100
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_CLASS_IN 1
+#define DNS_TYPE_OPT 41
+
+typedef enum {
+    RESOLVER_QUERY_SRV,
+    RESOLVER_QUERY_ADDR
+} resolver_query_type_t;
+
+typedef struct _resolver_query_t resolver_query_t;
+
+struct _resolver_query_t {
+    resolver_t *resolver;
+    resolver_query_type_t type;
+    char *name;
+    resolver_status_t status;
+    uint64_t expire;
+    resolver_result_t result;
+
+    /* state of the query in flight; an address query asks for A and AAAA
+     * records in two questions, a SRV query uses the first one only */
+    sock_t sock;
+    unsigned short id[2];
+    int outstanding; /* bitmask of unanswered questions */
+    int attempt;
+    uint64_t sent;
+    resolver_query_t *next; /* pending list */
+};
+
+struct _resolver_t {
+    xmpp_ctx_t *ctx;
+    hash_t *cache;
+    resolver_query_t *pending;
+
+    struct sockaddr_storage ns[RESOLVER_MAX_NS];
+    socklen_t ns_len[RESOLVER_MAX_NS];
+    int ns_count;
+    uint64_t timeout;
+    int attempts;
+
+    uint64_t last_sweep;
+    resolver_addr_t literal;
+};
+
+static void _query_free(const xmpp_ctx_t * const ctx, void *p);
+static void _query_complete(resolver_query_t *q);
+
+/* ASCII case-insensitive compare, ignoring a trailing dot */
+static int _name_equal(const char *a, const char *b)
+{
+    char ca, cb;
+
+    for (; *a && *b; ++a, ++b) {
+        ca = (*a >= 'A' && *a <= 'Z') ? *a - 'A' + 'a' : *a;
+        cb = (*b >= 'A' && *b <= 'Z') ? *b - 'A' + 'a' : *b;
+        if (ca != cb) return 0;
+    }
+    if (*a == '.') ++a;
+    if (*b == '.') ++b;
+
+    return *a == '\0' && *b == '\0';
+}
+
+/* returns the next whitespace separated token of a config line */
+static char *_next_token(char **p)
+{
+    char *start = *p;
+
+    while (*start == ' ' || *start == '\t') ++start;
+    if (*start == '\0' || *start == '\r' || *start == '\n') return NULL;
+    *p = start;
+    while (**p && **p != ' ' && **p != '\t' && **p != '\r' && **p != '\n')
+        ++*p;
+    if (**p) *(*p)++ = '\0';
+
+    return start;
+}
+
+static int _parse_literal(const char *host, resolver_addr_t *addr)
+{
+    if (inet_pton(AF_INET, host, addr->addr) == 1) {
+        addr->family = AF_INET;
+        return 1;
+    }
+    if (inet_pton(AF_INET6, host, addr->addr) == 1) {
+        addr->family = AF_INET6;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void _resolver_add_ns(resolver_t *resolver, const char *host)
+{
+    struct sockaddr_storage *ss = &resolver->ns[resolver->ns_count];
+    struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+    resolver_addr_t addr;
+
+    if (!_parse_literal(host, &addr)) return;
+
+    memset(ss, 0, sizeof(*ss));
+    if (addr.family == AF_INET) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(RESOLVER_PORT);
+        memcpy(&sin->sin_addr, addr.addr, 4);
+        resolver->ns_len[resolver->ns_count] = sizeof(*sin);
+    } else {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(RESOLVER_PORT);
+        memcpy(&sin6->sin6_addr, addr.addr, 16);
+        resolver->ns_len[resolver->ns_count] = sizeof(*sin6);
+    }
+    resolver->ns_count++;
+}
+
+/* picks up name servers and retransmission options from resolv.conf */
+static void _resolver_read_conf(resolver_t *resolver)
+{
+    FILE *f;
+    char line[256];
+    char *p, *tok;
+    int val;
+
+    f = fopen(RESOLV_CONF, "r");
+    if (!f) return;
+
+    while (fgets(line, sizeof(line), f)) {
+        p = line;
+        tok = _next_token(&p);
+        if (!tok) continue;
+        if (strcmp(tok, "nameserver") == 0) {
+            tok = _next_token(&p);
+            if (tok && resolver->ns_count < RESOLVER_MAX_NS)
+                _resolver_add_ns(resolver, tok);
+        } else if (strcmp(tok, "options") == 0) {
+            while ((tok = _next_token(&p))) {
+                if (strncmp(tok, "timeout:", 8) == 0) {
+                    val = atoi(tok + 8);
+                    if (val > 0) resolver->timeout = val * 1000;
+                } else if (strncmp(tok, "attempts:", 9) == 0) {
+                    val = atoi(tok + 9);
+                    if (val > 0) resolver->attempts = val;
+                }
+            }
+        }
+    }
+    fclose(f);
+}
+
+/** Create a resolver for a Strophe context.
+ *
+ *  @param ctx a Strophe context object
+ *
+ *  @return a new resolver or NULL on an error
+ */
+resolver_t *resolver_new(xmpp_ctx_t * const ctx)
+{
+    resolver_t *resolver;
+
+    resolver = xmpp_alloc(ctx, sizeof(*resolver));
+    if (!resolver) return NULL;
+
+    memset(resolver, 0, sizeof(*resolver));
+    resolver->ctx = ctx;
+    resolver->timeout = RESOLVER_TIMEOUT;
+    resolver->attempts = RESOLVER_ATTEMPTS;
+    resolver->cache = hash_new(ctx, 64, _query_free);
+    if (!resolver->cache) {
+        xmpp_free(ctx, resolver);
+        return NULL;
+    }
+    resolver->last_sweep = time_stamp();
+    _resolver_read_conf(resolver);
+    if (resolver->ns_count == 0)
+        xmpp_debug(ctx, "resolver", "No name servers in %s, using the "
+                   "system resolver.", RESOLV_CONF);
+
+    return resolver;
+}
+
+/** Free a resolver, cancelling the queries in flight.
+ *
+ *  @param resolver a resolver
+ */
+void resolver_free(resolver_t *resolver)
+{
+    hash_release(resolver->cache);
+    xmpp_free(resolver->ctx, resolver);
+}
+
+/* adds an address, keeping IPv6 addresses ahead of IPv4 ones */
+static void _result_add_addr(xmpp_ctx_t * const ctx,
+                             resolver_result_t *result,
+                             int family, const unsigned char *addr)
+{
+    resolver_addr_t *addrs;
+    int i;
+
+    addrs = xmpp_realloc(ctx, result->addrs,
+                         (result->addr_count + 1) * sizeof(*addrs));
+    if (!addrs) return;
+
+    i = result->addr_count;
+    if (family == AF_INET6) {
+        for (i = 0; i < result->addr_count; ++i)
+            if (addrs[i].family != AF_INET6) break;
+        memmove(&addrs[i + 1], &addrs[i],
+                (result->addr_count - i) * sizeof(*addrs));
+    }
+    addrs[i].family = family;
+    memset(addrs[i].addr, 0, sizeof(addrs[i].addr));
+    memcpy(addrs[i].addr, addr, family == AF_INET6 ? 16 : 4);
+    result->addrs = addrs;
+    result->addr_count++;
+}
+
+/* inserts a SRV record behind the records of the same priority */
+static void _result_add_srv(resolver_result_t *result, resolver_srv_rr_t *rr)
+{
+    resolver_srv_rr_t **pos = &result->srv;
+
+    while (*pos && (*pos)->priority <= rr->priority)
+        pos = &(*pos)->next;
+    rr->next = *pos;
+    *pos = rr;
+}
+
+/* moves the records of src into dst */
+static void _result_merge(xmpp_ctx_t * const ctx,
+                          resolver_result_t *dst, resolver_result_t *src)
+{
+    resolver_srv_rr_t *rr;
+    int i;
+
+    while (src->srv) {
+        rr = src->srv;
+        src->srv = rr->next;
+        _result_add_srv(dst, rr);
+    }
+    for (i = 0; i < src->addr_count; ++i)
+        _result_add_addr(ctx, dst, src->addrs[i].family, src->addrs[i].addr);
+    if (src->ttl < dst->ttl) dst->ttl = src->ttl;
+    resolver_result_clear(ctx, src);
+}
+
+/** Release the records of a lookup result.
+ *
+ *  @param ctx a Strophe context object
+ *  @param result the result to clear
+ */
+void resolver_result_clear(xmpp_ctx_t * const ctx, resolver_result_t *result)
+{
+    resolver_srv_rr_t *rr;
+
+    while (result->srv) {
+        rr = result->srv;
+        result->srv = rr->next;
+        xmpp_free(ctx, rr);
+    }
+    if (result->addrs) xmpp_free(ctx, result->addrs);
+    result->addrs = NULL;
+    result->addr_count = 0;
+    result->ttl = RESOLVER_MAX_TTL;
+}
+
+static unsigned int _get16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static unsigned long _get32(const unsigned char *p)
+{
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+           ((unsigned long)p[2] << 8) | p[3];
+}
+
+static void _put16(unsigned char *p, unsigned int v)
+{
+    p[0] = (v >> 8) & 0xff;
+    p[1] = v & 0xff;
+}
+
+/* reads a possibly compressed domain name at *off and moves *off past it */
+static int _dns_read_name(const unsigned char *buf, size_t len, size_t *off,
+                          char *name, size_t namelen)
+{
+    size_t pos = *off;
+    size_t out = 0;
+    unsigned int c;
+    int jumps = 0;
+
+    while (1) {
+        if (pos >= len) return -1;
+        c = buf[pos];
+        if ((c & 0xc0) == 0xc0) {
+            /* compression pointer; bound the number of jumps so loops in
+             * a malicious reply can't hang us */
+            if (pos + 1 >= len || ++jumps > 16) return -1;
+            if (jumps == 1) *off = pos + 2;
+            pos = ((c & 0x3f) << 8) | buf[pos + 1];
+            continue;
+        }
+        if (c & 0xc0) return -1;
+        ++pos;
+        if (c == 0) break;
+        if (pos + c > len || out + c + 2 > namelen) return -1;
+        if (out > 0) name[out++] = '.';
+        memcpy(&name[out], &buf[pos], c);
+        out += c;
+        pos += c;
+    }
+    name[out] = '\0';
+    if (jumps == 0) *off = pos;
+
+    return 0;
+}
+
+/** Build a recursive DNS query with an EDNS0 OPT record.
+ *
+ *  @param buf the buffer for the query
+ *  @param buflen the size of buf
+ *  @param id the query id
+ *  @param name the domain name to look up
+ *  @param type the record type to ask for
+ *
+ *  @return the length of the query or 0 if name is not a valid domain name
+ *      or buf is too small
+ */
+size_t resolver_build_query(unsigned char *buf, size_t buflen,
+                            unsigned short id, const char *name, int type)
+{
+    size_t off = DNS_HEADER_LEN;
+    size_t label;
+    const char *p = name;
+
+    /* header + name + question + OPT record */
+    if (*name == '\0' || strlen(name) > RESOLVER_MAX_DOMAIN - 3 ||
+        buflen < DNS_HEADER_LEN + strlen(name) + 2 + 4 + 11)
+        return 0;
+
+    memset(buf, 0, DNS_HEADER_LEN);
+    _put16(&buf[0], id);
+    _put16(&buf[2], DNS_FLAG_RD);
+    _put16(&buf[4], 1); /* qdcount */
+    _put16(&buf[10], 1); /* arcount */
+
+    while (*p) {
+        label = strcspn(p, ".");
+        if (label == 0 || label > 63) return 0;
+        buf[off++] = (unsigned char)label;
+        memcpy(&buf[off], p, label);
+        off += label;
+        p += label;
+        if (*p == '.') ++p;
+    }
+    buf[off++] = 0;
+    _put16(&buf[off], type);
+    _put16(&buf[off + 2], DNS_CLASS_IN);
+    off += 4;
+
+    /* OPT pseudo record: root name, type, payload size, ttl, rdlength */
+    buf[off++] = 0;
+    _put16(&buf[off], DNS_TYPE_OPT);
+    _put16(&buf[off + 2], RESOLVER_UDP_SIZE);
+    memset(&buf[off + 4], 0, 6);
+    off += 10;
+
+    return off;
+}
+
+/** Parse the reply to a DNS query.
+ *  The records of the requested type in the answer section are stored in
+ *  result.  A truncated reply yields the records it holds completely.
+ *
+ *  @param ctx a Strophe context object
+ *  @param buf the reply
+ *  @param len the length of the reply
+ *  @param name the domain name which was queried
+ *  @param type the record type which was queried
+ *  @param result the result to fill in
+ *
+ *  @return the response code of the reply or -1 if the reply is malformed
+ *      or doesn't answer the question
+ */
+int resolver_parse_reply(xmpp_ctx_t * const ctx,
+                         const unsigned char *buf, size_t len,
+                         const char *name, int type,
+                         resolver_result_t *result)
+{
+    char rname[RESOLVER_MAX_DOMAIN];
+    resolver_srv_rr_t *rr;
+    unsigned int flags, ancount, rtype, rclass, rdlen;
+    unsigned long ttl;
+    size_t off, roff;
+    unsigned int i;
+
+    memset(result, 0, sizeof(*result));
+    result->ttl = RESOLVER_MAX_TTL;
+
+    if (len < DNS_HEADER_LEN) return -1;
+    flags = _get16(&buf[2]);
+    ancount = _get16(&buf[6]);
+    if (!(flags & DNS_FLAG_QR) || _get16(&buf[4]) != 1) return -1;
+
+    off = DNS_HEADER_LEN;
+    if (_dns_read_name(buf, len, &off, rname, sizeof(rname)) != 0 ||
+        off + 4 > len || !_name_equal(rname, name) ||
+        _get16(&buf[off]) != (unsigned int)type)
+        return -1;
+    off += 4;
+
+    for (i = 0; i < ancount; ++i) {
+        if (_dns_read_name(buf, len, &off, rname, sizeof(rname)) != 0 ||
+            off + 10 > len)
+            break;
+        rtype = _get16(&buf[off]);
+        rclass = _get16(&buf[off + 2]);
+        ttl = _get32(&buf[off + 4]);
+        rdlen = _get16(&buf[off + 8]);
+        off += 10;
+        if (off + rdlen > len) break;
+
+        /* CNAMEs are followed by the records of their target, so any
+         * record of the right type belongs to the answer */
+        if (rclass == DNS_CLASS_IN && rtype == (unsigned int)type) {
+            if (type == RESOLVER_TYPE_SRV && rdlen > 6) {
+                roff = off + 6;
+                rr = xmpp_alloc(ctx, sizeof(*rr));
+                if (!rr) break;
+                rr->priority = _get16(&buf[off]);
+                rr->weight = _get16(&buf[off + 2]);
+                rr->port = _get16(&buf[off + 4]);
+                if (_dns_read_name(buf, len, &roff, rr->target,
+                                   sizeof(rr->target)) != 0 ||
+                    rr->target[0] == '\0') {
+                    /* a target of "." means the service isn't offered */
+                    xmpp_free(ctx, rr);
+                } else {
+                    _result_add_srv(result, rr);
+                }
+            } else if (type == RESOLVER_TYPE_A && rdlen == 4) {
+                _result_add_addr(ctx, result, AF_INET, &buf[off]);
+            } else if (type == RESOLVER_TYPE_AAAA && rdlen == 16) {
+                _result_add_addr(ctx, result, AF_INET6, &buf[off]);
+            }
+            if (ttl < result->ttl) result->ttl = ttl;
+        }
+        off += rdlen;
+    }
+
+    if (i < ancount && !(flags & DNS_FLAG_TC)) {
+        /* reply ends early without being marked as truncated */
+        resolver_result_clear(ctx, result);
+        return -1;
+    }
+
+    return flags & 0x000f;
+}
+
+static int _query_qtype(resolver_query_t *q, int question)
+{
+    if (q->type == RESOLVER_QUERY_SRV) return RESOLVER_TYPE_SRV;
+    return question == 0 ? RESOLVER_TYPE_A : RESOLVER_TYPE_AAAA;
+}
+
+static void _query_free(const xmpp_ctx_t * const ctx, void *p)
+{
+    resolver_query_t *q = (resolver_query_t *)p;
+
+    if (q->sock != -1) sock_close(q->sock);
+    resolver_result_clear(q->resolver->ctx, &q->result);
+    xmpp_free(ctx, q->name);
+    xmpp_free(ctx, q);
+}
+
+/* sends the unanswered questions to the next name server, returns -1 once
+ * every server has been asked often enough */
+static int _query_send(resolver_query_t *q)
+{
+    resolver_t *resolver = q->resolver;
+    unsigned char buf[RESOLVER_QUERY_MAX];
+    size_t len;
+    int ns, i;
+
+    if (q->sock != -1) {
+        sock_close(q->sock);
+        q->sock = -1;
+    }
+
+    while (q->attempt < resolver->ns_count * resolver->attempts) {
+        ns = q->attempt++ % resolver->ns_count;
+        /* a fresh socket per attempt gets a fresh source port */
+        q->sock = socket(resolver->ns[ns].ss_family, SOCK_DGRAM, IPPROTO_UDP);
+        if (q->sock < 0) {
+            q->sock = -1;
+            continue;
+        }
+        if (sock_set_nonblocking(q->sock) != 0 ||
+            connect(q->sock, (struct sockaddr *)&resolver->ns[ns],
+                    resolver->ns_len[ns]) != 0) {
+            sock_close(q->sock);
+            q->sock = -1;
+            continue;
+        }
+
+        for (i = 0; i < 2; ++i) {
+            if (!(q->outstanding & (1 << i))) continue;
+            do {
+                q->id[i] = (unsigned short)xmpp_rand(resolver->ctx);
+            } while (i == 1 && q->id[1] == q->id[0]);
+            len = resolver_build_query(buf, sizeof(buf), q->id[i], q->name,
+                                       _query_qtype(q, i));
+            if (len == 0) return -1;
+            /* a lost datagram is dealt with by the retransmission timer */
+            send(q->sock, (char *)buf, len, 0);
+        }
+        q->sent = time_stamp();
+        return 0;
+    }
+
+    return -1;
+}
+
+static void _query_start(resolver_query_t *q)
+{
+    q->outstanding = q->type == RESOLVER_QUERY_SRV ? 0x1 : 0x3;
+    q->next = q->resolver->pending;
+    q->resolver->pending = q;
+
+    xmpp_debug(q->resolver->ctx, "resolver", "Looking up %s records for %s",
+               q->type == RESOLVER_QUERY_SRV ? "SRV" : "address", q->name);
+    if (_query_send(q) != 0)
+        _query_complete(q);
+}
+
+static void _system_srv(resolver_query_t *q, const char *service,
+                        const char *proto, const char *domain)
+{
+    resolver_srv_rr_t *rr;
+    int port;
+
+    rr = xmpp_alloc(q->resolver->ctx, sizeof(*rr));
+    if (!rr) return;
+    memset(rr, 0, sizeof(*rr));
+    if (sock_srv_lookup(service, proto, domain, rr->target,
+                        sizeof(rr->target), &port)) {
+        rr->port = (unsigned short)port;
+        _result_add_srv(&q->result, rr);
+        q->result.ttl = RESOLVER_SYSTEM_TTL;
+    } else {
+        xmpp_free(q->resolver->ctx, rr);
+    }
+}
+
+static void _system_addr(resolver_query_t *q)
+{
+    struct addrinfo hints, *res, *ai;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(q->name, NULL, &hints, &res) != 0) return;
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET)
+            _result_add_addr(q->resolver->ctx, &q->result, AF_INET,
+                (unsigned char *)&((struct sockaddr_in *)ai->ai_addr)->sin_addr);
+        else if (ai->ai_family == AF_INET6)
+            _result_add_addr(q->resolver->ctx, &q->result, AF_INET6,
+                (unsigned char *)&((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr);
+    }
+    freeaddrinfo(res);
+    q->result.ttl = RESOLVER_SYSTEM_TTL;
+}
+
+static int _hosts_lookup(resolver_query_t *q)
+{
+    FILE *f;
+    char line[512];
+    char *p, *addr, *name;
+    resolver_addr_t a;
+
+    f = fopen(HOSTS_FILE, "r");
+    if (!f) return 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        p = strchr(line, '#');
+        if (p) *p = '\0';
+        p = line;
+        addr = _next_token(&p);
+        if (!addr || !_parse_literal(addr, &a)) continue;
+        while ((name = _next_token(&p))) {
+            if (_name_equal(name, q->name)) {
+                _result_add_addr(q->resolver->ctx, &q->result,
+                                 a.family, a.addr);
+                break;
+            }
+        }
+    }
+    fclose(f);
+    q->result.ttl = RESOLVER_SYSTEM_TTL;
+
+    return q->result.addr_count > 0;
+}
+
+static void _query_complete(resolver_query_t *q)
+{
+    resolver_t *resolver = q->resolver;
+    resolver_query_t **pos;
+    unsigned int ttl;
+
+    for (pos = &resolver->pending; *pos; pos = &(*pos)->next) {
+        if (*pos == q) {
+            *pos = q->next;
+            break;
+        }
+    }
+    q->next = NULL;
+    if (q->sock != -1) {
+        sock_close(q->sock);
+        q->sock = -1;
+    }
+
+    /* a name without addresses in DNS is not looked up again through the
+     * system resolver, which would block the event loop; it is only used
+     * when no name servers are configured */
+    if (q->result.srv || q->result.addr_count) {
+        q->status = RESOLVER_FOUND;
+        ttl = q->result.ttl;
+        if (ttl < RESOLVER_MIN_TTL) ttl = RESOLVER_MIN_TTL;
+    } else {
+        q->status = RESOLVER_NOTFOUND;
+        ttl = RESOLVER_NEGATIVE_TTL;
+    }
+    q->expire = time_stamp() + (uint64_t)ttl * 1000;
+
+    xmpp_debug(resolver->ctx, "resolver", "%s %s, cached for %u seconds",
+               q->name, q->status == RESOLVER_FOUND ? "resolved" :
+               "not found", ttl);
+}
+
+/* finds a cached or pending query, or sets up a new one */
+static resolver_query_t *_resolver_get(resolver_t *resolver,
+                                       resolver_query_type_t type,
+                                       const char *name, int *created)
+{
+    resolver_query_t *q;
+    char key[RESOLVER_MAX_DOMAIN + 2];
+    size_t len, i;
+
+    *created = 0;
+    len = strlen(name);
+    if (len > 0 && name[len - 1] == '.') --len;
+    if (len == 0 || len >= RESOLVER_MAX_DOMAIN - 2) return NULL;
+
+    key[0] = type == RESOLVER_QUERY_SRV ? 'S' : 'A';
+    key[1] = ':';
+    for (i = 0; i < len; ++i)
+        key[i + 2] = (name[i] >= 'A' && name[i] <= 'Z') ?
+                     name[i] - 'A' + 'a' : name[i];
+    key[len + 2] = '\0';
+
+    q = hash_get(resolver->cache, key);
+    if (q && (q->status == RESOLVER_PENDING || q->expire > time_stamp()))
+        return q;
+
+    q = xmpp_alloc(resolver->ctx, sizeof(*q));
+    if (!q) return NULL;
+    memset(q, 0, sizeof(*q));
+    q->resolver = resolver;
+    q->type = type;
+    q->status = RESOLVER_PENDING;
+    q->sock = -1;
+    q->result.ttl = RESOLVER_MAX_TTL;
+    q->name = xmpp_strdup(resolver->ctx, &key[2]);
+    if (!q->name) {
+        xmpp_free(resolver->ctx, q);
+        return NULL;
+    }
+    /* replaces the expired entry, if any */
+    if (hash_add(resolver->cache, key, q) != 0) {
+        _query_free(resolver->ctx, q);
+        return NULL;
+    }
+    *created = 1;
+
+    return q;
+}
+
+/** Look up the SRV records of a service.
+ *
+ *  @param resolver a resolver
+ *  @param service the service name, e.g. "xmpp-client"
+ *  @param proto the protocol, e.g. "tcp"
+ *  @param domain the domain offering the service
+ *  @param srv set to the records, sorted by priority, if they are found
+ *
+ *  @return RESOLVER_PENDING while the lookup is in progress, otherwise
+ *      RESOLVER_FOUND or RESOLVER_NOTFOUND
+ */
+resolver_status_t resolver_srv_lookup(resolver_t *resolver,
+                                      const char *service, const char *proto,
+                                      const char *domain,
+                                      const resolver_srv_rr_t **srv)
+{
+    char name[RESOLVER_MAX_DOMAIN];
+    resolver_query_t *q;
+    int created, len;
+
+    *srv = NULL;
+    /* a name cut short would be looked up and cached as another one */
+    len = xmpp_snprintf(name, sizeof(name), "_%s._%s.%s", service, proto,
+                        domain);
+    if (len < 0 || (size_t)len >= sizeof(name)) return RESOLVER_NOTFOUND;
+    q = _resolver_get(resolver, RESOLVER_QUERY_SRV, name, &created);
+    if (!q) return RESOLVER_NOTFOUND;
+
+    if (created) {
+        if (resolver->ns_count > 0) {
+            _query_start(q);
+        } else {
+            _system_srv(q, service, proto, domain);
+            _query_complete(q);
+        }
+    }
+    if (q->status == RESOLVER_FOUND) *srv = q->result.srv;
+
+    return q->status;
+}
+
+/** Order SRV records for connection attempts as described in RFC 2782.
+ *  The records are tried in order of priority.  Within a priority, each
+ *  record is picked at random with a chance proportional to its weight,
+ *  so connections spread over the targets as the domain intends.
+ *
+ *  @param ctx a Strophe context object
+ *  @param srv the records sorted by priority, as returned by
+ *      resolver_srv_lookup()
+ *
+ *  @return a copy of the records in the order they should be tried, which
+ *      must be released with resolver_srv_free(), or NULL on an error
+ */
+resolver_srv_rr_t *resolver_srv_select(xmpp_ctx_t * const ctx,
+                                       const resolver_srv_rr_t *srv)
+{
+    resolver_srv_rr_t *head = NULL, **tail = &head;
+    resolver_srv_rr_t *group, **gtail, *rr, **pos;
+    unsigned long sum, pick;
+    unsigned short priority;
+
+    while (srv) {
+        /* copy one priority group, records of weight 0 go first */
+        group = NULL;
+        gtail = &group;
+        priority = srv->priority;
+        for (; srv && srv->priority == priority; srv = srv->next) {
+            rr = xmpp_alloc(ctx, sizeof(*rr));
+            if (!rr) {
+                resolver_srv_free(ctx, group);
+                resolver_srv_free(ctx, head);
+                return NULL;
+            }
+            memcpy(rr, srv, sizeof(*rr));
+            if (rr->weight == 0) {
+                rr->next = group;
+                if (gtail == &group) gtail = &rr->next;
+                group = rr;
+            } else {
+                rr->next = NULL;
+                *gtail = rr;
+                gtail = &rr->next;
+            }
+        }
+
+        /* pick a random number in [0, sum of weights] and take the first
+         * record whose running sum of weights reaches it */
+        while (group) {
+            sum = 0;
+            for (rr = group; rr; rr = rr->next)
+                sum += rr->weight;
+            pick = sum ? (unsigned int)xmpp_rand(ctx) % (sum + 1) : 0;
+
+            sum = 0;
+            for (pos = &group; (*pos)->next; pos = &(*pos)->next) {
+                sum += (*pos)->weight;
+                if (sum >= pick) break;
+            }
+            rr = *pos;
+            *pos = rr->next;
+            rr->next = NULL;
+            *tail = rr;
+            tail = &rr->next;
+        }
+    }
+
+    return head;
+}
+
+/** Release a list of SRV records returned by resolver_srv_select().
+ *
+ *  @param ctx a Strophe context object
+ *  @param srv the records
+ */
+void resolver_srv_free(xmpp_ctx_t * const ctx, resolver_srv_rr_t *srv)
+{
+    resolver_srv_rr_t *rr;
+
+    while (srv) {
+        rr = srv;
+        srv = rr->next;
+        xmpp_free(ctx, rr);
+    }
+}
+
+/** Look up the addresses of a host.
+ *  IP address literals are returned as they are and the hosts file takes
+ *  precedence over DNS.
+ *
+ *  @param resolver a resolver
+ *  @param host the host name
+ *  @param addrs set to the addresses, IPv6 first, if they are found
+ *  @param count set to the number of addresses
+ *
+ *  @return RESOLVER_PENDING while the lookup is in progress, otherwise
+ *      RESOLVER_FOUND or RESOLVER_NOTFOUND
+ */
+resolver_status_t resolver_addr_lookup(resolver_t *resolver,
+                                       const char *host,
+                                       const resolver_addr_t **addrs,
+                                       int *count)
+{
+    resolver_query_t *q;
+    int created;
+
+    *addrs = NULL;
+    *count = 0;
+    if (_parse_literal(host, &resolver->literal)) {
+        *addrs = &resolver->literal;
+        *count = 1;
+        return RESOLVER_FOUND;
+    }
+
+    q = _resolver_get(resolver, RESOLVER_QUERY_ADDR, host, &created);
+    if (!q) return RESOLVER_NOTFOUND;
+
+    if (created) {
+        if (_hosts_lookup(q)) {
+            _query_complete(q);
+        } else if (resolver->ns_count > 0) {
+            _query_start(q);
+        } else {
+            _system_addr(q);
+            _query_complete(q);
+        }
+    }
+    if (q->status == RESOLVER_FOUND) {
+        *addrs = q->result.addrs;
+        *count = q->result.addr_count;
+    }
+
+    return q->status;
+}
+
+/* reads the replies which arrived for a query */
+static void _query_read(resolver_query_t *q)
+{
+    xmpp_ctx_t *ctx = q->resolver->ctx;
+    unsigned char buf[RESOLVER_UDP_SIZE];
+    resolver_result_t result;
+    unsigned int id;
+    int len, rcode, i;
+
+    while (q->status == RESOLVER_PENDING) {
+        len = recv(q->sock, (char *)buf, sizeof(buf), 0);
+        if (len < 0) {
+            /* e.g. port unreachable, no point in waiting for this server */
+            if (!sock_is_recoverable(sock_error()) && _query_send(q) != 0)
+                _query_complete(q);
+            break;
+        }
+        if (len < 2) continue;
+
+        /* drop replies to earlier attempts and spoofed ones */
+        id = _get16(buf);
+        for (i = 0; i < 2; ++i)
+            if ((q->outstanding & (1 << i)) && q->id[i] == id) break;
+        if (i == 2) continue;
+
+        rcode = resolver_parse_reply(ctx, buf, len, q->name,
+                                     _query_qtype(q, i), &result);
+        if (rcode < 0) {
+            xmpp_debug(ctx, "resolver", "Ignoring malformed reply for %s",
+                       q->name);
+            continue;
+        }
+        if (rcode == DNS_RCODE_NOERROR || rcode == DNS_RCODE_NXDOMAIN) {
+            _result_merge(ctx, &q->result, &result);
+            q->outstanding &= ~(1 << i);
+            if (!q->outstanding) _query_complete(q);
+        } else {
+            /* the server failed or refused, ask the next one right away */
+            xmpp_debug(ctx, "resolver", "Name server error %d for %s",
+                       rcode, q->name);
+            resolver_result_clear(ctx, &result);
+            if (_query_send(q) != 0) _query_complete(q);
+        }
+    }
+}
+
+/** Add the sockets of the queries in flight to a read set.
+ *
+ *  @param resolver a resolver
+ *  @param rfds the read set
+ *  @param max updated to the highest socket in the set
+ */
+void resolver_fdset(resolver_t *resolver, fd_set *rfds, sock_t *max)
+{
+    resolver_query_t *q;
+
+    for (q = resolver->pending; q; q = q->next) {
+        FD_SET(q->sock, rfds);
+        if (q->sock > *max) *max = q->sock;
+    }
+}
+
+/** Get the time until the resolver needs to retransmit a query.
+ *
+ *  @param resolver a resolver
+ *
+ *  @return the time in milliseconds
+ */
+uint64_t resolver_timeout(resolver_t *resolver)
+{
+    resolver_query_t *q;
+    uint64_t now = time_stamp();
+    uint64_t next = (uint64_t)-1;
+    uint64_t elapsed;
+
+    for (q = resolver->pending; q; q = q->next) {
+        elapsed = time_elapsed(q->sent, now);
+        if (elapsed >= resolver->timeout) return 0;
+        if (resolver->timeout - elapsed < next)
+            next = resolver->timeout - elapsed;
+    }
+
+    return next;
+}
+
+/* drops expired answers from the cache */
+static void _resolver_sweep(resolver_t *resolver)
+{
+    xmpp_ctx_t *ctx = resolver->ctx;
+    hash_iterator_t *iter;
+    resolver_query_t *q;
+    const char *key;
+    char **expired;
+    uint64_t now = time_stamp();
+    int n = 0;
+
+    expired = xmpp_alloc(ctx, hash_num_keys(resolver->cache) * sizeof(char *));
+    iter = hash_iter_new(resolver->cache);
+    if (!expired || !iter) {
+        if (expired) xmpp_free(ctx, expired);
+        if (iter) hash_iter_release(iter);
+        return;
+    }
+    while ((key = hash_iter_next(iter))) {
+        q = hash_get(resolver->cache, key);
+        if (q->status != RESOLVER_PENDING && q->expire <= now)
+            expired[n++] = xmpp_strdup(ctx, key);
+    }
+    hash_iter_release(iter);
+
+    while (n > 0) {
+        if (expired[--n]) {
+            hash_drop(resolver->cache, expired[n]);
+            xmpp_free(ctx, expired[n]);
+        }
+    }
+    xmpp_free(ctx, expired);
+}
+
+/** Process replies and retransmissions of the queries in flight.
+ *  This is called by the event loop after select().
+ *
+ *  @param resolver a resolver
+ *  @param rfds the read set returned by select()
+ */
+void resolver_process(resolver_t *resolver, fd_set *rfds)
+{
+    resolver_query_t *q, *next;
+
+    for (q = resolver->pending; q; q = next) {
+        next = q->next;
+        if (FD_ISSET(q->sock, rfds))
+            _query_read(q);
+        if (q->status != RESOLVER_PENDING) continue;
+
+        if (time_elapsed(q->sent, time_stamp()) >= resolver->timeout) {
+            xmpp_debug(resolver->ctx, "resolver",
+                       "Lookup of %s timed out, retrying.", q->name);
+            if (_query_send(q) != 0) _query_complete(q);
+        }
+    }
+
+    if (time_elapsed(resolver->last_sweep, time_stamp()) >=
+        RESOLVER_SWEEP_INTERVAL) {
+        _resolver_sweep(resolver);
+        resolver->last_sweep = time_stamp();
+    }
+}
@@ -0,0 +1,99 @@
+/* resolver.h
+** strophe XMPP client library -- DNS resolver
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/** @file
+ *  Asynchronous DNS resolver API.
+ */
+
+#ifndef __LIBSTROPHE_RESOLVER_H__
+#define __LIBSTROPHE_RESOLVER_H__
+
+#ifndef _WIN32
+#include <sys/select.h>
+#else
+#include <winsock2.h>
+#endif
+
+#include "strophe.h"
+#include "ostypes.h"
+#include "sock.h"
+
+/* buffer size for a domain name in presentation format */
+#define RESOLVER_MAX_DOMAIN 256
+
+/* DNS record types */
+#define RESOLVER_TYPE_A 1
+#define RESOLVER_TYPE_AAAA 28
+#define RESOLVER_TYPE_SRV 33
+
+typedef enum {
+    RESOLVER_PENDING,
+    RESOLVER_FOUND,
+    RESOLVER_NOTFOUND
+} resolver_status_t;
+
+typedef struct _resolver_srv_rr_t resolver_srv_rr_t;
+struct _resolver_srv_rr_t {
+    unsigned short priority;
+    unsigned short weight;
+    unsigned short port;
+    char target[RESOLVER_MAX_DOMAIN];
+    resolver_srv_rr_t *next;
+};
+
+typedef struct _resolver_addr_t {
+    int family; /* AF_INET or AF_INET6 */
+    unsigned char addr[16]; /* network byte order */
+} resolver_addr_t;
+
+typedef struct _resolver_result_t {
+    resolver_srv_rr_t *srv; /* sorted by priority */
+    resolver_addr_t *addrs; /* IPv6 addresses first */
+    int addr_count;
+    unsigned int ttl; /* smallest TTL of the records, in seconds */
+} resolver_result_t;
+
+typedef struct _resolver_t resolver_t;
+
+resolver_t *resolver_new(xmpp_ctx_t * const ctx);
+void resolver_free(resolver_t *resolver);
+
+/* lookups return RESOLVER_PENDING until the answer is known, the caller
+ * polls again from the event loop.  results are owned by the resolver and
+ * stay valid until the next call into it. */
+resolver_status_t resolver_srv_lookup(resolver_t *resolver,
+                                      const char *service, const char *proto,
+                                      const char *domain,
+                                      const resolver_srv_rr_t **srv);
+resolver_status_t resolver_addr_lookup(resolver_t *resolver,
+                                       const char *host,
+                                       const resolver_addr_t **addrs,
+                                       int *count);
+
+resolver_srv_rr_t *resolver_srv_select(xmpp_ctx_t * const ctx,
+                                       const resolver_srv_rr_t *srv);
+void resolver_srv_free(xmpp_ctx_t * const ctx, resolver_srv_rr_t *srv);
+
+/* event loop integration */
+void resolver_fdset(resolver_t *resolver, fd_set *rfds, sock_t *max);
+uint64_t resolver_timeout(resolver_t *resolver);
+void resolver_process(resolver_t *resolver, fd_set *rfds);
+
+/* DNS message handling */
+size_t resolver_build_query(unsigned char *buf, size_t buflen,
+                            unsigned short id, const char *name, int type);
+int resolver_parse_reply(xmpp_ctx_t * const ctx,
+                         const unsigned char *buf, size_t len,
+                         const char *name, int type,
+                         resolver_result_t *result);
+void resolver_result_clear(xmpp_ctx_t * const ctx, resolver_result_t *result);
+
+#endif /* __LIBSTROPHE_RESOLVER_H__ */
@@ -22,8 +22,14 @@
 #include "sasl.h"
 #include "md5.h"
 #include "sha1.h"
+#include "sha256.h"
 #include "scram.h"
 #include "rand.h"
+#include "cpu.h"
+
+#if defined(CPU_X86_SSSE3) || defined(CPU_X86_AVX2)
+#include <immintrin.h>
+#endif
 
 #ifdef _WIN32
 #define strtok_r strtok_s
@@ -54,6 +60,58 @@ char *sasl_plain(xmpp_ctx_t *ctx, const char *authid, const char *password) {
     return result;
 }
 
+/* HMAC of the channel binding data, which is empty for -NONE, keyed with
+ * the token */
+static void _ht_sha256_hash(const char *token, const char *label,
+                            uint8_t *hash)
+{
+    crypto_HMAC_SHA256((uint8_t *)token, strlen(token), (uint8_t *)label,
+                       strlen(label), hash);
+}
+
+/** generate the initial response for the SASL HT-SHA-256-NONE mechanism */
+char *sasl_ht_sha256(xmpp_ctx_t *ctx, const char *authid, const char *token)
+{
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    size_t idlen;
+    char *result = NULL;
+    unsigned char *msg;
+
+    /* our message is Base64(authid,\0,HMAC(token,"Initiator")) */
+    _ht_sha256_hash(token, "Initiator", hash);
+    idlen = strlen(authid);
+    msg = xmpp_alloc(ctx, idlen + 1 + sizeof(hash));
+    if (msg != NULL) {
+	memcpy(msg, authid, idlen);
+	msg[idlen] = '\0';
+	memcpy(msg + idlen + 1, hash, sizeof(hash));
+	result = base64_encode(ctx, msg, idlen + 1 + sizeof(hash));
+	xmpp_free(ctx, msg);
+    }
+
+    return result;
+}
+
+/** check that the server's additional data for HT-SHA-256-NONE proves it
+ *  knows the token, returns 0 if it does */
+int sasl_ht_sha256_verify(xmpp_ctx_t *ctx, const char *token,
+                          const char *data)
+{
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    unsigned char *reply;
+    int ret = -1;
+
+    reply = base64_decode(ctx, data, strlen(data));
+    if (!reply) return -1;
+    if (base64_decoded_len(ctx, data, strlen(data)) == sizeof(hash)) {
+	_ht_sha256_hash(token, "Responder", hash);
+	ret = memcmp(reply, hash, sizeof(hash)) == 0 ? 0 : -1;
+    }
+    xmpp_free(ctx, reply);
+
+    return ret;
+}
+
 /** helpers for digest auth */
 
 /* create a new, null-terminated string from a substring */
@@ -352,13 +410,13 @@ char *sasl_digest_md5(xmpp_ctx_t *ctx, const char *challenge,
     return response;
 }
 
-/** generate auth response string for the SASL SCRAM-SHA-1 mechanism */
-char *sasl_scram_sha1(xmpp_ctx_t *ctx, const char *challenge,
-                      const char *first_bare, const char *jid,
-                      const char *password)
+/** generate auth response string for the SASL SCRAM mechanisms */
+char *sasl_scram(xmpp_ctx_t *ctx, const scram_hash_t *alg,
+                 const char *challenge, const char *first_bare,
+                 const char *jid, const char *password)
 {
-    uint8_t key[SHA1_DIGEST_SIZE];
-    uint8_t sign[SHA1_DIGEST_SIZE];
+    uint8_t key[SCRAM_DIGEST_SIZE];
+    uint8_t sign[SCRAM_DIGEST_SIZE];
     char *r = NULL;
     char *s = NULL;
     char *i = NULL;
@@ -371,11 +429,10 @@ char *sasl_scram_sha1(xmpp_ctx_t *ctx, const char *challenge,
     char *response;
     char *auth;
     char *response_b64;
-    char *sign_b64;
     char *result = NULL;
     size_t response_len;
+    size_t len;
     size_t auth_len;
-    int j;
 
     tmp = xmpp_strdup(ctx, challenge);
     if (!tmp) {
@@ -411,7 +468,9 @@ char *sasl_scram_sha1(xmpp_ctx_t *ctx, const char *challenge,
         goto out_sval;
     }
 
-    response_len = 39 + strlen(r);
+    /* "c=biws," r ",p=" and the proof in base64 */
+    response_len = 7 + strlen(r) + 3 +
+                   xmpp_base64_encoded_len(alg->digest_size) + 1;
     response = xmpp_alloc(ctx, response_len);
     if (!response) {
         goto out_auth;
@@ -421,28 +480,20 @@ char *sasl_scram_sha1(xmpp_ctx_t *ctx, const char *challenge,
     xmpp_snprintf(auth, auth_len, "%s,%s,%s", first_bare + 3, challenge,
                   response);
 
-    SCRAM_SHA1_ClientKey((uint8_t *)password, strlen(password),
-                         (uint8_t *)sval, sval_len, (uint32_t)ival, key);
-    SCRAM_SHA1_ClientSignature(key, (uint8_t *)auth, strlen(auth), sign);
-    for (j = 0; j < SHA1_DIGEST_SIZE; j++) {
-        sign[j] ^= key[j];
-    }
+    SCRAM_ClientKeyCached(&ctx->scram_cache, alg,
+                          (uint8_t *)password, strlen(password),
+                          (uint8_t *)sval, sval_len, (uint32_t)ival, key);
+    SCRAM_ClientSignature(alg, key, (uint8_t *)auth, strlen(auth), sign);
+    SCRAM_ClientProof(alg, key, sign, sign);
 
-    sign_b64 = base64_encode(ctx, sign, sizeof(sign));
-    if (!sign_b64) {
-        goto out_response;
-    }
+    /* the proof goes straight into the space left for it */
+    len = strlen(response);
+    strcpy(response + len, ",p=");
+    len += 3;
+    len += xmpp_base64_encode(sign, alg->digest_size, response + len);
+    response[len] = '\0';
 
-    if (strlen(response) + strlen(sign_b64) + 3 + 1 > response_len) {
-        xmpp_free(ctx, sign_b64);
-        goto out_response;
-    }
-    strcat(response, ",p=");
-    strcat(response, sign_b64);
-    xmpp_free(ctx, sign_b64);
-
-    response_b64 = base64_encode(ctx, (unsigned char *)response,
-                                 strlen(response));
+    response_b64 = base64_encode(ctx, (unsigned char *)response, len);
     if (!response_b64) {
         goto out_response;
     }
@@ -460,7 +511,11 @@ out:
 }
 
 
-/** Base64 encoding routines. Implemented according to RFC 3548 */
+/** @defgroup Base64 Base64 encoding
+ *  Base64 encoding routines. Implemented according to RFC 3548.
+ *  They write to buffers supplied by the caller and use SSSE3 or AVX2
+ *  where the CPU has them.
+ */
 
 /** map of all byte values to the base64 values, or to
     '65' which indicates an invalid character. '=' is '64' */
@@ -497,170 +552,457 @@ static const char _base64_charmap[65] = {
     '='
 };
 
-int base64_encoded_len(xmpp_ctx_t *ctx, const unsigned len)
+#define _base64_value(c) _base64_invcharmap[(unsigned char)(c)]
+
+/* The vector code below encodes 12 or 24 bytes and decodes 16 or 32
+ * characters at a time, after W. Mula and D. Lemire, "Faster Base64
+ * Encoding and Decoding using AVX2 Instructions".  Each returns how much
+ * of the input it has done and leaves the rest to the scalar loops, which
+ * also find the errors the vector code stops at. */
+
+#ifdef CPU_X86_SSSE3
+__attribute__((target("ssse3")))
+static size_t _base64_encode_ssse3(const unsigned char *data, size_t len,
+                                   char *out)
+{
+    const __m128i split = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                       4, 5, 3, 4, 1, 2, 0, 1);
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '+' - 62,
+                                        '/' - 63, 'A', 0, 0);
+    __m128i x, t;
+    size_t i;
+
+    /* every load reads 16 bytes of which 12 are encoded */
+    for (i = 0; len - i >= 16; i += 12, out += 16) {
+        x = _mm_loadu_si128((const __m128i *)(data + i));
+        /* split 3 bytes of every 4 byte lane into four 6-bit values */
+        x = _mm_shuffle_epi8(x, split);
+        x = _mm_or_si128(
+            _mm_mulhi_epu16(_mm_and_si128(x, _mm_set1_epi32(0x0fc0fc00)),
+                            _mm_set1_epi32(0x04000040)),
+            _mm_mullo_epi16(_mm_and_si128(x, _mm_set1_epi32(0x003f03f0)),
+                            _mm_set1_epi32(0x01000010)));
+        /* pick the offset to the character from the range of the value */
+        t = _mm_subs_epu8(x, _mm_set1_epi8(51));
+        t = _mm_or_si128(t, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), x),
+                                          _mm_set1_epi8(13)));
+        x = _mm_add_epi8(x, _mm_shuffle_epi8(shift, t));
+        _mm_storeu_si128((__m128i *)out, x);
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t _base64_decode_ssse3(const char *base64, size_t len,
+                                   unsigned char *out)
+{
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,
+                                         0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+                                         0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+                                         0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                           0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                       14, 13, 12, -1, -1, -1, -1);
+    __m128i x, hi, lo;
+    size_t i;
+
+    /* every store writes 16 bytes of which 12 are decoded, so stop while
+     * at least 8 characters are left to the caller */
+    for (i = 0; len - i >= 24; i += 16, out += 12) {
+        x = _mm_loadu_si128((const __m128i *)(base64 + i));
+        hi = _mm_and_si128(_mm_srli_epi32(x, 4), _mm_set1_epi8(0x0f));
+        lo = _mm_and_si128(x, _mm_set1_epi8(0x0f));
+        /* the nibbles of valid characters have no class bit in common */
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo),
+                              _mm_shuffle_epi8(lut_hi, hi)),
+                _mm_setzero_si128())) != 0xFFFF)
+            break;
+        hi = _mm_add_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('/')), hi);
+        x = _mm_add_epi8(x, _mm_shuffle_epi8(lut_roll, hi));
+        /* join the 6-bit values into 3 byte groups */
+        x = _mm_maddubs_epi16(x, _mm_set1_epi32(0x01400140));
+        x = _mm_madd_epi16(x, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(x, pack));
+    }
+    return i;
+}
+#endif
+
+#ifdef CPU_X86_AVX2
+/* the same with 256 bit registers, which work as two 128 bit lanes */
+__attribute__((target("avx2")))
+static size_t _base64_encode_avx2(const unsigned char *data, size_t len,
+                                  char *out)
+{
+    const __m256i split = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                          4, 5, 3, 4, 1, 2, 0, 1,
+                                          10, 11, 9, 10, 7, 8, 6, 7,
+                                          4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '+' - 62,
+                                           '/' - 63, 'A', 0, 0,
+                                           'a' - 26, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '+' - 62,
+                                           '/' - 63, 'A', 0, 0);
+    __m256i x, t;
+    size_t i;
+
+    /* each lane gets 12 bytes, the second load reads 4 bytes beyond */
+    for (i = 0; len - i >= 28; i += 24, out += 32) {
+        x = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i *)(data + i))),
+            _mm_loadu_si128((const __m128i *)(data + i + 12)), 1);
+        x = _mm256_shuffle_epi8(x, split);
+        x = _mm256_or_si256(
+            _mm256_mulhi_epu16(
+                _mm256_and_si256(x, _mm256_set1_epi32(0x0fc0fc00)),
+                _mm256_set1_epi32(0x04000040)),
+            _mm256_mullo_epi16(
+                _mm256_and_si256(x, _mm256_set1_epi32(0x003f03f0)),
+                _mm256_set1_epi32(0x01000010)));
+        t = _mm256_subs_epu8(x, _mm256_set1_epi8(51));
+        t = _mm256_or_si256(t, _mm256_and_si256(
+                _mm256_cmpgt_epi8(_mm256_set1_epi8(26), x),
+                _mm256_set1_epi8(13)));
+        x = _mm256_add_epi8(x, _mm256_shuffle_epi8(shift, t));
+        _mm256_storeu_si256((__m256i *)out, x);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t _base64_decode_avx2(const char *base64, size_t len,
+                                  unsigned char *out)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    __m256i x, hi, lo;
+    size_t i;
+
+    /* each lane is stored with 16 bytes of which 12 are decoded, so stop
+     * while at least 8 characters are left to the caller */
+    for (i = 0; len - i >= 40; i += 32, out += 24) {
+        x = _mm256_loadu_si256((const __m256i *)(base64 + i));
+        hi = _mm256_and_si256(_mm256_srli_epi32(x, 4),
+                              _mm256_set1_epi8(0x0f));
+        lo = _mm256_and_si256(x, _mm256_set1_epi8(0x0f));
+        if (!_mm256_testz_si256(_mm256_shuffle_epi8(lut_lo, lo),
+                                _mm256_shuffle_epi8(lut_hi, hi)))
+            break;
+        hi = _mm256_add_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('/')),
+                             hi);
+        x = _mm256_add_epi8(x, _mm256_shuffle_epi8(lut_roll, hi));
+        x = _mm256_maddubs_epi16(x, _mm256_set1_epi32(0x01400140));
+        x = _mm256_madd_epi16(x, _mm256_set1_epi32(0x00011000));
+        x = _mm256_shuffle_epi8(x, pack);
+        _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(x));
+        _mm_storeu_si128((__m128i *)(out + 12),
+                         _mm256_extracti128_si256(x, 1));
+    }
+    return i;
+}
+#endif
+
+/* without vector instructions the scalar loops do everything */
+static size_t _base64_encode_none(const unsigned char *data, size_t len,
+                                  char *out)
+{
+    return 0;
+}
+
+static size_t _base64_decode_none(const char *base64, size_t len,
+                                  unsigned char *out)
+{
+    return 0;
+}
+
+static size_t _base64_encode_detect(const unsigned char *data, size_t len,
+                                    char *out);
+static size_t _base64_decode_detect(const char *base64, size_t len,
+                                    unsigned char *out);
+
+/* set to the best implementation for this CPU on first use */
+static size_t (*_base64_encode_blocks)(const unsigned char *data,
+                                       size_t len, char *out) =
+    _base64_encode_detect;
+static size_t (*_base64_decode_blocks)(const char *base64, size_t len,
+                                       unsigned char *out) =
+    _base64_decode_detect;
+
+static void _base64_detect(void)
+{
+#ifdef CPU_X86_AVX2
+    if (cpu_has_x86_avx2()) {
+        _base64_encode_blocks = _base64_encode_avx2;
+        _base64_decode_blocks = _base64_decode_avx2;
+        return;
+    }
+#endif
+#ifdef CPU_X86_SSSE3
+    if (cpu_has_x86_ssse3()) {
+        _base64_encode_blocks = _base64_encode_ssse3;
+        _base64_decode_blocks = _base64_decode_ssse3;
+        return;
+    }
+#endif
+    _base64_encode_blocks = _base64_encode_none;
+    _base64_decode_blocks = _base64_decode_none;
+}
+
+static size_t _base64_encode_detect(const unsigned char *data, size_t len,
+                                    char *out)
+{
+    _base64_detect();
+    return _base64_encode_blocks(data, len, out);
+}
+
+static size_t _base64_decode_detect(const char *base64, size_t len,
+                                    unsigned char *out)
+{
+    _base64_detect();
+    return _base64_decode_blocks(base64, len, out);
+}
+
+/** Get the length of the base64 encoding of some data.
+ *
+ *  @param len the length of the data
+ *
+ *  @return the number of characters xmpp_base64_encode() writes
+ *
+ *  @ingroup Base64
+ */
+size_t xmpp_base64_encoded_len(const size_t len)
 {
     /* encoded steam is 4 bytes for every three, rounded up */
-    return ((len + 2)/3) << 2;
+    return ((len + 2) / 3) << 2;
 }
 
-char *base64_encode(xmpp_ctx_t *ctx, 
-		    const unsigned char * const buffer, const unsigned len)
+/** Encode data to base64 into a buffer supplied by the caller.
+ *  The result is not NUL terminated.
+ *
+ *  @param data the data to encode
+ *  @param len the length of the data
+ *  @param out a buffer of at least xmpp_base64_encoded_len(len) bytes
+ *
+ *  @return the number of characters written
+ *
+ *  @ingroup Base64
+ */
+size_t xmpp_base64_encode(const unsigned char * const data, const size_t len,
+                          char * const out)
 {
-    int clen;
-    char *cbuf, *c;
-    uint32_t word, hextet;
-    unsigned i;
-
-    clen = base64_encoded_len(ctx, len);
-    cbuf = xmpp_alloc(ctx, clen + 1);
-    if (cbuf != NULL) {
-	c = cbuf;
-	/* loop over data, turning every 3 bytes into 4 characters */
-	for (i = 0; i + 2 < len; i += 3) {
-	    word = buffer[i] << 16 | buffer[i+1] << 8 | buffer[i+2];
-	    hextet = (word & 0x00FC0000) >> 18;
-	    *c++ = _base64_charmap[hextet];
-	    hextet = (word & 0x0003F000) >> 12;
-	    *c++ = _base64_charmap[hextet];
-	    hextet = (word & 0x00000FC0) >> 6;
-	    *c++ = _base64_charmap[hextet];
-	    hextet = (word & 0x000003F);
-	    *c++ = _base64_charmap[hextet];
-	}
-	/* zero, one or two bytes left */
-	switch (len - i) {
-	    case 0:
-		break;
-	    case 1:
-		hextet = (buffer[len-1] & 0xFC) >> 2;
-		*c++ = _base64_charmap[hextet];
-		hextet = (buffer[len-1] & 0x03) << 4;
-		*c++ = _base64_charmap[hextet];
-		*c++ = _base64_charmap[64]; /* pad */
-		*c++ = _base64_charmap[64]; /* pad */
-		break;
-	    case 2:
-		hextet = (buffer[len-2] & 0xFC) >> 2;
-		*c++ = _base64_charmap[hextet];
-		hextet = ((buffer[len-2] & 0x03) << 4) |
-			 ((buffer[len-1] & 0xF0) >> 4);
-		*c++ = _base64_charmap[hextet];
-		hextet = (buffer[len-1] & 0x0F) << 2;
-		*c++ = _base64_charmap[hextet];
-		*c++ = _base64_charmap[64]; /* pad */
-		break;
-	}
-	/* add a terminal null */
-	*c = '\0';
+    char *c;
+    uint32_t word;
+    size_t i;
+
+    i = _base64_encode_blocks(data, len, out);
+    c = out + i / 3 * 4;
+    /* loop over the rest, turning every 3 bytes into 4 characters */
+    for (; i + 2 < len; i += 3) {
+        word = data[i] << 16 | data[i+1] << 8 | data[i+2];
+        *c++ = _base64_charmap[(word & 0x00FC0000) >> 18];
+        *c++ = _base64_charmap[(word & 0x0003F000) >> 12];
+        *c++ = _base64_charmap[(word & 0x00000FC0) >> 6];
+        *c++ = _base64_charmap[word & 0x000003F];
+    }
+    /* zero, one or two bytes left */
+    switch (len - i) {
+    case 1:
+        *c++ = _base64_charmap[(data[len-1] & 0xFC) >> 2];
+        *c++ = _base64_charmap[(data[len-1] & 0x03) << 4];
+        *c++ = _base64_charmap[64]; /* pad */
+        *c++ = _base64_charmap[64]; /* pad */
+        break;
+    case 2:
+        *c++ = _base64_charmap[(data[len-2] & 0xFC) >> 2];
+        *c++ = _base64_charmap[((data[len-2] & 0x03) << 4) |
+                               ((data[len-1] & 0xF0) >> 4)];
+        *c++ = _base64_charmap[(data[len-1] & 0x0F) << 2];
+        *c++ = _base64_charmap[64]; /* pad */
+        break;
     }
 
-    return cbuf;
+    return (size_t)(c - out);
 }
 
-int base64_decoded_len(xmpp_ctx_t *ctx, 
-		       const char * const buffer, const unsigned len)
+/** Get the length of the data encoded in base64.
+ *
+ *  @param base64 the base64 encoding
+ *  @param len its length in characters
+ *
+ *  @return the number of bytes xmpp_base64_decode() writes, or 0 if the
+ *          padding is wrong
+ *
+ *  @ingroup Base64
+ */
+size_t xmpp_base64_decoded_len(const char * const base64, const size_t len)
 {
-    int nudge;
-    int c;
+    size_t nudge;
 
-    if (len < 4) return 0;
+    if (len < 4 || (len & 0x03)) return 0;
 
     /* count the padding characters for the remainder */
-    nudge = -1;
-    c = _base64_invcharmap[(int)buffer[len-1]];
-    if (c < 64) nudge = 0;
-    else if (c == 64) {
-	c = _base64_invcharmap[(int)buffer[len-2]];
-	if (c < 64) nudge = 1;
-	else if (c == 64) {
-	    c = _base64_invcharmap[(int)buffer[len-3]];
-	    if (c < 64) nudge = 2;
-	} 
-    }
-    if (nudge < 0) return 0; /* reject bad coding */
-
-    /* decoded steam is 3 bytes for every four */ 
+    if (_base64_value(base64[len-1]) < 64)
+        nudge = 0;
+    else if (_base64_value(base64[len-1]) != 64)
+        return 0; /* reject bad coding */
+    else if (_base64_value(base64[len-2]) < 64)
+        nudge = 1;
+    else if (_base64_value(base64[len-2]) == 64 &&
+             _base64_value(base64[len-3]) < 64)
+        nudge = 2;
+    else
+        return 0;
+
+    /* decoded steam is 3 bytes for every four */
     return 3 * (len >> 2) - nudge;
 }
 
+/** Decode base64 into a buffer supplied by the caller.
+ *
+ *  @param base64 the base64 encoding
+ *  @param len its length in characters, a multiple of 4
+ *  @param out a buffer of at least xmpp_base64_decoded_len(base64, len)
+ *             bytes
+ *  @param out_len set to the number of bytes written
+ *
+ *  @return XMPP_EOK (0) on success or XMPP_EINVOP if the input isn't
+ *          valid base64
+ *
+ *  @ingroup Base64
+ */
+int xmpp_base64_decode(const char * const base64, const size_t len,
+                       unsigned char * const out, size_t * const out_len)
+{
+    size_t dlen, full, i;
+    unsigned char *d;
+    uint32_t word, hextet;
+
+    *out_len = 0;
+    if (len == 0) return XMPP_EOK;
+    dlen = xmpp_base64_decoded_len(base64, len);
+    if (dlen == 0) return XMPP_EINVOP;
+
+    /* quartets with padding are left to the end */
+    full = dlen % 3 ? len - 4 : len;
+    i = _base64_decode_blocks(base64, full, out);
+    d = out + i / 4 * 3;
+    /* loop over each set of 4 characters, decoding 3 bytes */
+    for (; i < full; i += 4) {
+        hextet = _base64_value(base64[i]);
+        if (hextet & 0xC0) return XMPP_EINVOP;
+        word = hextet << 18;
+        hextet = _base64_value(base64[i+1]);
+        if (hextet & 0xC0) return XMPP_EINVOP;
+        word |= hextet << 12;
+        hextet = _base64_value(base64[i+2]);
+        if (hextet & 0xC0) return XMPP_EINVOP;
+        word |= hextet << 6;
+        hextet = _base64_value(base64[i+3]);
+        if (hextet & 0xC0) return XMPP_EINVOP;
+        word |= hextet;
+        *d++ = (word & 0x00FF0000) >> 16;
+        *d++ = (word & 0x0000FF00) >> 8;
+        *d++ = (word & 0x000000FF);
+    }
+    /* handle the remainder, the padding was checked by
+     * xmpp_base64_decoded_len() */
+    switch (dlen % 3) {
+    case 1:
+        hextet = _base64_value(base64[len-4]);
+        if (hextet & 0xC0) return XMPP_EINVOP;
+        word = hextet << 2;
+        hextet = _base64_value(base64[len-3]);
+        if (hextet & 0xC0) return XMPP_EINVOP;
+        word |= hextet >> 4;
+        *d++ = word & 0xFF;
+        break;
+    case 2:
+        hextet = _base64_value(base64[len-4]);
+        if (hextet & 0xC0) return XMPP_EINVOP;
+        word = hextet << 10;
+        hextet = _base64_value(base64[len-3]);
+        if (hextet & 0xC0) return XMPP_EINVOP;
+        word |= hextet << 4;
+        hextet = _base64_value(base64[len-2]);
+        if (hextet & 0xC0) return XMPP_EINVOP;
+        word |= hextet >> 2;
+        *d++ = (word & 0xFF00) >> 8;
+        *d++ = (word & 0x00FF);
+        break;
+    }
+
+    *out_len = (size_t)(d - out);
+    return XMPP_EOK;
+}
+
+int base64_encoded_len(xmpp_ctx_t *ctx, const unsigned len)
+{
+    return (int)xmpp_base64_encoded_len(len);
+}
+
+char *base64_encode(xmpp_ctx_t *ctx, 
+		    const unsigned char * const buffer, const unsigned len)
+{
+    char *cbuf;
+
+    cbuf = xmpp_alloc(ctx, xmpp_base64_encoded_len(len) + 1);
+    if (cbuf != NULL)
+        cbuf[xmpp_base64_encode(buffer, len, cbuf)] = '\0';
+
+    return cbuf;
+}
+
+int base64_decoded_len(xmpp_ctx_t *ctx, 
+		       const char * const buffer, const unsigned len)
+{
+    return (int)xmpp_base64_decoded_len(buffer, len);
+}
+
 unsigned char *base64_decode(xmpp_ctx_t *ctx,
 			     const char * const buffer, const unsigned len)
 {
-    int dlen;
-    unsigned char *dbuf, *d;
-    uint32_t word, hextet = 0;
-    unsigned i;
+    unsigned char *dbuf;
+    size_t dlen;
 
     /* len must be a multiple of 4 */
     if (len & 0x03) return NULL;
 
-    dlen = base64_decoded_len(ctx, buffer, len);
-    dbuf = xmpp_alloc(ctx, dlen + 1);
+    dbuf = xmpp_alloc(ctx, xmpp_base64_decoded_len(buffer, len) + 1);
     if (dbuf != NULL) {
-	d = dbuf;
-	/* loop over each set of 4 characters, decoding 3 bytes */
-	for (i = 0; i + 3 < len; i += 4) {
-	    hextet = _base64_invcharmap[(int)buffer[i]];
-	    if (hextet & 0xC0) break;
-	    word = hextet << 18;
-	    hextet = _base64_invcharmap[(int)buffer[i+1]];
-	    if (hextet & 0xC0) break;
-	    word |= hextet << 12;
-	    hextet = _base64_invcharmap[(int)buffer[i+2]];
-	    if (hextet & 0xC0) break;
-	    word |= hextet << 6;
-	    hextet = _base64_invcharmap[(int)buffer[i+3]];
-	    if (hextet & 0xC0) break;
-	    word |= hextet;
-	    *d++ = (word & 0x00FF0000) >> 16;
-	    *d++ = (word & 0x0000FF00) >> 8;
-	    *d++ = (word & 0x000000FF);
-	}
-	if (hextet > 64) goto _base64_decode_error;
-	/* handle the remainder */
-	switch (dlen % 3) {
-	    case 0:
-		/* nothing to do */
-		break;
-	    case 1:
-		/* redo the last quartet, checking for correctness */
-		hextet = _base64_invcharmap[(int)buffer[len-4]];
-		if (hextet & 0xC0) goto _base64_decode_error;
-		word = hextet << 2;
-		hextet = _base64_invcharmap[(int)buffer[len-3]];
-		if (hextet & 0xC0) goto _base64_decode_error;
-		word |= hextet >> 4;
-		*d++ = word & 0xFF;
-		hextet = _base64_invcharmap[(int)buffer[len-2]];
-		if (hextet != 64) goto _base64_decode_error;
-		hextet = _base64_invcharmap[(int)buffer[len-1]];
-		if (hextet != 64) goto _base64_decode_error;
-		break;
-	    case 2:
-		/* redo the last quartet, checking for correctness */
-		hextet = _base64_invcharmap[(int)buffer[len-4]];
-		if (hextet & 0xC0) goto _base64_decode_error;
-		word = hextet << 10;		
-		hextet = _base64_invcharmap[(int)buffer[len-3]];
-		if (hextet & 0xC0) goto _base64_decode_error;
-		word |= hextet << 4;		
-		hextet = _base64_invcharmap[(int)buffer[len-2]];
-		if (hextet & 0xC0) goto _base64_decode_error;
-		word |= hextet >> 2;
-		*d++ = (word & 0xFF00) >> 8;
-		*d++ = (word & 0x00FF);		
-		hextet = _base64_invcharmap[(int)buffer[len-1]];
-		if (hextet != 64) goto _base64_decode_error;
-		break;
-	}
-	*d = '\0';
+        if (xmpp_base64_decode(buffer, len, dbuf, &dlen) != XMPP_EOK) {
+            /* invalid character; abort decoding! */
+            xmpp_free(ctx, dbuf);
+            return NULL;
+        }
+        dbuf[dlen] = '\0';
     }
     return dbuf;
-
-_base64_decode_error:	
-    /* invalid character; abort decoding! */
-    xmpp_free(ctx, dbuf);
-    return NULL;
 }
 
 /*** self tests ***/
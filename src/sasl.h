@@ -17,15 +17,19 @@
 #define __LIBSTROPHE_SASL_H__
 
 #include "strophe.h"
+#include "scram.h"
 
 /** low-level sasl routines */
 
 char *sasl_plain(xmpp_ctx_t *ctx, const char *authid, const char *password);
 char *sasl_digest_md5(xmpp_ctx_t *ctx, const char *challenge,
 		      const char *jid, const char *password);
-char *sasl_scram_sha1(xmpp_ctx_t *ctx, const char *challenge,
-                      const char *first_bare, const char *jid,
-                      const char *password);
+char *sasl_scram(xmpp_ctx_t *ctx, const scram_hash_t *alg,
+                 const char *challenge, const char *first_bare,
+                 const char *jid, const char *password);
+char *sasl_ht_sha256(xmpp_ctx_t *ctx, const char *authid, const char *token);
+int sasl_ht_sha256_verify(xmpp_ctx_t *ctx, const char *token,
+                          const char *data);
 
 
 /** Base64 encoding routines. Implemented according to RFC 3548 */
@@ -1,8 +1,9 @@
 /* scram.c
  * strophe XMPP client library
  *
- * SCRAM-SHA1 helper functions according to RFC5802
- * HMAC-SHA1 implementation according to RFC2104
+ * SCRAM-SHA-1, SCRAM-SHA-256 and SCRAM-SHA-512 helper functions
+ * according to RFC5802 and RFC7677
+ * HMAC implementation according to RFC2104
  *
  * Copyright (C) 2013 Dmitry Podgorny <pasis.ua@gmail.com>
  *
@@ -13,71 +14,185 @@
  */
 
 /** @file
- *  SCRAM-SHA1 helper functions.
+ *  SCRAM helper functions.
  */
 
 #include <assert.h>
 #include <string.h>
 
 #include "sha1.h"
+#include "sha256.h"
+#include "sha512.h"
 #include "ostypes.h"
 
 #include "scram.h"
 
-#define HMAC_BLOCK_SIZE 64
+#define HMAC_BLOCK_SIZE_MAX 128
 
 static const uint8_t ipad = 0x36;
 static const uint8_t opad = 0x5C;
 
-static void crypto_HMAC_SHA1(const uint8_t *key, size_t key_len,
-                             const uint8_t *text, size_t len,
-                             uint8_t *digest)
+static void sha1_init(scram_hash_ctx_t *ctx)
 {
-    uint8_t key_pad[HMAC_BLOCK_SIZE];
-    uint8_t key_ipad[HMAC_BLOCK_SIZE];
-    uint8_t key_opad[HMAC_BLOCK_SIZE];
-    uint8_t sha_digest[SHA1_DIGEST_SIZE];
-    int i;
-    SHA1_CTX ctx;
+    crypto_SHA1_Init(&ctx->sha1);
+}
+
+static void sha1_update(scram_hash_ctx_t *ctx, const uint8_t *data,
+                        size_t len)
+{
+    crypto_SHA1_Update(&ctx->sha1, data, len);
+}
+
+static void sha1_final(scram_hash_ctx_t *ctx, uint8_t *digest)
+{
+    crypto_SHA1_Final(&ctx->sha1, digest);
+}
+
+static void sha256_init(scram_hash_ctx_t *ctx)
+{
+    crypto_SHA256_Init(&ctx->sha256);
+}
+
+static void sha256_update(scram_hash_ctx_t *ctx, const uint8_t *data,
+                          size_t len)
+{
+    crypto_SHA256_Update(&ctx->sha256, data, len);
+}
+
+static void sha256_final(scram_hash_ctx_t *ctx, uint8_t *digest)
+{
+    crypto_SHA256_Final(&ctx->sha256, digest);
+}
+
+static void sha512_init(scram_hash_ctx_t *ctx)
+{
+    crypto_SHA512_Init(&ctx->sha512);
+}
+
+static void sha512_update(scram_hash_ctx_t *ctx, const uint8_t *data,
+                          size_t len)
+{
+    crypto_SHA512_Update(&ctx->sha512, data, len);
+}
+
+static void sha512_final(scram_hash_ctx_t *ctx, uint8_t *digest)
+{
+    crypto_SHA512_Final(&ctx->sha512, digest);
+}
+
+const scram_hash_t scram_sha1 = {
+    "SCRAM-SHA-1", SHA1_DIGEST_SIZE, 64,
+    sha1_init, sha1_update, sha1_final
+};
+
+const scram_hash_t scram_sha256 = {
+    "SCRAM-SHA-256", SHA256_DIGEST_SIZE, 64,
+    sha256_init, sha256_update, sha256_final
+};
+
+const scram_hash_t scram_sha512 = {
+    "SCRAM-SHA-512", SHA512_DIGEST_SIZE, 128,
+    sha512_init, sha512_update, sha512_final
+};
+
+/* memset() which the compiler can't drop for memory that is freed next */
+static void scram_wipe(void *p, size_t len)
+{
+    volatile uint8_t *v = (volatile uint8_t *)p;
+
+    while (len--)
+        *v++ = 0;
+}
+
+static void crypto_Hash(const scram_hash_t *alg, const uint8_t *data,
+                        size_t len, uint8_t *digest)
+{
+    scram_hash_ctx_t ctx;
+
+    alg->init(&ctx);
+    alg->update(&ctx, data, len);
+    alg->final(&ctx, digest);
+}
+
+/* HMAC with the key already hashed into the inner and outer states */
+typedef struct {
+    const scram_hash_t *alg;
+    scram_hash_ctx_t inner;
+    scram_hash_ctx_t outer;
+} SCRAM_HMAC_CTX;
+
+static void crypto_HMAC_Init(SCRAM_HMAC_CTX *ctx, const scram_hash_t *alg,
+                             const uint8_t *key, size_t key_len)
+{
+    uint8_t key_pad[HMAC_BLOCK_SIZE_MAX];
+    uint8_t key_ipad[HMAC_BLOCK_SIZE_MAX];
+    uint8_t key_opad[HMAC_BLOCK_SIZE_MAX];
+    size_t i;
 
     memset(key_pad, 0, sizeof(key_pad));
-    if (key_len <= HMAC_BLOCK_SIZE) {
+    if (key_len <= alg->block_size) {
         memcpy(key_pad, key, key_len);
     } else {
         /* according to RFC2104 */
-        crypto_SHA1(key, key_len, key_pad);
+        crypto_Hash(alg, key, key_len, key_pad);
     }
 
-    for (i = 0; i < HMAC_BLOCK_SIZE; i++) {
+    for (i = 0; i < alg->block_size; i++) {
         key_ipad[i] = key_pad[i] ^ ipad;
         key_opad[i] = key_pad[i] ^ opad;
     }
 
-    crypto_SHA1_Init(&ctx);
-    crypto_SHA1_Update(&ctx, key_ipad, HMAC_BLOCK_SIZE);
-    crypto_SHA1_Update(&ctx, text, len);
-    crypto_SHA1_Final(&ctx, sha_digest);
+    ctx->alg = alg;
+    alg->init(&ctx->inner);
+    alg->update(&ctx->inner, key_ipad, alg->block_size);
+    alg->init(&ctx->outer);
+    alg->update(&ctx->outer, key_opad, alg->block_size);
+}
+
+/* digest may overlap text, ctx can be used again */
+static void crypto_HMAC_Digest(const SCRAM_HMAC_CTX *ctx,
+                               const uint8_t *text, size_t len,
+                               uint8_t *digest)
+{
+    const scram_hash_t *alg = ctx->alg;
+    uint8_t sha_digest[SCRAM_DIGEST_SIZE];
+    scram_hash_ctx_t sha;
 
-    crypto_SHA1_Init(&ctx);
-    crypto_SHA1_Update(&ctx, key_opad, HMAC_BLOCK_SIZE);
-    crypto_SHA1_Update(&ctx, sha_digest, SHA1_DIGEST_SIZE);
-    crypto_SHA1_Final(&ctx, digest);
+    sha = ctx->inner;
+    alg->update(&sha, text, len);
+    alg->final(&sha, sha_digest);
+
+    sha = ctx->outer;
+    alg->update(&sha, sha_digest, alg->digest_size);
+    alg->final(&sha, digest);
+}
+
+static void crypto_HMAC(const scram_hash_t *alg,
+                        const uint8_t *key, size_t key_len,
+                        const uint8_t *text, size_t len,
+                        uint8_t *digest)
+{
+    SCRAM_HMAC_CTX ctx;
+
+    crypto_HMAC_Init(&ctx, alg, key, key_len);
+    crypto_HMAC_Digest(&ctx, text, len, digest);
 }
 
-static void SCRAM_SHA1_Hi(const uint8_t *text, size_t len,
-                          const uint8_t *salt, size_t salt_len, uint32_t i,
-                          uint8_t *digest)
+static void SCRAM_Hi(const scram_hash_t *alg, const uint8_t *text,
+                     size_t len, const uint8_t *salt, size_t salt_len,
+                     uint32_t i, uint8_t *digest)
 {
-    int  k;
+    size_t k;
     uint32_t j;
     uint8_t tmp[128];
+    SCRAM_HMAC_CTX hmac;
 
     static uint8_t int1[] = {0x0, 0x0, 0x0, 0x1};
 
     /* assume salt + INT(1) isn't longer than sizeof(tmp) */
     assert(salt_len <= sizeof(tmp) - sizeof(int1));
 
-    memset(digest, 0, SHA1_DIGEST_SIZE);
+    memset(digest, 0, alg->digest_size);
     if (i == 0) {
         return;
     }
@@ -85,47 +200,114 @@ static void SCRAM_SHA1_Hi(const uint8_t *text, size_t len,
     memcpy(tmp, salt, salt_len);
     memcpy(&tmp[salt_len], int1, sizeof(int1));
 
-    /* 'text' for Hi is a 'key' for HMAC */
-    crypto_HMAC_SHA1(text, len, tmp, salt_len + sizeof(int1), digest);
-    memcpy(tmp, digest, SHA1_DIGEST_SIZE);
+    /* 'text' for Hi is a 'key' for HMAC, the pads are hashed once and
+     * every iteration only costs the two compressions of its own */
+    crypto_HMAC_Init(&hmac, alg, text, len);
+    crypto_HMAC_Digest(&hmac, tmp, salt_len + sizeof(int1), digest);
+    memcpy(tmp, digest, alg->digest_size);
 
     for (j = 1; j < i; j++) {
-        crypto_HMAC_SHA1(text, len, tmp, SHA1_DIGEST_SIZE, tmp);
-        for (k = 0; k < SHA1_DIGEST_SIZE; k++) {
+        crypto_HMAC_Digest(&hmac, tmp, alg->digest_size, tmp);
+        for (k = 0; k < alg->digest_size; k++) {
             digest[k] ^= tmp[k];
         }
     }
+    scram_wipe(&hmac, sizeof(hmac));
+    scram_wipe(tmp, sizeof(tmp));
 }
 
-void SCRAM_SHA1_ClientKey(const uint8_t *password, size_t len,
-                          const uint8_t *salt, size_t salt_len, uint32_t i,
-                          uint8_t *key)
+void SCRAM_ClientKey(const scram_hash_t *alg,
+                     const uint8_t *password, size_t len,
+                     const uint8_t *salt, size_t salt_len, uint32_t i,
+                     uint8_t *key)
 {
-    uint8_t salted[SHA1_DIGEST_SIZE];
+    uint8_t salted[SCRAM_DIGEST_SIZE];
 
     /* XXX: Normalize(password) is omitted */
 
-    SCRAM_SHA1_Hi(password, len, salt, salt_len, i, salted);
-    crypto_HMAC_SHA1(salted, SHA1_DIGEST_SIZE, (uint8_t *)"Client Key",
-                     strlen("Client Key"), key);
+    SCRAM_Hi(alg, password, len, salt, salt_len, i, salted);
+    crypto_HMAC(alg, salted, alg->digest_size, (uint8_t *)"Client Key",
+                strlen("Client Key"), key);
+    scram_wipe(salted, sizeof(salted));
+}
+
+void scram_cache_init(scram_cache_t *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+}
+
+void scram_cache_wipe(scram_cache_t *cache)
+{
+    scram_wipe(cache, sizeof(*cache));
+}
+
+void SCRAM_ClientKeyCached(scram_cache_t *cache, const scram_hash_t *alg,
+                           const uint8_t *password, size_t len,
+                           const uint8_t *salt, size_t salt_len,
+                           uint32_t i, uint8_t *key)
+{
+    scram_cache_entry_t *entry, *victim;
+    uint8_t id[SCRAM_DIGEST_SIZE];
+    uint8_t tmp[128];
+    int k;
+
+    if (i == 0 || salt_len > sizeof(tmp) - 4) {
+        SCRAM_ClientKey(alg, password, len, salt, salt_len, i, key);
+        return;
+    }
+
+    /* the password itself is never stored, entries are found by
+     * a MAC of the salt and iteration count keyed with it */
+    memcpy(tmp, salt, salt_len);
+    tmp[salt_len] = (uint8_t)(i >> 24);
+    tmp[salt_len + 1] = (uint8_t)(i >> 16);
+    tmp[salt_len + 2] = (uint8_t)(i >> 8);
+    tmp[salt_len + 3] = (uint8_t)i;
+    crypto_HMAC(alg, password, len, tmp, salt_len + 4, id);
+
+    victim = &cache->entry[0];
+    for (k = 0; k < SCRAM_CACHE_SIZE; k++) {
+        entry = &cache->entry[k];
+        if (entry->alg == alg && entry->i == i &&
+            memcmp(entry->id, id, alg->digest_size) == 0) {
+            entry->used = ++cache->clock;
+            memcpy(key, entry->key, alg->digest_size);
+            scram_wipe(id, sizeof(id));
+            return;
+        }
+        if (entry->used < victim->used)
+            victim = entry;
+    }
+
+    /* miss, replace the least recently used entry */
+    SCRAM_ClientKey(alg, password, len, salt, salt_len, i, key);
+    scram_wipe(victim, sizeof(*victim));
+    victim->alg = alg;
+    memcpy(victim->id, id, alg->digest_size);
+    memcpy(victim->key, key, alg->digest_size);
+    victim->i = i;
+    victim->used = ++cache->clock;
+    scram_wipe(id, sizeof(id));
 }
 
-void SCRAM_SHA1_ClientSignature(const uint8_t *ClientKey,
-                                const uint8_t *AuthMessage, size_t len,
-                                uint8_t *sign)
+void SCRAM_ClientSignature(const scram_hash_t *alg,
+                           const uint8_t *ClientKey,
+                           const uint8_t *AuthMessage, size_t len,
+                           uint8_t *sign)
 {
-    uint8_t stored[SHA1_DIGEST_SIZE];
+    uint8_t stored[SCRAM_DIGEST_SIZE];
 
-    crypto_SHA1(ClientKey, SHA1_DIGEST_SIZE, stored);
-    crypto_HMAC_SHA1(stored, SHA1_DIGEST_SIZE, AuthMessage, len, sign);
+    crypto_Hash(alg, ClientKey, alg->digest_size, stored);
+    crypto_HMAC(alg, stored, alg->digest_size, AuthMessage, len, sign);
 }
 
-void SCRAM_SHA1_ClientProof(const uint8_t *ClientKey,
-                            const uint8_t *ClientSignature,
-                            uint8_t *proof)
+void SCRAM_ClientProof(const scram_hash_t *alg,
+                       const uint8_t *ClientKey,
+                       const uint8_t *ClientSignature,
+                       uint8_t *proof)
 {
-    int i;
-    for (i = 0; i < SHA1_DIGEST_SIZE; i++) {
+    size_t i;
+    for (i = 0; i < alg->digest_size; i++) {
         proof[i] = ClientKey[i] ^ ClientSignature[i];
     }
 }
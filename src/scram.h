@@ -1,5 +1,5 @@
 /* scram.h
- * strophe XMPP client library -- SCRAM-SHA1 helper functions
+ * strophe XMPP client library -- SCRAM helper functions
  *
  * Copyright (C) 2013 Dmitry Podgorny <pasis.ua@gmail.com>
  *
@@ -10,7 +10,7 @@
  */
 
 /** @file
- *  SCRAM-SHA1 helper functions.
+ *  SCRAM helper functions.
  */
 
 #ifndef __LIBSTROPHE_SCRAM_H__
@@ -20,17 +20,71 @@
 #include "ostypes.h"
 
 #include "sha1.h"
+#include "sha256.h"
+#include "sha512.h"
 
-void SCRAM_SHA1_ClientKey(const uint8_t *password, size_t len,
-                          const uint8_t *salt, size_t salt_len, uint32_t i,
-                          uint8_t *key);
+/* the largest digest of the hashes below */
+#define SCRAM_DIGEST_SIZE 64
 
-void SCRAM_SHA1_ClientSignature(const uint8_t *ClientKey,
-                                const uint8_t *AuthMessage, size_t len,
-                                uint8_t *sign);
+typedef union {
+    SHA1_CTX sha1;
+    sha256_context sha256;
+    sha512_context sha512;
+} scram_hash_ctx_t;
 
-void SCRAM_SHA1_ClientProof(const uint8_t *ClientKey,
-                            const uint8_t *ClientSignature,
-                            uint8_t *proof);
+/* a hash function for SCRAM-<hash> */
+typedef struct {
+    const char *scram_name; /* the SASL mechanism */
+    size_t digest_size;
+    size_t block_size; /* for HMAC */
+    void (*init)(scram_hash_ctx_t *ctx);
+    void (*update)(scram_hash_ctx_t *ctx, const uint8_t *data, size_t len);
+    void (*final)(scram_hash_ctx_t *ctx, uint8_t *digest);
+} scram_hash_t;
+
+extern const scram_hash_t scram_sha1;
+extern const scram_hash_t scram_sha256;
+extern const scram_hash_t scram_sha512;
+
+/* number of derived keys kept per context */
+#define SCRAM_CACHE_SIZE 4
+
+/* ClientKey of a (hash, password, salt, iteration count) tuple, so that
+ * logging in again skips the Hi() iterations */
+typedef struct {
+    const scram_hash_t *alg; /* NULL for an empty slot */
+    uint8_t id[SCRAM_DIGEST_SIZE]; /* HMAC(password, salt + INT(i)) */
+    uint32_t i;
+    uint8_t key[SCRAM_DIGEST_SIZE];
+    unsigned long used;
+} scram_cache_entry_t;
+
+typedef struct {
+    scram_cache_entry_t entry[SCRAM_CACHE_SIZE];
+    unsigned long clock;
+} scram_cache_t;
+
+void scram_cache_init(scram_cache_t *cache);
+void scram_cache_wipe(scram_cache_t *cache);
+
+void SCRAM_ClientKey(const scram_hash_t *alg,
+                     const uint8_t *password, size_t len,
+                     const uint8_t *salt, size_t salt_len, uint32_t i,
+                     uint8_t *key);
+
+void SCRAM_ClientKeyCached(scram_cache_t *cache, const scram_hash_t *alg,
+                           const uint8_t *password, size_t len,
+                           const uint8_t *salt, size_t salt_len,
+                           uint32_t i, uint8_t *key);
+
+void SCRAM_ClientSignature(const scram_hash_t *alg,
+                           const uint8_t *ClientKey,
+                           const uint8_t *AuthMessage, size_t len,
+                           uint8_t *sign);
+
+void SCRAM_ClientProof(const scram_hash_t *alg,
+                       const uint8_t *ClientKey,
+                       const uint8_t *ClientSignature,
+                       uint8_t *proof);
 
 #endif /* __LIBSTROPHE_SCRAM_H__ */
@@ -70,23 +70,25 @@ use SHA1_ prefix for public api
 move public api to sha1.h
 */
 
-/* #define SHA1HANDSOFF  */
-
 #include <string.h>
 
 #include "ostypes.h"
+#include "cpu.h"
 #include "sha1.h"
 
+#ifdef CPU_X86_SHA
+#include <immintrin.h>
+#endif
+
 static uint32_t host_to_be(uint32_t i);
-static void SHA1_Transform(uint32_t state[5], const uint8_t buffer[64]);
 
 #define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
 
 /* blk0() and blk() perform the initial expand. */
 /* I got the idea of expanding during the round function from SSLeay */
-#define blk0(i) (block->l[i] = host_to_be(block->l[i]))
-#define blk(i) (block->l[i&15] = rol(block->l[(i+13)&15]^block->l[(i+8)&15] \
-    ^block->l[(i+2)&15]^block->l[i&15],1))
+#define blk0(i) (block.l[i] = host_to_be(block.l[i]))
+#define blk(i) (block.l[i&15] = rol(block.l[(i+13)&15]^block.l[(i+8)&15] \
+    ^block.l[(i+2)&15]^block.l[i&15],1))
 
 /* (R0+R1), R2, R3, R4 are the different operations used in SHA1 */
 #define R0(v,w,x,y,z,i) z+=((w&(x^y))^y)+blk0(i)+0x5A827999+rol(v,5);w=rol(w,30);
@@ -95,6 +97,34 @@ static void SHA1_Transform(uint32_t state[5], const uint8_t buffer[64]);
 #define R3(v,w,x,y,z,i) z+=(((w|x)&y)|(w&x))+blk(i)+0x8F1BBCDC+rol(v,5);w=rol(w,30);
 #define R4(v,w,x,y,z,i) z+=(w^x^y)+blk(i)+0xCA62C1D6+rol(v,5);w=rol(w,30);
 
+/* the same rounds taking the schedule plus constant from wk[] */
+#define RK0(v,w,x,y,z,i) z+=((w&(x^y))^y)+wk[i]+rol(v,5);w=rol(w,30);
+#define RK2(v,w,x,y,z,i) z+=(w^x^y)+wk[i]+rol(v,5);w=rol(w,30);
+#define RK3(v,w,x,y,z,i) z+=(((w|x)&y)|(w&x))+wk[i]+rol(v,5);w=rol(w,30);
+
+/* 80 rounds, loop unrolled */
+#define SHA1_ROUNDS(R0,R1,R2,R3,R4) \
+    R0(a,b,c,d,e, 0); R0(e,a,b,c,d, 1); R0(d,e,a,b,c, 2); R0(c,d,e,a,b, 3); \
+    R0(b,c,d,e,a, 4); R0(a,b,c,d,e, 5); R0(e,a,b,c,d, 6); R0(d,e,a,b,c, 7); \
+    R0(c,d,e,a,b, 8); R0(b,c,d,e,a, 9); R0(a,b,c,d,e,10); R0(e,a,b,c,d,11); \
+    R0(d,e,a,b,c,12); R0(c,d,e,a,b,13); R0(b,c,d,e,a,14); R0(a,b,c,d,e,15); \
+    R1(e,a,b,c,d,16); R1(d,e,a,b,c,17); R1(c,d,e,a,b,18); R1(b,c,d,e,a,19); \
+    R2(a,b,c,d,e,20); R2(e,a,b,c,d,21); R2(d,e,a,b,c,22); R2(c,d,e,a,b,23); \
+    R2(b,c,d,e,a,24); R2(a,b,c,d,e,25); R2(e,a,b,c,d,26); R2(d,e,a,b,c,27); \
+    R2(c,d,e,a,b,28); R2(b,c,d,e,a,29); R2(a,b,c,d,e,30); R2(e,a,b,c,d,31); \
+    R2(d,e,a,b,c,32); R2(c,d,e,a,b,33); R2(b,c,d,e,a,34); R2(a,b,c,d,e,35); \
+    R2(e,a,b,c,d,36); R2(d,e,a,b,c,37); R2(c,d,e,a,b,38); R2(b,c,d,e,a,39); \
+    R3(a,b,c,d,e,40); R3(e,a,b,c,d,41); R3(d,e,a,b,c,42); R3(c,d,e,a,b,43); \
+    R3(b,c,d,e,a,44); R3(a,b,c,d,e,45); R3(e,a,b,c,d,46); R3(d,e,a,b,c,47); \
+    R3(c,d,e,a,b,48); R3(b,c,d,e,a,49); R3(a,b,c,d,e,50); R3(e,a,b,c,d,51); \
+    R3(d,e,a,b,c,52); R3(c,d,e,a,b,53); R3(b,c,d,e,a,54); R3(a,b,c,d,e,55); \
+    R3(e,a,b,c,d,56); R3(d,e,a,b,c,57); R3(c,d,e,a,b,58); R3(b,c,d,e,a,59); \
+    R4(a,b,c,d,e,60); R4(e,a,b,c,d,61); R4(d,e,a,b,c,62); R4(c,d,e,a,b,63); \
+    R4(b,c,d,e,a,64); R4(a,b,c,d,e,65); R4(e,a,b,c,d,66); R4(d,e,a,b,c,67); \
+    R4(c,d,e,a,b,68); R4(b,c,d,e,a,69); R4(a,b,c,d,e,70); R4(e,a,b,c,d,71); \
+    R4(d,e,a,b,c,72); R4(c,d,e,a,b,73); R4(b,c,d,e,a,74); R4(a,b,c,d,e,75); \
+    R4(e,a,b,c,d,76); R4(d,e,a,b,c,77); R4(c,d,e,a,b,78); R4(b,c,d,e,a,79);
+
 
 static uint32_t host_to_be(uint32_t i)
 {
@@ -116,62 +146,242 @@ static uint32_t host_to_be(uint32_t i)
 #endif
 }
 
-/* Hash a single 512-bit block. This is the core of the algorithm. */
-static void SHA1_Transform(uint32_t state[5], const uint8_t buffer[64])
+/* Hash 512-bit blocks. This is the core of the algorithm. */
+static void SHA1_Transform(uint32_t state[5], const uint8_t *data,
+                           size_t blocks)
 {
     uint32_t a, b, c, d, e;
-    typedef union {
+    union {
         uint8_t c[64];
         uint32_t l[16];
-    } CHAR64LONG16;
-    CHAR64LONG16* block;
-
-#ifdef SHA1HANDSOFF
-    static uint8_t workspace[64];
-    block = (CHAR64LONG16*)workspace;
-    memcpy(block, buffer, 64);
-#else
-    block = (CHAR64LONG16*)buffer;
-#endif
+    } block;
+
+    for (; blocks > 0; blocks--, data += 64) {
+        /* the expansion works in place, so leave the caller's data alone */
+        memcpy(block.c, data, 64);
+
+        /* Copy context->state[] to working vars */
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+
+        /* 4 rounds of 20 operations each. */
+        SHA1_ROUNDS(R0, R1, R2, R3, R4)
+
+        /* Add the working vars back into context.state[] */
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
 
-    /* Copy context->state[] to working vars */
-    a = state[0];
-    b = state[1];
-    c = state[2];
-    d = state[3];
-    e = state[4];
-
-    /* 4 rounds of 20 operations each. Loop unrolled. */
-    R0(a,b,c,d,e, 0); R0(e,a,b,c,d, 1); R0(d,e,a,b,c, 2); R0(c,d,e,a,b, 3);
-    R0(b,c,d,e,a, 4); R0(a,b,c,d,e, 5); R0(e,a,b,c,d, 6); R0(d,e,a,b,c, 7);
-    R0(c,d,e,a,b, 8); R0(b,c,d,e,a, 9); R0(a,b,c,d,e,10); R0(e,a,b,c,d,11);
-    R0(d,e,a,b,c,12); R0(c,d,e,a,b,13); R0(b,c,d,e,a,14); R0(a,b,c,d,e,15);
-    R1(e,a,b,c,d,16); R1(d,e,a,b,c,17); R1(c,d,e,a,b,18); R1(b,c,d,e,a,19);
-    R2(a,b,c,d,e,20); R2(e,a,b,c,d,21); R2(d,e,a,b,c,22); R2(c,d,e,a,b,23);
-    R2(b,c,d,e,a,24); R2(a,b,c,d,e,25); R2(e,a,b,c,d,26); R2(d,e,a,b,c,27);
-    R2(c,d,e,a,b,28); R2(b,c,d,e,a,29); R2(a,b,c,d,e,30); R2(e,a,b,c,d,31);
-    R2(d,e,a,b,c,32); R2(c,d,e,a,b,33); R2(b,c,d,e,a,34); R2(a,b,c,d,e,35);
-    R2(e,a,b,c,d,36); R2(d,e,a,b,c,37); R2(c,d,e,a,b,38); R2(b,c,d,e,a,39);
-    R3(a,b,c,d,e,40); R3(e,a,b,c,d,41); R3(d,e,a,b,c,42); R3(c,d,e,a,b,43);
-    R3(b,c,d,e,a,44); R3(a,b,c,d,e,45); R3(e,a,b,c,d,46); R3(d,e,a,b,c,47);
-    R3(c,d,e,a,b,48); R3(b,c,d,e,a,49); R3(a,b,c,d,e,50); R3(e,a,b,c,d,51);
-    R3(d,e,a,b,c,52); R3(c,d,e,a,b,53); R3(b,c,d,e,a,54); R3(a,b,c,d,e,55);
-    R3(e,a,b,c,d,56); R3(d,e,a,b,c,57); R3(c,d,e,a,b,58); R3(b,c,d,e,a,59);
-    R4(a,b,c,d,e,60); R4(e,a,b,c,d,61); R4(d,e,a,b,c,62); R4(c,d,e,a,b,63);
-    R4(b,c,d,e,a,64); R4(a,b,c,d,e,65); R4(e,a,b,c,d,66); R4(d,e,a,b,c,67);
-    R4(c,d,e,a,b,68); R4(b,c,d,e,a,69); R4(a,b,c,d,e,70); R4(e,a,b,c,d,71);
-    R4(d,e,a,b,c,72); R4(c,d,e,a,b,73); R4(b,c,d,e,a,74); R4(a,b,c,d,e,75);
-    R4(e,a,b,c,d,76); R4(d,e,a,b,c,77); R4(c,d,e,a,b,78); R4(b,c,d,e,a,79);
+    /* Wipe variables */
+    a = b = c = d = e = 0;
+    memset(&block, 0, sizeof(block));
+}
 
-    /* Add the working vars back into context.state[] */
-    state[0] += a;
-    state[1] += b;
-    state[2] += c;
-    state[3] += d;
-    state[4] += e;
+#ifdef CPU_X86_SSSE3
+/* w[t..t+3] of the message schedule for t >= 32, which doesn't depend on
+ * words of the same group:
+ * w[t] = rol(w[t-6] ^ w[t-16] ^ w[t-28] ^ w[t-32], 2) */
+#define SHA1_SSSE3_W32(t) do { \
+    x = _mm_alignr_epi8(w[(t) / 4 - 1], w[(t) / 4 - 2], 8); \
+    x = _mm_xor_si128(x, w[(t) / 4 - 4]); \
+    x = _mm_xor_si128(x, w[(t) / 4 - 7]); \
+    x = _mm_xor_si128(x, w[(t) / 4 - 8]); \
+    w[(t) / 4] = _mm_or_si128(_mm_slli_epi32(x, 2), _mm_srli_epi32(x, 30)); \
+} while (0)
+
+/* the same for 16 <= t < 32 with the usual recurrence, w[t+3] needs w[t]
+ * which is patched in afterwards */
+#define SHA1_SSSE3_W16(t) do { \
+    x = _mm_srli_si128(w[(t) / 4 - 1], 4); \
+    x = _mm_xor_si128(x, w[(t) / 4 - 2]); \
+    x = _mm_xor_si128(x, _mm_alignr_epi8(w[(t) / 4 - 3], \
+                                         w[(t) / 4 - 4], 8)); \
+    x = _mm_xor_si128(x, w[(t) / 4 - 4]); \
+    x = _mm_or_si128(_mm_slli_epi32(x, 1), _mm_srli_epi32(x, 31)); \
+    y = _mm_slli_si128(x, 12); \
+    x = _mm_xor_si128(x, _mm_or_si128(_mm_slli_epi32(y, 1), \
+                                      _mm_srli_epi32(y, 31))); \
+    w[(t) / 4] = x; \
+} while (0)
+
+/* the portable rounds, with the message schedule computed four words at a
+ * time in SSE registers off the critical path of the rounds */
+__attribute__((target("ssse3")))
+static void SHA1_Transform_ssse3(uint32_t state[5], const uint8_t *data,
+                                 size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                        0x0405060700010203ULL);
+    const uint32_t K[4] = {0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6};
+    uint32_t a, b, c, d, e;
+    uint32_t wk[80];
+    __m128i w[20];
+    __m128i x, y;
+    int i;
+
+    for (; blocks > 0; blocks--, data += 64) {
+        for (i = 0; i < 4; i++) {
+            w[i] = _mm_loadu_si128((const __m128i *)(data + i * 16));
+            w[i] = _mm_shuffle_epi8(w[i], mask);
+        }
+        SHA1_SSSE3_W16(16); SHA1_SSSE3_W16(20);
+        SHA1_SSSE3_W16(24); SHA1_SSSE3_W16(28);
+        SHA1_SSSE3_W32(32); SHA1_SSSE3_W32(36);
+        SHA1_SSSE3_W32(40); SHA1_SSSE3_W32(44);
+        SHA1_SSSE3_W32(48); SHA1_SSSE3_W32(52);
+        SHA1_SSSE3_W32(56); SHA1_SSSE3_W32(60);
+        SHA1_SSSE3_W32(64); SHA1_SSSE3_W32(68);
+        SHA1_SSSE3_W32(72); SHA1_SSSE3_W32(76);
+        for (i = 0; i < 20; i++)
+            _mm_storeu_si128((__m128i *)&wk[i * 4],
+                             _mm_add_epi32(w[i], _mm_set1_epi32(K[i / 5])));
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+
+        SHA1_ROUNDS(RK0, RK0, RK2, RK3, RK2)
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
 
-    /* Wipe variables */
     a = b = c = d = e = 0;
+    memset(wk, 0, sizeof(wk));
+}
+#endif
+
+#ifdef CPU_X86_SHA
+/* four rounds with the SHA extensions, which also carry the message
+ * schedule of the following rounds along: m0 holds the words for these
+ * rounds, m1..m3 the partly computed words for the next ones */
+#define SHA1_X86_ROUNDS(e_use, e_next, m0, m1, m2, m3, f) \
+    e_use = _mm_sha1nexte_epu32(e_use, m0); \
+    e_next = abcd; \
+    m1 = _mm_sha1msg2_epu32(m1, m0); \
+    abcd = _mm_sha1rnds4_epu32(abcd, e_use, f); \
+    m3 = _mm_sha1msg1_epu32(m3, m0); \
+    m2 = _mm_xor_si128(m2, m0);
+
+/* the same with the SHA extensions, which keep A..D in one register and
+ * fold E into the message words */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void SHA1_Transform_x86(uint32_t state[5], const uint8_t *data,
+                               size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+                                        0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e0, e1, e_save;
+    __m128i m0, m1, m2, m3;
+
+    abcd = _mm_loadu_si128((const __m128i *)state);
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+    for (; blocks > 0; blocks--, data += 64) {
+        abcd_save = abcd;
+        e_save = e0;
+
+        /* rounds 0-15 load the message */
+        m0 = _mm_loadu_si128((const __m128i *)data);
+        m0 = _mm_shuffle_epi8(m0, mask);
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        m1 = _mm_loadu_si128((const __m128i *)(data + 16));
+        m1 = _mm_shuffle_epi8(m1, mask);
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+
+        m2 = _mm_loadu_si128((const __m128i *)(data + 32));
+        m2 = _mm_shuffle_epi8(m2, mask);
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        m3 = _mm_loadu_si128((const __m128i *)(data + 48));
+        m3 = _mm_shuffle_epi8(m3, mask);
+        SHA1_X86_ROUNDS(e1, e0, m3, m0, m1, m2, 0)
+
+        /* rounds 16-79 */
+        SHA1_X86_ROUNDS(e0, e1, m0, m1, m2, m3, 0)
+        SHA1_X86_ROUNDS(e1, e0, m1, m2, m3, m0, 1)
+        SHA1_X86_ROUNDS(e0, e1, m2, m3, m0, m1, 1)
+        SHA1_X86_ROUNDS(e1, e0, m3, m0, m1, m2, 1)
+        SHA1_X86_ROUNDS(e0, e1, m0, m1, m2, m3, 1)
+        SHA1_X86_ROUNDS(e1, e0, m1, m2, m3, m0, 1)
+        SHA1_X86_ROUNDS(e0, e1, m2, m3, m0, m1, 2)
+        SHA1_X86_ROUNDS(e1, e0, m3, m0, m1, m2, 2)
+        SHA1_X86_ROUNDS(e0, e1, m0, m1, m2, m3, 2)
+        SHA1_X86_ROUNDS(e1, e0, m1, m2, m3, m0, 2)
+        SHA1_X86_ROUNDS(e0, e1, m2, m3, m0, m1, 2)
+        SHA1_X86_ROUNDS(e1, e0, m3, m0, m1, m2, 3)
+        SHA1_X86_ROUNDS(e0, e1, m0, m1, m2, m3, 3)
+
+        /* the last rounds need no more message words */
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        m2 = _mm_sha1msg2_epu32(m2, m1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        m3 = _mm_xor_si128(m3, m1);
+
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        m3 = _mm_sha1msg2_epu32(m3, m2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+        e1 = _mm_sha1nexte_epu32(e1, m3);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    _mm_storeu_si128((__m128i *)state, abcd);
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+#endif
+
+static void SHA1_Transform_detect(uint32_t state[5], const uint8_t *data,
+                                  size_t blocks);
+
+/* set to the best implementation for this CPU on first use */
+static void (*sha1_transform)(uint32_t state[5], const uint8_t *data,
+                              size_t blocks) = SHA1_Transform_detect;
+
+static void SHA1_Transform_detect(uint32_t state[5], const uint8_t *data,
+                                  size_t blocks)
+{
+#ifdef CPU_X86_SHA
+    if (cpu_has_x86_sha())
+        sha1_transform = SHA1_Transform_x86;
+    else
+#endif
+#ifdef CPU_X86_SSSE3
+    if (cpu_has_x86_ssse3())
+        sha1_transform = SHA1_Transform_ssse3;
+    else
+#endif
+        sha1_transform = SHA1_Transform;
+    sha1_transform(state, data, blocks);
 }
 
 
@@ -199,9 +409,10 @@ void crypto_SHA1_Update(SHA1_CTX* context, const uint8_t* data,
     context->count[1] += (len >> 29);
     if ((j + len) > 63) {
         memcpy(&context->buffer[j], data, (i = 64-j));
-        SHA1_Transform(context->state, context->buffer);
-        for ( ; i + 63 < len; i += 64) {
-            SHA1_Transform(context->state, data + i);
+        sha1_transform(context->state, context->buffer, 1);
+        if (len - i >= 64) {
+            sha1_transform(context->state, data + i, (len - i) / 64);
+            i += (len - i) & ~(size_t)63;
         }
         j = 0;
     }
@@ -215,15 +426,18 @@ void crypto_SHA1_Final(SHA1_CTX* context, uint8_t* digest)
 {
     uint32_t i;
     uint8_t  finalcount[8];
+    uint8_t  pad[64];
+    size_t   used;
 
     for (i = 0; i < 8; i++) {
         finalcount[i] = (unsigned char)((context->count[(i >= 4 ? 0 : 1)]
          >> ((3-(i & 3)) * 8) ) & 255);  /* Endian independent */
     }
-    crypto_SHA1_Update(context, (uint8_t *)"\200", 1);
-    while ((context->count[0] & 504) != 448) {
-        crypto_SHA1_Update(context, (uint8_t *)"\0", 1);
-    }
+    /* 0x80 and zeroes up to 56 mod 64, in one go */
+    used = (context->count[0] >> 3) & 63;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    crypto_SHA1_Update(context, pad, used < 56 ? 56 - used : 120 - used);
     crypto_SHA1_Update(context, finalcount, 8);  /* Should cause a SHA1_Transform() */
     for (i = 0; i < SHA1_DIGEST_SIZE; i++) {
         digest[i] = (uint8_t)
@@ -236,10 +450,6 @@ void crypto_SHA1_Final(SHA1_CTX* context, uint8_t* digest)
     memset(context->state, 0, 20);
     memset(context->count, 0, 8);
     memset(finalcount, 0, 8);	/* SWR */
-
-#ifdef SHA1HANDSOFF  /* make SHA1Transform overwrite its own static vars */
-    SHA1_Transform(context->state, context->buffer);
-#endif
 }
 
 
@@ -0,0 +1,274 @@
+/* sha256.c
+** strophe XMPP client library -- SHA-256 according to FIPS 180-4
+** HMAC-SHA-256 according to RFC2104
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/** @file
+ *  SHA-256 hash.
+ */
+
+#include <string.h>
+
+#include "ostypes.h"
+#include "cpu.h"
+#include "sha256.h"
+
+#ifdef CPU_X86_SHA
+#include <immintrin.h>
+#endif
+
+#define HMAC_BLOCK_SIZE 64
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define S0(x) (ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define S1(x) (ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define s0(x) (ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define s1(x) (ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+/* hash blocks of 512 bits */
+static void SHA256_Transform(uint32_t state[8], const uint8_t *data,
+                             size_t blocks)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (; blocks > 0; blocks--, data += 64) {
+        for (i = 0; i < 16; i++) {
+            w[i] = (uint32_t)data[i * 4] << 24 |
+                   (uint32_t)data[i * 4 + 1] << 16 |
+                   (uint32_t)data[i * 4 + 2] << 8 |
+                   (uint32_t)data[i * 4 + 3];
+        }
+        for (i = 16; i < 64; i++)
+            w[i] = s1(w[i - 2]) + w[i - 7] + s0(w[i - 15]) + w[i - 16];
+
+        a = state[0]; b = state[1]; c = state[2]; d = state[3];
+        e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+        for (i = 0; i < 64; i++) {
+            t1 = h + S1(e) + CH(e, f, g) + K[i] + w[i];
+            t2 = S0(a) + MAJ(a, b, c);
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#ifdef CPU_X86_SHA
+/* four rounds with the SHA extensions, w[] holds the message schedule of
+ * the next groups of rounds */
+#define SHA256_X86_ROUNDS(i) do { \
+    if ((i) < 4) { \
+        w[i] = _mm_loadu_si128((const __m128i *)(data + (i) * 16)); \
+        w[i] = _mm_shuffle_epi8(w[i], mask); \
+    } \
+    msg = _mm_add_epi32(w[(i) & 3], \
+                        _mm_loadu_si128((const __m128i *)&K[(i) * 4])); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+    if ((i) >= 3 && (i) < 15) { \
+        tmp = _mm_alignr_epi8(w[(i) & 3], w[((i) - 1) & 3], 4); \
+        w[((i) + 1) & 3] = _mm_add_epi32(w[((i) + 1) & 3], tmp); \
+        w[((i) + 1) & 3] = _mm_sha256msg2_epu32(w[((i) + 1) & 3], \
+                                                w[(i) & 3]); \
+    } \
+    msg = _mm_shuffle_epi32(msg, 0x0E); \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg); \
+    if ((i) >= 1 && (i) < 13) \
+        w[((i) - 1) & 3] = _mm_sha256msg1_epu32(w[((i) - 1) & 3], \
+                                                w[(i) & 3]); \
+} while (0)
+
+/* the same with the SHA extensions, which keep the state as ABEF and
+ * CDGH and do two rounds per instruction */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void SHA256_Transform_x86(uint32_t state[8], const uint8_t *data,
+                                 size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                        0x0405060700010203ULL);
+    __m128i state0, state1, abef, cdgh, msg, tmp;
+    __m128i w[4];
+
+    tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+    state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1); /* CDAB */
+    state1 = _mm_shuffle_epi32(state1, 0x1B); /* EFGH */
+    state0 = _mm_alignr_epi8(tmp, state1, 8); /* ABEF */
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0); /* CDGH */
+
+    for (; blocks > 0; blocks--, data += 64) {
+        abef = state0;
+        cdgh = state1;
+
+        SHA256_X86_ROUNDS(0); SHA256_X86_ROUNDS(1);
+        SHA256_X86_ROUNDS(2); SHA256_X86_ROUNDS(3);
+        SHA256_X86_ROUNDS(4); SHA256_X86_ROUNDS(5);
+        SHA256_X86_ROUNDS(6); SHA256_X86_ROUNDS(7);
+        SHA256_X86_ROUNDS(8); SHA256_X86_ROUNDS(9);
+        SHA256_X86_ROUNDS(10); SHA256_X86_ROUNDS(11);
+        SHA256_X86_ROUNDS(12); SHA256_X86_ROUNDS(13);
+        SHA256_X86_ROUNDS(14); SHA256_X86_ROUNDS(15);
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B); /* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xB1); /* DCHG */
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0); /* DCBA */
+    state1 = _mm_alignr_epi8(state1, tmp, 8); /* HGFE */
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+#endif
+
+static void SHA256_Transform_detect(uint32_t state[8], const uint8_t *data,
+                                    size_t blocks);
+
+/* set to the best implementation for this CPU on first use */
+static void (*sha256_transform)(uint32_t state[8], const uint8_t *data,
+                                size_t blocks) = SHA256_Transform_detect;
+
+static void SHA256_Transform_detect(uint32_t state[8], const uint8_t *data,
+                                    size_t blocks)
+{
+#ifdef CPU_X86_SHA
+    if (cpu_has_x86_sha())
+        sha256_transform = SHA256_Transform_x86;
+    else
+#endif
+        sha256_transform = SHA256_Transform;
+    sha256_transform(state, data, blocks);
+}
+
+void crypto_SHA256_Init(sha256_context* context)
+{
+    context->state[0] = 0x6a09e667;
+    context->state[1] = 0xbb67ae85;
+    context->state[2] = 0x3c6ef372;
+    context->state[3] = 0xa54ff53a;
+    context->state[4] = 0x510e527f;
+    context->state[5] = 0x9b05688c;
+    context->state[6] = 0x1f83d9ab;
+    context->state[7] = 0x5be0cd19;
+    context->length = 0;
+}
+
+void crypto_SHA256_Update(sha256_context* context, const uint8_t* data,
+                          const size_t len)
+{
+    size_t i = 0;
+    size_t used = (size_t)(context->length % 64);
+    size_t n;
+
+    context->length += len;
+    if (used) {
+        n = len < 64 - used ? len : 64 - used;
+        memcpy(context->buffer + used, data, n);
+        i = n;
+        if (used + n < 64) return;
+        sha256_transform(context->state, context->buffer, 1);
+    }
+    if (len - i >= 64) {
+        sha256_transform(context->state, data + i, (len - i) / 64);
+        i += (len - i) & ~(size_t)63;
+    }
+    if (i < len)
+        memcpy(context->buffer, data + i, len - i);
+}
+
+void crypto_SHA256_Final(sha256_context* context, uint8_t* digest)
+{
+    uint64_t bits = context->length * 8;
+    uint8_t pad[72];
+    size_t used = (size_t)(context->length % 64);
+    size_t padlen = used < 56 ? 56 - used : 120 - used;
+    int i;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++)
+        pad[padlen + i] = (uint8_t)(bits >> (56 - i * 8));
+    crypto_SHA256_Update(context, pad, padlen + 8);
+
+    for (i = 0; i < 32; i++)
+        digest[i] = (uint8_t)(context->state[i / 4] >> (24 - (i % 4) * 8));
+
+    /* wipe the state */
+    memset(context, 0, sizeof(*context));
+}
+
+void crypto_SHA256(const uint8_t* data, size_t len, uint8_t* digest)
+{
+    sha256_context ctx;
+
+    crypto_SHA256_Init(&ctx);
+    crypto_SHA256_Update(&ctx, data, len);
+    crypto_SHA256_Final(&ctx, digest);
+}
+
+void crypto_HMAC_SHA256(const uint8_t* key, size_t key_len,
+                        const uint8_t* text, size_t len, uint8_t* digest)
+{
+    uint8_t key_pad[HMAC_BLOCK_SIZE];
+    uint8_t key_ipad[HMAC_BLOCK_SIZE];
+    uint8_t key_opad[HMAC_BLOCK_SIZE];
+    uint8_t sha_digest[SHA256_DIGEST_SIZE];
+    sha256_context ctx;
+    int i;
+
+    memset(key_pad, 0, sizeof(key_pad));
+    if (key_len <= HMAC_BLOCK_SIZE) {
+        memcpy(key_pad, key, key_len);
+    } else {
+        /* according to RFC2104 */
+        crypto_SHA256(key, key_len, key_pad);
+    }
+
+    for (i = 0; i < HMAC_BLOCK_SIZE; i++) {
+        key_ipad[i] = key_pad[i] ^ 0x36;
+        key_opad[i] = key_pad[i] ^ 0x5C;
+    }
+
+    crypto_SHA256_Init(&ctx);
+    crypto_SHA256_Update(&ctx, key_ipad, HMAC_BLOCK_SIZE);
+    crypto_SHA256_Update(&ctx, text, len);
+    crypto_SHA256_Final(&ctx, sha_digest);
+
+    crypto_SHA256_Init(&ctx);
+    crypto_SHA256_Update(&ctx, key_opad, HMAC_BLOCK_SIZE);
+    crypto_SHA256_Update(&ctx, sha_digest, SHA256_DIGEST_SIZE);
+    crypto_SHA256_Final(&ctx, digest);
+}
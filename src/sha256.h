@@ -0,0 +1,46 @@
+/* sha256.h
+** strophe XMPP client library -- SHA-256 hash API
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/** @file
+ *  SHA-256 hash API.
+ */
+
+#ifndef __LIBSTROPHE_SHA256_H__
+#define __LIBSTROPHE_SHA256_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* make sure the stdint.h types are available */
+#include "ostypes.h"
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length; /* bytes hashed so far */
+    uint8_t  buffer[64];
+} sha256_context;
+
+#define SHA256_DIGEST_SIZE 32
+
+void crypto_SHA256_Init(sha256_context* context);
+void crypto_SHA256_Update(sha256_context* context, const uint8_t* data,
+                          const size_t len);
+void crypto_SHA256_Final(sha256_context* context, uint8_t* digest);
+void crypto_SHA256(const uint8_t* data, size_t len, uint8_t* digest);
+void crypto_HMAC_SHA256(const uint8_t* key, size_t key_len,
+                        const uint8_t* text, size_t len, uint8_t* digest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBSTROPHE_SHA256_H__ */
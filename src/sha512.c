@@ -0,0 +1,173 @@
+/* sha512.c
+** strophe XMPP client library -- SHA-512 according to FIPS 180-4
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/** @file
+ *  SHA-512 hash.
+ */
+
+#include <string.h>
+
+#include "ostypes.h"
+#include "sha512.h"
+
+#define U64(x) x##ULL
+
+static const uint64_t K[80] = {
+    U64(0x428a2f98d728ae22), U64(0x7137449123ef65cd),
+    U64(0xb5c0fbcfec4d3b2f), U64(0xe9b5dba58189dbbc),
+    U64(0x3956c25bf348b538), U64(0x59f111f1b605d019),
+    U64(0x923f82a4af194f9b), U64(0xab1c5ed5da6d8118),
+    U64(0xd807aa98a3030242), U64(0x12835b0145706fbe),
+    U64(0x243185be4ee4b28c), U64(0x550c7dc3d5ffb4e2),
+    U64(0x72be5d74f27b896f), U64(0x80deb1fe3b1696b1),
+    U64(0x9bdc06a725c71235), U64(0xc19bf174cf692694),
+    U64(0xe49b69c19ef14ad2), U64(0xefbe4786384f25e3),
+    U64(0x0fc19dc68b8cd5b5), U64(0x240ca1cc77ac9c65),
+    U64(0x2de92c6f592b0275), U64(0x4a7484aa6ea6e483),
+    U64(0x5cb0a9dcbd41fbd4), U64(0x76f988da831153b5),
+    U64(0x983e5152ee66dfab), U64(0xa831c66d2db43210),
+    U64(0xb00327c898fb213f), U64(0xbf597fc7beef0ee4),
+    U64(0xc6e00bf33da88fc2), U64(0xd5a79147930aa725),
+    U64(0x06ca6351e003826f), U64(0x142929670a0e6e70),
+    U64(0x27b70a8546d22ffc), U64(0x2e1b21385c26c926),
+    U64(0x4d2c6dfc5ac42aed), U64(0x53380d139d95b3df),
+    U64(0x650a73548baf63de), U64(0x766a0abb3c77b2a8),
+    U64(0x81c2c92e47edaee6), U64(0x92722c851482353b),
+    U64(0xa2bfe8a14cf10364), U64(0xa81a664bbc423001),
+    U64(0xc24b8b70d0f89791), U64(0xc76c51a30654be30),
+    U64(0xd192e819d6ef5218), U64(0xd69906245565a910),
+    U64(0xf40e35855771202a), U64(0x106aa07032bbd1b8),
+    U64(0x19a4c116b8d2d0c8), U64(0x1e376c085141ab53),
+    U64(0x2748774cdf8eeb99), U64(0x34b0bcb5e19b48a8),
+    U64(0x391c0cb3c5c95a63), U64(0x4ed8aa4ae3418acb),
+    U64(0x5b9cca4f7763e373), U64(0x682e6ff3d6b2b8a3),
+    U64(0x748f82ee5defb2fc), U64(0x78a5636f43172f60),
+    U64(0x84c87814a1f0ab72), U64(0x8cc702081a6439ec),
+    U64(0x90befffa23631e28), U64(0xa4506cebde82bde9),
+    U64(0xbef9a3f7b2c67915), U64(0xc67178f2e372532b),
+    U64(0xca273eceea26619c), U64(0xd186b8c721c0c207),
+    U64(0xeada7dd6cde0eb1e), U64(0xf57d4f7fee6ed178),
+    U64(0x06f067aa72176fba), U64(0x0a637dc5a2c898a6),
+    U64(0x113f9804bef90dae), U64(0x1b710b35131c471b),
+    U64(0x28db77f523047d84), U64(0x32caab7b40c72493),
+    U64(0x3c9ebe0a15c9bebc), U64(0x431d67c49c100d4c),
+    U64(0x4cc5d4becb3e42b6), U64(0x597f299cfc657e2a),
+    U64(0x5fcb6fab3ad6faec), U64(0x6c44198c4a475817)
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+#define CH(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define S0(x) (ROR(x, 28) ^ ROR(x, 34) ^ ROR(x, 39))
+#define S1(x) (ROR(x, 14) ^ ROR(x, 18) ^ ROR(x, 41))
+#define s0(x) (ROR(x, 1) ^ ROR(x, 8) ^ ((x) >> 7))
+#define s1(x) (ROR(x, 19) ^ ROR(x, 61) ^ ((x) >> 6))
+
+/* hash blocks of 1024 bits */
+static void SHA512_Transform(uint64_t state[8], const uint8_t *data,
+                             size_t blocks)
+{
+    uint64_t w[80];
+    uint64_t a, b, c, d, e, f, g, h, t1, t2;
+    int i, j;
+
+    for (; blocks > 0; blocks--, data += 128) {
+        for (i = 0; i < 16; i++) {
+            w[i] = 0;
+            for (j = 0; j < 8; j++)
+                w[i] = w[i] << 8 | data[i * 8 + j];
+        }
+        for (i = 16; i < 80; i++)
+            w[i] = s1(w[i - 2]) + w[i - 7] + s0(w[i - 15]) + w[i - 16];
+
+        a = state[0]; b = state[1]; c = state[2]; d = state[3];
+        e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+        for (i = 0; i < 80; i++) {
+            t1 = h + S1(e) + CH(e, f, g) + K[i] + w[i];
+            t2 = S0(a) + MAJ(a, b, c);
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+void crypto_SHA512_Init(sha512_context* context)
+{
+    context->state[0] = U64(0x6a09e667f3bcc908);
+    context->state[1] = U64(0xbb67ae8584caa73b);
+    context->state[2] = U64(0x3c6ef372fe94f82b);
+    context->state[3] = U64(0xa54ff53a5f1d36f1);
+    context->state[4] = U64(0x510e527fade682d1);
+    context->state[5] = U64(0x9b05688c2b3e6c1f);
+    context->state[6] = U64(0x1f83d9abfb41bd6b);
+    context->state[7] = U64(0x5be0cd19137e2179);
+    context->length = 0;
+}
+
+void crypto_SHA512_Update(sha512_context* context, const uint8_t* data,
+                          const size_t len)
+{
+    size_t i = 0;
+    size_t used = (size_t)(context->length % 128);
+    size_t n;
+
+    context->length += len;
+    if (used) {
+        n = len < 128 - used ? len : 128 - used;
+        memcpy(context->buffer + used, data, n);
+        i = n;
+        if (used + n < 128) return;
+        SHA512_Transform(context->state, context->buffer, 1);
+    }
+    if (len - i >= 128) {
+        SHA512_Transform(context->state, data + i, (len - i) / 128);
+        i += (len - i) & ~(size_t)127;
+    }
+    if (i < len)
+        memcpy(context->buffer, data + i, len - i);
+}
+
+void crypto_SHA512_Final(sha512_context* context, uint8_t* digest)
+{
+    uint64_t bits = context->length * 8;
+    uint8_t pad[144];
+    size_t used = (size_t)(context->length % 128);
+    size_t padlen = used < 112 ? 112 - used : 240 - used;
+    int i;
+
+    /* the length is 128 bits, of which we only fill the lower 64 bits
+     * and the three bits shifted out of them */
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    pad[padlen + 7] = (uint8_t)(context->length >> 61);
+    for (i = 0; i < 8; i++)
+        pad[padlen + 8 + i] = (uint8_t)(bits >> (56 - i * 8));
+    crypto_SHA512_Update(context, pad, padlen + 16);
+
+    for (i = 0; i < 64; i++)
+        digest[i] = (uint8_t)(context->state[i / 8] >> (56 - (i % 8) * 8));
+
+    /* wipe the state */
+    memset(context, 0, sizeof(*context));
+}
+
+void crypto_SHA512(const uint8_t* data, size_t len, uint8_t* digest)
+{
+    sha512_context ctx;
+
+    crypto_SHA512_Init(&ctx);
+    crypto_SHA512_Update(&ctx, data, len);
+    crypto_SHA512_Final(&ctx, digest);
+}
@@ -0,0 +1,44 @@
+/* sha512.h
+** strophe XMPP client library -- SHA-512 hash API
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/** @file
+ *  SHA-512 hash API.
+ */
+
+#ifndef __LIBSTROPHE_SHA512_H__
+#define __LIBSTROPHE_SHA512_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* make sure the stdint.h types are available */
+#include "ostypes.h"
+
+typedef struct {
+    uint64_t state[8];
+    uint64_t length; /* bytes hashed so far */
+    uint8_t  buffer[128];
+} sha512_context;
+
+#define SHA512_DIGEST_SIZE 64
+
+void crypto_SHA512_Init(sha512_context* context);
+void crypto_SHA512_Update(sha512_context* context, const uint8_t* data,
+                          const size_t len);
+void crypto_SHA512_Final(sha512_context* context, uint8_t* digest);
+void crypto_SHA512(const uint8_t* data, size_t len, uint8_t* digest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBSTROPHE_SHA512_H__ */
@@ -0,0 +1,280 @@
+/* sm.c
+** strophe XMPP client library -- XEP-0198 stream management
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/** @file
+ *  Stream management acks and the queue of unacknowledged stanzas.
+ *
+ *  Negotiation of <enable/> and <resume/> lives with the rest of the
+ *  stream setup in auth.c; this file keeps the counters while the stream
+ *  runs.  Every stanza sent after <enable/> stays queued until the server
+ *  acknowledges it, so it can be sent again on a resumed stream.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+
+#ifndef SM_REQUEST_THRESHOLD
+/** @def SM_REQUEST_THRESHOLD
+ *  Number of unacknowledged stanzas which triggers an ack request.
+ */
+#define SM_REQUEST_THRESHOLD 10
+#endif
+#ifndef SM_REQUEST_PERIOD
+/** @def SM_REQUEST_PERIOD
+ *  Time in milliseconds after which fewer stanzas are acknowledged too.
+ */
+#define SM_REQUEST_PERIOD 5000 /* 5 seconds */
+#endif
+
+static int _sm_is_stanza(xmpp_stanza_t * const stanza)
+{
+    const char *name = xmpp_stanza_get_name(stanza);
+
+    return name && (strcmp(name, "message") == 0 ||
+                    strcmp(name, "presence") == 0 ||
+                    strcmp(name, "iq") == 0);
+}
+
+static void _sm_request(xmpp_conn_t * const conn)
+{
+    xmpp_send_raw_string(conn, "<r xmlns='%s'/>", XMPP_NS_SM);
+    conn->sm_unrequested = 0;
+}
+
+static void _sm_queue_free(xmpp_conn_t * const conn)
+{
+    xmpp_send_queue_t *item;
+
+    while ((item = conn->sm_queue_head)) {
+        conn->sm_queue_head = item->next;
+        xmpp_free(conn->ctx, item->data);
+        xmpp_free(conn->ctx, item);
+    }
+    conn->sm_queue_tail = NULL;
+}
+
+/* <r/>: tell the server how many stanzas we have handled */
+static int _sm_handle_r(xmpp_conn_t * const conn,
+                        xmpp_stanza_t * const stanza,
+                        void * const userdata)
+{
+    sm_send_ack(conn);
+    return 1;
+}
+
+/* <a/>: the server has handled our stanzas up to h */
+static int _sm_handle_a(xmpp_conn_t * const conn,
+                        xmpp_stanza_t * const stanza,
+                        void * const userdata)
+{
+    const char *h = xmpp_stanza_get_attribute(stanza, "h");
+
+    if (h)
+        sm_ack(conn, strtoul(h, NULL, 10));
+    return 1;
+}
+
+static int _sm_request_timer(xmpp_conn_t * const conn,
+                             void * const userdata)
+{
+    if (conn->sm_state == XMPP_SM_ENABLED && conn->sm_unrequested > 0)
+        _sm_request(conn);
+    return 1;
+}
+
+/** Start counting on a stream which has been enabled or resumed.
+ *  This function should not be used outside of the library.
+ *
+ *  @param conn a Strophe connection object
+ */
+void sm_start(xmpp_conn_t * const conn)
+{
+    handler_add(conn, _sm_handle_r, XMPP_NS_SM, "r", NULL, NULL);
+    handler_add(conn, _sm_handle_a, XMPP_NS_SM, "a", NULL, NULL);
+    handler_add_timed(conn, _sm_request_timer, SM_REQUEST_PERIOD, NULL);
+}
+
+/** Forget the stream management session.
+ *  Unacknowledged stanzas are dropped and the stream can't be resumed
+ *  anymore.  This function should not be used outside of the library.
+ *
+ *  @param conn a Strophe connection object
+ */
+void sm_reset(xmpp_conn_t * const conn)
+{
+    if (conn->sm_sent != conn->sm_acked)
+        xmpp_debug(conn->ctx, "sm", "Dropping %u unacknowledged stanzas",
+                   (unsigned int)(conn->sm_sent - conn->sm_acked));
+    _sm_queue_free(conn);
+    if (conn->sm_id) xmpp_free(conn->ctx, conn->sm_id);
+    conn->sm_id = NULL;
+    conn->sm_state = XMPP_SM_DISABLED;
+    conn->sm_handled = 0;
+    conn->sm_sent = 0;
+    conn->sm_acked = 0;
+    conn->sm_unrequested = 0;
+}
+
+/** Stop counting when the stream goes away.
+ *  A resumable session keeps its queue and counters for the next
+ *  connect.  This function should not be used outside of the library.
+ *
+ *  @param conn a Strophe connection object
+ */
+void sm_disconnect(xmpp_conn_t * const conn)
+{
+    xmpp_handler_delete(conn, _sm_handle_r);
+    xmpp_handler_delete(conn, _sm_handle_a);
+    xmpp_timed_handler_delete(conn, _sm_request_timer);
+
+    if (conn->sm_id == NULL)
+        sm_reset(conn);
+    conn->sm_state = XMPP_SM_DISABLED;
+}
+
+/** Check whether an outgoing stanza has to wait for the session.
+ *  While a resumption is pending, stanzas are only queued.  <resumed/>
+ *  sends them after the ones the server lost and <failed/> drops them
+ *  with the rest of the queue.  This function should not be used outside
+ *  of the library.
+ *
+ *  @param conn a Strophe connection object
+ *  @param stanza the stanza to be sent
+ *
+ *  @return 1 if the stanza must not be written yet, 0 otherwise
+ */
+int sm_stanza_held(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza)
+{
+    return conn->sm_state == XMPP_SM_RESUMING && _sm_is_stanza(stanza);
+}
+
+/** Count an outgoing stanza.
+ *  The rendered stanza is kept until the server acknowledges it.
+ *  This function should not be used outside of the library.
+ *
+ *  @param conn a Strophe connection object
+ *  @param stanza the stanza which has been sent
+ *  @param buf the rendered stanza, owned by the queue on success
+ *  @param len length of buf
+ *
+ *  @return 1 if the queue took buf, 0 if the caller still owns it
+ */
+int sm_stanza_sent(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza,
+                   char *buf, size_t len)
+{
+    xmpp_send_queue_t *item;
+
+    if (conn->sm_state == XMPP_SM_DISABLED || !_sm_is_stanza(stanza))
+        return 0;
+
+    item = xmpp_alloc(conn->ctx, sizeof(*item));
+    if (!item) {
+        /* the stanza can't be replayed, so give up on resumption */
+        xmpp_error(conn->ctx, "sm", "Out of memory, disabling resumption");
+        if (conn->sm_id) xmpp_free(conn->ctx, conn->sm_id);
+        conn->sm_id = NULL;
+        conn->sm_sent++;
+        conn->sm_acked++;
+        return 0;
+    }
+    item->data = buf;
+    item->len = len;
+    item->written = 0;
+    item->next = NULL;
+    if (conn->sm_queue_tail)
+        conn->sm_queue_tail->next = item;
+    else
+        conn->sm_queue_head = item;
+    conn->sm_queue_tail = item;
+    conn->sm_sent++;
+
+    if (++conn->sm_unrequested >= SM_REQUEST_THRESHOLD &&
+        conn->sm_state == XMPP_SM_ENABLED)
+        _sm_request(conn);
+
+    return 1;
+}
+
+/** Count an incoming stanza once the handlers have seen it.
+ *  This function should not be used outside of the library.
+ *
+ *  @param conn a Strophe connection object
+ *  @param stanza the received stanza
+ */
+void sm_stanza_handled(xmpp_conn_t * const conn,
+                       xmpp_stanza_t * const stanza)
+{
+    if (conn->sm_state == XMPP_SM_ENABLED && _sm_is_stanza(stanza))
+        conn->sm_handled++;
+}
+
+/** Drop the stanzas the server has acknowledged.
+ *  This function should not be used outside of the library.
+ *
+ *  @param conn a Strophe connection object
+ *  @param h number of stanzas the server has handled, modulo 2^32
+ */
+void sm_ack(xmpp_conn_t * const conn, uint32_t h)
+{
+    xmpp_send_queue_t *item;
+    uint32_t count = h - conn->sm_acked;
+
+    if (count > conn->sm_sent - conn->sm_acked) {
+        xmpp_error(conn->ctx, "sm", "Server acknowledged %u stanzas, "
+                   "only %u were sent", (unsigned int)count,
+                   (unsigned int)(conn->sm_sent - conn->sm_acked));
+        count = conn->sm_sent - conn->sm_acked;
+    }
+
+    while (count-- > 0 && (item = conn->sm_queue_head)) {
+        conn->sm_queue_head = item->next;
+        xmpp_free(conn->ctx, item->data);
+        xmpp_free(conn->ctx, item);
+        conn->sm_acked++;
+    }
+    if (!conn->sm_queue_head) conn->sm_queue_tail = NULL;
+}
+
+/** Acknowledge the stanzas handled so far.
+ *  This function should not be used outside of the library.
+ *
+ *  @param conn a Strophe connection object
+ */
+void sm_send_ack(xmpp_conn_t * const conn)
+{
+    xmpp_send_raw_string(conn, "<a xmlns='%s' h='%u'/>", XMPP_NS_SM,
+                         (unsigned int)conn->sm_handled);
+}
+
+/** Send the stanzas the server lost again on a resumed stream.
+ *  They keep their place in the count.  This function should not be used
+ *  outside of the library.
+ *
+ *  @param conn a Strophe connection object
+ */
+void sm_resend(xmpp_conn_t * const conn)
+{
+    xmpp_send_queue_t *item;
+    int count = 0;
+
+    for (item = conn->sm_queue_head; item; item = item->next) {
+        xmpp_send_raw(conn, item->data, item->len);
+        count++;
+    }
+    if (count > 0) {
+        xmpp_debug(conn->ctx, "sm", "Resent %d stanzas", count);
+        conn->sm_unrequested = count;
+        _sm_request(conn);
+    }
+}
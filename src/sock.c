@@ -27,7 +27,9 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <arpa/nameser.h>
@@ -73,7 +75,8 @@ static int _in_progress(int error)
 #endif
 }
 
-sock_t sock_connect(const char * const host, const unsigned int port)
+sock_t sock_connect(const char * const host, const unsigned int port,
+                    const sock_opts_t * const opts, int * const failed)
 {
     sock_t sock;
     char service[6];
@@ -99,6 +102,8 @@ sock_t sock_connect(const char * const host, const unsigned int port)
         if (sock < 0)
             continue;
 
+        err = sock_set_options(sock, opts);
+        if (failed) *failed = err;
         err = sock_set_nonblocking(sock);
         if (err == 0) {
             err = connect(sock, ainfo->ai_addr, ainfo->ai_addrlen);
@@ -114,6 +119,91 @@ sock_t sock_connect(const char * const host, const unsigned int port)
     return sock;
 }
 
+/* starts a non-blocking connect to a resolved IPv4 or IPv6 address */
+sock_t sock_connect_addr(const int family, const unsigned char * const addr,
+                         const unsigned int port,
+                         const sock_opts_t * const opts, int * const failed)
+{
+    struct sockaddr_storage ss;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+    socklen_t len;
+    sock_t sock;
+    int err;
+
+    memset(&ss, 0, sizeof(ss));
+    if (family == AF_INET) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        memcpy(&sin->sin_addr, addr, 4);
+        len = sizeof(*sin);
+    } else if (family == AF_INET6) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        memcpy(&sin6->sin6_addr, addr, 16);
+        len = sizeof(*sin6);
+    } else {
+        return -1;
+    }
+
+    sock = socket(family, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0)
+        return -1;
+
+    err = sock_set_options(sock, opts);
+    if (failed) *failed = err;
+    err = sock_set_nonblocking(sock);
+    if (err == 0) {
+        err = connect(sock, (struct sockaddr *)&ss, len);
+        if (err == 0 || _in_progress(sock_error()))
+            return sock;
+    }
+    sock_close(sock);
+
+    return -1;
+}
+
+/* starts a non-blocking connect to a local stream socket */
+sock_t sock_connect_unix(const char * const path,
+                         const sock_opts_t * const opts, int * const failed)
+{
+#ifndef _WIN32
+    struct sockaddr_un addr;
+    sock_opts_t unix_opts;
+    sock_t sock;
+    int err;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+
+    /* only the buffer sizes make sense without TCP */
+    memset(&unix_opts, 0, sizeof(unix_opts));
+    if (opts) {
+        unix_opts.sndbuf = opts->sndbuf;
+        unix_opts.rcvbuf = opts->rcvbuf;
+    }
+    err = sock_set_options(sock, &unix_opts);
+    if (failed) *failed = err;
+
+    err = sock_set_nonblocking(sock);
+    if (err == 0) {
+        err = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+        if (err == 0 || _in_progress(sock_error()))
+            return sock;
+    }
+    sock_close(sock);
+#endif
+
+    return -1;
+}
+
 int sock_close(const sock_t sock)
 {
 #ifdef _WIN32
@@ -123,6 +213,77 @@ int sock_close(const sock_t sock)
 #endif
 }
 
+static int _setsockopt_int(const sock_t sock, const int level,
+                           const int name, const int value)
+{
+    return setsockopt(sock, level, name, (const void *)&value, sizeof(value));
+}
+
+/* applies the socket options, they must be set before connect() since the
+ * buffer sizes determine the window scale negotiated in the handshake.
+ * options the platform doesn't know are skipped, returns the SOCK_OPT_*
+ * bits of the supported ones which couldn't be set */
+int sock_set_options(const sock_t sock, const sock_opts_t * const opts)
+{
+    int failed = 0;
+
+    if (opts == NULL)
+        return 0;
+
+    if (opts->nodelay &&
+        _setsockopt_int(sock, IPPROTO_TCP, TCP_NODELAY, 1) != 0)
+        failed |= SOCK_OPT_NODELAY;
+
+    if (opts->keepalive_idle > 0) {
+        if (_setsockopt_int(sock, SOL_SOCKET, SO_KEEPALIVE, 1) != 0)
+            failed |= SOCK_OPT_KEEPALIVE;
+#if defined(TCP_KEEPIDLE)
+        if (_setsockopt_int(sock, IPPROTO_TCP, TCP_KEEPIDLE,
+                            opts->keepalive_idle) != 0)
+            failed |= SOCK_OPT_KEEPALIVE;
+#elif defined(TCP_KEEPALIVE)
+        /* macOS names the idle time TCP_KEEPALIVE */
+        if (_setsockopt_int(sock, IPPROTO_TCP, TCP_KEEPALIVE,
+                            opts->keepalive_idle) != 0)
+            failed |= SOCK_OPT_KEEPALIVE;
+#endif
+#ifdef TCP_KEEPINTVL
+        if (opts->keepalive_interval > 0 &&
+            _setsockopt_int(sock, IPPROTO_TCP, TCP_KEEPINTVL,
+                            opts->keepalive_interval) != 0)
+            failed |= SOCK_OPT_KEEPALIVE;
+#endif
+#ifdef TCP_KEEPCNT
+        if (opts->keepalive_count > 0 &&
+            _setsockopt_int(sock, IPPROTO_TCP, TCP_KEEPCNT,
+                            opts->keepalive_count) != 0)
+            failed |= SOCK_OPT_KEEPALIVE;
+#endif
+    }
+
+    if (opts->sndbuf > 0 &&
+        _setsockopt_int(sock, SOL_SOCKET, SO_SNDBUF, opts->sndbuf) != 0)
+        failed |= SOCK_OPT_SNDBUF;
+    if (opts->rcvbuf > 0 &&
+        _setsockopt_int(sock, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf) != 0)
+        failed |= SOCK_OPT_RCVBUF;
+
+#ifdef TCP_USER_TIMEOUT
+    if (opts->user_timeout > 0 &&
+        _setsockopt_int(sock, IPPROTO_TCP, TCP_USER_TIMEOUT,
+                        (int)opts->user_timeout) != 0)
+        failed |= SOCK_OPT_USER_TIMEOUT;
+#endif
+#ifdef SO_BUSY_POLL
+    if (opts->busy_poll > 0 &&
+        _setsockopt_int(sock, SOL_SOCKET, SO_BUSY_POLL,
+                        (int)opts->busy_poll) != 0)
+        failed |= SOCK_OPT_BUSY_POLL;
+#endif
+
+    return failed;
+}
+
 int sock_set_blocking(const sock_t sock)
 {
 #ifdef _WIN32
@@ -165,6 +326,19 @@ int sock_write(const sock_t sock, const void * const buff, const size_t len)
     return send(sock, buff, len, 0);
 }
 
+/* gathers the buffers into a single send, returns the number of bytes
+ * written like sock_write() */
+int sock_writev(const sock_t sock, const sock_iovec_t * const iov,
+                const int iovcnt)
+{
+#ifdef _WIN32
+    /* WSABUF has a different layout, send the first buffer only */
+    return iovcnt > 0 ? sock_write(sock, iov[0].iov_base, iov[0].iov_len) : 0;
+#else
+    return writev(sock, iov, iovcnt);
+#endif
+}
+
 int sock_is_recoverable(const int error)
 {
 #ifdef _WIN32
@@ -19,24 +19,65 @@
 #include <stdio.h>
 
 #ifndef _WIN32
+#include <sys/uio.h>
 typedef int sock_t;
+typedef struct iovec sock_iovec_t;
 #else
 #include <winsock2.h>
 typedef SOCKET sock_t;
+typedef struct {
+    void *iov_base;
+    size_t iov_len;
+} sock_iovec_t;
 #endif
 
+/* most buffers handed to sock_writev() at once */
+#define SOCK_IOV_MAX 16
+
+/* bits of the options sock_set_options() couldn't set */
+#define SOCK_OPT_NODELAY 0x01
+#define SOCK_OPT_KEEPALIVE 0x02
+#define SOCK_OPT_SNDBUF 0x04
+#define SOCK_OPT_RCVBUF 0x08
+#define SOCK_OPT_USER_TIMEOUT 0x10
+#define SOCK_OPT_BUSY_POLL 0x20
+
+/* options applied to a socket before it connects, zero keeps the system
+ * default */
+typedef struct _sock_opts_t {
+    int nodelay; /* disable Nagle's algorithm */
+    int keepalive_idle; /* seconds of idle before the first probe */
+    int keepalive_interval; /* seconds between probes */
+    int keepalive_count; /* unanswered probes before the link is dropped */
+    int sndbuf; /* bytes */
+    int rcvbuf; /* bytes */
+    unsigned int user_timeout; /* milliseconds unacknowledged data may wait */
+    unsigned int busy_poll; /* microseconds to busy poll on reads */
+} sock_opts_t;
+
 void sock_initialize(void);
 void sock_shutdown(void);
 
 int sock_error(void);
 
-sock_t sock_connect(const char * const host, const unsigned int port);
+/* the connect functions store the SOCK_OPT_* bits of the options they
+ * couldn't set in failed, unless it is NULL */
+sock_t sock_connect(const char * const host, const unsigned int port,
+                    const sock_opts_t * const opts, int * const failed);
+sock_t sock_connect_addr(const int family, const unsigned char * const addr,
+                         const unsigned int port,
+                         const sock_opts_t * const opts, int * const failed);
+sock_t sock_connect_unix(const char * const path,
+                         const sock_opts_t * const opts, int * const failed);
 int sock_close(const sock_t sock);
 
 int sock_set_blocking(const sock_t sock);
 int sock_set_nonblocking(const sock_t sock);
+int sock_set_options(const sock_t sock, const sock_opts_t * const opts);
 int sock_read(const sock_t sock, void * const buff, const size_t len);
 int sock_write(const sock_t sock, const void * const buff, const size_t len);
+int sock_writev(const sock_t sock, const sock_iovec_t * const iov,
+                const int iovcnt);
 int sock_is_recoverable(const int error);
 /* checks for an error after connect, return 0 if connect successful */
 int sock_connect_error(const sock_t sock);
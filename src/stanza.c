@@ -16,6 +16,7 @@
 /** @defgroup Stanza Stanza creation and manipulation
  */
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -27,6 +28,80 @@
 #define inline __inline
 #endif
 
+/* A block holding the nodes and strings of a stanza built from a template,
+ * freed when the last of them is. */
+struct _stanza_arena_t {
+    unsigned int ref;
+};
+
+static void _stanza_arena_release(xmpp_ctx_t *ctx, stanza_arena_t *arena)
+{
+    if (--arena->ref == 0)
+	xmpp_free(ctx, arena);
+}
+
+/* Names and texts are shared by a stanza and its copies, with the count
+ * of their users in front of the characters.  They are never changed in
+ * place, a setter puts in a new one. */
+typedef struct {
+    unsigned int ref;
+    stanza_arena_t *arena;
+} stanza_data_t;
+
+static char *_stanza_data_new(xmpp_ctx_t *ctx, const char *text,
+			      const size_t len)
+{
+    stanza_data_t *head;
+    char *data;
+
+    head = xmpp_alloc(ctx, sizeof(*head) + len + 1);
+    if (!head) return NULL;
+    head->ref = 1;
+    head->arena = NULL;
+    data = (char *)(head + 1);
+    memcpy(data, text, len);
+    data[len] = '\0';
+
+    return data;
+}
+
+static char *_stanza_data_clone(char *data)
+{
+    ((stanza_data_t *)data - 1)->ref++;
+
+    return data;
+}
+
+static void _stanza_data_release(xmpp_ctx_t *ctx, char *data)
+{
+    stanza_data_t *head = (stanza_data_t *)data - 1;
+
+    if (--head->ref == 0) {
+	if (head->arena)
+	    _stanza_arena_release(ctx, head->arena);
+	else
+	    xmpp_free(ctx, head);
+    }
+}
+
+static void _stanza_init(xmpp_stanza_t *stanza, xmpp_ctx_t *ctx)
+{
+    stanza->ref = 1;
+    stanza->ctx = ctx;
+    stanza->arena = NULL;
+    stanza->type = XMPP_STANZA_UNKNOWN;
+    stanza->prev = NULL;
+    stanza->next = NULL;
+    stanza->children = NULL;
+    stanza->parent = NULL;
+    stanza->data = NULL;
+    stanza->attributes = NULL;
+    stanza->frozen = 0;
+    stanza->rendered = NULL;
+    stanza->rendered_len = 0;
+    stanza->rendered_skip_ns = 0;
+}
+
 /** Create a stanza object.
  *  This function allocates and initializes and blank stanza object.
  *  The stanza will have a reference count of one, so the caller does not
@@ -43,17 +118,8 @@ xmpp_stanza_t *xmpp_stanza_new(xmpp_ctx_t *ctx)
     xmpp_stanza_t *stanza;
 
     stanza = xmpp_alloc(ctx, sizeof(xmpp_stanza_t));
-    if (stanza != NULL) {
-	stanza->ref = 1;
-	stanza->ctx = ctx;
-	stanza->type = XMPP_STANZA_UNKNOWN;
-	stanza->prev = NULL;
-	stanza->next = NULL;
-	stanza->children = NULL;
-	stanza->parent = NULL;
-	stanza->data = NULL;
-	stanza->attributes = NULL;
-    }
+    if (stanza != NULL)
+	_stanza_init(stanza, ctx);
 
     return stanza; 
 }
@@ -75,40 +141,57 @@ xmpp_stanza_t *xmpp_stanza_clone(xmpp_stanza_t * const stanza)
 }
 
 /*
- * Copy the attributes of stanza src into stanza dst. Return -1 on error.
+ * Copy an attribute table. Return NULL on error.
  */
-static int _stanza_copy_attributes(xmpp_stanza_t * dst,
-                                   const xmpp_stanza_t * const src)
+static hash_t *_stanza_copy_attributes(xmpp_ctx_t *ctx, hash_t *src)
 {
     hash_iterator_t *iter = NULL;
+    hash_t *dst;
     const char *key;
     void *val;
 
-    dst->attributes = hash_new(src->ctx, 8, xmpp_free);
-    if (!dst->attributes)
-        return -1;
-    iter = hash_iter_new(src->attributes);
+    dst = hash_new(ctx, 8, xmpp_free);
+    if (!dst)
+        return NULL;
+    iter = hash_iter_new(src);
     if (!iter)
         goto error;
     while ((key = hash_iter_next(iter))) {
-        val = xmpp_strdup(src->ctx,
-                          (char *)hash_get(src->attributes, key));
+        val = xmpp_strdup(ctx, (char *)hash_get(src, key));
         if (!val)
             goto error;
 
-        if (hash_add(dst->attributes, key, val)) {
-            xmpp_free(src->ctx, val);
+        if (hash_add(dst, key, val)) {
+            xmpp_free(ctx, val);
             goto error;
         }
     }
     hash_iter_release(iter);
-    return 0;
+    return dst;
 
 error:
     if (iter != NULL)
         hash_iter_release(iter);
-    hash_release(dst->attributes);
-    return -1;
+    hash_release(dst);
+    return NULL;
+}
+
+/*
+ * Give a stanza its own attribute table before it is changed, if the
+ * table is still shared with a copy. Return -1 on error.
+ */
+static int _stanza_own_attributes(xmpp_stanza_t * const stanza)
+{
+    hash_t *attributes;
+
+    if (!hash_is_shared(stanza->attributes))
+        return 0;
+    attributes = _stanza_copy_attributes(stanza->ctx, stanza->attributes);
+    if (!attributes)
+        return -1;
+    hash_release(stanza->attributes);
+    stanza->attributes = attributes;
+    return 0;
 }
 
 /** Copy a stanza and its children.
@@ -117,6 +200,11 @@ error:
  *  stanza will have no parent and no siblings.  This function is useful
  *  for extracting a child stanza for inclusion in another tree.
  *
+ *  The copy shares the names, texts and attributes with the original
+ *  until either of them changes, so copying a stanza to change a few
+ *  attributes costs little more than the tree itself.  A copy of a
+ *  frozen stanza is frozen and keeps the text.
+ *
  *  @param stanza a Strophe stanza object
  *
  *  @return a new Strophe stanza object
@@ -132,14 +220,23 @@ xmpp_stanza_t *xmpp_stanza_copy(const xmpp_stanza_t * const stanza)
 
     copy->type = stanza->type;
 
-    if (stanza->data) {
-	copy->data = xmpp_strdup(stanza->ctx, stanza->data);
-	if (!copy->data) goto copy_error;
-    }
-
-    if (stanza->attributes) {
-	if (_stanza_copy_attributes(copy, stanza) == -1)
-            goto copy_error;
+    if (stanza->data)
+	copy->data = _stanza_data_clone(stanza->data);
+
+    if (stanza->attributes)
+	copy->attributes = hash_clone(stanza->attributes);
+
+    /* a copy of a frozen stanza keeps the text */
+    if (stanza->frozen) {
+	copy->frozen = 1;
+	if (stanza->rendered) {
+	    copy->rendered = xmpp_alloc(copy->ctx, stanza->rendered_len + 1);
+	    if (!copy->rendered) goto copy_error;
+	    memcpy(copy->rendered, stanza->rendered,
+		   stanza->rendered_len + 1);
+	    copy->rendered_len = stanza->rendered_len;
+	    copy->rendered_skip_ns = stanza->rendered_skip_ns;
+	}
     }
 
     tail = copy->children;
@@ -192,8 +289,12 @@ int xmpp_stanza_release(xmpp_stanza_t * const stanza)
 	}
 
 	if (stanza->attributes) hash_release(stanza->attributes);
-	if (stanza->data) xmpp_free(stanza->ctx, stanza->data);
-	xmpp_free(stanza->ctx, stanza);
+	if (stanza->data) _stanza_data_release(stanza->ctx, stanza->data);
+	if (stanza->rendered) xmpp_free(stanza->ctx, stanza->rendered);
+	if (stanza->arena)
+	    _stanza_arena_release(stanza->ctx, stanza->arena);
+	else
+	    xmpp_free(stanza->ctx, stanza);
 	released = 1;
     }
 
@@ -300,6 +401,36 @@ static inline void _render_update(int *written, const int length,
     }
 }
 
+/* whether the xmlns of a stanza goes without saying: it is the one of the
+ * parent or, at the top, the stream namespace */
+static int _render_skip_ns(xmpp_stanza_t *stanza)
+{
+    const char *ns, *parent_ns;
+
+    if (!stanza->attributes) return 0;
+    ns = hash_get(stanza->attributes, "xmlns");
+    if (!ns) return 0;
+    if (!stanza->parent) return !strcmp(ns, XMPP_NS_CLIENT);
+    if (!stanza->parent->attributes) return 0;
+    parent_ns = hash_get(stanza->parent->attributes, "xmlns");
+
+    return parent_ns && !strcmp(ns, parent_ns);
+}
+
+/* drop the text rendered for a stanza and for the stanzas containing it,
+ * which is stale after a change */
+static void _stanza_unrender(xmpp_stanza_t *stanza)
+{
+    for (; stanza; stanza = stanza->parent) {
+	if (stanza->rendered) {
+	    xmpp_free(stanza->ctx, stanza->rendered);
+	    stanza->rendered = NULL;
+	}
+    }
+}
+
+static int _render_frozen(xmpp_stanza_t *stanza);
+
 /* always returns number of bytes written or that would have been
  * written if the buffer was large enough
  * return values < 0 indicate some error occured,
@@ -320,6 +451,22 @@ static int _render_stanza_recursive(xmpp_stanza_t *stanza,
 
     if (stanza->type == XMPP_STANZA_UNKNOWN) return XMPP_EINVOP;
 
+    if (stanza->frozen) {
+	if (!stanza->rendered ||
+	    stanza->rendered_skip_ns != _render_skip_ns(stanza)) {
+	    ret = _render_frozen(stanza);
+	    if (ret < 0) return ret;
+	}
+	/* as snprintf() would */
+	if (buflen > 0) {
+	    left = stanza->rendered_len < buflen ? stanza->rendered_len
+						 : buflen - 1;
+	    memcpy(buf, stanza->rendered, left);
+	    buf[left] = '\0';
+	}
+	return (int)stanza->rendered_len;
+    }
+
     if (stanza->type == XMPP_STANZA_TEXT) {
 	if (!stanza->data) return XMPP_EINVOP;
 
@@ -340,20 +487,10 @@ static int _render_stanza_recursive(xmpp_stanza_t *stanza,
 	if (stanza->attributes && hash_num_keys(stanza->attributes) > 0) {
 	    iter = hash_iter_new(stanza->attributes);
 	    while ((key = hash_iter_next(iter))) {
-		if (!strcmp(key, "xmlns")) {
-		    /* don't output namespace if parent stanza is the same */
-		    if (stanza->parent &&
-			stanza->parent->attributes &&
-			hash_get(stanza->parent->attributes, key) &&
-			!strcmp((char*)hash_get(stanza->attributes, key),
-			    (char*)hash_get(stanza->parent->attributes, key)))
-			continue;
-		    /* or if this is the stream namespace */
-		    if (!stanza->parent &&
-			!strcmp((char*)hash_get(stanza->attributes, key),
-			    XMPP_NS_CLIENT))
-			continue;
-		}
+		/* don't output namespace if parent stanza is the same
+		 * or if this is the stream namespace */
+		if (!strcmp(key, "xmlns") && _render_skip_ns(stanza))
+		    continue;
 		tmp = _escape_xml(stanza->ctx,
 		    (char *)hash_get(stanza->attributes, key));
 		if (tmp == NULL) return XMPP_EMEM;
@@ -423,6 +560,21 @@ int  xmpp_stanza_to_text(xmpp_stanza_t *stanza,
     size_t length;
     int ret;
 
+    /* a frozen stanza is copied in one go */
+    if (stanza->frozen && stanza->rendered &&
+        stanza->rendered_skip_ns == _render_skip_ns(stanza)) {
+	buffer = xmpp_alloc(stanza->ctx, stanza->rendered_len + 1);
+	if (!buffer) {
+	    *buf = NULL;
+	    *buflen = 0;
+	    return XMPP_EMEM;
+	}
+	memcpy(buffer, stanza->rendered, stanza->rendered_len + 1);
+	*buf = buffer;
+	*buflen = stanza->rendered_len;
+	return XMPP_EOK;
+    }
+
     /* allocate a default sized buffer and attempt to render */
     length = 1024;
     buffer = xmpp_alloc(stanza->ctx, length);
@@ -458,6 +610,58 @@ int  xmpp_stanza_to_text(xmpp_stanza_t *stanza,
     return XMPP_EOK;
 }
 
+/* render a frozen stanza on its own and keep the text */
+static int _render_frozen(xmpp_stanza_t *stanza)
+{
+    char *buf;
+    size_t len;
+    int ret;
+
+    if (stanza->rendered) {
+	xmpp_free(stanza->ctx, stanza->rendered);
+	stanza->rendered = NULL;
+    }
+    stanza->frozen = 0;
+    ret = xmpp_stanza_to_text(stanza, &buf, &len);
+    stanza->frozen = 1;
+    if (ret != XMPP_EOK) return ret;
+
+    stanza->rendered = buf;
+    stanza->rendered_len = len;
+    stanza->rendered_skip_ns = _render_skip_ns(stanza);
+
+    return XMPP_EOK;
+}
+
+/** Freeze a stanza for sending many times.
+ *  This function renders the stanza and its children to text and keeps
+ *  the text with the stanza, so rendering the stanza again, or a stanza
+ *  containing it, copies the text instead of building it once more.  A
+ *  payload sent to many recipients is frozen once and either carried by
+ *  a single stanza whose 'to' is changed for each of them, or copied with
+ *  xmpp_stanza_copy(), which keeps the text, into each stanza.  Like any
+ *  stanza, a frozen one has at most one parent, xmpp_stanza_add_child()
+ *  refuses to add it to a second one.
+ *
+ *  The stanza may still be changed with the xmpp_stanza_set_*() and
+ *  xmpp_stanza_add_child() functions, called on it or on any of its
+ *  children.  The kept text is then dropped and rendered anew the next
+ *  time it is needed.
+ *
+ *  @param stanza a Strophe stanza object
+ *
+ *  @return XMPP_EOK (0) on success, and a number less than 0 on failure
+ *      (XMPP_EMEM, XMPP_EINVOP)
+ *
+ *  @ingroup Stanza
+ */
+int xmpp_stanza_freeze(xmpp_stanza_t * const stanza)
+{
+    stanza->frozen = 1;
+
+    return _render_frozen(stanza);
+}
+
 /** Set the name of a stanza.
  *  
  *  @param stanza a Strophe stanza object
@@ -473,10 +677,11 @@ int xmpp_stanza_set_name(xmpp_stanza_t *stanza,
 {
     if (stanza->type == XMPP_STANZA_TEXT) return XMPP_EINVOP;
 
-    if (stanza->data) xmpp_free(stanza->ctx, stanza->data);
+    _stanza_unrender(stanza);
+    if (stanza->data) _stanza_data_release(stanza->ctx, stanza->data);
 
     stanza->type = XMPP_STANZA_TAG;
-    stanza->data = xmpp_strdup(stanza->ctx, name);
+    stanza->data = _stanza_data_new(stanza->ctx, name, strlen(name));
 
     return stanza->data == NULL ? XMPP_EMEM : XMPP_EOK;
 }
@@ -577,16 +782,16 @@ int xmpp_stanza_set_attribute(xmpp_stanza_t * const stanza,
 
     if (stanza->type != XMPP_STANZA_TAG) return XMPP_EINVOP;
 
+    _stanza_unrender(stanza);
     if (!stanza->attributes) {
 	stanza->attributes = hash_new(stanza->ctx, 8, xmpp_free);
 	if (!stanza->attributes) return XMPP_EMEM;
-    }
+    } else if (_stanza_own_attributes(stanza) == -1)
+	return XMPP_EMEM;
 
     val = xmpp_strdup(stanza->ctx, value);
-    if (!val) {
-        hash_release(stanza->attributes);
+    if (!val)
         return XMPP_EMEM;
-    }
 
     hash_add(stanza->attributes, key, val);
 
@@ -612,12 +817,14 @@ int xmpp_stanza_set_ns(xmpp_stanza_t * const stanza,
 
 /** Add a child stanza to a stanza object.
  *  This function clones the child and appends it to the stanza object's
- *  children.
+ *  children.  A stanza has at most one parent, so a child which already
+ *  has one is refused; add a copy of it instead.
  *
  *  @param stanza a Strophe stanza object
  *  @param child the child stanza object
  *
  *  @return XMPP_EOK (0) on success or a number less than 0 on failure
+ *      (XMPP_EINVOP)
  *
  *  @ingroup Stanza
  */
@@ -625,8 +832,11 @@ int xmpp_stanza_add_child(xmpp_stanza_t *stanza, xmpp_stanza_t *child)
 {
     xmpp_stanza_t *s;
 
+    if (child->parent) return XMPP_EINVOP;
+
     /* get a reference to the child */
     xmpp_stanza_clone(child);
+    _stanza_unrender(stanza);
 
     child->parent = stanza;
 
@@ -661,9 +871,10 @@ int xmpp_stanza_set_text(xmpp_stanza_t *stanza,
     if (stanza->type == XMPP_STANZA_TAG) return XMPP_EINVOP;
     
     stanza->type = XMPP_STANZA_TEXT;
+    _stanza_unrender(stanza);
 
-    if (stanza->data) xmpp_free(stanza->ctx, stanza->data);
-    stanza->data = xmpp_strdup(stanza->ctx, text);
+    if (stanza->data) _stanza_data_release(stanza->ctx, stanza->data);
+    stanza->data = _stanza_data_new(stanza->ctx, text, strlen(text));
 
     return stanza->data == NULL ? XMPP_EMEM : XMPP_EOK;
 }
@@ -689,15 +900,12 @@ int xmpp_stanza_set_text_with_size(xmpp_stanza_t *stanza,
     if (stanza->type == XMPP_STANZA_TAG) return XMPP_EINVOP;
 
     stanza->type = XMPP_STANZA_TEXT;
+    _stanza_unrender(stanza);
 
-    if (stanza->data) xmpp_free(stanza->ctx, stanza->data);
-    stanza->data = xmpp_alloc(stanza->ctx, size + 1);
-    if (!stanza->data) return XMPP_EMEM;
-
-    memcpy(stanza->data, text, size);
-    stanza->data[size] = 0;
+    if (stanza->data) _stanza_data_release(stanza->ctx, stanza->data);
+    stanza->data = _stanza_data_new(stanza->ctx, text, size);
 
-    return XMPP_EOK;
+    return stanza->data == NULL ? XMPP_EMEM : XMPP_EOK;
 }
 
 /** Get the 'id' attribute of the stanza object.
@@ -1034,6 +1242,9 @@ int xmpp_stanza_del_attribute(xmpp_stanza_t * const stanza,
     if (!stanza->attributes)
         return -1;
 
+    _stanza_unrender(stanza);
+    if (_stanza_own_attributes(stanza) == -1)
+        return XMPP_EMEM;
     return hash_drop(stanza->attributes, name);
 }
 
@@ -1058,15 +1269,11 @@ xmpp_stanza_t *xmpp_stanza_reply(xmpp_stanza_t * const stanza)
 
     copy->type = stanza->type;
 
-    if (stanza->data) {
-        copy->data = xmpp_strdup(stanza->ctx, stanza->data);
-        if (!copy->data) goto copy_error;
-    }
+    if (stanza->data)
+        copy->data = _stanza_data_clone(stanza->data);
 
-    if (stanza->attributes) {
-        if (_stanza_copy_attributes(copy, stanza) == -1)
-            goto copy_error;
-    }
+    if (stanza->attributes)
+        copy->attributes = hash_clone(stanza->attributes);
 
     xmpp_stanza_set_to(copy, xmpp_stanza_get_from(stanza));
     xmpp_stanza_del_attribute(copy, "from");
@@ -1077,3 +1284,355 @@ copy_error:
     if (copy) xmpp_stanza_release(copy);
     return NULL;
 }
+
+/* skip blanks of a stanza template */
+static const char *_build_skip_space(const char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+    return p;
+}
+
+/* length of a tag or attribute name in a stanza template */
+static size_t _build_name_len(const char *p)
+{
+    size_t len;
+
+    for (len = 0;; len++) {
+	switch (p[len]) {
+	case '\0': case ' ': case '\t': case '\r': case '\n':
+	case '/': case '>': case '=': case '<': case '\'': case '"': case '%':
+	    return len;
+	}
+    }
+}
+
+/* the arena of a stanza being built and what is left of it */
+typedef struct {
+    xmpp_ctx_t *ctx;
+    stanza_arena_t *arena;
+    xmpp_stanza_t *node;
+    xmpp_stanza_t *node_end;
+    char *data;
+    char *data_end;
+} stanza_builder_t;
+
+#define BUILD_ALIGN(n) \
+    (((n) + sizeof(stanza_data_t) - 1) & ~(sizeof(stanza_data_t) - 1))
+
+/* get one block for the nodes, names and texts of a template, counted
+ * the way xmpp_stanza_vbuild() will make them */
+static int _build_arena(stanza_builder_t *b, const char *fmt, va_list ap)
+{
+    size_t nodes = 0, bytes = 0, len, size;
+    const char *p = fmt, *arg;
+    int in_tag = 0;
+
+    while (*p) {
+	if (in_tag) {
+	    p += strcspn(p, ">'\"%");
+	    if (*p == '\0') {
+		break;
+	    } else if (*p == '>') {
+		in_tag = 0;
+	    } else if (*p == '\'' || *p == '"') {
+		arg = strchr(p + 1, *p);
+		if (!arg) break;
+		p = arg;
+	    } else if (p[0] == '%' && p[1] == 's') {
+		(void)va_arg(ap, const char *);
+		p++;
+	    }
+	    p++;
+	} else if (*p == '<') {
+	    p++;
+	    if (*p != '/') {
+		len = _build_name_len(p);
+		nodes++;
+		bytes += BUILD_ALIGN(sizeof(stanza_data_t) + len + 1);
+		p += len;
+	    }
+	    in_tag = 1;
+	} else if (*p == '%' && (p[1] == 's' || p[1] == 'p')) {
+	    if (p[1] == 's') {
+		arg = va_arg(ap, const char *);
+		if (arg) {
+		    nodes++;
+		    bytes += BUILD_ALIGN(sizeof(stanza_data_t) +
+					 strlen(arg) + 1);
+		}
+	    } else {
+		(void)va_arg(ap, xmpp_stanza_t *);
+	    }
+	    p += 2;
+	} else {
+	    arg = p;
+	    if (*p == '%') p += p[1] == '%' ? 2 : 1;
+	    p += strcspn(p, "<%");
+	    nodes++;
+	    bytes += BUILD_ALIGN(sizeof(stanza_data_t) + (p - arg) + 1);
+	}
+    }
+    size = BUILD_ALIGN(sizeof(stanza_arena_t)) +
+	   nodes * BUILD_ALIGN(sizeof(xmpp_stanza_t)) + bytes;
+
+    b->arena = xmpp_alloc(b->ctx, size);
+    if (!b->arena) return XMPP_EMEM;
+    b->arena->ref = 1;
+    b->node = (xmpp_stanza_t *)((char *)b->arena +
+				BUILD_ALIGN(sizeof(stanza_arena_t)));
+    b->node_end = b->node + nodes;
+    b->data = (char *)b->arena + size - bytes;
+    b->data_end = (char *)b->arena + size;
+
+    return XMPP_EOK;
+}
+
+static xmpp_stanza_t *_build_node(stanza_builder_t *b,
+				  const xmpp_stanza_type_t type,
+				  const char *text, const size_t len)
+{
+    xmpp_stanza_t *stanza;
+    stanza_data_t *head;
+    size_t size = BUILD_ALIGN(sizeof(stanza_data_t) + len + 1);
+
+    if (b->node == b->node_end || (size_t)(b->data_end - b->data) < size)
+	return NULL;
+    stanza = b->node++;
+    _stanza_init(stanza, b->ctx);
+    stanza->arena = b->arena;
+    stanza->type = type;
+    head = (stanza_data_t *)b->data;
+    b->data += size;
+    head->ref = 1;
+    head->arena = b->arena;
+    stanza->data = (char *)(head + 1);
+    memcpy(stanza->data, text, len);
+    stanza->data[len] = '\0';
+    b->arena->ref += 2;
+
+    return stanza;
+}
+
+/* append a child to the last one built */
+static void _build_append(xmpp_stanza_t *parent, xmpp_stanza_t **tail,
+			  xmpp_stanza_t *child)
+{
+    child->parent = parent;
+    child->prev = *tail;
+    child->next = NULL;
+    if (*tail) (*tail)->next = child;
+    else parent->children = child;
+    *tail = child;
+}
+
+/* parse the attributes of an element in a stanza template up to the end
+ * of its start tag, NULL on an error */
+static const char *_build_attributes(xmpp_stanza_t *stanza, const char *p,
+				     va_list *ap)
+{
+    xmpp_ctx_t *ctx = stanza->ctx;
+    char keybuf[64];
+    char *key, *value;
+    const char *arg, *end;
+    size_t len;
+
+    for (p = _build_skip_space(p); *p != '>' && *p != '/';
+	 p = _build_skip_space(p)) {
+	len = _build_name_len(p);
+	if (len == 0) return NULL;
+	key = len < sizeof(keybuf) ? keybuf : xmpp_alloc(ctx, len + 1);
+	if (!key) return NULL;
+	memcpy(key, p, len);
+	key[len] = '\0';
+	p = _build_skip_space(p + len);
+	if (*p++ != '=') goto error;
+	p = _build_skip_space(p);
+
+	if (p[0] == '%' && p[1] == 's') {
+	    arg = va_arg(*ap, const char *);
+	    value = arg ? xmpp_strdup(ctx, arg) : NULL;
+	    p += 2;
+	} else if (*p == '\'' || *p == '"') {
+	    end = strchr(p + 1, *p);
+	    if (!end) goto error;
+	    value = xmpp_alloc(ctx, end - p);
+	    if (!value) goto error;
+	    memcpy(value, p + 1, end - p - 1);
+	    value[end - p - 1] = '\0';
+	    arg = value;
+	    p = end + 1;
+	} else
+	    goto error;
+
+	/* attributes given as NULL are left out */
+	if (arg) {
+	    if (!value) goto error;
+	    if (!stanza->attributes)
+		stanza->attributes = hash_new(ctx, 8, xmpp_free);
+	    if (!stanza->attributes ||
+		hash_add(stanza->attributes, key, value) != 0) {
+		xmpp_free(ctx, value);
+		goto error;
+	    }
+	}
+	if (key != keybuf) xmpp_free(ctx, key);
+    }
+
+    return p;
+
+error:
+    if (key != keybuf) xmpp_free(ctx, key);
+    return NULL;
+}
+
+/** Build a stanza from a template.
+ *  This function builds a whole stanza tree in one call, from a template
+ *  that looks like the XML of the stanza.  For example:
+ *
+ *  xmpp_stanza_build(ctx, "<message to=%s type='chat'>"
+ *                         "<body>%s</body></message>", to, text);
+ *
+ *  Element names, attribute values in quotes and text are taken as they
+ *  are, without entities.  The following are replaced by the arguments:
+ *  - %s as an attribute value, by a string which is left out if NULL;
+ *  - %s in text, by a string which is left out if NULL;
+ *  - %p in text, by a copy of a stanza object added as a child, if it is
+ *    not NULL.  The stanza itself stays where it is and the caller keeps
+ *    its reference.
+ *
+ *  %% stands for a '%'.  Blanks between tags are dropped.  The nodes,
+ *  names and texts are all put into one allocation, which is freed when
+ *  the last of them is released, and nothing is created that is not part
+ *  of the result.
+ *
+ *  @param ctx a Strophe context object
+ *  @param fmt the template
+ *  @param ap the arguments of the template
+ *
+ *  @return a new Strophe stanza object, or NULL if the template is not a
+ *      single well-formed element or memory runs out
+ *
+ *  @ingroup Stanza
+ */
+xmpp_stanza_t *xmpp_stanza_vbuild(xmpp_ctx_t *ctx, const char * const fmt,
+				  va_list ap)
+{
+    xmpp_stanza_t *root = NULL, *parent = NULL, *tail = NULL, *stanza;
+    stanza_builder_t b;
+    const char *p = fmt, *text, *arg;
+    va_list args;
+    size_t len;
+    int ret;
+
+    b.ctx = ctx;
+    va_copy(args, ap);
+    ret = _build_arena(&b, fmt, args);
+    va_end(args);
+    if (ret != XMPP_EOK) return NULL;
+
+    va_copy(args, ap);
+    while (*p) {
+	if (*p == '<' && p[1] == '/') {
+	    /* end tag */
+	    if (!parent) goto error;
+	    p += 2;
+	    len = _build_name_len(p);
+	    if (strncmp(p, parent->data, len) != 0 || parent->data[len])
+		goto error;
+	    p = _build_skip_space(p + len);
+	    if (*p++ != '>') goto error;
+	    tail = parent;
+	    parent = parent->parent;
+	} else if (*p == '<') {
+	    /* start tag */
+	    if (!parent && root) goto error;
+	    p++;
+	    len = _build_name_len(p);
+	    if (len == 0) goto error;
+	    stanza = _build_node(&b, XMPP_STANZA_TAG, p, len);
+	    if (!stanza) goto error;
+	    if (parent)
+		_build_append(parent, &tail, stanza);
+	    else
+		root = stanza;
+	    p = _build_attributes(stanza, p + len, &args);
+	    if (!p) goto error;
+	    if (*p == '/') {
+		if (*++p != '>') goto error;
+	    } else {
+		parent = stanza;
+		tail = NULL;
+	    }
+	    p++;
+	} else if (*p == '%' && (p[1] == 's' || p[1] == 'p')) {
+	    /* arguments in text */
+	    if (!parent) goto error;
+	    if (p[1] == 's') {
+		arg = va_arg(args, const char *);
+		stanza = arg ? _build_node(&b, XMPP_STANZA_TEXT, arg,
+					   strlen(arg)) : NULL;
+		if (arg && !stanza) goto error;
+	    } else {
+		stanza = va_arg(args, xmpp_stanza_t *);
+		if (stanza) {
+		    stanza = xmpp_stanza_copy(stanza);
+		    if (!stanza) goto error;
+		}
+	    }
+	    if (stanza) _build_append(parent, &tail, stanza);
+	    p += 2;
+	} else {
+	    /* text up to the next tag or argument, %% ends it as well */
+	    text = p;
+	    if (*p == '%' && p[1] == '%') p += 2;
+	    p += strcspn(p, "<%");
+	    len = p - text;
+	    if (text[0] == '%') {
+		if (text[1] != '%') goto error;
+		text++;
+		len--;
+	    }
+	    if (_build_skip_space(text) >= text + len) continue;
+	    if (!parent) goto error;
+	    stanza = _build_node(&b, XMPP_STANZA_TEXT, text, len);
+	    if (!stanza) goto error;
+	    _build_append(parent, &tail, stanza);
+	}
+    }
+    va_end(args);
+    if (!root || parent) goto malformed;
+
+    _stanza_arena_release(ctx, b.arena);
+    return root;
+
+error:
+    va_end(args);
+malformed:
+    xmpp_error(ctx, "xmpp", "Couldn't build a stanza from \"%s\"", fmt);
+    if (root) xmpp_stanza_release(root);
+    _stanza_arena_release(ctx, b.arena);
+    return NULL;
+}
+
+/** Build a stanza from a template.
+ *  See xmpp_stanza_vbuild() for the template.
+ *
+ *  @param ctx a Strophe context object
+ *  @param fmt the template
+ *  @param ... the arguments of the template
+ *
+ *  @return a new Strophe stanza object, or NULL on an error
+ *
+ *  @ingroup Stanza
+ */
+xmpp_stanza_t *xmpp_stanza_build(xmpp_ctx_t *ctx, const char * const fmt, ...)
+{
+    xmpp_stanza_t *stanza;
+    va_list ap;
+
+    va_start(ap, fmt);
+    stanza = xmpp_stanza_vbuild(ctx, fmt, ap);
+    va_end(ap);
+
+    return stanza;
+}
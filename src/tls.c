@@ -0,0 +1,38 @@
+/* tls.c
+** strophe XMPP client library -- TLS code shared by the backends
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/** @file
+ *  TLS code which doesn't depend on the backend.
+ */
+
+#include "common.h"
+#include "tls.h"
+
+/* writes the buffers one TLS record each, for backends which can't do
+ * better in tls_writev().  A failure after some progress is reported by
+ * the next call. */
+int tls_writev_records(tls_t *tls, const sock_iovec_t * const iov,
+                       const int iovcnt)
+{
+    int written = 0;
+    int ret, i;
+
+    for (i = 0; i < iovcnt; ++i) {
+        ret = tls_write(tls, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0)
+            return written > 0 ? written : -1;
+        written += ret;
+        if ((size_t)ret < iov[i].iov_len)
+            break;
+    }
+
+    return written;
+}
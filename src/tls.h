@@ -28,15 +28,30 @@ tls_t *tls_new(xmpp_ctx_t *ctx, sock_t sock);
 void tls_free(tls_t *tls);
 
 int tls_set_credentials(tls_t *tls, const char *cafilename);
-
+int tls_enable_ktls(tls_t *tls);
+int tls_enable_low_mem(tls_t *tls);
+
+/* tls_start() performs one non-blocking step of the handshake; it returns
+ * 1 when the handshake is complete and 0 otherwise.  If the error is
+ * recoverable, the handshake is still in progress and tls_start() must be
+ * called again once the socket is ready in the direction reported by
+ * tls_want_write(). */
 int tls_start(tls_t *tls);
 int tls_stop(tls_t *tls);
+int tls_want_write(tls_t *tls);
 
 int tls_error(tls_t *tls);
 
 int tls_pending(tls_t *tls);
 int tls_read(tls_t *tls, void * const buff, const size_t len);
 int tls_write(tls_t *tls, const void * const buff, const size_t len);
+/* writes the buffers in order, returns the number of bytes written like
+ * tls_write() */
+int tls_writev(tls_t *tls, const sock_iovec_t * const iov, const int iovcnt);
+/* tls_writev() with one record per buffer, for backends without a better
+ * way, in tls.c */
+int tls_writev_records(tls_t *tls, const sock_iovec_t * const iov,
+                       const int iovcnt);
 
 int tls_clear_pending_write(tls_t *tls);
 int tls_is_recoverable(int error);
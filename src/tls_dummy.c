@@ -49,6 +49,17 @@ int tls_set_credentials(tls_t *tls, const char *cafilename)
     return -1;
 }
 
+int tls_enable_ktls(tls_t *tls)
+{
+    /* kernel TLS offload is only implemented for OpenSSL */
+    return 0;
+}
+
+int tls_enable_low_mem(tls_t *tls)
+{
+    return 0;
+}
+
 int tls_start(tls_t *tls)
 {
     return -1;
@@ -59,6 +70,11 @@ int tls_stop(tls_t *tls)
     return -1;
 }
 
+int tls_want_write(tls_t *tls)
+{
+    return 0;
+}
+
 int tls_error(tls_t *tls)
 {
     /* todo: some kind of error polling/dump */
@@ -80,6 +96,11 @@ int tls_write(tls_t *tls, const void * const buff, const size_t len)
     return -1;
 }
 
+int tls_writev(tls_t *tls, const sock_iovec_t * const iov, const int iovcnt)
+{
+    return -1;
+}
+
 int tls_clear_pending_write(tls_t *tls)
 {
     return -1;
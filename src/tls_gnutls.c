@@ -22,6 +22,9 @@
 /* FIXME this shouldn't be a constant string */
 #define CAFILE "/etc/ssl/certs/ca-certificates.crt"
 
+/* maximum plaintext record size requested in low memory mode */
+#define TLS_LOW_MEM_RECORD_SIZE 4096
+
 struct _tls {
     xmpp_ctx_t *ctx; /* do we need this? */
     sock_t sock;
@@ -90,11 +93,31 @@ int tls_set_credentials(tls_t *tls, const char *cafilename)
     return err == GNUTLS_E_SUCCESS;
 }
 
+int tls_enable_ktls(tls_t *tls)
+{
+    /* kernel TLS offload is only implemented for OpenSSL */
+    return 0;
+}
+
+int tls_enable_low_mem(tls_t *tls)
+{
+    /* GnuTLS allocates record buffers per record and frees them once
+     * consumed, so the idle cost is already low.  What we can do is ask
+     * the server for smaller records (RFC 8449), which bounds the size
+     * of the buffers allocated while data is flowing. */
+#if GNUTLS_VERSION_NUMBER >= 0x030608
+    return gnutls_record_set_max_recv_size(tls->session,
+                                           TLS_LOW_MEM_RECORD_SIZE) == 0;
+#else
+    return gnutls_record_set_max_size(tls->session,
+                                      TLS_LOW_MEM_RECORD_SIZE) == 0;
+#endif
+}
+
 int tls_start(tls_t *tls)
 {
-    sock_set_blocking(tls->sock);
+    /* returns GNUTLS_E_AGAIN while the handshake is in progress */
     tls->lasterror = gnutls_handshake(tls->session);
-    sock_set_nonblocking(tls->sock);
 
     return tls->lasterror == GNUTLS_E_SUCCESS;
 }
@@ -105,6 +128,11 @@ int tls_stop(tls_t *tls)
     return tls->lasterror == GNUTLS_E_SUCCESS;
 }
 
+int tls_want_write(tls_t *tls)
+{
+    return gnutls_record_get_direction(tls->session) == 1;
+}
+
 int tls_error(tls_t *tls)
 {
     return tls->lasterror;
@@ -140,6 +168,11 @@ int tls_write(tls_t *tls, const void * const buff, const size_t len)
     return ret;
 }
 
+int tls_writev(tls_t *tls, const sock_iovec_t * const iov, const int iovcnt)
+{
+    return tls_writev_records(tls, iov, iovcnt);
+}
+
 int tls_clear_pending_write(tls_t *tls)
 {
     return 0;
@@ -15,14 +15,12 @@
 
 #include <string.h>
 
-#ifndef _WIN32
-#include <sys/select.h>
-#else
-#include <winsock2.h>
-#endif
-
 #include <openssl/ssl.h>
 
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define HAVE_KTLS
+#endif
+
 #include "common.h"
 #include "tls.h"
 #include "sock.h"
@@ -30,20 +28,36 @@
 struct _tls {
     xmpp_ctx_t *ctx;
     sock_t sock;
-    SSL_CTX *ssl_ctx;
     SSL *ssl;
+    int ktls_send; /* records are encrypted by the kernel on send */
     int lasterror;
 };
 
+/* all connections share one SSL_CTX; it is sizeable and every SSL object
+ * holds its own reference to it.  Only xmpp_initialize() makes it and only
+ * tls_shutdown() frees it, so connections in several threads need no
+ * lock around it. */
+static SSL_CTX *_ssl_ctx = NULL;
+
 void tls_initialize(void)
 {
+    if (_ssl_ctx) return;
+
     SSL_library_init();
     SSL_load_error_strings();
+
+    _ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+    if (_ssl_ctx) {
+        SSL_CTX_set_client_cert_cb(_ssl_ctx, NULL);
+        SSL_CTX_set_mode(_ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
+        SSL_CTX_set_verify(_ssl_ctx, SSL_VERIFY_NONE, NULL);
+    }
 }
 
 void tls_shutdown(void)
 {
-    return;
+    SSL_CTX_free(_ssl_ctx);
+    _ssl_ctx = NULL;
 }
 
 int tls_error(tls_t *tls)
@@ -53,7 +67,15 @@ int tls_error(tls_t *tls)
 
 tls_t *tls_new(xmpp_ctx_t *ctx, sock_t sock)
 {
-    tls_t *tls = xmpp_alloc(ctx, sizeof(*tls));
+    tls_t *tls;
+
+    if (!_ssl_ctx) {
+	xmpp_error(ctx, "tls", "OpenSSL is not initialized, "
+		   "xmpp_initialize() must be called first");
+	return NULL;
+    }
+
+    tls = xmpp_alloc(ctx, sizeof(*tls));
 
     if (tls) {
         int ret;
@@ -61,13 +83,11 @@ tls_t *tls_new(xmpp_ctx_t *ctx, sock_t sock)
 
 	tls->ctx = ctx;
 	tls->sock = sock;
-	tls->ssl_ctx = SSL_CTX_new(SSLv23_client_method());
-
-	SSL_CTX_set_client_cert_cb(tls->ssl_ctx, NULL);
-	SSL_CTX_set_mode (tls->ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
-	SSL_CTX_set_verify (tls->ssl_ctx, SSL_VERIFY_NONE, NULL);
-
-	tls->ssl = SSL_new(tls->ssl_ctx);
+	tls->ssl = SSL_new(_ssl_ctx);
+	if (!tls->ssl) {
+	    xmpp_free(ctx, tls);
+	    return NULL;
+	}
 
 	ret = SSL_set_fd(tls->ssl, sock);
 	if (ret <= 0) {
@@ -84,7 +104,6 @@ tls_t *tls_new(xmpp_ctx_t *ctx, sock_t sock)
 void tls_free(tls_t *tls)
 {
     SSL_free(tls->ssl);
-    SSL_CTX_free(tls->ssl_ctx);
     xmpp_free(tls->ctx, tls);
     return;
 }
@@ -94,41 +113,44 @@ int tls_set_credentials(tls_t *tls, const char *cafilename)
     return -1;
 }
 
+int tls_enable_ktls(tls_t *tls)
+{
+#ifdef HAVE_KTLS
+    /* OpenSSL falls back to user space crypto if the kernel lacks
+       support for the negotiated cipher or the tls module */
+    SSL_set_options(tls->ssl, SSL_OP_ENABLE_KTLS);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+int tls_enable_low_mem(tls_t *tls)
+{
+    /* frees the ~34KB of read and write buffers whenever they are empty
+       and reallocates them on the next record */
+    SSL_set_mode(tls->ssl, SSL_MODE_RELEASE_BUFFERS);
+    return 1;
+}
+
 int tls_start(tls_t *tls)
 {
-    fd_set fds;
-    struct timeval tv;
-    int error;
     int ret;
 
-    /* Since we're non-blocking, loop the connect call until it
-       succeeds or fails */
-    while (1) {
-        ret = SSL_connect(tls->ssl);
-        error = ret <= 0 ? SSL_get_error(tls->ssl, ret) : 0;
-
-        if (ret == -1 && tls_is_recoverable(error)) {
-            /* wait for something to happen on the sock before looping back */
-            tv.tv_sec = 0;
-            tv.tv_usec = 1000;
-
-            FD_ZERO(&fds);
-            FD_SET(tls->sock, &fds);
-    
-            if (error == SSL_ERROR_WANT_READ)
-                select(tls->sock + 1, &fds, NULL, NULL, &tv);
-            else
-                select(tls->sock + 1, NULL, &fds, NULL, &tv);
-            continue;
-        }
+    /* the socket is non-blocking, so this returns as soon as OpenSSL
+       needs more data; the event loop calls us again when the socket
+       becomes ready */
+    ret = SSL_connect(tls->ssl);
+    tls->lasterror = ret <= 0 ? SSL_get_error(tls->ssl, ret) : 0;
 
-        /* success or fatal error */
-        break;
+#ifdef HAVE_KTLS
+    if (ret > 0 && BIO_get_ktls_send(SSL_get_wbio(tls->ssl))) {
+        xmpp_debug(tls->ctx, "tls", "Kernel TLS send offload enabled");
+        tls->ktls_send = 1;
     }
-    tls->lasterror = error;
+#endif
 
     return ret <= 0 ? 0 : 1;
-
 }
 
 int tls_stop(tls_t *tls)
@@ -141,6 +163,11 @@ int tls_stop(tls_t *tls)
     return ret <= 0 ? 0 : 1;
 }
 
+int tls_want_write(tls_t *tls)
+{
+    return tls->lasterror == SSL_ERROR_WANT_WRITE;
+}
+
 int tls_is_recoverable(int error)
 {
     return (error == SSL_ERROR_NONE || error == SSL_ERROR_WANT_READ
@@ -167,7 +194,20 @@ int tls_read(tls_t *tls, void * const buff, const size_t len)
 
 int tls_write(tls_t *tls, const void * const buff, const size_t len)
 {
-    int ret = SSL_write(tls->ssl, buff, len);
+    int ret;
+
+    /* the kernel frames and encrypts application data itself, so
+       bypass the SSL record layer and its copy */
+    if (tls->ktls_send) {
+        ret = sock_write(tls->sock, buff, len);
+        if (ret < 0) {
+            tls->lasterror = sock_is_recoverable(sock_error()) ?
+                             SSL_ERROR_WANT_WRITE : SSL_ERROR_SYSCALL;
+        }
+        return ret;
+    }
+
+    ret = SSL_write(tls->ssl, buff, len);
 
     if (ret <= 0) {
 	tls->lasterror = SSL_get_error(tls->ssl, ret);
@@ -176,6 +216,24 @@ int tls_write(tls_t *tls, const void * const buff, const size_t len)
     return ret;
 }
 
+int tls_writev(tls_t *tls, const sock_iovec_t * const iov, const int iovcnt)
+{
+    int ret;
+
+    /* the kernel frames the records, so the buffers go out in one
+       gathered send like on a plain socket */
+    if (tls->ktls_send) {
+        ret = sock_writev(tls->sock, iov, iovcnt);
+        if (ret < 0) {
+            tls->lasterror = sock_is_recoverable(sock_error()) ?
+                             SSL_ERROR_WANT_WRITE : SSL_ERROR_SYSCALL;
+        }
+        return ret;
+    }
+
+    return tls_writev_records(tls, iov, iovcnt);
+}
+
 int tls_clear_pending_write(tls_t *tls)
 {
     return 0;
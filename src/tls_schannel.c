@@ -203,6 +203,17 @@ int tls_set_credentials(tls_t *tls, const char *cafilename)
     return -1;
 }
 
+int tls_enable_ktls(tls_t *tls)
+{
+    /* kernel TLS offload is only implemented for OpenSSL */
+    return 0;
+}
+
+int tls_enable_low_mem(tls_t *tls)
+{
+    return 0;
+}
+
 int tls_start(tls_t *tls)
 {
     ULONG ctxtreq = 0, ctxtattr = 0;
@@ -383,6 +394,12 @@ int tls_stop(tls_t *tls)
     return -1;
 }
 
+int tls_want_write(tls_t *tls)
+{
+    /* the schannel handshake completes within tls_start() */
+    return 0;
+}
+
 int tls_error(tls_t *tls)
 {
     return tls->lasterror;
@@ -646,3 +663,8 @@ int tls_write(tls_t *tls, const void * const buff, const size_t len)
 
     return sent;
 }
+
+int tls_writev(tls_t *tls, const sock_iovec_t * const iov, const int iovcnt)
+{
+    return tls_writev_records(tls, iov, iovcnt);
+}
@@ -0,0 +1,368 @@
+/* transport.c
+** strophe XMPP client library -- transport implementations
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/** @file
+ *  Socket and loopback transports.
+ */
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#else
+#include <winsock2.h>
+#define ECONNRESET WSAECONNRESET
+#endif
+
+#include "strophe.h"
+#include "common.h"
+#include "transport.h"
+
+/* socket transport */
+
+static int _sock_read(xmpp_conn_t * const conn, void * const buff,
+                      const size_t len)
+{
+    int ret;
+
+    if (!conn->tls)
+        return sock_read(conn->sock, buff, len);
+
+    /* a TLS close notify is an error like any other */
+    ret = tls_read(conn->tls, buff, len);
+    return ret > 0 ? ret : -1;
+}
+
+static int _sock_write(xmpp_conn_t * const conn, const void * const buff,
+                       const size_t len)
+{
+    if (conn->tls)
+        return tls_write(conn->tls, buff, len);
+    return sock_write(conn->sock, buff, len);
+}
+
+static int _sock_writev(xmpp_conn_t * const conn,
+                        const sock_iovec_t * const iov, const int iovcnt)
+{
+    if (!conn->tls)
+        return sock_writev(conn->sock, iov, iovcnt);
+
+    return tls_writev(conn->tls, iov, iovcnt);
+}
+
+static int _sock_flush(xmpp_conn_t * const conn)
+{
+    /* a TLS record may be left over from a write which would block */
+    return conn->tls ? tls_clear_pending_write(conn->tls) : 0;
+}
+
+static int _sock_pending(xmpp_conn_t * const conn)
+{
+    return conn->tls ? tls_pending(conn->tls) : 0;
+}
+
+static int _sock_error(xmpp_conn_t * const conn)
+{
+    int error;
+
+    if (conn->tls) {
+        error = tls_error(conn->tls);
+        return tls_is_recoverable(error) ? 0 : error;
+    }
+    error = sock_error();
+    return sock_is_recoverable(error) ? 0 : error;
+}
+
+static void _sock_close(xmpp_conn_t * const conn)
+{
+    if (conn->tls) {
+        tls_stop(conn->tls);
+        tls_free(conn->tls);
+        conn->tls = NULL;
+    }
+    if (conn->sock != -1) {
+        sock_close(conn->sock);
+        conn->sock = -1;
+    }
+}
+
+static sock_t _sock_fd(xmpp_conn_t * const conn)
+{
+    return conn->sock;
+}
+
+const transport_t transport_sock = {
+    "socket",
+    conn_sock_connect,
+    _sock_read,
+    _sock_write,
+    _sock_writev,
+    _sock_flush,
+    _sock_pending,
+    _sock_error,
+    _sock_close,
+    _sock_fd,
+    NULL
+};
+
+/* loopback transport */
+
+typedef struct _loopback_t {
+    transport_loopback_handler handler;
+    void *userdata;
+    char *in; /* written by the peer, read by the connection */
+    size_t in_len;
+    size_t in_off;
+    size_t in_size;
+    char *out; /* written by the connection when there is no handler */
+    size_t out_len;
+    size_t out_size;
+    int closed;
+} loopback_t;
+
+static int _buf_append(const xmpp_ctx_t * const ctx, char **buf,
+                       size_t *len, size_t *size,
+                       const char * const data, const size_t n)
+{
+    size_t new_size;
+    char *p;
+
+    if (*len + n > *size) {
+        new_size = *size ? *size : 1024;
+        while (new_size < *len + n)
+            new_size *= 2;
+        p = xmpp_realloc(ctx, *buf, new_size);
+        if (!p) return -1;
+        *buf = p;
+        *size = new_size;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+
+    return 0;
+}
+
+static int _loopback_connect(xmpp_conn_t * const conn)
+{
+    loopback_t *lb = (loopback_t *)conn->transport_data;
+
+    lb->in_len = lb->in_off = 0;
+    lb->out_len = 0;
+    lb->closed = 0;
+    conn_established(conn);
+
+    return 0;
+}
+
+static int _loopback_read(xmpp_conn_t * const conn, void * const buff,
+                          const size_t len)
+{
+    loopback_t *lb = (loopback_t *)conn->transport_data;
+    size_t n = lb->in_len - lb->in_off;
+
+    if (n == 0)
+        return lb->closed ? 0 : -1;
+    if (n > len) n = len;
+    memcpy(buff, lb->in + lb->in_off, n);
+    lb->in_off += n;
+    if (lb->in_off == lb->in_len)
+        lb->in_off = lb->in_len = 0;
+
+    return (int)n;
+}
+
+static int _loopback_write(xmpp_conn_t * const conn, const void * const buff,
+                           const size_t len)
+{
+    loopback_t *lb = (loopback_t *)conn->transport_data;
+
+    if (lb->closed)
+        return -1;
+    if (lb->handler) {
+        lb->handler(conn, buff, len, lb->userdata);
+        return (int)len;
+    }
+    if (_buf_append(conn->ctx, &lb->out, &lb->out_len, &lb->out_size,
+                    buff, len) != 0)
+        return -1;
+
+    return (int)len;
+}
+
+static int _loopback_writev(xmpp_conn_t * const conn,
+                            const sock_iovec_t * const iov, const int iovcnt)
+{
+    int written = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; ++i) {
+        if (_loopback_write(conn, iov[i].iov_base, iov[i].iov_len) < 0)
+            return written > 0 ? written : -1;
+        written += iov[i].iov_len;
+    }
+
+    return written;
+}
+
+static int _loopback_flush(xmpp_conn_t * const conn)
+{
+    return 0;
+}
+
+static int _loopback_pending(xmpp_conn_t * const conn)
+{
+    loopback_t *lb = (loopback_t *)conn->transport_data;
+
+    /* there is no descriptor to wake the event loop, so a close by the
+     * peer counts as pending to let the connection read the end */
+    if (lb->closed && lb->in_len == lb->in_off)
+        return 1;
+
+    return (int)(lb->in_len - lb->in_off);
+}
+
+static int _loopback_error(xmpp_conn_t * const conn)
+{
+    loopback_t *lb = (loopback_t *)conn->transport_data;
+
+    /* reads only fail while waiting for the peer */
+    return lb->closed ? ECONNRESET : 0;
+}
+
+static void _loopback_close(xmpp_conn_t * const conn)
+{
+    loopback_t *lb = (loopback_t *)conn->transport_data;
+
+    lb->closed = 1;
+    lb->in_len = lb->in_off = 0;
+}
+
+static sock_t _loopback_fd(xmpp_conn_t * const conn)
+{
+    return -1;
+}
+
+static void _loopback_free(xmpp_conn_t * const conn)
+{
+    loopback_t *lb = (loopback_t *)conn->transport_data;
+
+    if (lb->in) xmpp_free(conn->ctx, lb->in);
+    if (lb->out) xmpp_free(conn->ctx, lb->out);
+    xmpp_free(conn->ctx, lb);
+    conn->transport_data = NULL;
+}
+
+static const transport_t transport_loopback = {
+    "loopback",
+    _loopback_connect,
+    _loopback_read,
+    _loopback_write,
+    _loopback_writev,
+    _loopback_flush,
+    _loopback_pending,
+    _loopback_error,
+    _loopback_close,
+    _loopback_fd,
+    _loopback_free
+};
+
+/* only the loopback keeps data in conn->transport_data.  it stays at the
+ * bottom when a layer such as compression is put over it, so it isn't
+ * found by looking at conn->transport */
+static loopback_t *_loopback_data(xmpp_conn_t * const conn)
+{
+    return (loopback_t *)conn->transport_data;
+}
+
+/** Replace the transport of a connection with an in-process loopback.
+ *  The connection must be disconnected.  Its next connect completes
+ *  at once without touching the network.
+ *
+ *  @param conn a Strophe connection object
+ *  @param handler receives everything the connection writes, or NULL to
+ *      buffer it for transport_loopback_recv()
+ *  @param userdata an opaque data pointer that will be passed to handler
+ *
+ *  @return 0 on success or -1 on an error
+ */
+int transport_loopback_attach(xmpp_conn_t * const conn,
+                              transport_loopback_handler handler,
+                              void * const userdata)
+{
+    loopback_t *lb;
+
+    if (conn->state != XMPP_STATE_DISCONNECTED)
+        return -1;
+
+    lb = xmpp_alloc(conn->ctx, sizeof(*lb));
+    if (!lb) return -1;
+    memset(lb, 0, sizeof(*lb));
+    lb->handler = handler;
+    lb->userdata = userdata;
+
+    if (conn->transport->free)
+        conn->transport->free(conn);
+    conn->transport = &transport_loopback;
+    conn->transport_data = lb;
+    conn->tls_disabled = 1;
+
+    return 0;
+}
+
+/** Queue data for the connection to read, as if sent by the server.
+ *
+ *  @return 0 on success or -1 on an error
+ */
+int transport_loopback_send(xmpp_conn_t * const conn,
+                            const char * const data, const size_t len)
+{
+    loopback_t *lb = _loopback_data(conn);
+
+    if (!lb || lb->closed)
+        return -1;
+
+    return _buf_append(conn->ctx, &lb->in, &lb->in_len, &lb->in_size,
+                       data, len);
+}
+
+/** Take up to len bytes of the data the connection has written.
+ *  Only used when no handler was given to transport_loopback_attach().
+ *
+ *  @return the number of bytes copied to buff
+ */
+size_t transport_loopback_recv(xmpp_conn_t * const conn,
+                               char * const buff, const size_t len)
+{
+    loopback_t *lb = _loopback_data(conn);
+    size_t n;
+
+    if (!lb)
+        return 0;
+
+    n = lb->out_len < len ? lb->out_len : len;
+    memcpy(buff, lb->out, n);
+    memmove(lb->out, lb->out + n, lb->out_len - n);
+    lb->out_len -= n;
+
+    return n;
+}
+
+/** Close the stream from the server side.
+ *  The connection reads the end of the stream on the next run of the
+ *  event loop.
+ */
+void transport_loopback_close(xmpp_conn_t * const conn)
+{
+    loopback_t *lb = _loopback_data(conn);
+
+    if (lb)
+        lb->closed = 1;
+}
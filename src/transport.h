@@ -0,0 +1,72 @@
+/* transport.h
+** strophe XMPP client library -- transport abstraction header
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/** @file
+ *  Transport abstraction API.
+ */
+
+#ifndef __LIBSTROPHE_TRANSPORT_H__
+#define __LIBSTROPHE_TRANSPORT_H__
+
+#include "strophe.h"
+#include "sock.h"
+
+/* the byte stream under a connection.  read() and write() return the
+ * number of bytes transferred or -1, read() returns 0 once the peer has
+ * closed the stream.  after a failure error() tells whether to give up:
+ * it returns 0 if the call only would have blocked and the error code
+ * otherwise.  fd() is the descriptor the event loop waits on or -1 if
+ * the transport has none, pending() counts bytes which can be read
+ * without waiting for it.  flush() writes out data the transport holds
+ * back from earlier writes and fails like write() if it can't. */
+typedef struct _transport_t {
+    const char *name;
+    /* starts connecting, the transport calls conn_established() when the
+     * stream is ready */
+    int (*connect)(xmpp_conn_t * const conn);
+    int (*read)(xmpp_conn_t * const conn, void * const buff,
+                const size_t len);
+    int (*write)(xmpp_conn_t * const conn, const void * const buff,
+                 const size_t len);
+    int (*writev)(xmpp_conn_t * const conn, const sock_iovec_t * const iov,
+                  const int iovcnt);
+    int (*flush)(xmpp_conn_t * const conn);
+    int (*pending)(xmpp_conn_t * const conn);
+    int (*error)(xmpp_conn_t * const conn);
+    void (*close)(xmpp_conn_t * const conn);
+    sock_t (*fd)(xmpp_conn_t * const conn);
+    /* releases conn->transport_data, may be NULL */
+    void (*free)(xmpp_conn_t * const conn);
+} transport_t;
+
+/* TCP or local socket, with TLS layered on top once it is started */
+extern const transport_t transport_sock;
+
+/* in-process transport for tests and benchmarks.  the test plays the
+ * server: everything the connection writes goes to the handler, or is
+ * buffered for transport_loopback_recv() if there is none, and
+ * transport_loopback_send() queues data for the connection to read.
+ * the loopback carries plaintext only, so TLS is disabled. */
+typedef void (*transport_loopback_handler)(xmpp_conn_t * const conn,
+                                           const char * const data,
+                                           const size_t len,
+                                           void * const userdata);
+
+int transport_loopback_attach(xmpp_conn_t * const conn,
+                              transport_loopback_handler handler,
+                              void * const userdata);
+int transport_loopback_send(xmpp_conn_t * const conn,
+                            const char * const data, const size_t len);
+size_t transport_loopback_recv(xmpp_conn_t * const conn,
+                               char * const buff, const size_t len);
+void transport_loopback_close(xmpp_conn_t * const conn);
+
+#endif /* __LIBSTROPHE_TRANSPORT_H__ */
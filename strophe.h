@@ -17,6 +17,7 @@
 #define __LIBSTROPHE_STROPHE_H__
 
 #include <stddef.h>     /* size_t */
+#include <stdarg.h>     /* va_list */
 
 #ifdef __cplusplus
 extern "C" {
@@ -71,6 +72,30 @@ extern "C" {
  *  Namespace definition for 'jabber:iq:roster'.
  */
 #define XMPP_NS_ROSTER "jabber:iq:roster"
+/** @def XMPP_NS_SM
+ *  Namespace definition for 'urn:xmpp:sm:3'.
+ */
+#define XMPP_NS_SM "urn:xmpp:sm:3"
+/** @def XMPP_NS_COMPRESS
+ *  Namespace definition for 'http://jabber.org/protocol/compress'.
+ */
+#define XMPP_NS_COMPRESS "http://jabber.org/protocol/compress"
+/** @def XMPP_NS_FEATURE_COMPRESS
+ *  Namespace definition for 'http://jabber.org/features/compress'.
+ */
+#define XMPP_NS_FEATURE_COMPRESS "http://jabber.org/features/compress"
+/** @def XMPP_NS_SASL2
+ *  Namespace definition for 'urn:xmpp:sasl:2'.
+ */
+#define XMPP_NS_SASL2 "urn:xmpp:sasl:2"
+/** @def XMPP_NS_BIND2
+ *  Namespace definition for 'urn:xmpp:bind:0'.
+ */
+#define XMPP_NS_BIND2 "urn:xmpp:bind:0"
+/** @def XMPP_NS_FAST
+ *  Namespace definition for 'urn:xmpp:fast:0'.
+ */
+#define XMPP_NS_FAST "urn:xmpp:fast:0"
 
 /* error defines */
 /** @def XMPP_EOK
@@ -117,6 +142,9 @@ typedef struct _xmpp_ctx_t xmpp_ctx_t;
 xmpp_ctx_t *xmpp_ctx_new(const xmpp_mem_t * const mem, 
 			     const xmpp_log_t * const log);
 void xmpp_ctx_free(xmpp_ctx_t * const ctx);
+void xmpp_ctx_set_connect_limits(xmpp_ctx_t * const ctx,
+                                 unsigned int max_connecting,
+                                 unsigned int max_rate);
 
 struct _xmpp_mem_t {
     void *(*alloc)(const size_t size, void * const userdata);
@@ -195,6 +223,12 @@ typedef enum {
 #define XMPP_CONN_FLAG_DISABLE_TLS   0x0001
 #define XMPP_CONN_FLAG_MANDATORY_TLS 0x0002
 #define XMPP_CONN_FLAG_LEGACY_SSL    0x0004
+#define XMPP_CONN_FLAG_KTLS          0x0008
+#define XMPP_CONN_FLAG_TLS_LOW_MEM   0x0010
+#define XMPP_CONN_FLAG_TCP_NODELAY   0x0020
+#define XMPP_CONN_FLAG_STREAM_MGMT   0x0040
+#define XMPP_CONN_FLAG_COMPRESSION   0x0080
+#define XMPP_CONN_FLAG_SASL2         0x0100
 
 typedef struct {
     xmpp_error_type_t type;
@@ -214,6 +248,32 @@ int xmpp_conn_release(xmpp_conn_t * const conn);
 
 long xmpp_conn_get_flags(const xmpp_conn_t * const conn);
 int xmpp_conn_set_flags(xmpp_conn_t * const conn, long flags);
+int xmpp_conn_set_keepalive(xmpp_conn_t * const conn, int idle,
+                            int interval, int count);
+int xmpp_conn_set_sockbuf(xmpp_conn_t * const conn, int sndbuf, int rcvbuf);
+int xmpp_conn_set_user_timeout(xmpp_conn_t * const conn,
+                               unsigned int timeout);
+int xmpp_conn_set_busy_poll(xmpp_conn_t * const conn, unsigned int usec);
+int xmpp_conn_set_unix_path(xmpp_conn_t * const conn, const char * const path);
+void xmpp_conn_set_reconnect(xmpp_conn_t * const conn,
+                             unsigned long min_delay,
+                             unsigned long max_delay);
+int xmpp_conn_is_reconnecting(const xmpp_conn_t * const conn);
+int xmpp_conn_set_compression(xmpp_conn_t * const conn, int level,
+                              int mem_level);
+int xmpp_conn_set_user_agent(xmpp_conn_t * const conn, const char * const id,
+                             const char * const software,
+                             const char * const device);
+int xmpp_conn_set_fast_token(xmpp_conn_t * const conn,
+                             const char * const token, unsigned long count);
+const char *xmpp_conn_get_fast_token(const xmpp_conn_t * const conn,
+                                     unsigned long * const count);
+/** @def XMPP_ID_SIZE
+ *  Size of a buffer that holds any id of xmpp_conn_gen_id() with its '\0'.
+ */
+#define XMPP_ID_SIZE 20
+size_t xmpp_conn_gen_id(xmpp_conn_t * const conn, char * const buf,
+                        const size_t len);
 const char *xmpp_conn_get_jid(const xmpp_conn_t * const conn);
 const char *xmpp_conn_get_bound_jid(const xmpp_conn_t * const conn);
 void xmpp_conn_set_jid(xmpp_conn_t * const conn, const char * const jid);
@@ -222,6 +282,8 @@ void xmpp_conn_set_pass(xmpp_conn_t * const conn, const char * const pass);
 xmpp_ctx_t* xmpp_conn_get_context(xmpp_conn_t * const conn);
 void xmpp_conn_disable_tls(xmpp_conn_t * const conn);
 int xmpp_conn_is_secured(xmpp_conn_t * const conn);
+int xmpp_conn_is_resumed(const xmpp_conn_t * const conn);
+int xmpp_conn_is_compressed(const xmpp_conn_t * const conn);
 
 int xmpp_connect_client(xmpp_conn_t * const conn, 
 			  const char * const altdomain,
@@ -308,6 +370,8 @@ int xmpp_stanza_is_tag(xmpp_stanza_t * const stanza);
 /** marshall a stanza into text for transmission or display **/
 int xmpp_stanza_to_text(xmpp_stanza_t *stanza, 
 			char ** const buf, size_t * const buflen);
+/** keep the text of a stanza sent many times **/
+int xmpp_stanza_freeze(xmpp_stanza_t * const stanza);
 
 xmpp_stanza_t *xmpp_stanza_get_children(xmpp_stanza_t * const stanza);
 xmpp_stanza_t *xmpp_stanza_get_child_by_name(xmpp_stanza_t * const stanza, 
@@ -362,6 +426,12 @@ int xmpp_stanza_set_from(xmpp_stanza_t * const stanza,
 /* allocate and initialize a stanza in reply to another */
 xmpp_stanza_t *xmpp_stanza_reply(xmpp_stanza_t * const stanza);
 
+/* build a stanza tree from an XML-like template */
+xmpp_stanza_t *xmpp_stanza_build(xmpp_ctx_t *ctx, const char * const fmt,
+                                 ...);
+xmpp_stanza_t *xmpp_stanza_vbuild(xmpp_ctx_t *ctx, const char * const fmt,
+                                  va_list ap);
+
 /* stanza subclasses */
 /* unimplemented
 void xmpp_message_new();
@@ -381,10 +451,42 @@ char *xmpp_jid_bare(xmpp_ctx_t *ctx, const char *jid);
 char *xmpp_jid_node(xmpp_ctx_t *ctx, const char *jid);
 char *xmpp_jid_domain(xmpp_ctx_t *ctx, const char *jid);
 char *xmpp_jid_resource(xmpp_ctx_t *ctx, const char *jid);
+char *xmpp_jid_normalize(xmpp_ctx_t *ctx, const char *jid);
+
+/* a parsed JID whose parts point into the original string; a part
+ * that is not present has a length of 0 */
+typedef struct {
+    size_t offset;
+    size_t len;
+} xmpp_jid_slice_t;
+
+typedef struct {
+    const char *jid;
+    xmpp_jid_slice_t bare;
+    xmpp_jid_slice_t node;
+    xmpp_jid_slice_t domain;
+    xmpp_jid_slice_t resource;
+} xmpp_jid_view_t;
+
+int xmpp_jid_parse(const char * const jid, xmpp_jid_view_t * const view);
+int xmpp_jid_bare_equal(const xmpp_jid_view_t * const a,
+                        const xmpp_jid_view_t * const b);
+int xmpp_jid_domain_match(const xmpp_jid_view_t * const view,
+                          const char * const domain);
 
 /** UUID **/
 char *xmpp_uuid_gen(xmpp_ctx_t *ctx);
 
+/** base64 **/
+/* these write to buffers supplied by the caller, the _len functions
+ * tell the size they need */
+size_t xmpp_base64_encoded_len(const size_t len);
+size_t xmpp_base64_encode(const unsigned char * const data, const size_t len,
+                          char * const out);
+size_t xmpp_base64_decoded_len(const char * const base64, const size_t len);
+int xmpp_base64_decode(const char * const base64, const size_t len,
+                       unsigned char * const out, size_t * const out_len);
+
 /** event loop **/
 void xmpp_run_once(xmpp_ctx_t *ctx, const unsigned long  timeout);
 void xmpp_run(xmpp_ctx_t *ctx);
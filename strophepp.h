@@ -57,10 +57,14 @@ namespace XMPP {
 	void *operator new(size_t size, Context *ctx);
 	void operator delete(void *p);
 	Stanza(Context *ctx);
+	Stanza(Context *ctx, xmpp_stanza_t *stanza);
 	virtual ~Stanza();
 
     public:
 	static Stanza *create(Context *ctx);
+	/* a tree from a template, see xmpp_stanza_build() */
+	static Stanza *build(Context *ctx, const char * const fmt, ...);
+	xmpp_stanza_t *getStanza();
 	void release();
 	Stanza *clone();
 	Stanza *copy();
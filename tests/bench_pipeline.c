@@ -0,0 +1,140 @@
+/* bench_pipeline.c
+** libstrophe XMPP client library -- stanza pipeline throughput
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/* Runs a component over the loopback transport against a scripted server
+ * which floods it with messages.  A handler answers every message, so
+ * each stanza goes through the parser, the handler dispatch and the send
+ * queue without any network in the way.
+ *
+ * Usage: bench_pipeline [N]
+ *   N   number of messages (default 100000)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "transport.h"
+
+#define DEFAULT_MESSAGES 100000
+#define BATCH 100
+
+#define STREAM_HEADER "<?xml version='1.0'?>" \
+    "<stream:stream xmlns='jabber:component:accept' " \
+    "xmlns:stream='http://etherx.jabber.org/streams' " \
+    "id='bench' from='bench.localhost'>"
+
+static int connected;
+static unsigned long received;
+static unsigned long answered;
+
+static void server_handler(xmpp_conn_t * const conn,
+                           const char * const data, const size_t len,
+                           void * const userdata)
+{
+    const char *p;
+    const char *end = data + len;
+
+    if (len >= 5 && memcmp(data, "<?xml", 5) == 0)
+        transport_loopback_send(conn, STREAM_HEADER, strlen(STREAM_HEADER));
+    else if (len >= 10 && memcmp(data, "<handshake", 10) == 0)
+        transport_loopback_send(conn, "<handshake/>", 12);
+
+    for (p = data; p + 8 <= end; ++p) {
+        if (memcmp(p, "<message", 8) == 0)
+            ++answered;
+    }
+}
+
+static void conn_handler(xmpp_conn_t * const conn,
+                         const xmpp_conn_event_t status,
+                         const int error,
+                         xmpp_stream_error_t * const stream_error,
+                         void * const userdata)
+{
+    connected = status == XMPP_CONN_CONNECT;
+}
+
+static int message_handler(xmpp_conn_t * const conn,
+                           xmpp_stanza_t * const stanza,
+                           void * const userdata)
+{
+    xmpp_stanza_t *reply;
+
+    ++received;
+    reply = xmpp_stanza_new(xmpp_conn_get_context(conn));
+    xmpp_stanza_set_name(reply, "message");
+    xmpp_stanza_set_attribute(reply, "to",
+                              xmpp_stanza_get_attribute(stanza, "from"));
+    xmpp_stanza_set_id(reply, xmpp_stanza_get_id(stanza));
+    xmpp_send(conn, reply);
+    xmpp_stanza_release(reply);
+
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    char buf[128];
+    unsigned long n = DEFAULT_MESSAGES;
+    unsigned long sent = 0;
+    uint64_t start, elapsed;
+    int i;
+
+    if (argc > 1)
+        n = strtoul(argv[1], NULL, 10);
+
+    xmpp_initialize();
+    ctx = xmpp_ctx_new(NULL, NULL);
+    conn = xmpp_conn_new(ctx);
+    if (!ctx || !conn) return 1;
+    xmpp_conn_set_jid(conn, "bench.localhost");
+    xmpp_conn_set_pass(conn, "bench");
+    transport_loopback_attach(conn, server_handler, NULL);
+    xmpp_connect_component(conn, "localhost", 0, conn_handler, NULL);
+    for (i = 0; i < 10 && !connected; ++i)
+        xmpp_run_once(ctx, 0);
+    if (!connected) {
+        fprintf(stderr, "handshake failed\n");
+        return 1;
+    }
+    xmpp_handler_add(conn, message_handler, NULL, "message", NULL, NULL);
+
+    start = time_stamp();
+    while (answered < n) {
+        for (i = 0; i < BATCH && sent < n; ++i, ++sent) {
+            xmpp_snprintf(buf, sizeof(buf),
+                          "<message from='user@localhost/res' id='m%lu' "
+                          "type='chat'><body>hello</body></message>", sent);
+            transport_loopback_send(conn, buf, strlen(buf));
+        }
+        xmpp_run_once(ctx, 0);
+    }
+    elapsed = time_elapsed(start, time_stamp());
+
+    printf("messages:        %lu received, %lu answered\n",
+           received, answered);
+    printf("time:            %lu ms\n", (unsigned long)elapsed);
+    if (elapsed > 0)
+        printf("throughput:      %.0f stanzas/s\n",
+               (double)received * 1000 / elapsed);
+
+    xmpp_disconnect(conn);
+    xmpp_conn_release(conn);
+    xmpp_ctx_free(ctx);
+    xmpp_shutdown();
+
+    return 0;
+}
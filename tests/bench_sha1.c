@@ -0,0 +1,94 @@
+/* bench_sha1.c
+** libstrophe XMPP client library -- SHA-1 throughput
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/* Runs every SHA-1 transform this CPU supports over a megabyte of data
+ * and through the SCRAM-SHA-1 key derivation with the usual 4096
+ * iterations, so the portable code gives the figures before and the
+ * accelerated ones after.
+ *
+ * Usage: bench_sha1 [N]
+ *   N   number of SCRAM logins per implementation (default 200)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* include sha1.c to switch between the implementations */
+#include "sha1.c"
+#include "scram.h"
+
+#define DEFAULT_LOGINS 200
+#define ITERATIONS 4096
+
+typedef void (*transform_t)(uint32_t state[5], const uint8_t *data,
+                            size_t blocks);
+
+static double seconds_since(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void bench(const char *name, transform_t transform,
+                  unsigned long logins)
+{
+    static uint8_t data[1 << 20];
+    static const uint8_t salt[] = "QSXCR+Q6sek8bf92";
+    uint8_t digest[SCRAM_DIGEST_SIZE];
+    clock_t start;
+    double t_bulk, t_short, t_login;
+    unsigned long n;
+
+    sha1_transform = transform;
+    memset(data, 'a', sizeof(data));
+
+    start = clock();
+    for (n = 0; n < 50; n++)
+        crypto_SHA1(data, sizeof(data), digest);
+    t_bulk = seconds_since(start);
+    start = clock();
+    for (n = 0; n < 500000; n++)
+        crypto_SHA1(data, 64, digest);
+    t_short = seconds_since(start);
+    start = clock();
+    for (n = 0; n < logins; n++)
+        SCRAM_ClientKey(&scram_sha1, (uint8_t *)"pencil", 6, salt,
+                        sizeof(salt) - 1, ITERATIONS, digest);
+    t_login = seconds_since(start);
+
+    printf("%-20s %8.0f MB/s %8.0f MB/s %10.0f logins/s\n", name,
+           t_bulk > 0 ? 50 / t_bulk : 0.0,
+           t_short > 0 ? 500000.0 * 64 / t_short / (1 << 20) : 0.0,
+           t_login > 0 ? logins / t_login : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long logins = DEFAULT_LOGINS;
+
+    if (argc > 1)
+        logins = strtoul(argv[1], NULL, 10);
+
+    printf("%-20s %13s %13s %19s\n", "SHA-1", "1 MB", "64 bytes",
+           "SCRAM-SHA-1");
+    bench("portable", SHA1_Transform, logins);
+#ifdef CPU_X86_SSSE3
+    if (cpu_has_x86_ssse3())
+        bench("SSSE3", SHA1_Transform_ssse3, logins);
+#endif
+#ifdef CPU_X86_SHA
+    if (cpu_has_x86_sha())
+        bench("x86 SHA extensions", SHA1_Transform_x86, logins);
+#endif
+
+    return 0;
+}
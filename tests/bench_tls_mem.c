@@ -0,0 +1,248 @@
+/* bench_tls_mem.c
+** libstrophe XMPP client library -- memory footprint of idle TLS connections
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/* Opens N legacy SSL connections to a TLS server running in a child
+ * process, waits until every handshake is complete and reports the resident
+ * set size consumed per connection.
+ *
+ * Usage: bench_tls_mem [-l] [N]
+ *   -l  enable XMPP_CONN_FLAG_TLS_LOW_MEM
+ *   N   number of connections (default 500)
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "strophe.h"
+
+#define DEFAULT_CONNECTIONS 500
+#define HANDSHAKE_TIMEOUT 60000 /* milliseconds */
+
+/* P-256 key through the EVP_PKEY_CTX calls of OpenSSL 1.1 and 3 */
+static EVP_PKEY *ec_key(void)
+{
+    EVP_PKEY_CTX *pctx;
+    EVP_PKEY *key = NULL;
+
+    pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (!pctx) return NULL;
+    if (EVP_PKEY_keygen_init(pctx) <= 0 ||
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx,
+                                               NID_X9_62_prime256v1) <= 0 ||
+        EVP_PKEY_keygen(pctx, &key) <= 0)
+        key = NULL;
+    EVP_PKEY_CTX_free(pctx);
+
+    return key;
+}
+
+static SSL_CTX *server_ssl_ctx(void)
+{
+    SSL_CTX *ssl_ctx;
+    EVP_PKEY *key;
+    X509 *cert;
+    X509_NAME *name;
+
+    /* throw-away self-signed certificate, the client doesn't verify it */
+    key = ec_key();
+    cert = X509_new();
+    if (!key || !cert) return NULL;
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, key);
+    name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_sign(cert, key, EVP_sha256());
+
+    ssl_ctx = SSL_CTX_new(TLS_server_method());
+    if (ssl_ctx) {
+        SSL_CTX_use_certificate(ssl_ctx, cert);
+        SSL_CTX_use_PrivateKey(ssl_ctx, key);
+    }
+    X509_free(cert);
+    EVP_PKEY_free(key);
+
+    return ssl_ctx;
+}
+
+/* accepts n connections, completes the handshakes and keeps them idle */
+static void run_server(int lsock, int n)
+{
+    SSL_CTX *ssl_ctx;
+    SSL *ssl;
+    int sock;
+    int i;
+
+    ssl_ctx = server_ssl_ctx();
+    if (!ssl_ctx) {
+        fprintf(stderr, "server: failed to set up TLS\n");
+        exit(1);
+    }
+
+    for (i = 0; i < n; ++i) {
+        sock = accept(lsock, NULL, NULL);
+        if (sock < 0) break;
+        ssl = SSL_new(ssl_ctx);
+        SSL_set_fd(ssl, sock);
+        if (SSL_accept(ssl) <= 0)
+            fprintf(stderr, "server: handshake #%d failed\n", i + 1);
+        /* sessions stay open until the parent kills us */
+    }
+
+    while (1)
+        pause();
+}
+
+static long rss_kb(void)
+{
+    FILE *f;
+    long size, resident;
+
+    f = fopen("/proc/self/statm", "r");
+    if (!f) return -1;
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+        resident = -1;
+    fclose(f);
+
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void conn_handler(xmpp_conn_t * const conn,
+                         const xmpp_conn_event_t status,
+                         const int error,
+                         xmpp_stream_error_t * const stream_error,
+                         void * const userdata)
+{
+    int *failed = (int *)userdata;
+
+    if (status == XMPP_CONN_DISCONNECT || status == XMPP_CONN_FAIL)
+        ++*failed;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t **conns;
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    long flags = XMPP_CONN_FLAG_LEGACY_SSL;
+    long rss_before, rss_after;
+    unsigned long elapsed = 0;
+    int n = DEFAULT_CONNECTIONS;
+    int failed = 0;
+    int secured = 0;
+    int lsock;
+    pid_t pid;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-l") == 0)
+            flags |= XMPP_CONN_FLAG_TLS_LOW_MEM;
+        else
+            n = atoi(argv[i]);
+    }
+    /* the event loop is select() based */
+    if (n <= 0 || n > FD_SETSIZE - 16) {
+        fprintf(stderr, "Number of connections must be in range 1..%d\n",
+                FD_SETSIZE - 16);
+        return 1;
+    }
+
+    lsock = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addrlen = sizeof(addr);
+    if (lsock < 0 ||
+        bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(lsock, n) != 0 ||
+        getsockname(lsock, (struct sockaddr *)&addr, &addrlen) != 0) {
+        perror("server socket");
+        return 1;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0)
+        run_server(lsock, n);
+    close(lsock);
+
+    xmpp_initialize();
+    ctx = xmpp_ctx_new(NULL, NULL);
+    conns = malloc(n * sizeof(*conns));
+    if (!ctx || !conns) {
+        kill(pid, SIGTERM);
+        return 1;
+    }
+
+    for (i = 0; i < n; ++i) {
+        conns[i] = xmpp_conn_new(ctx);
+        xmpp_conn_set_flags(conns[i], flags);
+        xmpp_conn_set_jid(conns[i], "bench@localhost");
+        xmpp_conn_set_pass(conns[i], "bench");
+    }
+
+    rss_before = rss_kb();
+
+    for (i = 0; i < n; ++i)
+        xmpp_connect_client(conns[i], "127.0.0.1", ntohs(addr.sin_port),
+                            conn_handler, &failed);
+
+    while (secured + failed < n && elapsed < HANDSHAKE_TIMEOUT) {
+        xmpp_run_once(ctx, 10);
+        elapsed += 10;
+        for (secured = 0, i = 0; i < n; ++i)
+            secured += xmpp_conn_is_secured(conns[i]);
+    }
+    /* flush the stream headers so the send buffers are idle too */
+    for (i = 0; i < 10; ++i)
+        xmpp_run_once(ctx, 10);
+
+    rss_after = rss_kb();
+
+    printf("mode:            %s\n", flags & XMPP_CONN_FLAG_TLS_LOW_MEM ?
+                                    "low memory" : "default");
+    printf("connections:     %d secured, %d failed\n", secured, failed);
+    printf("RSS growth:      %ld KB\n", rss_after - rss_before);
+    if (secured > 0)
+        printf("per connection:  %.1f KB\n",
+               (double)(rss_after - rss_before) / secured);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    for (i = 0; i < n; ++i)
+        xmpp_conn_release(conns[i]);
+    free(conns);
+    xmpp_ctx_free(ctx);
+    xmpp_shutdown();
+
+    return secured == n ? 0 : 1;
+}
@@ -10,6 +10,7 @@
  */
 
 #include <assert.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "test.h"
@@ -52,3 +53,72 @@ const char *test_bin_to_hex(const uint8_t *bin, size_t len)
 
     return buf;
 }
+
+#ifdef TEST_LOOPBACK
+#include "transport.h"
+
+int test_connects;
+int test_disconnects;
+
+/* copies the value of attribute name of the first element in data */
+const char *test_find_attr(const char *data, const char *name,
+                           char *value, size_t len)
+{
+    size_t name_len = strlen(name);
+    const char *p;
+    char quote;
+    size_t n = 0;
+
+    value[0] = '\0';
+    for (p = strstr(data, name); p; p = strstr(p + 1, name)) {
+        if (p > data && (p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\n') &&
+            p[name_len] == '=' &&
+            (p[name_len + 1] == '\'' || p[name_len + 1] == '"'))
+            break;
+    }
+    if (!p) return NULL;
+    quote = p[name_len + 1];
+    p += name_len + 2;
+    while (p[n] && p[n] != quote && n < len - 1) {
+        value[n] = p[n];
+        n++;
+    }
+    value[n] = '\0';
+
+    return value;
+}
+
+void test_reply(xmpp_conn_t * const conn, const char *data)
+{
+    transport_loopback_send(conn, data, strlen(data));
+}
+
+void test_run(xmpp_ctx_t *ctx, int n)
+{
+    while (n-- > 0)
+        xmpp_run_once(ctx, 0);
+}
+
+static void _test_conn_handler(xmpp_conn_t * const conn,
+                               const xmpp_conn_event_t status,
+                               const int error,
+                               xmpp_stream_error_t * const stream_error,
+                               void * const userdata)
+{
+    if (status == XMPP_CONN_CONNECT)
+        test_connects++;
+    else
+        test_disconnects++;
+}
+
+/* connects to the server attached to conn and runs the loop long enough
+ * for a scripted login */
+void test_connect(xmpp_ctx_t *ctx, xmpp_conn_t *conn)
+{
+    if (xmpp_connect_client(conn, NULL, 0, _test_conn_handler, NULL) != 0) {
+        printf("connect failed\n");
+        exit(1);
+    }
+    test_run(ctx, 10);
+}
+#endif
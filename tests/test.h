@@ -66,4 +66,19 @@ do {                                           \
 void test_hex_to_bin(const char *hex, uint8_t *bin, size_t *bin_len);
 const char *test_bin_to_hex(const uint8_t *bin, size_t len);
 
+#ifdef TEST_LOOPBACK
+/* helpers for a server scripted on the loopback transport, test.c has them
+ * when it is built with -DTEST_LOOPBACK and linked with libstrophe */
+#include "strophe.h"
+
+extern int test_connects;
+extern int test_disconnects;
+
+const char *test_find_attr(const char *data, const char *name,
+                           char *value, size_t len);
+void test_reply(xmpp_conn_t * const conn, const char *data);
+void test_run(xmpp_ctx_t *ctx, int n);
+void test_connect(xmpp_ctx_t *ctx, xmpp_conn_t *conn);
+#endif
+
 #endif /* __LIBSTROPHE_TEST_H__ */
@@ -12,13 +12,16 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "strophe.h"
 #include "common.h"
-#include "sasl.h"
 
 #include "test.h"
 
+/* include sasl.c to test every implementation of the codec */
+#include "sasl.c"
+
 static const unsigned char test_2_raw[] =
     {0x14, 0xfb, 0x9c, 0x03, 0xd9, 0x7e, 0x00};
 static const unsigned char test_4_raw[] =
@@ -95,6 +98,134 @@ static const struct {
     },
 };
 
+typedef size_t (*encode_t)(const unsigned char *data, size_t len,
+                           char *out);
+typedef size_t (*decode_t)(const char *base64, size_t len,
+                           unsigned char *out);
+
+static const struct {
+    const char *name;
+    encode_t encode;
+    decode_t decode;
+} impls[] = {
+    { "scalar", _base64_encode_none, _base64_decode_none },
+#ifdef CPU_X86_SSSE3
+    { "SSSE3", _base64_encode_ssse3, _base64_decode_ssse3 },
+#endif
+#ifdef CPU_X86_AVX2
+    { "AVX2", _base64_encode_avx2, _base64_decode_avx2 },
+#endif
+};
+
+static int impl_supported(int k)
+{
+#ifdef CPU_X86_SSSE3
+    if (impls[k].encode == _base64_encode_ssse3)
+        return cpu_has_x86_ssse3();
+#endif
+#ifdef CPU_X86_AVX2
+    if (impls[k].encode == _base64_encode_avx2)
+        return cpu_has_x86_avx2();
+#endif
+    return 1;
+}
+
+#define BIG (1 << 20)
+
+/* every length up to a few vectors, against the scalar code, and the
+ * buffers are written up to their length only */
+static void test_lengths(void)
+{
+    static unsigned char data[300], dec[300 + 1];
+    static char enc[400 + 1], ref[400 + 1];
+    encode_t encode = _base64_encode_blocks;
+    size_t len, elen, dlen;
+
+    for (len = 0; len < sizeof(data); ++len)
+        data[len] = (unsigned char)(len * 167 + 13);
+    for (len = 0; len < sizeof(data); ++len) {
+        elen = xmpp_base64_encoded_len(len);
+        memset(enc, '#', sizeof(enc));
+        if (xmpp_base64_encode(data, len, enc) != elen || enc[elen] != '#') {
+            printf("encoding %u bytes overflows\n", (unsigned)len);
+            exit(1);
+        }
+        _base64_encode_blocks = _base64_encode_none;
+        xmpp_base64_encode(data, len, ref);
+        COMPARE_BUF(ref, elen, enc, elen);
+        _base64_encode_blocks = encode;
+
+        memset(dec, '#', sizeof(dec));
+        if (xmpp_base64_decode(enc, elen, dec, &dlen) != XMPP_EOK ||
+            xmpp_base64_decoded_len(enc, elen) != len || dec[len] != '#') {
+            printf("decoding %u bytes fails\n", (unsigned)len);
+            exit(1);
+        }
+        COMPARE_BUF(data, len, dec, dlen);
+    }
+}
+
+/* a bad character anywhere is found, also where the vectors stop */
+static void test_invalid(void)
+{
+    static const char bad[] = { '*', '=', '\n', (char)0x80, (char)0xFF };
+    unsigned char data[150], dec[150];
+    char enc[200];
+    size_t i, k, dlen;
+
+    memset(data, 0x5a, sizeof(data));
+    xmpp_base64_encode(data, sizeof(data), enc);
+    for (i = 0; i < sizeof(enc); ++i) {
+        for (k = 0; k < sizeof(bad); ++k) {
+            char save = enc[i];
+            /* that's padding */
+            if (bad[k] == '=' && i == sizeof(enc) - 1)
+                continue;
+            enc[i] = bad[k];
+            if (xmpp_base64_decode(enc, sizeof(enc), dec, &dlen) !=
+                XMPP_EINVOP) {
+                printf("'%c' at %u not found\n", bad[k], (unsigned)i);
+                exit(1);
+            }
+            enc[i] = save;
+        }
+    }
+    if (xmpp_base64_decode(enc, sizeof(enc) - 1, dec, &dlen) != XMPP_EINVOP) {
+        printf("length not a multiple of 4 accepted\n");
+        exit(1);
+    }
+}
+
+static double seconds_since(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+/* MB/s of encoding and decoding a megabyte */
+static void bench(void)
+{
+    static unsigned char data[BIG], dec[BIG];
+    static char enc[BIG / 3 * 4 + 4];
+    size_t elen, dlen;
+    double t_enc, t_dec;
+    clock_t start;
+    int n;
+
+    for (n = 0; n < BIG; ++n)
+        data[n] = (unsigned char)(n * 31);
+    start = clock();
+    for (n = 0; n < 50; ++n)
+        elen = xmpp_base64_encode(data, BIG, enc);
+    t_enc = seconds_since(start);
+    start = clock();
+    for (n = 0; n < 50; ++n)
+        xmpp_base64_decode(enc, elen, dec, &dlen);
+    t_dec = seconds_since(start);
+    COMPARE_BUF(data, BIG, dec, dlen);
+    printf("%.0f MB/s encoding, %.0f MB/s decoding... ",
+           t_enc > 0 ? 50 / t_enc : 0.0, t_dec > 0 ? 50 / t_dec : 0.0);
+}
+
 int main(int argc, char *argv[])
 {
     xmpp_ctx_t *ctx;
@@ -129,6 +260,19 @@ int main(int argc, char *argv[])
         printf("ok\n");
     }
 
+    printf("Caller buffer tests.\n");
+    for (i = 0; i < ARRAY_SIZE(impls); ++i) {
+        if (!impl_supported(i))
+            continue;
+        _base64_encode_blocks = impls[i].encode;
+        _base64_decode_blocks = impls[i].decode;
+        printf("Test #%d: %s: ", (int)i + 1, impls[i].name);
+        test_lengths();
+        test_invalid();
+        bench();
+        printf("ok\n");
+    }
+
     xmpp_ctx_free(ctx);
 
     return ret;
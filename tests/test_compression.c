@@ -0,0 +1,294 @@
+/* test_compression.c
+** libstrophe XMPP client library -- test routines for stream compression
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "transport.h"
+
+#include "test.h"
+
+#ifdef HAVE_ZLIB
+
+#include <zlib.h>
+
+#define STREAM_HEADER "<?xml version='1.0'?>" \
+    "<stream:stream xmlns='jabber:client' " \
+    "xmlns:stream='http://etherx.jabber.org/streams' " \
+    "id='s1' from='localhost' version='1.0'>"
+#define FEATURES_SASL "<stream:features>" \
+    "<mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>" \
+    "<mechanism>PLAIN</mechanism></mechanisms></stream:features>"
+#define FEATURES_COMPRESS "<stream:features>" \
+    "<compression xmlns='http://jabber.org/features/compress'>" \
+    "<method>lzw</method><method>zlib</method></compression>" \
+    "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/></stream:features>"
+#define FEATURES_BIND "<stream:features>" \
+    "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/></stream:features>"
+
+/* the scripted server */
+static struct {
+    int authenticated;
+    int refuse; /* answer <compress/> with <failure/> */
+    int compress_requests;
+    int compressed;
+    z_stream deflate;
+    z_stream inflate;
+    int binds;
+    int messages;
+    unsigned long raw_bytes; /* as written by the client */
+    unsigned long bytes; /* after inflating */
+} server;
+
+static int handled;
+
+static void server_send(xmpp_conn_t * const conn, const char *data)
+{
+    unsigned char buf[4096];
+    z_stream *z = &server.deflate;
+
+    if (!server.compressed) {
+        transport_loopback_send(conn, data, strlen(data));
+        return;
+    }
+
+    z->next_in = (Bytef *)data;
+    z->avail_in = strlen(data);
+    do {
+        z->next_out = buf;
+        z->avail_out = sizeof(buf);
+        deflate(z, Z_SYNC_FLUSH);
+        transport_loopback_send(conn, (char *)buf, sizeof(buf) - z->avail_out);
+    } while (z->avail_out == 0);
+}
+
+static void server_handler(xmpp_conn_t * const conn,
+                           const char * const data, const size_t len,
+                           void * const userdata)
+{
+    static char buf[65536];
+    const char *p;
+    z_stream *z = &server.inflate;
+    size_t n;
+
+    server.raw_bytes += len;
+    if (server.compressed) {
+        z->next_in = (Bytef *)data;
+        z->avail_in = len;
+        z->next_out = (Bytef *)buf;
+        z->avail_out = sizeof(buf) - 1;
+        if (inflate(z, Z_SYNC_FLUSH) != Z_OK || z->avail_in > 0) {
+            printf("client sent a corrupt stream\n");
+            exit(1);
+        }
+        n = sizeof(buf) - 1 - z->avail_out;
+    } else {
+        n = len < sizeof(buf) ? len : sizeof(buf) - 1;
+        memcpy(buf, data, n);
+    }
+    buf[n] = '\0';
+    server.bytes += n;
+
+    if (strncmp(buf, "<?xml", 5) == 0) {
+        server_send(conn, STREAM_HEADER);
+        if (!server.authenticated)
+            server_send(conn, FEATURES_SASL);
+        else
+            server_send(conn, server.compressed ? FEATURES_BIND
+                                                : FEATURES_COMPRESS);
+    } else if (strncmp(buf, "<auth", 5) == 0) {
+        server.authenticated = 1;
+        server_send(conn, "<success xmlns='urn:ietf:params:xml:ns:"
+                          "xmpp-sasl'/>");
+    } else if (strncmp(buf, "<compress", 9) == 0) {
+        server.compress_requests++;
+        if (server.refuse) {
+            server_send(conn, "<failure xmlns='http://jabber.org/protocol/"
+                              "compress'><setup-failed/></failure>");
+        } else {
+            server_send(conn, "<compressed xmlns='http://jabber.org/"
+                              "protocol/compress'/>");
+            server.compressed = 1;
+        }
+    } else if (strstr(buf, "_xmpp_bind1")) {
+        server.binds++;
+        server_send(conn, "<iq id='_xmpp_bind1' type='result'>"
+                          "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'>"
+                          "<jid>user@localhost/res</jid></bind></iq>");
+    }
+    for (p = buf; (p = strstr(p, "<message")); ++p)
+        server.messages++;
+}
+
+static void server_reset(void)
+{
+    if (server.compressed) {
+        deflateReset(&server.deflate);
+        inflateReset(&server.inflate);
+    }
+    server.authenticated = 0;
+    server.compressed = 0;
+    server.compress_requests = 0;
+    server.binds = 0;
+    server.messages = 0;
+    server.raw_bytes = 0;
+    server.bytes = 0;
+}
+
+static int message_handler(xmpp_conn_t * const conn,
+                           xmpp_stanza_t * const stanza,
+                           void * const userdata)
+{
+    ++handled;
+    return 1;
+}
+
+static void connect_client(xmpp_ctx_t *ctx, xmpp_conn_t *conn)
+{
+    server_reset();
+    test_connect(ctx, conn);
+}
+
+int main()
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    xmpp_stanza_t *msg;
+    char buf[128];
+    int i;
+
+    deflateInit(&server.deflate, Z_DEFAULT_COMPRESSION);
+    inflateInit(&server.inflate);
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    conn = xmpp_conn_new(ctx);
+    if (ctx == NULL || conn == NULL) {
+        fprintf(stderr, "failed to create connection\n");
+        return 1;
+    }
+    xmpp_conn_set_jid(conn, "user@localhost/res");
+    xmpp_conn_set_pass(conn, "secret");
+    transport_loopback_attach(conn, server_handler, NULL);
+    xmpp_handler_add(conn, message_handler, NULL, "message", NULL, NULL);
+
+    printf("Test #1: no compression unless asked for... ");
+    connect_client(ctx, conn);
+    if (test_connects != 1 || server.compress_requests != 0 ||
+        xmpp_conn_is_compressed(conn)) {
+        printf("connects %d, compress requests %d\n", test_connects,
+               server.compress_requests);
+        exit(1);
+    }
+    transport_loopback_close(conn);
+    test_run(ctx, 2);
+    printf("ok\n");
+
+    printf("Test #2: compression is negotiated after auth... ");
+    if (xmpp_conn_set_compression(conn, 10, 0) == 0 ||
+        xmpp_conn_set_compression(conn, 9, 4) != 0 ||
+        xmpp_conn_set_flags(conn, XMPP_CONN_FLAG_COMPRESSION) != 0 ||
+        !(xmpp_conn_get_flags(conn) & XMPP_CONN_FLAG_COMPRESSION)) {
+        printf("can't configure compression\n");
+        exit(1);
+    }
+    connect_client(ctx, conn);
+    if (test_connects != 2 || server.compress_requests != 1 ||
+        server.binds != 1 || !xmpp_conn_is_compressed(conn)) {
+        printf("connects %d, compress requests %d, binds %d\n",
+               test_connects, server.compress_requests, server.binds);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #3: compressed stanzas are received... ");
+    for (i = 0; i < 500; ++i) {
+        xmpp_snprintf(buf, sizeof(buf), "<message id='m%d' type='chat'>"
+                      "<body>hello</body></message>", i);
+        server_send(conn, buf);
+    }
+    test_run(ctx, 50);
+    if (handled != 500) {
+        printf("%d of 500 messages handled\n", handled);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #4: stanzas are sent compressed... ");
+    server.raw_bytes = server.bytes = 0;
+    for (i = 0; i < 200; ++i) {
+        msg = xmpp_stanza_new(ctx);
+        xmpp_stanza_set_name(msg, "message");
+        xmpp_stanza_set_attribute(msg, "to", "peer@localhost");
+        xmpp_stanza_set_type(msg, "chat");
+        xmpp_send(conn, msg);
+        xmpp_stanza_release(msg);
+        /* a sync flush after every few stanzas */
+        if (i % 10 == 9) test_run(ctx, 1);
+    }
+    test_run(ctx, 1);
+    if (server.messages != 200 || server.raw_bytes * 4 > server.bytes) {
+        printf("%d messages, %lu bytes as %lu\n", server.messages,
+               server.bytes, server.raw_bytes);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #5: a refused compression falls back to bind... ");
+    transport_loopback_close(conn);
+    test_run(ctx, 2);
+    if (xmpp_conn_is_compressed(conn)) {
+        printf("compression outlived the connection\n");
+        exit(1);
+    }
+    server.refuse = 1;
+    connect_client(ctx, conn);
+    if (test_connects != 3 || server.compress_requests != 1 ||
+        server.binds != 1 || xmpp_conn_is_compressed(conn)) {
+        printf("connects %d, compress requests %d, binds %d\n",
+               test_connects, server.compress_requests, server.binds);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #6: compression is set up again on a reconnect... ");
+    transport_loopback_close(conn);
+    test_run(ctx, 2);
+    server.refuse = 0;
+    handled = 0;
+    connect_client(ctx, conn);
+    server_send(conn, "<message><body>again</body></message>");
+    test_run(ctx, 2);
+    if (test_connects != 4 || !xmpp_conn_is_compressed(conn) || handled != 1) {
+        printf("connects %d, handled %d\n", test_connects, handled);
+        exit(1);
+    }
+    printf("ok\n");
+
+    xmpp_conn_release(conn);
+    xmpp_ctx_free(ctx);
+    deflateEnd(&server.deflate);
+    inflateEnd(&server.inflate);
+
+    return 0;
+}
+
+#else /* !HAVE_ZLIB */
+
+int main()
+{
+    printf("built without zlib, skipping\n");
+    return 77;
+}
+
+#endif /* HAVE_ZLIB */
@@ -0,0 +1,247 @@
+/* test_conn.c
+** libstrophe XMPP client library -- test routines for connection setup
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "resolver.h"
+#include "util.h"
+
+static int disconnected;
+static int disconnect_error;
+static int warnings;
+
+static void count_warnings(void * const userdata,
+                           const xmpp_log_level_t level,
+                           const char * const area,
+                           const char * const msg)
+{
+    if (level == XMPP_LEVEL_WARN)
+        ++warnings;
+}
+
+static void conn_handler(xmpp_conn_t * const conn,
+                         const xmpp_conn_event_t status,
+                         const int error,
+                         xmpp_stream_error_t * const stream_error,
+                         void * const userdata)
+{
+    if (status == XMPP_CONN_DISCONNECT || status == XMPP_CONN_FAIL) {
+        disconnected = 1;
+        disconnect_error = error;
+    }
+}
+
+/* a socket bound to a free local port, returns the port */
+static unsigned short bind_local(int *sock)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    *sock = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (*sock < 0 ||
+        bind(*sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        getsockname(*sock, (struct sockaddr *)&addr, &len) != 0)
+        return 0;
+
+    return ntohs(addr.sin_port);
+}
+
+/* a local port nothing listens on */
+static unsigned short closed_port(void)
+{
+    unsigned short port;
+    int sock;
+
+    port = bind_local(&sock);
+    if (sock >= 0) close(sock);
+
+    return port;
+}
+
+static int get_int(int sock, int level, int name)
+{
+    int value = -1;
+    socklen_t len = sizeof(value);
+
+    if (getsockopt(sock, level, name, &value, &len) != 0)
+        return -1;
+
+    return value;
+}
+
+static void run_until_connected(xmpp_ctx_t *ctx, xmpp_conn_t *conn,
+                                uint64_t limit)
+{
+    uint64_t start = time_stamp();
+
+    while (conn->state != XMPP_STATE_CONNECTED && !disconnected &&
+           time_elapsed(start, time_stamp()) < limit)
+        xmpp_run_once(ctx, 5);
+}
+
+static void run_until_disconnected(xmpp_ctx_t *ctx, uint64_t limit)
+{
+    uint64_t start = time_stamp();
+
+    while (!disconnected && time_elapsed(start, time_stamp()) < limit)
+        xmpp_run_once(ctx, 5);
+}
+
+/* the options set on the connection are found on its socket */
+static int test_sock_opts(void)
+{
+    xmpp_log_t log = { count_warnings, NULL };
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    unsigned short port;
+    int lsock, sock;
+
+    ctx = xmpp_ctx_new(NULL, &log);
+    conn = ctx ? xmpp_conn_new(ctx) : NULL;
+    port = bind_local(&lsock);
+    if (conn == NULL || port == 0 || listen(lsock, 4) != 0) {
+        fprintf(stderr, "failed to set up the test\n");
+        return 1;
+    }
+    xmpp_conn_set_jid(conn, "romeo@localhost");
+
+    printf("Test #2: socket options reach the socket... ");
+    xmpp_conn_set_keepalive(conn, 30, 5, 3);
+    xmpp_conn_set_sockbuf(conn, 65536, 131072);
+    xmpp_conn_set_user_timeout(conn, 10000);
+    disconnected = 0;
+    xmpp_connect_client(conn, "127.0.0.1", port, conn_handler, NULL);
+    run_until_connected(ctx, conn, 5000);
+    sock = conn->sock;
+    if (conn->state != XMPP_STATE_CONNECTED) {
+        printf("not connected\n");
+        return 1;
+    }
+    /* Linux doubles the buffer sizes for its bookkeeping */
+    if (get_int(sock, SOL_SOCKET, SO_KEEPALIVE) == 0 ||
+        get_int(sock, SOL_SOCKET, SO_SNDBUF) < 65536 ||
+        get_int(sock, SOL_SOCKET, SO_RCVBUF) < 131072) {
+        printf("keepalive %d, buffers %d and %d\n",
+               get_int(sock, SOL_SOCKET, SO_KEEPALIVE),
+               get_int(sock, SOL_SOCKET, SO_SNDBUF),
+               get_int(sock, SOL_SOCKET, SO_RCVBUF));
+        return 1;
+    }
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+    if (get_int(sock, IPPROTO_TCP, TCP_KEEPIDLE) != 30 ||
+        get_int(sock, IPPROTO_TCP, TCP_KEEPINTVL) != 5 ||
+        get_int(sock, IPPROTO_TCP, TCP_KEEPCNT) != 3) {
+        printf("keepalive %d/%d/%d\n",
+               get_int(sock, IPPROTO_TCP, TCP_KEEPIDLE),
+               get_int(sock, IPPROTO_TCP, TCP_KEEPINTVL),
+               get_int(sock, IPPROTO_TCP, TCP_KEEPCNT));
+        return 1;
+    }
+#endif
+#ifdef TCP_USER_TIMEOUT
+    if (get_int(sock, IPPROTO_TCP, TCP_USER_TIMEOUT) != 10000) {
+        printf("user timeout %d\n",
+               get_int(sock, IPPROTO_TCP, TCP_USER_TIMEOUT));
+        return 1;
+    }
+#endif
+    if (warnings != 0) {
+        printf("%d warnings\n", warnings);
+        return 1;
+    }
+    printf("ok\n");
+    xmpp_disconnect(conn);
+    run_until_disconnected(ctx, 5000);
+
+#ifdef TCP_USER_TIMEOUT
+    printf("Test #3: options which can't be set are logged... ");
+    /* the kernel rejects a timeout which is negative as an int */
+    if (xmpp_conn_set_user_timeout(conn, 0x80000000u) != 0) {
+        printf("the option was refused\n");
+        return 1;
+    }
+    disconnected = 0;
+    xmpp_connect_client(conn, "127.0.0.1", port, conn_handler, NULL);
+    run_until_connected(ctx, conn, 5000);
+    if (warnings != 1) {
+        printf("%d warnings\n", warnings);
+        return 1;
+    }
+    printf("ok\n");
+    xmpp_disconnect(conn);
+    run_until_disconnected(ctx, 5000);
+#endif
+
+    xmpp_conn_release(conn);
+    xmpp_ctx_free(ctx);
+    close(lsock);
+
+    return 0;
+}
+
+int main()
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    resolver_srv_rr_t *rr;
+    unsigned short port;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    conn = ctx ? xmpp_conn_new(ctx) : NULL;
+    port = closed_port();
+    if (conn == NULL || port == 0) {
+        fprintf(stderr, "failed to set up the test\n");
+        return 1;
+    }
+    xmpp_conn_set_jid(conn, "romeo@localhost");
+
+    printf("Test #1: the error of the last SRV target is reported... ");
+    if (xmpp_connect_client(conn, "127.0.0.1", port, conn_handler,
+                            NULL) != 0) {
+        printf("connect failed\n");
+        return 1;
+    }
+    /* the next target can't be resolved, the refused connect to the
+     * first one is what went wrong */
+    rr = xmpp_alloc(ctx, sizeof(*rr));
+    memset(rr, 0, sizeof(*rr));
+    strcpy(rr->target, ".");
+    rr->port = port;
+    conn->srv_targets = rr;
+    run_until_disconnected(ctx, 5000);
+    if (!disconnected || disconnect_error != ECONNREFUSED) {
+        printf("disconnected %d with error %d\n", disconnected,
+               disconnect_error);
+        return 1;
+    }
+    printf("ok\n");
+
+    xmpp_conn_release(conn);
+    xmpp_ctx_free(ctx);
+
+    if (test_sock_opts() != 0)
+        return 1;
+
+    return 0;
+}
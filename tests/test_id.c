@@ -0,0 +1,127 @@
+/* test_id.c
+** libstrophe XMPP client library -- test routines for stanza ids
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "hash.h"
+
+#define NUM_IDS 100000
+#define NUM_HANDLERS 20000
+
+static int iq_handler(xmpp_conn_t * const conn,
+                      xmpp_stanza_t * const stanza,
+                      void * const userdata)
+{
+    return 0;
+}
+
+int main()
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn, *conn2;
+    hash_t *seen;
+    char id[XMPP_ID_SIZE];
+    char id2[XMPP_ID_SIZE];
+    char first[XMPP_ID_SIZE];
+    clock_t start;
+    double t;
+    size_t len;
+    int i;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    conn = xmpp_conn_new(ctx);
+    conn2 = xmpp_conn_new(ctx);
+    seen = hash_new(ctx, 1024, NULL);
+    if (ctx == NULL || conn == NULL || conn2 == NULL || seen == NULL) {
+        fprintf(stderr, "failed to create connection\n");
+        return 1;
+    }
+
+    printf("Test #1: ids are unique... ");
+    for (i = 0; i < NUM_IDS; i++) {
+        len = xmpp_conn_gen_id(conn, id, sizeof(id));
+        if (len == 0 || len != strlen(id)) {
+            printf("bad length %lu for '%s'\n", (unsigned long)len, id);
+            return 1;
+        }
+        if (strspn(id, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                       "0123456789-_") != len) {
+            printf("'%s' is not base64url\n", id);
+            return 1;
+        }
+        if (i == 0)
+            strcpy(first, id);
+        else if (hash_get(seen, id) != NULL) {
+            printf("'%s' was generated twice\n", id);
+            return 1;
+        }
+        hash_add(seen, id, conn);
+    }
+    if (hash_num_keys(seen) != NUM_IDS) {
+        printf("%d of %d ids are unique\n", hash_num_keys(seen), NUM_IDS);
+        return 1;
+    }
+    printf("ok\n");
+
+    printf("Test #2: connections use their own prefix... ");
+    xmpp_conn_gen_id(conn2, id2, sizeof(id2));
+    if (memcmp(first, id2, CONN_ID_PREFIX_LEN) == 0 ||
+        strncmp(first, id, CONN_ID_PREFIX_LEN) != 0) {
+        printf("'%s', '%s' and '%s'\n", first, id, id2);
+        return 1;
+    }
+    printf("ok\n");
+
+    printf("Test #3: a short buffer is not written... ");
+    memset(id, 'x', sizeof(id));
+    if (xmpp_conn_gen_id(conn, id, CONN_ID_PREFIX_LEN + 1) != 0 ||
+        id[0] != 'x') {
+        printf("the id did not fit into %d bytes\n", CONN_ID_PREFIX_LEN + 1);
+        return 1;
+    }
+    len = xmpp_conn_gen_id(conn, id, sizeof(id));
+    if (xmpp_conn_gen_id(conn, id2, len + 1) != len ||
+        strncmp(id, id2, len - 1) != 0 || strcmp(id, id2) == 0) {
+        printf("'%s' was followed by '%s'\n", id, id2);
+        return 1;
+    }
+    printf("ok\n");
+
+    printf("Test #4: id handlers of sequential ids... ");
+    start = clock();
+    for (i = 0; i < NUM_HANDLERS; i++) {
+        xmpp_conn_gen_id(conn2, id, sizeof(id));
+        xmpp_id_handler_add(conn2, iq_handler, id, NULL);
+        if (hash_get(conn2->id_handlers, id) == NULL) {
+            printf("no handler for '%s'\n", id);
+            return 1;
+        }
+    }
+    t = (double)(clock() - start) / CLOCKS_PER_SEC;
+    if (hash_num_keys(conn2->id_handlers) != NUM_HANDLERS) {
+        printf("%d handlers\n", hash_num_keys(conn2->id_handlers));
+        return 1;
+    }
+    printf("%.0f handlers/s... ", t > 0 ? NUM_HANDLERS / t : 0.0);
+    printf("ok\n");
+
+    hash_release(seen);
+    xmpp_conn_release(conn2);
+    xmpp_conn_release(conn);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
@@ -11,6 +11,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "strophe.h"
 #include "common.h"
@@ -94,6 +95,134 @@ int test_jid_new(xmpp_ctx_t *ctx)
     return 0;
 }
 
+static int check_part(const xmpp_jid_view_t *view,
+                      const xmpp_jid_slice_t *part, const char *expected)
+{
+    if (expected == NULL)
+        return part->len != 0;
+    return part->len != strlen(expected) ||
+           memcmp(view->jid + part->offset, expected, part->len) != 0;
+}
+
+int test_jid_view(xmpp_ctx_t *ctx)
+{
+    static const struct {
+        const char *jid;
+        const char *bare, *node, *domain, *resource;
+    } tests[] = {
+        { "foo@bar.com", "foo@bar.com", "foo", "bar.com", NULL },
+        { "anyone@example.com/hullo", "anyone@example.com", "anyone",
+          "example.com", "hullo" },
+        { "domain.tld", "domain.tld", NULL, "domain.tld", NULL },
+        { "example.com/a@b/c", "example.com", NULL, "example.com", "a@b/c" },
+        { "juliet@example.com./balcony", "juliet@example.com.", "juliet",
+          "example.com.", "balcony" },
+    };
+    xmpp_jid_view_t view, other;
+    char *str;
+    size_t i;
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        if (xmpp_jid_parse(tests[i].jid, &view) != XMPP_EOK ||
+            check_part(&view, &view.bare, tests[i].bare) ||
+            check_part(&view, &view.node, tests[i].node) ||
+            check_part(&view, &view.domain, tests[i].domain) ||
+            check_part(&view, &view.resource, tests[i].resource)) {
+            printf("jid '%s' parsed wrongly\n", tests[i].jid);
+            return 1;
+        }
+    }
+    if (xmpp_jid_parse("foo@/bar", &view) != XMPP_EINVOP ||
+        xmpp_jid_parse("", &view) != XMPP_EINVOP)
+        return 1;
+
+    /* the allocating functions agree with the view */
+    str = xmpp_jid_node(ctx, "example.com/a@b");
+    if (str != NULL) return 1;
+    str = xmpp_jid_resource(ctx, "example.com/a@b");
+    if (str == NULL || strcmp(str, "a@b")) return 1;
+    xmpp_free(ctx, str);
+    str = xmpp_jid_domain(ctx, "juliet@example.com./balcony");
+    if (str == NULL || strcmp(str, "example.com.")) return 1;
+    xmpp_free(ctx, str);
+
+    xmpp_jid_parse("Romeo@Example.COM/orchard", &view);
+    xmpp_jid_parse("romeo@example.com./balcony", &other);
+    if (!xmpp_jid_bare_equal(&view, &other)) return 1;
+    if (!xmpp_jid_domain_match(&view, "example.com")) return 1;
+    if (!xmpp_jid_domain_match(&other, "EXAMPLE.com.")) return 1;
+    if (xmpp_jid_domain_match(&view, "muc.example.com")) return 1;
+    xmpp_jid_parse("juliet@example.com", &other);
+    if (xmpp_jid_bare_equal(&view, &other)) return 1;
+    xmpp_jid_parse("example.com", &other);
+    if (xmpp_jid_bare_equal(&view, &other)) return 1;
+
+    return 0;
+}
+
+static int check_normalize(xmpp_ctx_t *ctx, const char *jid,
+                           const char *expected)
+{
+    char *norm = xmpp_jid_normalize(ctx, jid);
+    int ret;
+
+    ret = expected == NULL ? norm != NULL
+                           : norm == NULL || strcmp(norm, expected) != 0;
+    if (ret)
+        printf("'%s' normalized to '%s'\n", jid, norm ? norm : "(null)");
+    if (norm) xmpp_free(ctx, norm);
+
+    return ret;
+}
+
+int test_jid_normalize(xmpp_ctx_t *ctx)
+{
+    static const char *tests[][2] = {
+        { "Juliet@Example.COM/Balcony", "juliet@example.com/Balcony" },
+        { "juliet@example.com./balcony", "juliet@example.com/balcony" },
+        { "EXAMPLE.com", "example.com" },
+        { "example.com/a@b/c", "example.com/a@b/c" },
+        { "@example.com", NULL },
+        { "juliet@example.com/", NULL },
+        { "jul iet@example.com", NULL },
+        { "a<b@example.com", NULL },
+        { "juliet@exa mple.com", NULL },
+#ifdef HAVE_ICU
+        { "JULI\xc3\x8bT@example.com", "juli\xc3\xabt@example.com" },
+        { "julie\xcc\x88t@example.com", "juli\xc3\xabt@example.com" },
+        { "\xef\xbc\xb2omeo@B\xc3\x9c" "CHER.example/Caf\xc3\xa9",
+          "romeo@b\xc3\xbc" "cher.example/Caf\xc3\xa9" },
+        { "romeo@XN--bcher-kva.example", "romeo@b\xc3\xbc" "cher.example" },
+        { "romeo@xn--a.example", NULL },
+#endif
+    };
+    char jid[64];
+    char expected[64];
+    clock_t start;
+    double t;
+    size_t i;
+    int n;
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+        if (check_normalize(ctx, tests[i][0], tests[i][1])) return 1;
+
+    /* more senders than the cache holds, twice so the first are gone */
+    for (n = 0; n < 2 * JID_CACHE_SIZE + 2; n++) {
+        sprintf(jid, "User%d@Caf\xc3\xa9.example/r", n % (JID_CACHE_SIZE + 1));
+        sprintf(expected, "user%d@caf\xc3\xa9.example/r",
+                n % (JID_CACHE_SIZE + 1));
+        if (check_normalize(ctx, jid, expected)) return 1;
+    }
+
+    start = clock();
+    for (n = 0; n < 100000; n++)
+        xmpp_free(ctx, xmpp_jid_normalize(ctx, "User1@Caf\xc3\xa9.example/r"));
+    t = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%.0f cached normalizations/s... ", t > 0 ? 100000 / t : 0.0);
+
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     xmpp_ctx_t *ctx;
@@ -117,6 +246,18 @@ int main(int argc, char *argv[])
     if (ret) return ret;
     printf("ok.\n");
 
+    printf("testing jid views... ");
+    ret = test_jid_view(ctx);
+    if (ret) printf("failed!\n");
+    if (ret) return ret;
+    printf("ok.\n");
+
+    printf("testing jid normalization... ");
+    ret = test_jid_normalize(ctx);
+    if (ret) printf("failed!\n");
+    if (ret) return ret;
+    printf("ok.\n");
+
     printf("freeing context... ");
     xmpp_ctx_free(ctx);
     printf("ok.\n");
@@ -9,11 +9,13 @@
  *  This program is dual licensed under the MIT and GPLv3 licenses.
  */
 
-/* gcc -o test_rand -I./src tests/test_rand.c tests/test.c src/sha1.c */
+/* gcc -o test_rand -I./src tests/test_rand.c tests/test.c src/sha1.c \
+ *     src/cpu.c */
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/wait.h>
 
 #include "test.h"
 
@@ -22,11 +24,10 @@
 
 /* stubs to build test without whole libstrophe */
 void *xmpp_alloc(const xmpp_ctx_t * const ctx, const size_t size) {
-    return NULL;
+    return malloc(size);
 }
-void xmpp_free(const xmpp_ctx_t * const ctx, void *p) { }
-int xmpp_snprintf (char *str, size_t count, const char *fmt, ...) {
-    return 0;
+void xmpp_free(const xmpp_ctx_t * const ctx, void *p) {
+    free(p);
 }
 
 static struct {
@@ -101,6 +102,106 @@ static struct {
     },
 };
 
+/* RFC 8439, 2.3.2 */
+static const char *chacha_key =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f";
+static const char *chacha_block =
+    "10f1e7e4d13b5915500fdd1fa32071c4c7d1f4c733c068030422aa9ac3d46c4e"
+    "d2826446079faa0914c2d705d98b02a2b5129cd1de164eb9cbd083e8a2503c4e";
+
+static void test_chacha20(void)
+{
+    static const uint32_t nonce[3] = { 0x09000000, 0x4a000000, 0 };
+    uint8_t key_bytes[32];
+    uint32_t key[8];
+    uint8_t out[64];
+    size_t len;
+    int i;
+
+    test_hex_to_bin(chacha_key, key_bytes, &len);
+    for (i = 0; i < 8; ++i)
+        key[i] = load_le32(key_bytes + i * 4);
+    chacha20_block(key, 1, nonce, out);
+    COMPARE(chacha_block, test_bin_to_hex(out, sizeof(out)));
+}
+
+static int is_zero(const uint8_t *buf, size_t len)
+{
+    while (len > 0 && buf[len - 1] == 0)
+        --len;
+    return len == 0;
+}
+
+/* draws in odd sizes across several refills and reseeds */
+static void test_generator(xmpp_ctx_t *ctx)
+{
+    static uint8_t big[RAND_BUFSIZE * 3];
+    uint8_t a[37], b[37];
+    char nonce[16];
+    unsigned k;
+    int i;
+
+    xmpp_rand_bytes(ctx, a, sizeof(a));
+    xmpp_rand_bytes(ctx, b, sizeof(b));
+    assert(!is_zero(a, sizeof(a)) && memcmp(a, b, sizeof(a)) != 0);
+    xmpp_rand_bytes(ctx, big, sizeof(big));
+    assert(!is_zero(big + sizeof(big) - 64, 64));
+    for (k = 0; k < RAND_RESEED_REFILLS * 2; ++k)
+        xmpp_rand_bytes(ctx, a, 17);
+    assert(ctx->rand->rng->refills < RAND_RESEED_REFILLS);
+
+    memset(nonce, 'X', sizeof(nonce));
+    xmpp_rand_nonce(ctx, nonce, sizeof(nonce));
+    for (i = 0; i < (int)sizeof(nonce) - 1; ++i)
+        assert(strchr("0123456789abcdef", nonce[i]) != NULL);
+    assert(nonce[sizeof(nonce) - 1] == '\0');
+}
+
+/* a child doesn't repeat what its parent draws after the fork */
+static void test_fork(xmpp_ctx_t *ctx)
+{
+    uint8_t parent[32], child[32];
+    int fds[2];
+    pid_t pid;
+
+    /* leave some output buffered to be inherited */
+    xmpp_rand_bytes(ctx, parent, 1);
+    assert(pipe(fds) == 0);
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        xmpp_rand_bytes(ctx, child, sizeof(child));
+        _exit(write(fds[1], child, sizeof(child)) != sizeof(child));
+    }
+    xmpp_rand_bytes(ctx, parent, sizeof(parent));
+    assert(read(fds[0], child, sizeof(child)) == sizeof(child));
+    waitpid(pid, NULL, 0);
+    close(fds[0]);
+    close(fds[1]);
+    assert(memcmp(parent, child, sizeof(parent)) != 0);
+}
+
+/* ids per second from the old Hash_DRBG and the buffered ChaCha20 */
+static void bench(xmpp_ctx_t *ctx)
+{
+    uint8_t id[16];
+    clock_t start;
+    double t_drbg, t_chacha;
+    int n;
+
+    start = clock();
+    for (n = 0; n < 200000; ++n)
+        Hash_DRBG_bytes(ctx, id, sizeof(id));
+    t_drbg = (double)(clock() - start) / CLOCKS_PER_SEC;
+    start = clock();
+    for (n = 0; n < 200000; ++n)
+        xmpp_rand_bytes(ctx, id, sizeof(id));
+    t_chacha = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("16 byte draws: Hash_DRBG %.1fM/s, ChaCha20 %.1fM/s... ",
+           t_drbg > 0 ? 0.2 / t_drbg : 0.0,
+           t_chacha > 0 ? 0.2 / t_chacha : 0.0);
+}
+
 int main()
 {
     size_t i;
@@ -110,6 +211,9 @@ int main()
     size_t nonce_len;
     uint8_t output[1024];
     Hash_DRBG_CTX ctx;
+    xmpp_ctx_t xctx;
+    chacha_rng_t *rng;
+    int wipe_on_fork;
 
     printf("Hash_DRBG tests.\n");
     for (i = 0; i < ARRAY_SIZE(test_vectors); ++i) {
@@ -138,5 +242,39 @@ int main()
         printf("ok\n");
     }
 
+    printf("ChaCha20 generator tests.\n");
+    memset(&xctx, 0, sizeof(xctx));
+    xctx.rand = xmpp_rand_new(&xctx);
+    assert(xctx.rand != NULL);
+
+    printf("Test #1: ChaCha20 block function... ");
+    test_chacha20();
+    printf("ok\n");
+
+    printf("Test #2: output across refills and reseeds... ");
+    test_generator(&xctx);
+    printf("ok\n");
+
+    printf("Test #3: a forked child draws other bytes... ");
+    test_fork(&xctx);
+    printf("ok\n");
+
+    printf("Test #4: the same without a page wiped on fork... ");
+    rng = xctx.rand->rng;
+    wipe_on_fork = xctx.rand->wipe_on_fork;
+    xctx.rand->rng = calloc(1, sizeof(*rng));
+    xctx.rand->wipe_on_fork = 0;
+    test_fork(&xctx);
+    free(xctx.rand->rng);
+    xctx.rand->rng = rng;
+    xctx.rand->wipe_on_fork = wipe_on_fork;
+    printf("ok\n");
+
+    printf("Test #5: ");
+    bench(&xctx);
+    printf("ok\n");
+
+    xmpp_rand_free(&xctx, xctx.rand);
+
     return 0;
 }
@@ -0,0 +1,242 @@
+/* test_reconnect.c
+** libstrophe XMPP client library -- test routines for automatic reconnects
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "transport.h"
+#include "util.h"
+
+#include "test.h"
+
+#define STREAM_HEADER "<?xml version='1.0'?>" \
+    "<stream:stream xmlns='jabber:component:accept' " \
+    "xmlns:stream='http://etherx.jabber.org/streams' " \
+    "id='loopback' from='component.localhost'>"
+
+#define CONNS 3
+
+static int connects[CONNS];
+static int disconnects[CONNS];
+static int handled;
+static int refuse; /* number of handshakes to fail */
+
+static void server_handler(xmpp_conn_t * const conn,
+                           const char * const data, const size_t len,
+                           void * const userdata)
+{
+    if (len >= 5 && memcmp(data, "<?xml", 5) == 0)
+        transport_loopback_send(conn, STREAM_HEADER, strlen(STREAM_HEADER));
+    else if (len >= 10 && memcmp(data, "<handshake", 10) == 0) {
+        if (refuse > 0) {
+            refuse--;
+            transport_loopback_close(conn);
+        } else {
+            transport_loopback_send(conn, "<handshake/>", 12);
+        }
+    }
+}
+
+static void conn_handler(xmpp_conn_t * const conn,
+                         const xmpp_conn_event_t status,
+                         const int error,
+                         xmpp_stream_error_t * const stream_error,
+                         void * const userdata)
+{
+    int i = *(int *)userdata;
+
+    if (status == XMPP_CONN_CONNECT)
+        connects[i]++;
+    else
+        disconnects[i]++;
+}
+
+static int message_handler(xmpp_conn_t * const conn,
+                           xmpp_stanza_t * const stanza,
+                           void * const userdata)
+{
+    ++handled;
+    return 1;
+}
+
+/* runs the event loop until all connections are connected again or the
+ * time is up, returns the time it took */
+static uint64_t run_until_connected(xmpp_ctx_t *ctx, xmpp_conn_t **conns,
+                                    int n, uint64_t limit)
+{
+    uint64_t start = time_stamp();
+    int i, done;
+
+    do {
+        xmpp_run_once(ctx, 5);
+        for (i = 0, done = 1; i < n; ++i)
+            if (conns[i]->state != XMPP_STATE_CONNECTED ||
+                !conns[i]->authenticated)
+                done = 0;
+    } while (!done && time_elapsed(start, time_stamp()) < limit);
+
+    return time_elapsed(start, time_stamp());
+}
+
+int main()
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conns[CONNS];
+    int ids[CONNS];
+    uint64_t elapsed;
+    int i, max;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    if (ctx == NULL) {
+        fprintf(stderr, "failed to create context\n");
+        return 1;
+    }
+    for (i = 0; i < CONNS; ++i) {
+        ids[i] = i;
+        conns[i] = xmpp_conn_new(ctx);
+        if (conns[i] == NULL) {
+            fprintf(stderr, "failed to create connection\n");
+            return 1;
+        }
+        xmpp_conn_set_jid(conns[i], "component.localhost");
+        xmpp_conn_set_pass(conns[i], "secret");
+        transport_loopback_attach(conns[i], server_handler, NULL);
+        xmpp_handler_add(conns[i], message_handler, NULL, "message", NULL,
+                         NULL);
+    }
+
+    printf("Test #1: no reconnect unless asked for... ");
+    xmpp_connect_component(conns[0], "localhost", 0, conn_handler, &ids[0]);
+    run_until_connected(ctx, conns, 1, 100);
+    transport_loopback_close(conns[0]);
+    xmpp_run_once(ctx, 0);
+    if (connects[0] != 1 || disconnects[0] != 1 ||
+        xmpp_conn_is_reconnecting(conns[0])) {
+        printf("connects %d, disconnects %d\n", connects[0], disconnects[0]);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #2: a lost connection comes back... ");
+    xmpp_conn_set_reconnect(conns[0], 20, 1000);
+    xmpp_connect_component(conns[0], "localhost", 0, conn_handler, &ids[0]);
+    run_until_connected(ctx, conns, 1, 100);
+    transport_loopback_close(conns[0]);
+    xmpp_run_once(ctx, 0);
+    if (disconnects[0] != 2 || !xmpp_conn_is_reconnecting(conns[0])) {
+        printf("no reconnect pending\n");
+        exit(1);
+    }
+    elapsed = run_until_connected(ctx, conns, 1, 1000);
+    if (connects[0] != 3 || elapsed < 10 || elapsed > 100) {
+        printf("connects %d after %lu ms\n", connects[0],
+               (unsigned long)elapsed);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #3: handlers survive the reconnect... ");
+    transport_loopback_send(conns[0], "<message/>", 10);
+    xmpp_run_once(ctx, 0);
+    if (handled != 1) {
+        printf("handled %d\n", handled);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #4: the delay backs off... ");
+    /* the first try after a session waits 10-20 ms and fails, the
+     * second one waits 20-40 ms */
+    refuse = 1;
+    transport_loopback_close(conns[0]);
+    xmpp_run_once(ctx, 0);
+    elapsed = run_until_connected(ctx, conns, 1, 1000);
+    if (connects[0] != 4 || disconnects[0] != 4 ||
+        conns[0]->reconnect_backoff != 40 || elapsed < 30) {
+        printf("connects %d, backoff %lu after %lu ms\n", connects[0],
+               conns[0]->reconnect_backoff, (unsigned long)elapsed);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #5: xmpp_disconnect() cancels the reconnect... ");
+    transport_loopback_close(conns[0]);
+    xmpp_run_once(ctx, 0);
+    xmpp_disconnect(conns[0]);
+    elapsed = run_until_connected(ctx, conns, 1, 100);
+    if (connects[0] != 4 || xmpp_conn_is_reconnecting(conns[0])) {
+        printf("connects %d\n", connects[0]);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #6: reconnects are limited per context... ");
+    xmpp_ctx_set_connect_limits(ctx, 1, 20);
+    for (i = 0; i < CONNS; ++i) {
+        xmpp_conn_set_reconnect(conns[i], 2, 2);
+        xmpp_connect_component(conns[i], "localhost", 0, conn_handler,
+                               &ids[i]);
+    }
+    run_until_connected(ctx, conns, CONNS, 100);
+    for (i = 0; i < CONNS; ++i)
+        transport_loopback_close(conns[i]);
+    max = 0;
+    elapsed = time_stamp();
+    while (time_elapsed(elapsed, time_stamp()) < 1000) {
+        int connecting = 0, connected = 0;
+
+        xmpp_run_once(ctx, 5);
+        for (i = 0; i < CONNS; ++i) {
+            if (conns[i]->state == XMPP_STATE_DISCONNECTED) continue;
+            if (conns[i]->authenticated) connected++;
+            else connecting++;
+        }
+        if (connecting > max) max = connecting;
+        if (connected == CONNS) break;
+    }
+    elapsed = time_elapsed(elapsed, time_stamp());
+    /* the burst allows 20 right away, the cap lets them in one by one */
+    if (max != 1 || elapsed >= 1000) {
+        printf("%d connecting at once, %lu ms\n", max,
+               (unsigned long)elapsed);
+        exit(1);
+    }
+    xmpp_ctx_set_connect_limits(ctx, 0, 5);
+    for (i = 0; i < CONNS; ++i)
+        transport_loopback_close(conns[i]);
+    elapsed = run_until_connected(ctx, conns, CONNS, 2000);
+    /* 5 per second with a full bucket to start from, no wait */
+    if (elapsed >= 200) {
+        printf("burst took %lu ms\n", (unsigned long)elapsed);
+        exit(1);
+    }
+    for (i = 0; i < CONNS; ++i)
+        transport_loopback_close(conns[i]);
+    elapsed = run_until_connected(ctx, conns, CONNS, 2000);
+    /* 2 tokens left, the third reconnect waits for one */
+    if (elapsed < 100 || elapsed >= 2000) {
+        printf("rate limited reconnects took %lu ms\n",
+               (unsigned long)elapsed);
+        exit(1);
+    }
+    printf("ok\n");
+
+    for (i = 0; i < CONNS; ++i) {
+        xmpp_conn_set_reconnect(conns[i], 0, 0);
+        xmpp_conn_release(conns[i]);
+    }
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
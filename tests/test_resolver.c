@@ -0,0 +1,356 @@
+/* test_resolver.c
+** libstrophe XMPP client library -- test routines for the DNS resolver
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
+#include "strophe.h"
+#include "common.h"
+#include "resolver.h"
+
+#include "test.h"
+
+#define SRV_NAME "_xmpp-client._tcp.example.com"
+
+static unsigned char reply[512];
+static size_t reply_len;
+
+/* turns a query into a reply without answers */
+static void reply_start(const char *name, int type, int rcode)
+{
+    reply_len = resolver_build_query(reply, sizeof(reply), 0x1234,
+                                     name, type);
+    /* drop the OPT record */
+    reply_len -= 11;
+    reply[2] |= 0x80;
+    reply[3] = (unsigned char)rcode;
+    reply[11] = 0;
+}
+
+/* appends an answer whose owner is the question name */
+static void reply_add(int type, unsigned long ttl,
+                      const unsigned char *rdata, size_t rdlen)
+{
+    unsigned char *p = &reply[reply_len];
+
+    p[0] = 0xc0;
+    p[1] = 0x0c;
+    p[2] = 0;
+    p[3] = (unsigned char)type;
+    p[4] = 0;
+    p[5] = 1;
+    p[6] = (ttl >> 24) & 0xff;
+    p[7] = (ttl >> 16) & 0xff;
+    p[8] = (ttl >> 8) & 0xff;
+    p[9] = ttl & 0xff;
+    p[10] = 0;
+    p[11] = (unsigned char)rdlen;
+    memcpy(&p[12], rdata, rdlen);
+    reply_len += 12 + rdlen;
+    reply[7]++;
+}
+
+static void test_build_query(void)
+{
+    static const unsigned char expected[] = {
+        0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+        12, '_', 'x', 'm', 'p', 'p', '-', 'c', 'l', 'i', 'e', 'n', 't',
+        4, '_', 't', 'c', 'p', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+        3, 'c', 'o', 'm', 0, 0x00, 0x21, 0x00, 0x01,
+        0x00, 0x00, 0x29, 0x04, 0xd0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    };
+    unsigned char buf[512];
+    size_t len;
+
+    printf("Test #1: build query... ");
+    len = resolver_build_query(buf, sizeof(buf), 0x1234, SRV_NAME,
+                               RESOLVER_TYPE_SRV);
+    COMPARE_BUF(expected, sizeof(expected), buf, len);
+    len = resolver_build_query(buf, sizeof(buf), 0x1234, SRV_NAME ".",
+                               RESOLVER_TYPE_SRV);
+    COMPARE_BUF(expected, sizeof(expected), buf, len);
+
+    printf("ok\n");
+
+    printf("Test #2: reject invalid names... ");
+    if (resolver_build_query(buf, sizeof(buf), 1, "", 1) != 0 ||
+        resolver_build_query(buf, sizeof(buf), 1, "a..b", 1) != 0 ||
+        resolver_build_query(buf, 20, 1, "example.com", 1) != 0) {
+        printf("invalid name accepted\n");
+        exit(1);
+    }
+    printf("ok\n");
+}
+
+static void test_parse_srv(xmpp_ctx_t *ctx)
+{
+    static const unsigned char srv1[] = {
+        0, 20, 0, 10, 0x14, 0x66,
+        5, 'x', 'm', 'p', 'p', '2', 0xc0, 30,
+    };
+    static const unsigned char srv2[] = {
+        0, 10, 0, 60, 0x14, 0x67,
+        5, 'x', 'm', 'p', 'p', '1', 0xc0, 30,
+    };
+    resolver_result_t result;
+    resolver_srv_rr_t *rr;
+    int rcode;
+
+    printf("Test #3: SRV records are sorted by priority... ");
+    reply_start(SRV_NAME, RESOLVER_TYPE_SRV, 0);
+    reply_add(RESOLVER_TYPE_SRV, 3600, srv1, sizeof(srv1));
+    reply_add(RESOLVER_TYPE_SRV, 300, srv2, sizeof(srv2));
+    rcode = resolver_parse_reply(ctx, reply, reply_len, SRV_NAME,
+                                 RESOLVER_TYPE_SRV, &result);
+    if (rcode != 0 || result.srv == NULL || result.srv->next == NULL) {
+        printf("rcode %d, records missing\n", rcode);
+        exit(1);
+    }
+    rr = result.srv;
+    COMPARE("xmpp1.example.com", rr->target);
+    COMPARE("xmpp2.example.com", rr->next->target);
+    if (rr->priority != 10 || rr->weight != 60 || rr->port != 5223 ||
+        rr->next->port != 5222 || result.ttl != 300) {
+        printf("wrong record data\n");
+        exit(1);
+    }
+    resolver_result_clear(ctx, &result);
+
+    printf("ok\n");
+
+    printf("Test #4: names compare case-insensitively... ");
+    rcode = resolver_parse_reply(ctx, reply, reply_len,
+                                 "_XMPP-client._tcp.EXAMPLE.com.",
+                                 RESOLVER_TYPE_SRV, &result);
+    if (rcode != 0 || result.srv == NULL) {
+        printf("reply not accepted\n");
+        exit(1);
+    }
+    resolver_result_clear(ctx, &result);
+
+    printf("ok\n");
+
+    printf("Test #5: replies to other questions are rejected... ");
+    if (resolver_parse_reply(ctx, reply, reply_len, "example.com",
+                             RESOLVER_TYPE_SRV, &result) != -1 ||
+        resolver_parse_reply(ctx, reply, reply_len, SRV_NAME,
+                             RESOLVER_TYPE_A, &result) != -1) {
+        printf("mismatched reply accepted\n");
+        exit(1);
+    }
+    printf("ok\n");
+}
+
+static void test_parse_addr(xmpp_ctx_t *ctx)
+{
+    static const unsigned char a[] = { 192, 0, 2, 1 };
+    static const unsigned char aaaa[] = {
+        0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+    };
+    resolver_result_t result;
+    int rcode;
+
+    printf("Test #6: A and AAAA records... ");
+    reply_start("example.com", RESOLVER_TYPE_A, 0);
+    reply_add(RESOLVER_TYPE_AAAA, 60, aaaa, sizeof(aaaa));
+    reply_add(RESOLVER_TYPE_A, 60, a, sizeof(a));
+    rcode = resolver_parse_reply(ctx, reply, reply_len, "example.com",
+                                 RESOLVER_TYPE_A, &result);
+    if (rcode != 0 || result.addr_count != 1 ||
+        result.addrs[0].family != AF_INET) {
+        printf("expected a single IPv4 address\n");
+        exit(1);
+    }
+    COMPARE_BUF(a, sizeof(a), result.addrs[0].addr, 4);
+    resolver_result_clear(ctx, &result);
+
+    reply_start("example.com", RESOLVER_TYPE_AAAA, 0);
+    reply_add(RESOLVER_TYPE_AAAA, 60, aaaa, sizeof(aaaa));
+    rcode = resolver_parse_reply(ctx, reply, reply_len, "example.com",
+                                 RESOLVER_TYPE_AAAA, &result);
+    if (rcode != 0 || result.addr_count != 1 ||
+        result.addrs[0].family != AF_INET6) {
+        printf("expected a single IPv6 address\n");
+        exit(1);
+    }
+    COMPARE_BUF(aaaa, sizeof(aaaa), result.addrs[0].addr, 16);
+    resolver_result_clear(ctx, &result);
+
+    printf("ok\n");
+
+    printf("Test #7: NXDOMAIN... ");
+    reply_start("nonexistent.example.com", RESOLVER_TYPE_A, 3);
+    rcode = resolver_parse_reply(ctx, reply, reply_len,
+                                 "nonexistent.example.com",
+                                 RESOLVER_TYPE_A, &result);
+    if (rcode != 3 || result.addr_count != 0) {
+        printf("rcode %d, %d addresses\n", rcode, result.addr_count);
+        exit(1);
+    }
+    printf("ok\n");
+}
+
+static void test_parse_malformed(xmpp_ctx_t *ctx)
+{
+    static const unsigned char a[] = { 192, 0, 2, 1 };
+    resolver_result_t result;
+    size_t len;
+
+    printf("Test #8: truncated replies... ");
+    reply_start("example.com", RESOLVER_TYPE_A, 0);
+    reply_add(RESOLVER_TYPE_A, 60, a, sizeof(a));
+    reply_add(RESOLVER_TYPE_A, 60, a, sizeof(a));
+    for (len = 0; len < reply_len; ++len) {
+        if (resolver_parse_reply(ctx, reply, len, "example.com",
+                                 RESOLVER_TYPE_A, &result) != -1) {
+            printf("short reply of %d bytes accepted\n", (int)len);
+            exit(1);
+        }
+    }
+    /* with TC set the complete records are used */
+    reply[2] |= 0x02;
+    if (resolver_parse_reply(ctx, reply, reply_len - 2, "example.com",
+                             RESOLVER_TYPE_A, &result) != 0 ||
+        result.addr_count != 1) {
+        printf("truncated reply not used\n");
+        exit(1);
+    }
+    resolver_result_clear(ctx, &result);
+
+    printf("ok\n");
+
+    printf("Test #9: compression loops... ");
+    reply_start("example.com", RESOLVER_TYPE_A, 0);
+    reply_add(RESOLVER_TYPE_A, 60, a, sizeof(a));
+    /* make the answer name point to itself */
+    reply[29] = 0xc0;
+    reply[30] = 29;
+    if (resolver_parse_reply(ctx, reply, reply_len, "example.com",
+                             RESOLVER_TYPE_A, &result) != -1) {
+        printf("looping reply accepted\n");
+        exit(1);
+    }
+    printf("ok\n");
+}
+
+static resolver_srv_rr_t *srv_list(resolver_srv_rr_t *rrs, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        xmpp_snprintf(rrs[i].target, sizeof(rrs[i].target), "xmpp%d", i);
+        rrs[i].next = i + 1 < n ? &rrs[i + 1] : NULL;
+    }
+
+    return rrs;
+}
+
+static void test_srv_select(xmpp_ctx_t *ctx)
+{
+    resolver_srv_rr_t rrs[4];
+    resolver_srv_rr_t *order;
+    int first[4];
+    int i;
+
+    printf("Test #10: SRV targets are tried by priority... ");
+    memset(rrs, 0, sizeof(rrs));
+    rrs[0].priority = 10;
+    rrs[0].weight = 50;
+    rrs[1].priority = 10;
+    rrs[1].weight = 50;
+    rrs[2].priority = 10;
+    rrs[3].priority = 20;
+    rrs[3].weight = 100;
+    srv_list(rrs, 4);
+    for (i = 0; i < 100; ++i) {
+        order = resolver_srv_select(ctx, rrs);
+        if (!order || !order->next || !order->next->next ||
+            !order->next->next->next || order->next->next->next->next ||
+            order->priority != 10 || order->next->next->priority != 10 ||
+            order->next->next->next->priority != 20) {
+            printf("wrong order\n");
+            exit(1);
+        }
+        resolver_srv_free(ctx, order);
+    }
+    printf("ok\n");
+
+    printf("Test #11: SRV targets are picked by weight... ");
+    memset(rrs, 0, sizeof(rrs));
+    rrs[0].weight = 10;
+    rrs[1].weight = 30;
+    srv_list(rrs, 2);
+    memset(first, 0, sizeof(first));
+    for (i = 0; i < 4000; ++i) {
+        order = resolver_srv_select(ctx, rrs);
+        first[order->target[4] - '0']++;
+        resolver_srv_free(ctx, order);
+    }
+    /* RFC 2782 picks from [0, 40], so the heavy record goes first with a
+     * chance of 30/41 */
+    if (first[1] < 2600 || first[1] > 3250) {
+        printf("weight 30 record first %d times out of 4000\n", first[1]);
+        exit(1);
+    }
+    printf("ok\n");
+}
+
+static void test_srv_lookup(xmpp_ctx_t *ctx)
+{
+    resolver_t *resolver;
+    const resolver_srv_rr_t *srv;
+    char domain[RESOLVER_MAX_DOMAIN];
+
+    printf("Test #12: SRV names that don't fit are not looked up... ");
+    resolver = resolver_new(ctx);
+    if (!resolver) {
+        printf("no resolver\n");
+        exit(1);
+    }
+    /* fits on its own, not with the service and protocol in front */
+    memset(domain, 'a', sizeof(domain) - 1);
+    domain[sizeof(domain) - 1] = '\0';
+    domain[100] = domain[200] = '.';
+    if (resolver_srv_lookup(resolver, "xmpp-client", "tcp", domain,
+                            &srv) != RESOLVER_NOTFOUND || srv != NULL) {
+        printf("looked up\n");
+        exit(1);
+    }
+    resolver_free(resolver);
+    printf("ok\n");
+}
+
+int main()
+{
+    xmpp_ctx_t *ctx;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    if (ctx == NULL) {
+        fprintf(stderr, "failed to create context\n");
+        return 1;
+    }
+
+    test_build_query();
+    test_parse_srv(ctx);
+    test_parse_addr(ctx);
+    test_parse_malformed(ctx);
+    test_srv_select(ctx);
+    test_srv_lookup(ctx);
+
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
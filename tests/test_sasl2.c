@@ -0,0 +1,354 @@
+/* test_sasl2.c
+** libstrophe XMPP client library -- test routines for SASL2, Bind2 and FAST
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "transport.h"
+#include "sasl.h"
+#include "sha256.h"
+
+#include "test.h"
+
+#define STREAM_HEADER "<?xml version='1.0'?>" \
+    "<stream:stream xmlns='jabber:client' " \
+    "xmlns:stream='http://etherx.jabber.org/streams' " \
+    "id='s1' from='localhost' version='1.0'>"
+#define FEATURES_SASL2 "<stream:features>" \
+    "<mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>" \
+    "<mechanism>PLAIN</mechanism></mechanisms>" \
+    "<authentication xmlns='urn:xmpp:sasl:2'>" \
+    "<mechanism>PLAIN</mechanism><inline>" \
+    "<bind xmlns='urn:xmpp:bind:0'><inline>" \
+    "<feature var='urn:xmpp:sm:3'/></inline></bind>" \
+    "<sm xmlns='urn:xmpp:sm:3'/>" \
+    "<fast xmlns='urn:xmpp:fast:0'><mechanism>HT-SHA-256-NONE</mechanism>" \
+    "</fast></inline></authentication></stream:features>"
+#define FEATURES_SCRAM "<stream:features>" \
+    "<mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>" \
+    "<mechanism>SCRAM-SHA-1</mechanism><mechanism>SCRAM-SHA-256</mechanism>" \
+    "<mechanism>SCRAM-SHA-512</mechanism><mechanism>PLAIN</mechanism>" \
+    "</mechanisms><authentication xmlns='urn:xmpp:sasl:2'>" \
+    "<mechanism>SCRAM-SHA-1</mechanism><mechanism>SCRAM-SHA-256</mechanism>" \
+    "<mechanism>SCRAM-SHA-512</mechanism><mechanism>PLAIN</mechanism>" \
+    "</authentication></stream:features>"
+#define FEATURES_BIND "<stream:features>" \
+    "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/></stream:features>"
+#define UA_ID "d4565fa7-4d72-4749-b3d3-740edbf87770"
+
+/* the scripted server */
+static struct {
+    int authenticated;
+    int writes; /* by the client, one per round trip */
+    int authenticates;
+    int binds;
+    int reject_token;
+    int bad_proof; /* 1 to send a wrong proof, 2 to send none */
+    int tokens; /* issued */
+    char token[16];
+    char mechanism[32];
+    char count[16];
+    int enable; /* the last <authenticate/> enabled stream management */
+    int resume; /* and the one before resumed it */
+    int user_agent;
+    int closed; /* the client sent </stream:stream> */
+    int scram; /* offer SCRAM and refuse it */
+    char tried[128]; /* mechanisms, in order */
+} server;
+
+
+/* checks an HT-SHA-256-NONE initial response against the token */
+static int token_valid(xmpp_conn_t * const conn, const char *data)
+{
+    const char *start = strstr(data, "<initial-response>");
+    const char *end = strstr(data, "</initial-response>");
+    char *expected;
+    int ok;
+
+    if (!start || !end) return 0;
+    start += strlen("<initial-response>");
+    expected = sasl_ht_sha256(conn->ctx, "user", server.token);
+    ok = strlen(expected) == (size_t)(end - start) &&
+         strncmp(start, expected, end - start) == 0;
+    xmpp_free(conn->ctx, expected);
+
+    return ok;
+}
+
+static void sasl2_success(xmpp_conn_t * const conn, const char *data)
+{
+    char buf[1024];
+    char proof[128] = "";
+    char token[64] = "";
+    char *b64;
+    uint8_t hash[SHA256_DIGEST_SIZE];
+
+    if (strcmp(server.mechanism, "HT-SHA-256-NONE") == 0 &&
+        server.bad_proof != 2) {
+        crypto_HMAC_SHA256((uint8_t *)server.token, strlen(server.token),
+                           (uint8_t *)"Responder", 9, hash);
+        if (server.bad_proof) hash[0] ^= 1;
+        b64 = base64_encode(conn->ctx, hash, sizeof(hash));
+        xmpp_snprintf(proof, sizeof(proof),
+                      "<additional-data>%s</additional-data>", b64);
+        xmpp_free(conn->ctx, b64);
+    }
+    if (strstr(data, "<request-token")) {
+        xmpp_snprintf(server.token, sizeof(server.token), "tok%d",
+                      ++server.tokens);
+        xmpp_snprintf(token, sizeof(token), "<token xmlns='urn:xmpp:fast:0' "
+                      "token='%s'/>", server.token);
+    }
+
+    if (server.resume) {
+        xmpp_snprintf(buf, sizeof(buf), "<success xmlns='urn:xmpp:sasl:2'>"
+                      "%s<authorization-identifier>user@localhost/app.x"
+                      "</authorization-identifier>%s"
+                      "<resumed xmlns='urn:xmpp:sm:3' h='0' previd='sm-1'/>"
+                      "</success>", proof, token);
+    } else {
+        xmpp_snprintf(buf, sizeof(buf), "<success xmlns='urn:xmpp:sasl:2'>"
+                      "%s<authorization-identifier>user@localhost/app.x"
+                      "</authorization-identifier>%s"
+                      "<bound xmlns='urn:xmpp:bind:0'>%s</bound>"
+                      "</success>", proof, token, server.enable ?
+                      "<enabled xmlns='urn:xmpp:sm:3' id='sm-1' "
+                      "resume='true'/>" : "");
+    }
+    test_reply(conn, buf);
+}
+
+static void server_handler(xmpp_conn_t * const conn,
+                           const char * const data, const size_t len,
+                           void * const userdata)
+{
+    char buf[1024];
+
+    memcpy(buf, data, len < sizeof(buf) ? len : sizeof(buf) - 1);
+    buf[len < sizeof(buf) ? len : sizeof(buf) - 1] = '\0';
+    server.writes++;
+
+    if (strncmp(buf, "<?xml", 5) == 0) {
+        test_reply(conn, STREAM_HEADER);
+        test_reply(conn, server.authenticated ? FEATURES_BIND :
+                         server.scram ? FEATURES_SCRAM : FEATURES_SASL2);
+    } else if (strncmp(buf, "<auth ", 6) == 0) {
+        test_find_attr(buf, "mechanism", server.mechanism,
+                       sizeof(server.mechanism));
+        strcat(server.tried, server.mechanism);
+        strcat(server.tried, " ");
+        if (strncmp(server.mechanism, "SCRAM-", 6) == 0) {
+            test_reply(conn, "<failure xmlns='urn:ietf:params:xml:ns:"
+                             "xmpp-sasl'><not-authorized/></failure>");
+            return;
+        }
+        server.authenticated = 1;
+        test_reply(conn,
+                   "<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>");
+    } else if (strncmp(buf, "<authenticate", 13) == 0) {
+        server.authenticates++;
+        test_find_attr(buf, "mechanism", server.mechanism,
+                       sizeof(server.mechanism));
+        strcat(server.tried, server.mechanism);
+        strcat(server.tried, " ");
+        if (strncmp(server.mechanism, "SCRAM-", 6) == 0) {
+            test_reply(conn, "<failure xmlns='urn:xmpp:sasl:2'>"
+                             "<not-authorized xmlns='urn:ietf:params:xml:"
+                             "ns:xmpp-sasl'/></failure>");
+            return;
+        }
+        server.count[0] = '\0';
+        if (strstr(buf, "<fast"))
+            test_find_attr(strstr(buf, "<fast"), "count", server.count,
+                           sizeof(server.count));
+        server.user_agent = strstr(buf, "<user-agent id=\"" UA_ID "\">"
+                                   "<software>app</software>") != NULL;
+        server.resume = strstr(buf, "<resume") != NULL &&
+                        strstr(buf, "previd=\"sm-1\"") != NULL;
+        server.enable = strstr(buf, "<enable") != NULL;
+
+        if (strcmp(server.mechanism, "HT-SHA-256-NONE") == 0 &&
+            (server.reject_token || !token_valid(conn, buf)))
+            test_reply(conn, "<failure xmlns='urn:xmpp:sasl:2'>"
+                             "<not-authorized xmlns='urn:ietf:params:xml:"
+                             "ns:xmpp-sasl'/></failure>");
+        else
+            sasl2_success(conn, buf);
+    } else if (strncmp(buf, "</stream:stream>", 16) == 0) {
+        server.closed = 1;
+    } else if (strstr(buf, "_xmpp_bind1")) {
+        server.binds++;
+        test_reply(conn, "<iq id='_xmpp_bind1' type='result'>"
+                         "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'>"
+                         "<jid>user@localhost/res</jid></bind></iq>");
+    }
+}
+
+static void connect_client(xmpp_ctx_t *ctx, xmpp_conn_t *conn)
+{
+    server.authenticated = 0;
+    server.writes = 0;
+    server.authenticates = 0;
+    server.binds = 0;
+    server.closed = 0;
+    server.tried[0] = '\0';
+    test_connect(ctx, conn);
+}
+
+static void drop(xmpp_ctx_t *ctx, xmpp_conn_t *conn)
+{
+    transport_loopback_close(conn);
+    test_run(ctx, 2);
+}
+
+int main()
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    unsigned long count;
+    const char *token;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    conn = xmpp_conn_new(ctx);
+    if (ctx == NULL || conn == NULL) {
+        fprintf(stderr, "failed to create connection\n");
+        return 1;
+    }
+    xmpp_conn_set_jid(conn, "user@localhost/res");
+    xmpp_conn_set_pass(conn, "secret");
+    transport_loopback_attach(conn, server_handler, NULL);
+
+    printf("Test #1: no SASL2 unless asked for... ");
+    connect_client(ctx, conn);
+    if (test_connects != 1 || server.authenticates != 0 || server.binds != 1) {
+        printf("connects %d, authenticates %d, binds %d\n", test_connects,
+               server.authenticates, server.binds);
+        exit(1);
+    }
+    drop(ctx, conn);
+    printf("ok\n");
+
+    printf("Test #2: SASL2 binds and enables stream management... ");
+    xmpp_conn_set_flags(conn, XMPP_CONN_FLAG_SASL2 |
+                              XMPP_CONN_FLAG_STREAM_MGMT);
+    xmpp_conn_set_user_agent(conn, UA_ID, "app", NULL);
+    connect_client(ctx, conn);
+    token = xmpp_conn_get_fast_token(conn, &count);
+    if (test_connects != 2 || server.authenticates != 1 || server.binds != 0 ||
+        strcmp(server.mechanism, "PLAIN") != 0 || !server.user_agent ||
+        !server.enable || server.writes != 2 || conn->sm_id == NULL ||
+        strcmp(xmpp_conn_get_bound_jid(conn), "user@localhost/app.x") != 0) {
+        printf("connects %d, authenticates %d, binds %d, writes %d\n",
+               test_connects, server.authenticates, server.binds,
+               server.writes);
+        exit(1);
+    }
+    if (!token || strcmp(token, "tok1") != 0 || count != 0) {
+        printf("no token\n");
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #3: a reconnect resumes with the FAST token... ");
+    drop(ctx, conn);
+    connect_client(ctx, conn);
+    if (test_connects != 3 || server.authenticates != 1 ||
+        strcmp(server.mechanism, "HT-SHA-256-NONE") != 0 ||
+        strcmp(server.count, "1") != 0 || !server.resume ||
+        !xmpp_conn_is_resumed(conn) || server.writes != 2) {
+        printf("connects %d, mechanism %s, count %s, writes %d\n",
+               test_connects, server.mechanism, server.count, server.writes);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #4: a saved token is used after a restart... ");
+    drop(ctx, conn);
+    xmpp_conn_set_flags(conn, XMPP_CONN_FLAG_SASL2);
+    xmpp_conn_set_fast_token(conn, "tok1", 41);
+    connect_client(ctx, conn);
+    if (test_connects != 4 || strcmp(server.count, "42") != 0 ||
+        server.resume || server.enable || xmpp_conn_is_resumed(conn)) {
+        printf("connects %d, count %s\n", test_connects, server.count);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #5: a rejected token falls back to the password... ");
+    drop(ctx, conn);
+    server.reject_token = 1;
+    connect_client(ctx, conn);
+    token = xmpp_conn_get_fast_token(conn, &count);
+    if (test_connects != 5 || server.authenticates != 2 ||
+        strcmp(server.mechanism, "PLAIN") != 0 ||
+        !token || strcmp(token, "tok2") != 0 || count != 0) {
+        printf("connects %d, authenticates %d, token %s\n", test_connects,
+               server.authenticates, token ? token : "none");
+        exit(1);
+    }
+    server.reject_token = 0;
+    printf("ok\n");
+
+    printf("Test #6: a server which doesn't know the token is dropped... ");
+    drop(ctx, conn);
+    server.bad_proof = 1;
+    connect_client(ctx, conn);
+    if (test_connects != 5 || !server.closed) {
+        printf("connects %d, closed %d\n", test_connects, server.closed);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #7: so is one which leaves out the proof... ");
+    drop(ctx, conn);
+    server.bad_proof = 2;
+    connect_client(ctx, conn);
+    if (test_connects != 5 || !server.closed ||
+        strcmp(server.mechanism, "HT-SHA-256-NONE") != 0) {
+        printf("connects %d, closed %d, mechanism %s\n", test_connects,
+               server.closed, server.mechanism);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #8: SASL2 tries the SCRAM hashes from the strongest... ");
+    drop(ctx, conn);
+    server.bad_proof = 0;
+    server.scram = 1;
+    connect_client(ctx, conn);
+    if (test_connects != 6 ||
+        strcmp(server.tried, "SCRAM-SHA-512 SCRAM-SHA-256 "
+                             "SCRAM-SHA-1 PLAIN ") != 0) {
+        printf("connects %d, tried %s\n", test_connects, server.tried);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #9: so does SASL... ");
+    drop(ctx, conn);
+    xmpp_conn_set_flags(conn, 0);
+    connect_client(ctx, conn);
+    if (test_connects != 7 ||
+        strcmp(server.tried, "SCRAM-SHA-512 SCRAM-SHA-256 "
+                             "SCRAM-SHA-1 PLAIN ") != 0) {
+        printf("connects %d, tried %s\n", test_connects, server.tried);
+        exit(1);
+    }
+    printf("ok\n");
+
+    xmpp_conn_release(conn);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
@@ -1,5 +1,5 @@
 /* test_scram.c
- * strophe XMPP client library -- test vectors for SCRAM-SHA1
+ * strophe XMPP client library -- test vectors for SCRAM
  *
  * Copyright (C) 2014 Dmitry Podgorny <pasis.ua@gmail.com>
  *
@@ -9,12 +9,14 @@
  *  This program is dual licensed under the MIT and GPLv3 licenses.
  */
 
-/* gcc -o test_scram -I./src tests/test_scram.c tests/test.c src/sha1.c */
+/* gcc -o test_scram -I./src tests/test_scram.c tests/test.c src/sha1.c \
+ *     src/sha256.c src/sha512.c src/cpu.c */
 
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "test.h"
 
@@ -22,9 +24,11 @@
 #include "scram.c"
 
 /*
- * Test vectors for derivation function (RFC6070).
+ * Test vectors for derivation function (RFC6070, and the same inputs
+ * with PBKDF2-HMAC-SHA-256 and -SHA-512).
  */
 static const struct {
+    const scram_hash_t *alg;
     char *P;      /* text */
     char *S;      /* salt */
     size_t P_len;
@@ -33,6 +37,7 @@ static const struct {
     char *DK;     /* resulting digest */
 } df_vectors[] = {
     {
+        .alg = &scram_sha1,
         .P = "password",
         .S = "salt",
         .P_len = 8,
@@ -41,6 +46,7 @@ static const struct {
         .DK = "0c60c80f961f0e71f3a9b524af6012062fe037a6",
     },
     {
+        .alg = &scram_sha1,
         .P = "password",
         .S = "salt",
         .P_len = 8,
@@ -49,6 +55,7 @@ static const struct {
         .DK = "ea6c014dc72d6f8ccd1ed92ace1d41f0d8de8957",
     },
     {
+        .alg = &scram_sha1,
         .P = "password",
         .S = "salt",
         .P_len = 8,
@@ -56,28 +63,68 @@ static const struct {
         .c = 4096,
         .DK = "4b007901b765489abead49d926f721d065a429c1",
     },
+    {
+        .alg = &scram_sha256,
+        .P = "password",
+        .S = "salt",
+        .P_len = 8,
+        .S_len = 4,
+        .c = 1,
+        .DK = "120fb6cffcf8b32c43e7225256c4f837a86548c92ccc35480805987cb70be17b",
+    },
+    {
+        .alg = &scram_sha256,
+        .P = "password",
+        .S = "salt",
+        .P_len = 8,
+        .S_len = 4,
+        .c = 4096,
+        .DK = "c5e478d59288c841aa530db6845c4c8d962893a001ce4e11a4963873aa98134a",
+    },
+    {
+        .alg = &scram_sha512,
+        .P = "password",
+        .S = "salt",
+        .P_len = 8,
+        .S_len = 4,
+        .c = 1,
+        .DK = "867f70cf1ade02cff3752599a3a53dc4af34c7a669815ae5d513554e1c8cf252"
+              "c02d470a285a0501bad999bfe943c08f050235d7d68b1da55e63f73b60a57fce",
+    },
+    {
+        .alg = &scram_sha512,
+        .P = "password",
+        .S = "salt",
+        .P_len = 8,
+        .S_len = 4,
+        .c = 4096,
+        .DK = "d197b1b33db0143e018b12f3d1d1479e6cdebdcc97c5c0f87f6902e072f457b5"
+              "143f30602641b3d55cd335988cb36b84376060ecd532e039b742a239434af2d5",
+    },
 };
 
 static void test_df(void)
 {
     size_t i;
     const char *s;
-    uint8_t dk[SHA1_DIGEST_SIZE];
+    uint8_t dk[SCRAM_DIGEST_SIZE];
 
-    printf("Derivation function tests (SCRAM_SHA1_Hi).\n");
+    printf("Derivation function tests (SCRAM_Hi).\n");
     for (i = 0; i < ARRAY_SIZE(df_vectors); ++i) {
         printf("Test #%d: ", (int)i + 1);
-        SCRAM_SHA1_Hi((uint8_t *)df_vectors[i].P, df_vectors[i].P_len,
-                      (uint8_t *)df_vectors[i].S, df_vectors[i].S_len,
-                      df_vectors[i].c, dk);
-        s = test_bin_to_hex(dk, sizeof(dk));
+        SCRAM_Hi(df_vectors[i].alg,
+                 (uint8_t *)df_vectors[i].P, df_vectors[i].P_len,
+                 (uint8_t *)df_vectors[i].S, df_vectors[i].S_len,
+                 df_vectors[i].c, dk);
+        s = test_bin_to_hex(dk, df_vectors[i].alg->digest_size);
         COMPARE(df_vectors[i].DK, s);
         printf("ok\n");
     }
 }
 
-/* RFC6120 */
+/* RFC6120, RFC7677 and the same exchange with SCRAM-SHA-512 */
 static const struct {
+    const scram_hash_t *alg;
     char *password;
     char *initial;
     char *challenge;
@@ -87,6 +134,7 @@ static const struct {
     char *sign;
 } scram_vectors[] = {
     {
+        .alg = &scram_sha1,
         .password = "r0m30myr0m30",
         .initial = "n,,n=juliet,r=oMsTAAwAAAAMAAAANP0TAAAAAABPU0AA",
         .challenge = "r=oMsTAAwAAAAMAAAANP0TAAAAAABPU0AAe124695b-69a9-4de6-9c30"
@@ -99,44 +147,209 @@ static const struct {
         .i = 4096,
         .sign = "500e7bb4cfd2be90130641f6157b345835ef258c",
     },
+    {
+        .alg = &scram_sha256,
+        .password = "pencil",
+        .initial = "n,,n=user,r=rOprNGfwEbeRWgbNEkqO",
+        .challenge = "r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF$k0,"
+                     "s=W22ZaJ0SNY7soEsUEjb6gQ==,i=4096",
+        .response = "c=biws,r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF"
+                    "$k0",
+        .salt = "5b6d99689d12358eeca04b141236fa81",
+        .i = 4096,
+        .sign = "747cdb65aa56224e2352137e52d7bdcad6a0f738df30782caa69a2cfb0277554",
+    },
+    {
+        .alg = &scram_sha512,
+        .password = "pencil",
+        .initial = "n,,n=user,r=rOprNGfwEbeRWgbNEkqO",
+        .challenge = "r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF$k0,"
+                     "s=W22ZaJ0SNY7soEsUEjb6gQ==,i=4096",
+        .response = "c=biws,r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF"
+                    "$k0",
+        .salt = "5b6d99689d12358eeca04b141236fa81",
+        .i = 4096,
+        .sign = "80c19745c7af49c36dc59ebff25418a46b67b0d01cde619c98da26bfec67a0e3"
+                "30fb7476c4d25d30d9f33254cdf0f3c2eb0769e9dc9b1260d85d84f1c2760f25",
+    },
 };
 
 static void test_scram(void)
 {
-    uint8_t key[SHA1_DIGEST_SIZE];
-    uint8_t sign[SHA1_DIGEST_SIZE];
+    const scram_hash_t *alg;
+    uint8_t key[SCRAM_DIGEST_SIZE];
+    uint8_t sign[SCRAM_DIGEST_SIZE];
     uint8_t salt[256];
     size_t salt_len;
     char auth[512];
     const char *s;
     size_t i;
-    int j;
 
-    printf("SCRAM_SHA1_ClientKey and SCRAM_SHA1_ClientSignature tests.\n");
+    printf("SCRAM_ClientKey and SCRAM_ClientSignature tests.\n");
     for (i = 0; i < ARRAY_SIZE(scram_vectors); ++i) {
         printf("Test #%d: ", (int)i + 1);
         snprintf(auth, sizeof(auth), "%s,%s,%s",
                  scram_vectors[i].initial + 3, scram_vectors[i].challenge,
                  scram_vectors[i].response);
         test_hex_to_bin(scram_vectors[i].salt, salt, &salt_len);
+        alg = scram_vectors[i].alg;
 
-        SCRAM_SHA1_ClientKey((uint8_t *)scram_vectors[i].password,
-                             strlen(scram_vectors[i].password),
-                             salt, salt_len, scram_vectors[i].i, key);
-        SCRAM_SHA1_ClientSignature(key, (uint8_t *)auth, strlen(auth), sign);
-        for (j = 0; j < SHA1_DIGEST_SIZE; j++) {
-            sign[j] ^= key[j];
-        }
-        s = test_bin_to_hex(sign, SHA1_DIGEST_SIZE);
+        SCRAM_ClientKey(alg, (uint8_t *)scram_vectors[i].password,
+                        strlen(scram_vectors[i].password),
+                        salt, salt_len, scram_vectors[i].i, key);
+        SCRAM_ClientSignature(alg, key, (uint8_t *)auth, strlen(auth), sign);
+        SCRAM_ClientProof(alg, key, sign, sign);
+        s = test_bin_to_hex(sign, alg->digest_size);
         COMPARE(scram_vectors[i].sign, s);
         printf("ok\n");
     }
 }
 
+static void test_cache(void)
+{
+    scram_cache_t cache;
+    uint8_t key[SHA1_DIGEST_SIZE];
+    uint8_t cached[SCRAM_DIGEST_SIZE];
+    uint8_t zero[sizeof(cache)];
+    uint8_t salt[256];
+    size_t salt_len;
+    char password[16];
+    int k;
+
+    printf("SCRAM_ClientKeyCached tests.\n");
+    scram_cache_init(&cache);
+    test_hex_to_bin(scram_vectors[0].salt, salt, &salt_len);
+    SCRAM_ClientKey(&scram_sha1, (uint8_t *)"r0m30myr0m30", 12,
+                    salt, salt_len, 4096, key);
+
+    printf("Test #1: a miss derives the key... ");
+    SCRAM_ClientKeyCached(&cache, &scram_sha1, (uint8_t *)"r0m30myr0m30",
+                          12, salt, salt_len, 4096, cached);
+    COMPARE_BUF(key, sizeof(key), cached, sizeof(key));
+    printf("ok\n");
+
+    printf("Test #2: a hit returns the same key... ");
+    memset(cached, 0, sizeof(cached));
+    SCRAM_ClientKeyCached(&cache, &scram_sha1, (uint8_t *)"r0m30myr0m30",
+                          12, salt, salt_len, 4096, cached);
+    COMPARE_BUF(key, sizeof(key), cached, sizeof(key));
+    if (cache.clock != 2 || cache.entry[0].used != 2) {
+        printf("not a hit\n");
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #3: other passwords, counts and hashes don't match... ");
+    SCRAM_ClientKeyCached(&cache, &scram_sha1, (uint8_t *)"r0m30myr0m31",
+                          12, salt, salt_len, 4096, cached);
+    if (memcmp(key, cached, sizeof(key)) == 0) {
+        printf("got the key of another password\n");
+        exit(1);
+    }
+    SCRAM_ClientKeyCached(&cache, &scram_sha1, (uint8_t *)"r0m30myr0m30",
+                          12, salt, salt_len, 4095, cached);
+    if (memcmp(key, cached, sizeof(key)) == 0) {
+        printf("got the key of another count\n");
+        exit(1);
+    }
+    SCRAM_ClientKeyCached(&cache, &scram_sha256, (uint8_t *)"r0m30myr0m30",
+                          12, salt, salt_len, 4096, cached);
+    if (memcmp(key, cached, sizeof(key)) == 0) {
+        printf("got the key of another hash\n");
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #4: the least recently used key is dropped... ");
+    /* touch the first key, so it outlives the others */
+    SCRAM_ClientKeyCached(&cache, &scram_sha1, (uint8_t *)"r0m30myr0m30",
+                          12, salt, salt_len, 4096, cached);
+    for (k = 0; k < SCRAM_CACHE_SIZE - 1; k++) {
+        snprintf(password, sizeof(password), "pass%d", k);
+        SCRAM_ClientKeyCached(&cache, &scram_sha1, (uint8_t *)password,
+                              strlen(password), salt, salt_len, 2, cached);
+    }
+    for (k = 0; k < SCRAM_CACHE_SIZE; k++) {
+        if (cache.entry[k].i == 4096 &&
+            memcmp(cache.entry[k].key, key, sizeof(key)) == 0)
+            break;
+    }
+    if (k == SCRAM_CACHE_SIZE) {
+        printf("the recently used key was dropped\n");
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #5: wiping clears all keys... ");
+    scram_cache_wipe(&cache);
+    memset(zero, 0, sizeof(zero));
+    COMPARE_BUF(zero, sizeof(zero), (uint8_t *)&cache, sizeof(cache));
+    printf("ok\n");
+}
+
+/* Hi() as it was before the HMAC states were precomputed, with the key
+ * pads hashed again in every iteration */
+static void naive_Hi(const scram_hash_t *alg, const uint8_t *text,
+                     size_t len, const uint8_t *salt, size_t salt_len,
+                     uint32_t i, uint8_t *digest)
+{
+    uint8_t tmp[128];
+    uint32_t j;
+    size_t k;
+
+    memcpy(tmp, salt, salt_len);
+    memcpy(&tmp[salt_len], "\0\0\0\1", 4);
+    crypto_HMAC(alg, text, len, tmp, salt_len + 4, digest);
+    memcpy(tmp, digest, alg->digest_size);
+    for (j = 1; j < i; j++) {
+        crypto_HMAC(alg, text, len, tmp, alg->digest_size, tmp);
+        for (k = 0; k < alg->digest_size; k++) {
+            digest[k] ^= tmp[k];
+        }
+    }
+}
+
+static double bench_Hi(void (*hi)(const scram_hash_t *, const uint8_t *,
+                                  size_t, const uint8_t *, size_t, uint32_t,
+                                  uint8_t *),
+                       const scram_hash_t *alg, uint8_t *digest)
+{
+    clock_t start = clock();
+    int n;
+
+    for (n = 0; n < 20; n++)
+        hi(alg, (uint8_t *)"password", 8, (uint8_t *)"salt", 4, 4096, digest);
+
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void test_bench(void)
+{
+    const scram_hash_t *algs[] = { &scram_sha1, &scram_sha256,
+                                   &scram_sha512 };
+    uint8_t naive[SCRAM_DIGEST_SIZE];
+    uint8_t digest[SCRAM_DIGEST_SIZE];
+    double t_naive, t_hi;
+    size_t i;
+
+    printf("Benchmark of SCRAM_Hi, 20 logins of 4096 iterations.\n");
+    for (i = 0; i < ARRAY_SIZE(algs); ++i) {
+        t_naive = bench_Hi(naive_Hi, algs[i], naive);
+        t_hi = bench_Hi(SCRAM_Hi, algs[i], digest);
+        COMPARE_BUF(naive, algs[i]->digest_size,
+                    digest, algs[i]->digest_size);
+        printf("%s: per-iteration HMAC: %.3fs, precomputed pads: %.3fs "
+               "(%.1fx)\n", algs[i]->scram_name, t_naive, t_hi,
+               t_hi > 0 ? t_naive / t_hi : 0.0);
+    }
+}
+
 int main(int argc, char **argv)
 {
     test_df();
     test_scram();
+    test_cache();
+    test_bench();
 
     return 0;
 }
@@ -1,12 +1,13 @@
 /* Tests for Steve Reid's public domain SHA-1 implementation */
 /* This file is in the public domain */
 
-/* gcc -o test_sha1 -I./src tests/test_sha1.c src/sha1.c */
+/* gcc -o test_sha1 -I./src tests/test_sha1.c src/cpu.c */
 
 #include <stdio.h>
 #include <string.h>
 
-#include "sha1.h"
+/* include sha1.c to test every implementation of the transform */
+#include "sha1.c"
 
 /* Test Vectors (from FIPS PUB 180-1) */
 static char *test_data[] = {
@@ -35,29 +36,37 @@ static void digest_to_hex(const uint8_t *digest, char *output)
     *(c - 1) = '\0';
 }
     
-int main(int argc, char** argv)
+typedef void (*transform_t)(uint32_t state[5], const uint8_t *data,
+                            size_t blocks);
+
+static int check(const char *name, const char *output, const char *result)
 {
+    if (strcmp(output, result)) {
+        fprintf(stdout, "FAIL\n");
+        fprintf(stderr,"* hash of \"%s\" incorrect:\n", name);
+        fprintf(stderr,"\t%s returned\n", output);
+        fprintf(stderr,"\t%s is correct\n", result);
+        return 1;
+    }
+    return 0;
+}
+
+static int test_vectors(void)
+{
+    static uint8_t million[1000000];
     int k;
     SHA1_CTX context;
     uint8_t digest[20];
     char output[80];
 
-    fprintf(stdout, "verifying SHA-1 implementation... ");
-    
     for (k = 0; k < 2; k++){ 
         crypto_SHA1_Init(&context);
         crypto_SHA1_Update(&context, (uint8_t*)test_data[k],
                            strlen(test_data[k]));
         crypto_SHA1_Final(&context, digest);
         digest_to_hex(digest, output);
-
-        if (strcmp(output, test_results[k])) {
-            fprintf(stdout, "FAIL\n");
-            fprintf(stderr,"* hash of \"%s\" incorrect:\n", test_data[k]);
-            fprintf(stderr,"\t%s returned\n", output);
-            fprintf(stderr,"\t%s is correct\n", test_results[k]);
-            return (1);
-        }    
+        if (check(test_data[k], output, test_results[k]))
+            return 1;
     }
     /* million 'a' vector we feed separately */
     crypto_SHA1_Init(&context);
@@ -65,15 +74,55 @@ int main(int argc, char** argv)
         crypto_SHA1_Update(&context, (uint8_t*)"a", 1);
     crypto_SHA1_Final(&context, digest);
     digest_to_hex(digest, output);
-    if (strcmp(output, test_results[2])) {
-        fprintf(stdout, "FAIL\n");
-        fprintf(stderr,"* hash of \"%s\" incorrect:\n", test_data[2]);
-        fprintf(stderr,"\t%s returned\n", output);
-        fprintf(stderr,"\t%s is correct\n", test_results[2]);
-        return (1);
+    if (check(test_data[2], output, test_results[2]))
+        return 1;
+    /* and in one go, which hashes the blocks straight from the input */
+    memset(million, 'a', sizeof(million));
+    crypto_SHA1(million, sizeof(million), digest);
+    digest_to_hex(digest, output);
+    if (check(test_data[2], output, test_results[2]))
+        return 1;
+    /* the input is left alone */
+    for (k = 0; k < (int)sizeof(million); k++) {
+        if (million[k] != 'a') {
+            fprintf(stdout, "FAIL\n");
+            fprintf(stderr, "* input modified at %d\n", k);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    transform_t transforms[3];
+    const char *names[3];
+    int n = 0, k;
+
+    transforms[n] = SHA1_Transform;
+    names[n++] = "portable";
+#ifdef CPU_X86_SSSE3
+    if (cpu_has_x86_ssse3()) {
+        transforms[n] = SHA1_Transform_ssse3;
+        names[n++] = "SSSE3";
+    }
+#endif
+#ifdef CPU_X86_SHA
+    if (cpu_has_x86_sha()) {
+        transforms[n] = SHA1_Transform_x86;
+        names[n++] = "x86 SHA extensions";
+    }
+#endif
+
+    for (k = 0; k < n; k++) {
+        fprintf(stdout, "verifying SHA-1 implementation (%s)... ", names[k]);
+        sha1_transform = transforms[k];
+        if (test_vectors())
+            return 1;
+        fprintf(stdout, "ok\n");
     }
 
     /* success */
-    fprintf(stdout, "ok\n");
-    return(0);
+    return 0;
 }
@@ -0,0 +1,141 @@
+/* test_sha256.c
+** libstrophe XMPP client library -- test routines for SHA-256
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/* gcc -o test_sha256 -I./src tests/test_sha256.c src/cpu.c */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* include sha256.c to test every implementation of the transform */
+#include "sha256.c"
+
+/* Test Vectors (from FIPS 180-2 and RFC 4231) */
+static char *test_data[] = {
+    "abc",
+    "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+    "",
+    "A million repetitions of 'a'"};
+static char *test_results[] = {
+    "BA7816BF8F01CFEA414140DE5DAE2223B00361A396177A9CB410FF61F20015AD",
+    "248D6A61D20638B8E5C026930C3E6039A33CE45964FF2167F6ECEDD419DB06C1",
+    "E3B0C44298FC1C149AFBF4C8996FB92427AE41E4649B934CA495991B7852B855",
+    "CDC76E5C9914FB9281A1C7E284D73E67F1809A48A497200E046D39CCC7112CD0"};
+static char *hmac_result =
+    "B0344C61D8DB38535CA8AFCEAF0BF12B881DC200C9833DA726E9376C2E32CFF7";
+
+static void digest_to_hex(const uint8_t *digest, char *output)
+{
+    int i;
+
+    for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+        sprintf(output + i * 2, "%02X", digest[i]);
+}
+
+static int check(const char *name, const char *output, const char *result)
+{
+    if (strcmp(output, result)) {
+        fprintf(stdout, "FAIL\n");
+        fprintf(stderr, "* %s incorrect:\n", name);
+        fprintf(stderr, "\t%s returned\n", output);
+        fprintf(stderr, "\t%s is correct\n", result);
+        return 1;
+    }
+    return 0;
+}
+
+typedef void (*transform_t)(uint32_t state[8], const uint8_t *data,
+                            size_t blocks);
+
+static int test_vectors(void)
+{
+    int k;
+    sha256_context context;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint8_t key[20];
+    char output[SHA256_DIGEST_SIZE * 2 + 1];
+
+    for (k = 0; k < 3; k++) {
+        crypto_SHA256((uint8_t*)test_data[k], strlen(test_data[k]), digest);
+        digest_to_hex(digest, output);
+        if (check(test_data[k], output, test_results[k]))
+            return 1;
+    }
+    /* million 'a' vector we feed in uneven pieces */
+    crypto_SHA256_Init(&context);
+    for (k = 0; k < 1000000; k += 7)
+        crypto_SHA256_Update(&context, (uint8_t*)"aaaaaaa",
+                             k + 7 <= 1000000 ? 7 : 1000000 - k);
+    crypto_SHA256_Final(&context, digest);
+    digest_to_hex(digest, output);
+    if (check(test_data[3], output, test_results[3]))
+        return 1;
+
+    memset(key, 0x0b, sizeof(key));
+    crypto_HMAC_SHA256(key, sizeof(key), (uint8_t*)"Hi There", 8, digest);
+    digest_to_hex(digest, output);
+    if (check("HMAC-SHA-256", output, hmac_result))
+        return 1;
+
+    return 0;
+}
+
+/* MB/s of hashing one megabyte, and of the 84 byte messages of SCRAM */
+static void bench(void)
+{
+    static uint8_t data[1 << 20];
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    clock_t start;
+    double t_bulk, t_short;
+    int n;
+
+    memset(data, 'a', sizeof(data));
+    start = clock();
+    for (n = 0; n < 20; n++)
+        crypto_SHA256(data, sizeof(data), digest);
+    t_bulk = (double)(clock() - start) / CLOCKS_PER_SEC;
+    start = clock();
+    for (n = 0; n < 200000; n++)
+        crypto_SHA256(data, 84, digest);
+    t_short = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%.0f MB/s, %.0f MB/s for 84 bytes... ",
+           t_bulk > 0 ? 20 / t_bulk : 0.0,
+           t_short > 0 ? 200000 * 84 / t_short / (1 << 20) : 0.0);
+}
+
+int main(int argc, char** argv)
+{
+    transform_t transforms[2];
+    const char *names[2];
+    int n = 0, k;
+
+    transforms[n] = SHA256_Transform;
+    names[n++] = "portable";
+#ifdef CPU_X86_SHA
+    if (cpu_has_x86_sha()) {
+        transforms[n] = SHA256_Transform_x86;
+        names[n++] = "x86 SHA extensions";
+    }
+#endif
+
+    for (k = 0; k < n; k++) {
+        fprintf(stdout, "verifying SHA-256 implementation (%s)... ",
+                names[k]);
+        sha256_transform = transforms[k];
+        if (test_vectors())
+            return 1;
+        bench();
+        fprintf(stdout, "ok\n");
+    }
+
+    /* success */
+    return 0;
+}
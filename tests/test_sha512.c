@@ -0,0 +1,110 @@
+/* test_sha512.c
+** libstrophe XMPP client library -- test routines for SHA-512
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+/* gcc -o test_sha512 -I./src tests/test_sha512.c src/sha512.c */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sha512.h"
+
+/* Test Vectors (from FIPS 180-2) */
+static char *test_data[] = {
+    "abc",
+    "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+    "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+    "",
+    "A million repetitions of 'a'"};
+static char *test_results[] = {
+    "DDAF35A193617ABACC417349AE20413112E6FA4E89A97EA20A9EEEE64B55D39A"
+    "2192992A274FC1A836BA3C23A3FEEBBD454D4423643CE80E2A9AC94FA54CA49F",
+    "8E959B75DAE313DA8CF4F72814FC143F8F7779C6EB9F7FA17299AEADB6889018"
+    "501D289E4900F7E4331B99DEC4B5433AC7D329EEB6DD26545E96E55B874BE909",
+    "CF83E1357EEFB8BDF1542850D66D8007D620E4050B5715DC83F4A921D36CE9CE"
+    "47D0D13C5D85F2B0FF8318D2877EEC2F63B931BD47417A81A538327AF927DA3E",
+    "E718483D0CE769644E2E42C7BC15B4638E1F98B13B2044285632A803AFA973EB"
+    "DE0FF244877EA60A4CB0432CE577C31BEB009C5C2C49AA2E4EADB217AD8CC09B"};
+
+static void digest_to_hex(const uint8_t *digest, char *output)
+{
+    int i;
+
+    for (i = 0; i < SHA512_DIGEST_SIZE; i++)
+        sprintf(output + i * 2, "%02X", digest[i]);
+}
+
+static int check(const char *name, const char *output, const char *result)
+{
+    if (strcmp(output, result)) {
+        fprintf(stdout, "FAIL\n");
+        fprintf(stderr, "* %s incorrect:\n", name);
+        fprintf(stderr, "\t%s returned\n", output);
+        fprintf(stderr, "\t%s is correct\n", result);
+        return 1;
+    }
+    return 0;
+}
+
+/* MB/s of hashing one megabyte, and of the 192 byte messages of SCRAM */
+static void bench(void)
+{
+    static uint8_t data[1 << 20];
+    uint8_t digest[SHA512_DIGEST_SIZE];
+    clock_t start;
+    double t_bulk, t_short;
+    int n;
+
+    memset(data, 'a', sizeof(data));
+    start = clock();
+    for (n = 0; n < 20; n++)
+        crypto_SHA512(data, sizeof(data), digest);
+    t_bulk = (double)(clock() - start) / CLOCKS_PER_SEC;
+    start = clock();
+    for (n = 0; n < 100000; n++)
+        crypto_SHA512(data, 192, digest);
+    t_short = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%.0f MB/s, %.0f MB/s for 192 bytes... ",
+           t_bulk > 0 ? 20 / t_bulk : 0.0,
+           t_short > 0 ? 100000 * 192 / t_short / (1 << 20) : 0.0);
+}
+
+int main(int argc, char** argv)
+{
+    int k;
+    sha512_context context;
+    uint8_t digest[SHA512_DIGEST_SIZE];
+    char output[SHA512_DIGEST_SIZE * 2 + 1];
+
+    fprintf(stdout, "verifying SHA-512 implementation... ");
+
+    for (k = 0; k < 3; k++) {
+        crypto_SHA512((uint8_t*)test_data[k], strlen(test_data[k]), digest);
+        digest_to_hex(digest, output);
+        if (check(test_data[k], output, test_results[k]))
+            return 1;
+    }
+    /* million 'a' vector we feed in uneven pieces */
+    crypto_SHA512_Init(&context);
+    for (k = 0; k < 1000000; k += 7)
+        crypto_SHA512_Update(&context, (uint8_t*)"aaaaaaa",
+                             k + 7 <= 1000000 ? 7 : 1000000 - k);
+    crypto_SHA512_Final(&context, digest);
+    digest_to_hex(digest, output);
+    if (check(test_data[3], output, test_results[3]))
+        return 1;
+
+    bench();
+
+    /* success */
+    fprintf(stdout, "ok\n");
+    return 0;
+}
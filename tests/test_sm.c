@@ -0,0 +1,268 @@
+/* test_sm.c
+** libstrophe XMPP client library -- test routines for stream management
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "transport.h"
+
+#include "test.h"
+
+#define STREAM_HEADER "<?xml version='1.0'?>" \
+    "<stream:stream xmlns='jabber:client' " \
+    "xmlns:stream='http://etherx.jabber.org/streams' " \
+    "id='s1' from='localhost' version='1.0'>"
+#define FEATURES_SASL "<stream:features>" \
+    "<mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>" \
+    "<mechanism>PLAIN</mechanism></mechanisms></stream:features>"
+#define FEATURES_BIND "<stream:features>" \
+    "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/>" \
+    "<sm xmlns='urn:xmpp:sm:3'/></stream:features>"
+
+/* the scripted server */
+static struct {
+    int authenticated;
+    int resume_ok; /* answer <resume/> with <resumed/> */
+    int resume_late; /* leave <resume/> to the test to answer */
+    int enables;
+    int resumes;
+    int binds;
+    int requests;
+    long acked; /* h of the last <a/>, -1 if none */
+    int messages;
+    char last_message[16];
+    char resume_h[16];
+} server;
+
+
+static void server_handler(xmpp_conn_t * const conn,
+                           const char * const data, const size_t len,
+                           void * const userdata)
+{
+    char buf[256];
+    char value[16];
+
+    memcpy(buf, data, len < sizeof(buf) ? len : sizeof(buf) - 1);
+    buf[len < sizeof(buf) ? len : sizeof(buf) - 1] = '\0';
+
+    if (strncmp(buf, "<?xml", 5) == 0) {
+        test_reply(conn, STREAM_HEADER);
+        test_reply(conn, server.authenticated ? FEATURES_BIND : FEATURES_SASL);
+    } else if (strncmp(buf, "<auth", 5) == 0) {
+        server.authenticated = 1;
+        test_reply(conn,
+                   "<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>");
+    } else if (strstr(buf, "_xmpp_bind1")) {
+        server.binds++;
+        test_reply(conn, "<iq id='_xmpp_bind1' type='result'>"
+                         "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'>"
+                         "<jid>user@localhost/res</jid></bind></iq>");
+    } else if (strncmp(buf, "<enable", 7) == 0) {
+        server.enables++;
+        test_reply(conn, "<enabled xmlns='urn:xmpp:sm:3' id='sm-1' "
+                         "resume='true'/>");
+    } else if (strncmp(buf, "<resume", 7) == 0) {
+        server.resumes++;
+        test_find_attr(buf, "h", server.resume_h, sizeof(server.resume_h));
+        if (server.resume_late)
+            ;
+        else if (server.resume_ok)
+            test_reply(conn, "<resumed xmlns='urn:xmpp:sm:3' h='10' "
+                             "previd='sm-1'/>");
+        else
+            test_reply(conn, "<failed xmlns='urn:xmpp:sm:3'/>");
+    } else if (strncmp(buf, "<a ", 3) == 0) {
+        server.acked = atol(test_find_attr(buf, "h", value, sizeof(value)));
+    } else if (strncmp(buf, "<r ", 3) == 0) {
+        server.requests++;
+    } else if (strncmp(buf, "<message", 8) == 0) {
+        server.messages++;
+        test_find_attr(buf, "id", server.last_message,
+                       sizeof(server.last_message));
+    }
+}
+
+static void connect_client(xmpp_ctx_t *ctx, xmpp_conn_t *conn)
+{
+    server.authenticated = 0;
+    test_connect(ctx, conn);
+}
+
+static void send_messages(xmpp_ctx_t *ctx, xmpp_conn_t *conn,
+                          int first, int count)
+{
+    xmpp_stanza_t *msg;
+    char id[16];
+    int i;
+
+    for (i = first; i < first + count; ++i) {
+        xmpp_snprintf(id, sizeof(id), "c%d", i);
+        msg = xmpp_stanza_new(ctx);
+        xmpp_stanza_set_name(msg, "message");
+        xmpp_stanza_set_id(msg, id);
+        xmpp_stanza_set_attribute(msg, "to", "peer@localhost");
+        xmpp_send(conn, msg);
+        xmpp_stanza_release(msg);
+    }
+    test_run(ctx, 1);
+}
+
+int main()
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    int i;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    conn = xmpp_conn_new(ctx);
+    if (ctx == NULL || conn == NULL) {
+        fprintf(stderr, "failed to create connection\n");
+        return 1;
+    }
+    xmpp_conn_set_jid(conn, "user@localhost/res");
+    xmpp_conn_set_pass(conn, "secret");
+    transport_loopback_attach(conn, server_handler, NULL);
+    server.acked = -1;
+
+    printf("Test #1: no stream management unless asked for... ");
+    connect_client(ctx, conn);
+    if (test_connects != 1 || server.enables != 0) {
+        printf("connects %d, enables %d\n", test_connects, server.enables);
+        exit(1);
+    }
+    transport_loopback_close(conn);
+    test_run(ctx, 2);
+    printf("ok\n");
+
+    printf("Test #2: stream management is enabled after bind... ");
+    xmpp_conn_set_flags(conn, XMPP_CONN_FLAG_STREAM_MGMT);
+    connect_client(ctx, conn);
+    if (test_connects != 2 || server.enables != 1 ||
+        conn->sm_state != XMPP_SM_ENABLED || conn->sm_id == NULL ||
+        xmpp_conn_is_resumed(conn)) {
+        printf("connects %d, enables %d, state %d\n", test_connects,
+               server.enables, conn->sm_state);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #3: handled stanzas are acknowledged... ");
+    for (i = 0; i < 3; ++i)
+        test_reply(conn, "<message from='peer@localhost'><body>hi</body>"
+                         "</message>");
+    test_reply(conn, "<r xmlns='urn:xmpp:sm:3'/>");
+    test_run(ctx, 2);
+    if (server.acked != 3) {
+        printf("acked %ld\n", server.acked);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #4: acks are requested and drop sent stanzas... ");
+    send_messages(ctx, conn, 1, 12);
+    if (server.messages != 12 || server.requests != 1) {
+        printf("messages %d, requests %d\n", server.messages,
+               server.requests);
+        exit(1);
+    }
+    test_reply(conn, "<a xmlns='urn:xmpp:sm:3' h='8'/>");
+    test_run(ctx, 2);
+    if (conn->sm_sent - conn->sm_acked != 4) {
+        printf("%u stanzas unacknowledged\n",
+               (unsigned int)(conn->sm_sent - conn->sm_acked));
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #5: a dropped stream is resumed... ");
+    transport_loopback_close(conn);
+    test_run(ctx, 2);
+    server.resume_ok = 1;
+    server.messages = 0;
+    connect_client(ctx, conn);
+    if (test_connects != 3 || server.resumes != 1 || server.binds != 2 ||
+        strcmp(server.resume_h, "3") != 0 || !xmpp_conn_is_resumed(conn)) {
+        printf("connects %d, resumes %d, binds %d, h %s\n", test_connects,
+               server.resumes, server.binds, server.resume_h);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #6: unacknowledged stanzas are sent again... ");
+    /* the server has seen 10 of our 12 stanzas */
+    if (server.messages != 2 || strcmp(server.last_message, "c12") != 0 ||
+        conn->sm_sent - conn->sm_acked != 2) {
+        printf("%d resent, last %s\n", server.messages, server.last_message);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #7: stanzas sent while resuming wait for the session... ");
+    transport_loopback_close(conn);
+    test_run(ctx, 2);
+    server.resume_late = 1;
+    server.messages = 0;
+    connect_client(ctx, conn);
+    send_messages(ctx, conn, 13, 2);
+    if (conn->sm_state != XMPP_SM_RESUMING || server.messages != 0 ||
+        conn->sm_sent - conn->sm_acked != 4) {
+        printf("state %d, %d sent, %u unacknowledged\n", conn->sm_state,
+               server.messages,
+               (unsigned int)(conn->sm_sent - conn->sm_acked));
+        exit(1);
+    }
+    /* the server has all but the two held ones */
+    test_reply(conn, "<resumed xmlns='urn:xmpp:sm:3' h='12' previd='sm-1'/>");
+    test_run(ctx, 2);
+    test_reply(conn, "<a xmlns='urn:xmpp:sm:3' h='14'/>");
+    test_run(ctx, 2);
+    if (test_connects != 4 || server.messages != 2 ||
+        strcmp(server.last_message, "c14") != 0 ||
+        conn->sm_sent != conn->sm_acked) {
+        printf("connects %d, %d sent, last %s, %u unacknowledged\n",
+               test_connects, server.messages, server.last_message,
+               (unsigned int)(conn->sm_sent - conn->sm_acked));
+        exit(1);
+    }
+    server.resume_late = 0;
+    printf("ok\n");
+
+    printf("Test #8: a failed resumption binds a new session... ");
+    transport_loopback_close(conn);
+    test_run(ctx, 2);
+    server.resume_ok = 0;
+    connect_client(ctx, conn);
+    if (test_connects != 5 || server.resumes != 3 || server.binds != 3 ||
+        server.enables != 2 || xmpp_conn_is_resumed(conn) ||
+        conn->sm_sent != 0) {
+        printf("connects %d, resumes %d, binds %d, enables %d\n",
+               test_connects, server.resumes, server.binds, server.enables);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #9: a clean disconnect ends the session... ");
+    xmpp_disconnect(conn);
+    test_run(ctx, 2);
+    if (conn->sm_id != NULL || conn->sm_state != XMPP_SM_DISABLED) {
+        printf("session still resumable\n");
+        exit(1);
+    }
+    printf("ok\n");
+
+    xmpp_conn_release(conn);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
@@ -42,7 +42,7 @@ int main(int argc, char **argv)
 
     sock_initialize();
 
-    sock = sock_connect("www.google.com", 80);
+    sock = sock_connect("www.google.com", 80, NULL, NULL);
 
     if (sock < 0) {
 	sock_shutdown();
@@ -0,0 +1,377 @@
+/* test_stanza.c
+** libstrophe XMPP client library -- test routines for stanza rendering
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "strophe.h"
+
+#include "test.h"
+
+#define RECIPIENTS 20000
+
+static xmpp_ctx_t *ctx;
+
+static xmpp_stanza_t *new_tag(const char *name, const char *ns)
+{
+    xmpp_stanza_t *stanza = xmpp_stanza_new(ctx);
+
+    xmpp_stanza_set_name(stanza, name);
+    if (ns) xmpp_stanza_set_ns(stanza, ns);
+
+    return stanza;
+}
+
+static void add_text(xmpp_stanza_t *parent, const char *text)
+{
+    xmpp_stanza_t *stanza = xmpp_stanza_new(ctx);
+
+    xmpp_stanza_set_text(stanza, text);
+    xmpp_stanza_add_child(parent, stanza);
+    xmpp_stanza_release(stanza);
+}
+
+static void check_text(xmpp_stanza_t *stanza, const char *expected)
+{
+    char *buf;
+    size_t len;
+
+    if (xmpp_stanza_to_text(stanza, &buf, &len) != XMPP_EOK) {
+        printf("rendering failed\n");
+        exit(1);
+    }
+    COMPARE(expected, buf);
+    if (len != strlen(expected)) {
+        printf("length %lu for '%s'\n", (unsigned long)len, buf);
+        exit(1);
+    }
+    xmpp_free(ctx, buf);
+}
+
+/* a message with a payload of many children */
+static xmpp_stanza_t *new_payload(void)
+{
+    xmpp_stanza_t *event, *item, *entry;
+    int i;
+
+    event = new_tag("event", "http://jabber.org/protocol/pubsub#event");
+    for (i = 0; i < 20; i++) {
+        item = new_tag("item", NULL);
+        xmpp_stanza_set_id(item, "ae890ac52d0df67ed7cfdf51b644e901");
+        entry = new_tag("entry", "http://www.w3.org/2005/Atom");
+        add_text(entry, "Soliloquy: To be, or not to be & that <is>"
+                        " the question");
+        xmpp_stanza_add_child(item, entry);
+        xmpp_stanza_release(entry);
+        xmpp_stanza_add_child(event, item);
+        xmpp_stanza_release(item);
+    }
+
+    return event;
+}
+
+static double broadcast(xmpp_stanza_t *payload)
+{
+    xmpp_stanza_t *msg;
+    char to[32];
+    char *buf;
+    size_t len;
+    clock_t start;
+    double t;
+    int i;
+
+    msg = new_tag("message", NULL);
+    xmpp_stanza_set_attribute(msg, "from", "pubsub.example.com");
+    xmpp_stanza_add_child(msg, payload);
+    start = clock();
+    for (i = 0; i < RECIPIENTS; i++) {
+        sprintf(to, "user%d@example.com", i);
+        xmpp_stanza_set_to(msg, to);
+        xmpp_stanza_to_text(msg, &buf, &len);
+        xmpp_free(ctx, buf);
+    }
+    t = (double)(clock() - start) / CLOCKS_PER_SEC;
+    xmpp_stanza_release(msg);
+
+    return t > 0 ? RECIPIENTS / t : 0.0;
+}
+
+/* copy an incoming stanza and change one attribute, as handlers do */
+static double copy_and_change(xmpp_stanza_t *stanza)
+{
+    xmpp_stanza_t *copy;
+    clock_t start;
+    double t;
+    int i;
+
+    start = clock();
+    for (i = 0; i < RECIPIENTS; i++) {
+        copy = xmpp_stanza_copy(stanza);
+        xmpp_stanza_set_to(copy, "romeo@example.com");
+        xmpp_stanza_release(copy);
+    }
+    t = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    return t > 0 ? RECIPIENTS / t : 0.0;
+}
+
+/* the version reply of examples/bot.c, both ways */
+static xmpp_stanza_t *version_by_hand(void)
+{
+    xmpp_stanza_t *reply, *query, *name, *version;
+
+    reply = new_tag("iq", NULL);
+    xmpp_stanza_set_type(reply, "result");
+    xmpp_stanza_set_id(reply, "ver1");
+    xmpp_stanza_set_to(reply, "romeo@example.com/orchard");
+    query = new_tag("query", "jabber:iq:version");
+    name = new_tag("name", NULL);
+    add_text(name, "libstrophe example bot");
+    xmpp_stanza_add_child(query, name);
+    xmpp_stanza_release(name);
+    version = new_tag("version", NULL);
+    add_text(version, "1.0");
+    xmpp_stanza_add_child(query, version);
+    xmpp_stanza_release(version);
+    xmpp_stanza_add_child(reply, query);
+    xmpp_stanza_release(query);
+
+    return reply;
+}
+
+static xmpp_stanza_t *version_built(void)
+{
+    return xmpp_stanza_build(ctx,
+        "<iq type='result' id=%s to=%s>"
+          "<query xmlns=%s>"
+            "<name>libstrophe example bot</name>"
+            "<version>1.0</version>"
+          "</query>"
+        "</iq>",
+        "ver1", "romeo@example.com/orchard", "jabber:iq:version");
+}
+
+static double build_rate(xmpp_stanza_t *(*build)(void))
+{
+    clock_t start;
+    double t;
+    int i;
+
+    start = clock();
+    for (i = 0; i < RECIPIENTS * 5; i++)
+        xmpp_stanza_release(build());
+    t = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    return t > 0 ? RECIPIENTS * 5 / t : 0.0;
+}
+
+int main()
+{
+    xmpp_stanza_t *msg, *body, *event, *copy, *reply;
+    char *plain, *frozen, *text;
+    size_t len;
+    double before, after;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+
+    printf("Test #1: a frozen stanza renders as before... ");
+    msg = new_tag("message", XMPP_NS_CLIENT);
+    xmpp_stanza_set_to(msg, "juliet@example.com");
+    body = new_tag("body", XMPP_NS_CLIENT);
+    add_text(body, "Wherefore art thou, \"Romeo\"?");
+    xmpp_stanza_add_child(msg, body);
+    check_text(msg, "<message to=\"juliet@example.com\"><body>"
+                    "Wherefore art thou, &quot;Romeo&quot;?</body></message>");
+    if (xmpp_stanza_freeze(body) != XMPP_EOK) {
+        printf("freezing failed\n");
+        return 1;
+    }
+    check_text(msg, "<message to=\"juliet@example.com\"><body>"
+                    "Wherefore art thou, &quot;Romeo&quot;?</body></message>");
+    check_text(body, "<body>Wherefore art thou, &quot;Romeo&quot;?</body>");
+    printf("ok\n");
+
+    printf("Test #2: changes reach the rendered text... ");
+    xmpp_stanza_set_attribute(body, "xml:lang", "en");
+    check_text(msg, "<message to=\"juliet@example.com\"><body xml:lang=\"en\">"
+                    "Wherefore art thou, &quot;Romeo&quot;?</body></message>");
+    xmpp_stanza_set_text(xmpp_stanza_get_children(body), "Hi");
+    check_text(msg, "<message to=\"juliet@example.com\"><body xml:lang=\"en\">"
+                    "Hi</body></message>");
+    xmpp_stanza_freeze(msg);
+    xmpp_stanza_set_text(xmpp_stanza_get_children(body), "Bye");
+    check_text(msg, "<message to=\"juliet@example.com\"><body xml:lang=\"en\">"
+                    "Bye</body></message>");
+    xmpp_stanza_set_to(msg, "romeo@example.com");
+    xmpp_stanza_del_attribute(body, "xml:lang");
+    check_text(msg, "<message to=\"romeo@example.com\"><body>"
+                    "Bye</body></message>");
+    printf("ok\n");
+
+    printf("Test #3: the namespace follows the parent... ");
+    xmpp_stanza_set_ns(msg, "jabber:server");
+    check_text(msg, "<message xmlns=\"jabber:server\" to=\"romeo@example.com\">"
+                    "<body xmlns=\"jabber:client\">Bye</body></message>");
+    xmpp_stanza_release(body);
+    xmpp_stanza_release(msg);
+    printf("ok\n");
+
+    printf("Test #4: fan out of a frozen payload... ");
+    event = new_payload();
+    copy = xmpp_stanza_copy(event);
+    xmpp_stanza_to_text(event, &plain, &len);
+    xmpp_stanza_freeze(event);
+    xmpp_stanza_to_text(event, &frozen, &len);
+    COMPARE(plain, frozen);
+    xmpp_free(ctx, plain);
+    xmpp_free(ctx, frozen);
+    before = broadcast(copy);
+    after = broadcast(event);
+    printf("%.0f stanzas/s, frozen %.0f stanzas/s... ", before, after);
+    xmpp_stanza_release(copy);
+    xmpp_stanza_release(event);
+    printf("ok\n");
+
+    printf("Test #5: a frozen payload has one parent... ");
+    event = new_payload();
+    xmpp_stanza_freeze(event);
+    xmpp_stanza_to_text(event, &frozen, &len);
+    msg = new_tag("message", NULL);
+    xmpp_stanza_add_child(msg, event);
+    body = new_tag("body", NULL);
+    xmpp_stanza_add_child(msg, body);
+    xmpp_stanza_release(body);
+    reply = new_tag("message", NULL);
+    if (xmpp_stanza_add_child(reply, event) != XMPP_EINVOP) {
+        printf("added to a second parent\n");
+        return 1;
+    }
+    copy = xmpp_stanza_copy(event);
+    xmpp_stanza_release(event);
+    xmpp_stanza_add_child(reply, copy);
+    xmpp_stanza_release(copy);
+    xmpp_stanza_to_text(reply, &text, &len);
+    xmpp_stanza_release(reply);
+    plain = malloc(strlen(frozen) + 32);
+    sprintf(plain, "<message>%s</message>", frozen);
+    COMPARE(plain, text);
+    xmpp_free(ctx, text);
+    sprintf(plain, "<message>%s<body/></message>", frozen);
+    check_text(msg, plain);
+    free(plain);
+    xmpp_free(ctx, frozen);
+    xmpp_stanza_release(msg);
+    printf("ok\n");
+
+    printf("Test #6: copies do not see each other's changes... ");
+    msg = new_tag("message", NULL);
+    xmpp_stanza_set_attribute(msg, "from", "romeo@example.com");
+    xmpp_stanza_set_to(msg, "juliet@example.com");
+    body = new_tag("body", NULL);
+    add_text(body, "Hi");
+    xmpp_stanza_add_child(msg, body);
+    xmpp_stanza_release(body);
+    copy = xmpp_stanza_copy(msg);
+    xmpp_stanza_set_to(copy, "nurse@example.com");
+    body = xmpp_stanza_get_child_by_name(copy, "body");
+    xmpp_stanza_set_text(xmpp_stanza_get_children(body), "Bye");
+    xmpp_stanza_set_attribute(body, "xml:lang", "en");
+    check_text(msg, "<message to=\"juliet@example.com\" "
+                    "from=\"romeo@example.com\"><body>Hi</body></message>");
+    check_text(copy, "<message to=\"nurse@example.com\" "
+                     "from=\"romeo@example.com\"><body xml:lang=\"en\">"
+                     "Bye</body></message>");
+    xmpp_stanza_del_attribute(msg, "from");
+    xmpp_stanza_set_name(msg, "iq");
+    check_text(msg, "<iq to=\"juliet@example.com\"><body>Hi</body></iq>");
+    check_text(copy, "<message to=\"nurse@example.com\" "
+                     "from=\"romeo@example.com\"><body xml:lang=\"en\">"
+                     "Bye</body></message>");
+    reply = xmpp_stanza_reply(copy);
+    check_text(reply, "<message to=\"romeo@example.com\"/>");
+    xmpp_stanza_release(copy);
+    text = xmpp_stanza_get_text(xmpp_stanza_get_child_by_name(msg, "body"));
+    COMPARE("Hi", text);
+    xmpp_free(ctx, text);
+    xmpp_stanza_release(msg);
+    check_text(reply, "<message to=\"romeo@example.com\"/>");
+    xmpp_stanza_release(reply);
+    printf("ok\n");
+
+    printf("Test #7: copy and change a stanza... ");
+    event = new_payload();
+    msg = new_tag("message", NULL);
+    xmpp_stanza_set_attribute(msg, "from", "pubsub.example.com");
+    xmpp_stanza_set_to(msg, "juliet@example.com");
+    xmpp_stanza_set_id(msg, "ae890ac52d0df67ed7cfdf51b644e901");
+    xmpp_stanza_add_child(msg, event);
+    xmpp_stanza_release(event);
+    printf("%.0f stanzas/s... ", copy_and_change(msg));
+    xmpp_stanza_release(msg);
+    printf("ok\n");
+
+    printf("Test #8: stanzas built from templates... ");
+    msg = version_by_hand();
+    xmpp_stanza_to_text(msg, &plain, &len);
+    xmpp_stanza_release(msg);
+    msg = version_built();
+    check_text(msg, plain);
+    xmpp_free(ctx, plain);
+    xmpp_stanza_release(msg);
+    body = xmpp_stanza_build(ctx, "<body>%s</body>", "Hi");
+    msg = xmpp_stanza_build(ctx,
+                            "<message to=%s type=\"chat\" id=%s>\n"
+                            "  %p\n"
+                            "  <x xmlns='jabber:x:oob'> 100%% &amp; %s%p</x>\n"
+                            "</message>",
+                            "juliet@example.com", NULL, body, NULL, NULL);
+    xmpp_stanza_release(body);
+    if (!msg) {
+        printf("building failed\n");
+        return 1;
+    }
+    check_text(msg, "<message to=\"juliet@example.com\" type=\"chat\">"
+                    "<body>Hi</body><x xmlns=\"jabber:x:oob\">"
+                    " 100% &amp;amp; </x></message>");
+    xmpp_stanza_release(msg);
+    msg = version_built();
+    body = xmpp_stanza_get_child_by_name(
+        xmpp_stanza_get_child_by_name(msg, "query"), "name");
+    reply = xmpp_stanza_build(ctx, "<iq type='result'>%p</iq>", body);
+    xmpp_stanza_set_text(xmpp_stanza_get_children(body), "bot");
+    check_text(reply, "<iq type=\"result\"><name>libstrophe example bot"
+                      "</name></iq>");
+    xmpp_stanza_release(reply);
+    check_text(xmpp_stanza_get_child_by_name(msg, "query"),
+               "<query xmlns=\"jabber:iq:version\"><name>bot</name>"
+               "<version>1.0</version></query>");
+    xmpp_stanza_release(msg);
+    if (xmpp_stanza_build(ctx, "<a><b></a></b>") ||
+        xmpp_stanza_build(ctx, "<a/><b/>") ||
+        xmpp_stanza_build(ctx, "<a>") ||
+        xmpp_stanza_build(ctx, "text<a/>") ||
+        xmpp_stanza_build(ctx, "<a b=c/>") ||
+        xmpp_stanza_build(ctx, "<a>%d</a>", 1) ||
+        xmpp_stanza_build(ctx, "")) {
+        printf("a malformed template was built\n");
+        return 1;
+    }
+    before = build_rate(version_by_hand);
+    after = build_rate(version_built);
+    printf("%.0f stanzas/s, built %.0f stanzas/s... ", before, after);
+    printf("ok\n");
+
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+/* test_transport.c
+** libstrophe XMPP client library -- test routines for the loopback transport
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This program is dual licensed under the MIT and GPLv3 licenses.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "transport.h"
+
+#include "test.h"
+
+#define STREAM_HEADER "<?xml version='1.0'?>" \
+    "<stream:stream xmlns='jabber:component:accept' " \
+    "xmlns:stream='http://etherx.jabber.org/streams' " \
+    "id='loopback' from='component.localhost'>"
+
+/* state of the scripted server */
+static int server_messages;
+
+/* events seen by the connection */
+static int conn_event = -1;
+static int conn_error;
+static int client_messages;
+
+static void server_handler(xmpp_conn_t * const conn,
+                           const char * const data, const size_t len,
+                           void * const userdata)
+{
+    const char *p;
+    const char *end = data + len;
+
+    if (len >= 14 && memcmp(data, "<?xml", 5) == 0)
+        transport_loopback_send(conn, STREAM_HEADER, strlen(STREAM_HEADER));
+    else if (len >= 10 && memcmp(data, "<handshake", 10) == 0)
+        transport_loopback_send(conn, "<handshake/>", 12);
+
+    for (p = data; p + 8 <= end; ++p) {
+        if (memcmp(p, "<message", 8) == 0)
+            ++server_messages;
+    }
+}
+
+static void conn_handler(xmpp_conn_t * const conn,
+                         const xmpp_conn_event_t status,
+                         const int error,
+                         xmpp_stream_error_t * const stream_error,
+                         void * const userdata)
+{
+    conn_event = status;
+    conn_error = error;
+}
+
+static int message_handler(xmpp_conn_t * const conn,
+                           xmpp_stanza_t * const stanza,
+                           void * const userdata)
+{
+    ++client_messages;
+    return 1;
+}
+
+static void run(xmpp_ctx_t *ctx, int n)
+{
+    while (n-- > 0)
+        xmpp_run_once(ctx, 0);
+}
+
+int main()
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    xmpp_stanza_t *msg;
+    char buf[64];
+    int i;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    conn = xmpp_conn_new(ctx);
+    if (ctx == NULL || conn == NULL) {
+        fprintf(stderr, "failed to create connection\n");
+        return 1;
+    }
+    xmpp_conn_set_jid(conn, "component.localhost");
+    xmpp_conn_set_pass(conn, "secret");
+
+    printf("Test #1: component handshake over loopback... ");
+    if (transport_loopback_attach(conn, server_handler, NULL) != 0 ||
+        xmpp_connect_component(conn, "localhost", 0, conn_handler,
+                               NULL) != 0) {
+        printf("connect failed\n");
+        exit(1);
+    }
+    run(ctx, 5);
+    if (conn_event != XMPP_CONN_CONNECT) {
+        printf("not connected, event %d\n", conn_event);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #2: server stanzas reach the handlers... ");
+    xmpp_handler_add(conn, message_handler, NULL, "message", NULL, NULL);
+    for (i = 0; i < 100; ++i) {
+        xmpp_snprintf(buf, sizeof(buf), "<message id='m%d'><body/></message>",
+                      i);
+        transport_loopback_send(conn, buf, strlen(buf));
+    }
+    run(ctx, 10);
+    if (client_messages != 100) {
+        printf("%d of 100 messages handled\n", client_messages);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #3: the send queue is written... ");
+    for (i = 0; i < 50; ++i) {
+        msg = xmpp_stanza_new(ctx);
+        xmpp_stanza_set_name(msg, "message");
+        xmpp_stanza_set_attribute(msg, "to", "user@localhost");
+        xmpp_send(conn, msg);
+        xmpp_stanza_release(msg);
+    }
+    run(ctx, 1);
+    if (server_messages != 50 || conn->send_queue_head != NULL) {
+        printf("%d of 50 messages written\n", server_messages);
+        exit(1);
+    }
+    printf("ok\n");
+
+    printf("Test #4: a close by the server disconnects... ");
+    transport_loopback_close(conn);
+    run(ctx, 2);
+    if (conn_event != XMPP_CONN_DISCONNECT || conn_error != ECONNRESET) {
+        printf("event %d, error %d\n", conn_event, conn_error);
+        exit(1);
+    }
+    printf("ok\n");
+
+    xmpp_conn_release(conn);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}